@@ -33,9 +33,25 @@
 #include <shlwapi.h>
 #include <process.h>
 #include <algorithm>
+#include "auth.h"
+#include "conffile.h"
+#include "confimage.h"
+#include "digest.h"
+#include "filecache.h"
+#include "fswatch.h"
+#include "handlecache.h"
+#include "json.h"
+#include "listcache.h"
+#include "listwalker.h"
+#include "metrics.h"
+#include "mountcheck.h"
+#include "statcache.h"
 #include "permdb.h"
+#include "rcu.h"
 #include "synclogger.h"
+#include "trace.h"
 #include "userdb.h"
+#include "userstore.h"
 #include "vfs.h"
 #include "tree.h"
 
@@ -43,6 +59,13 @@ using namespace std;
 
 #define SERVERID L"SlimFTPd 3.181, by WhitSoft Development (www.whitsoftdev.com)"
 #define PACKET_SIZE 1452
+#define SHARED_READ_SIZE 0x10000
+#define MAPPED_VIEW_SIZE 0x1000000
+#define MAPPED_SEND_SIZE 0x40000
+#define RELOAD_SETTLE_TIME 500
+#define TRANSFERLOG_RECORDS 1024
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_REQUEST_TIMEOUT 2000
 enum class IpAddressType {
 	LAN = 1,
 	WAN,
@@ -52,6 +75,11 @@ enum class SocketFileIODirection {
 	SEND = 1,
 	RECEIVE
 };
+enum class TransferLogFormat {
+	OFF = 0,
+	XFERLOG,
+	JSON
+};
 enum class ReceiveStatus {
 	OK = 1,
 	NETWORK_ERROR,
@@ -59,44 +87,162 @@ enum class ReceiveStatus {
 	INVALID_DATA,
 	INSUFFICIENT_BUFFER
 };
+enum class ConfDirective {
+	UNKNOWN = 0,
+	BIND_INTERFACE,
+	BIND_PORT,
+	MAX_CONNECTIONS,
+	COMMAND_TIMEOUT,
+	CONNECT_TIMEOUT,
+	LOOKUP_HOSTS,
+	UPLOAD_DIGEST,
+	LISTING_CACHE_SIZE,
+	LISTING_CACHE_TTL,
+	STAT_CACHE_TTL,
+	HANDLE_CACHE_ENTRIES,
+	MEMORY_CACHE_SIZE,
+	MEMORY_CACHE_FILE_LIMIT,
+	USER_STORE,
+	USER_CACHE_ENTRIES,
+	AUTH_HELPER,
+	AUTH_THREADS,
+	AUTH_CACHE_TTL,
+	AUTH_NEGATIVE_CACHE_TTL,
+	MAP_THRESHOLD,
+	MOUNT_CHECK,
+	MOUNT_CHECK_TIMEOUT,
+	LOG_FULL_POLICY,
+	TRANSFER_LOG,
+	TRANSFER_LOG_MAX_SIZE,
+	TRANSFER_LOG_ROTATE,
+	TRANSFER_LOG_COMPRESS,
+	METRICS_PORT,
+	TRACE,
+	USER,
+	END_USER,
+	GROUP,
+	END_GROUP,
+	PASSWORD,
+	MOUNT,
+	ALLOW,
+	DENY
+};
+
+// What one transfer moved and where its time went. The Do* functions add up
+// the bytes and the ticks spent waiting on the file and on the data
+// connection; EndTransfer turns the ticks into microseconds.
+struct TRANSFERSTATS {
+	ULONGLONG qwBytes;
+	ULONGLONG qwStartTicks;
+	ULONGLONG qwDiskTicks;
+	ULONGLONG qwNetworkTicks;
+	ULONGLONG qwMicroseconds;
+	ULONGLONG qwDiskMicroseconds;
+	ULONGLONG qwNetworkMicroseconds;
+};
+
+// The users and groups read by one pass over the config script. A session
+// logs in under the current one and keeps it until it logs out, however
+// many times the script is reloaded in between.
+struct CONFIG {
+	UserDB *pUsers;
+	UserStore *pUserStore;
+	wstring strUserStore;
+	DWORD dwUserCacheEntries;
+	DWORD dwGeneration;
+	// The compiled image the users' trees were attached from, if any; it
+	// stays mapped until the users are freed
+	ConfImage *pImage;
+	wstring strImage;
+	ULONGLONG qwSourceHash;
+	CONFIG() : pUsers(new UserDB), pUserStore(NULL), dwUserCacheEntries(1024), dwGeneration(1), pImage(NULL), qwSourceHash(0) {}
+	~CONFIG();
+};
 
 // Service functions {
 VOID WINAPI ServiceMain(DWORD, LPTSTR);
 VOID WINAPI ServiceHandler(DWORD);
 bool Startup();
 void Cleanup();
+unsigned __stdcall ReloadThread(void *);
 // }
 
 // Configuration functions {
 void LogConfError(const wchar_t *, DWORD, const wchar_t *);
-bool ConfParseScript(const wchar_t *);
+bool ConfParseScript(const wchar_t *pszFileName, CONFIG *pconf, bool isReload, bool isImageAllowed);
+ConfDirective ConfFindDirective(const wchar_t *pszDirective);
+bool ConfIsReloadable(ConfDirective directive);
+bool ConfIsCompiled(ConfDirective directive);
+bool ConfLoadImage(CONFIG *pconf, vector<MountCheck::MOUNT> *pmounts);
+void ConfFinish(CONFIG *pconf);
+bool ConfReload(const wchar_t *pszFileName);
 bool ConfSetBindInterface(const wchar_t *pszArg, DWORD dwLine);
 bool ConfSetBindPort(const wchar_t *pszArg, DWORD dwLine);
 bool ConfSetMaxConnections(const wchar_t *pszArg, DWORD dwLine);
 bool ConfSetCommandTimeout(const wchar_t *pszArg, DWORD dwLine);
 bool ConfSetConnectTimeout(const wchar_t *pszArg, DWORD dwLine);
 bool ConfSetLookupHosts(const wchar_t *pszArg, DWORD dwLine);
-bool ConfAddUser(const wchar_t *pszArg, DWORD dwLine);
-bool ConfSetUserPassword(const wchar_t *pszUser, const wchar_t *pszArg, DWORD dwLine);
-bool ConfSetMountPoint(const wchar_t *pszUser, const wchar_t *pszVirtual, const wchar_t *pszLocal, DWORD dwLine);
-bool ConfSetPermission(DWORD dwMode, const wchar_t *pszUser, const wchar_t *pszVirtual, const wchar_t *pszPerms, DWORD dwLine);
+bool ConfSetUploadDigest(const wchar_t *pszArgs, DWORD dwLine);
+bool ConfSetListingCacheSize(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetListingCacheTTL(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetStatCacheTTL(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetHandleCacheEntries(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetMemoryCacheSize(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetMemoryCacheFileLimit(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetUserStore(CONFIG *pconf, const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetUserCacheEntries(CONFIG *pconf, const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetAuthHelper(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetAuthThreads(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetAuthCacheTTL(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetAuthNegativeCacheTTL(const wchar_t *pszArg, DWORD dwLine);
+bool ConfBuildUserStore(const wchar_t *pszSource, const wchar_t *pszIndex);
+void ConfGetUserStoreIndex(const wchar_t *pszSource, const FILETIME *pftSource, wchar_t *pszIndex, size_t stIndex);
+void ConfRemoveStaleUserStores(const wchar_t *pszSource);
+bool ConfLoadUser(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszBlock, DWORD dwLine);
+bool ConfAddUser(UserDB *pdb, const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetUserPassword(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetUserGroup(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszArg, DWORD dwLine);
+bool ConfAddGroup(UserDB *pdb, const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetMapThreshold(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetMountCheck(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetMountCheckTimeout(const wchar_t *pszArg, DWORD dwLine);
+bool ConfCheckMounts(const vector<MountCheck::MOUNT> &mounts, bool isRecheck);
+bool ConfSetLogFullPolicy(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetTransferLog(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetTransferLogMaxSize(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetTransferLogRotate(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetTransferLogCompress(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetMetricsPort(const wchar_t *pszArg, DWORD dwLine);
+bool ConfSetTrace(const wchar_t *pszArg, DWORD dwLine);
+void ConfWatchMount(void *pContext, const wchar_t *pszLocal);
+bool ConfSetMountPoint(VFS *pvfs, const wchar_t *pszVirtual, const wchar_t *pszLocal, const wchar_t *pszMapThreshold, DWORD dwLine, vector<MountCheck::MOUNT> *pmounts);
+bool ConfSetPermission(DWORD dwMode, PermDB *pperms, const wchar_t *pszVirtual, const wchar_t *pszPerms, DWORD dwLine);
 // }
 
 // Network functions {
 void __cdecl ListenThread(void *);
 void __cdecl ConnectionThread(void *);
+unsigned __stdcall MetricsThread(void *);
+void RenderMetrics(string &str);
 bool SocketSendString(SOCKET, const wchar_t *);
 ReceiveStatus SocketReceiveString(SOCKET, wchar_t *, DWORD, DWORD *);
 ReceiveStatus SocketReceiveLetter(SOCKET, wchar_t *, DWORD, DWORD *);
 ReceiveStatus SocketReceiveData(SOCKET, char *, DWORD, DWORD *);
 SOCKET EstablishDataConnection(SOCKADDR_IN *, SOCKET *);
 void LookupHost(const SOCKADDR_IN *sai, wchar_t *pszHostName, size_t stHostName);
-bool DoSocketFileIO(SOCKET sCmd, SOCKET sData, HANDLE hFile, SocketFileIODirection direction, DWORD *pdwAbortFlag);
+bool DoSocketFileIO(SOCKET sCmd, SOCKET sData, HANDLE hFile, SocketFileIODirection direction, DWORD *pdwAbortFlag, Digest *pDigest, TRANSFERSTATS *pts);
+bool DoSocketSharedSend(SOCKET sCmd, SOCKET sData, HandleCache::FILEREF *pref, ULONGLONG qwOffset, DWORD *pdwAbortFlag, TRANSFERSTATS *pts);
+bool DoSocketMemorySend(SOCKET sCmd, SOCKET sData, const FileCache::CONTENT *pcontent, ULONGLONG qwOffset, DWORD *pdwAbortFlag, TRANSFERSTATS *pts);
+bool DoSocketMappedSend(SOCKET sCmd, SOCKET sData, HANDLE hFile, ULONGLONG qwOffset, DWORD *pdwAbortFlag, TRANSFERSTATS *pts);
+bool CheckForAbort(SOCKET sCmd, DWORD *pdwAbortFlag);
+bool IsConnectionClosed(SOCKET s);
+void BeginTransfer(TRANSFERSTATS *pts);
+void EndTransfer(TRANSFERSTATS *pts);
+void FormatTransferStats(const TRANSFERSTATS *pts, bool isLogLine, wchar_t *pszOut, size_t stOut);
+void LogTransfer(SOCKET sCmd, const SOCKADDR_IN *psaiPeer, const wchar_t *pszPeerName, const wstring &strUser, const wstring &strVirtual, SocketFileIODirection direction, const TRANSFERSTATS *pts, bool isComplete);
 // }
 
 // Miscellaneous support functions {
-bool FileSkipBOM(HANDLE hFile);
-DWORD FileReadLine(HANDLE, wchar_t *, DWORD);
 DWORD SplitTokens(wchar_t *);
 const wchar_t * GetToken(const wchar_t *, DWORD);
 IpAddressType GetIPAddressType(IN_ADDR ia);
@@ -109,11 +255,39 @@ SERVICE_STATUS ServiceStatus;
 bool isService;
 DWORD dwMaxConnections = 20, dwCommandTimeout = 300, dwConnectTimeout = 15;
 bool bLookupHosts = true;
+DWORD dwUploadDigests = 0;
+DWORD dwListingCacheSize = 0;
+DWORD dwListingCacheTTL = 60;
+DWORD dwStatCacheTTL = 0;
+DWORD dwHandleCacheEntries = 0;
+DWORD dwMemoryCacheSize = 0, dwMemoryCacheFileLimit = 256;
+wstring strAuthHelper;
+DWORD dwAuthThreads = AUTH_THREADS_DEFAULT, dwAuthCacheTTL = 300, dwAuthNegativeCacheTTL = 30;
+MountCheckMode mountCheckMode = MountCheckMode::STRICT;
+DWORD dwMountCheckTimeout = MOUNTCHECK_TIMEOUT_DEFAULT;
+TransferLogFormat transferLogFormat = TransferLogFormat::OFF;
+DWORD dwTransferLogMaxSize = 0;
+LogRotate transferLogRotate = LogRotate::OFF;
+bool bTransferLogCompress = true;
+DWORD dwMetricsPort = 0;
+DWORD dwTraceSample = 0;
 volatile DWORD dwActiveConnections = 0;
-SOCKET sListen;
+SOCKET sListen, sMetrics;
 SOCKADDR_IN saiListen;
-UserDB *pUsers;
+HANDLE hMetricsThread;
+rcu<CONFIG> *pConfig;
+HANDLE hReloadEvent, hReloadStop, hReloadThread;
+Authenticator *pAuth;
 SyncLogger *pLog;
+SyncLogger *pTransferLog;
+Metrics *pMetrics;
+Tracer *pTracer;
+FSWatcher *pWatcher;
+MountCheck *pMountCheck;
+ListingCache *pListingCache;
+StatCache *pStatCache;
+HandleCache *pHandleCache;
+FileCache *pFileCache;
 // }
 
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR pszCmdLine, int nShowCmd)
@@ -153,7 +327,7 @@ VOID WINAPI ServiceMain(DWORD dwArgc, LPTSTR lpszArgv)
 	hServiceStatus=RegisterServiceCtrlHandler(L"SlimFTPd",(LPHANDLER_FUNCTION)ServiceHandler);
 	ServiceStatus.dwServiceType=SERVICE_WIN32_OWN_PROCESS;
 	ServiceStatus.dwCurrentState=SERVICE_RUNNING;
-	ServiceStatus.dwControlsAccepted=SERVICE_ACCEPT_STOP|SERVICE_ACCEPT_SHUTDOWN;
+	ServiceStatus.dwControlsAccepted=SERVICE_ACCEPT_STOP|SERVICE_ACCEPT_SHUTDOWN|SERVICE_ACCEPT_PARAMCHANGE;
 	ServiceStatus.dwWin32ExitCode=NO_ERROR;
 	ServiceStatus.dwServiceSpecificExitCode=0;
 	ServiceStatus.dwCheckPoint=0;
@@ -183,26 +357,49 @@ VOID WINAPI ServiceHandler(DWORD fdwControl)
 			ServiceStatus.dwCurrentState=SERVICE_STOPPED;
 			SetServiceStatus(hServiceStatus,&ServiceStatus);
 			break;
+		case SERVICE_CONTROL_PARAMCHANGE:
+			pLog->Log(L"The SlimFTPd service has received a request to reload its configuration.");
+			if (hReloadEvent) SetEvent(hReloadEvent);
+			break;
 	}
 }
 
 bool Startup()
 {
 	WSADATA wsad;
-	wchar_t szLogFile[512], szConfFile[512];
+	wchar_t szLogFile[512], szConfFile[512], szTransferLogFile[512], szTraceFile[512];
+	SOCKADDR_IN saiMetrics;
+	CONFIG *pconf;
 
 	// Construct log and config filenames
 	GetModuleFileName(0,szLogFile,ARRAYSIZE(szLogFile));
 	*wcsrchr(szLogFile, L'\\') = 0;
 	wcscpy_s(szConfFile,szLogFile);
+	wcscpy_s(szTransferLogFile,szLogFile);
+	swprintf_s(szTraceFile, L"%s\\SlimFTPd.trace.json", szLogFile);
 	wcscat_s(szLogFile, L"\\SlimFTPd.log");
 	wcscat_s(szConfFile, L"\\SlimFTPd.conf");
 
 	// Start logger thread
 	pLog=new SyncLogger(szLogFile);
 
-	// Allocate user database
-	pUsers = new UserDB;
+	// The user database is published once the config script has been read
+	pTransferLog = NULL;
+	pMetrics = NULL;
+	pTracer = NULL;
+	hMetricsThread = NULL;
+	pConfig = NULL;
+	pAuth = NULL;
+	hReloadEvent = NULL;
+	hReloadStop = NULL;
+	hReloadThread = NULL;
+
+	// Allocate the change watcher; mount points are added as they are parsed
+	pWatcher = new FSWatcher;
+	pListingCache = NULL;
+	pStatCache = NULL;
+	pHandleCache = NULL;
+	pFileCache = NULL;
 
 	// Log some startup info
 	pLog->Log(L"-------------------------------------------------------------------------------");
@@ -219,8 +416,54 @@ bool Startup()
 	// Start Winsock
 	WSAStartup(MAKEWORD(2,2),&wsad);
 
+	// Mounted folders are watched once they have been found
+	VFS::SetWatcher(pWatcher);
+	pMountCheck = new MountCheck(ConfWatchMount, pWatcher);
+	VFS::SetMountCheck(pMountCheck);
+
 	// Exec config script
-	if (!ConfParseScript(szConfFile)) return false;
+	pconf = new CONFIG;
+	if (!ConfParseScript(szConfFile, pconf, false, true)) {
+		delete pconf;
+		return false;
+	}
+	pAuth = new Authenticator(dwAuthThreads, dwAuthCacheTTL, dwAuthNegativeCacheTTL, strAuthHelper.empty() ? NULL : strAuthHelper.c_str());
+	ConfFinish(pconf);
+	pConfig = new rcu<CONFIG>(pconf);
+
+	// Counting starts before the first connection is accepted
+	if (dwMetricsPort) pMetrics = new Metrics;
+	if (dwTraceSample) pTracer = new Tracer(szTraceFile, dwTraceSample);
+
+	// Open the transfer log in the format the script asked for
+	if (transferLogFormat != TransferLogFormat::OFF) {
+		wcscat_s(szTransferLogFile, (transferLogFormat == TransferLogFormat::JSON) ? L"\\SlimFTPd.xferlog.json" : L"\\SlimFTPd.xferlog");
+		pTransferLog = new SyncLogger(szTransferLogFile, LOG_PLAIN, TRANSFERLOG_RECORDS);
+		pTransferLog->SetRotation((ULONGLONG)dwTransferLogMaxSize << 20, transferLogRotate, bTransferLogCompress);
+	}
+
+	// Set up the shared caches and start watching the mounted folders
+	if (dwListingCacheSize) {
+		pListingCache = new ListingCache(dwListingCacheSize * 1024, dwListingCacheTTL);
+		pWatcher->AddClient(ListingCache::OnChange, pListingCache);
+		VFS::SetListingCache(pListingCache);
+	}
+	if (dwStatCacheTTL) {
+		pStatCache = new StatCache(dwStatCacheTTL);
+		pWatcher->AddClient(StatCache::OnChange, pStatCache);
+		VFS::SetStatCache(pStatCache);
+	}
+	if (dwHandleCacheEntries) {
+		pHandleCache = new HandleCache(dwHandleCacheEntries);
+		pWatcher->AddClient(HandleCache::OnChange, pHandleCache);
+		VFS::SetHandleCache(pHandleCache);
+	}
+	if (dwMemoryCacheSize) {
+		pFileCache = new FileCache((size_t)dwMemoryCacheSize * 1024, (size_t)dwMemoryCacheFileLimit * 1024);
+		pWatcher->AddClient(FileCache::OnChange, pFileCache);
+		VFS::SetFileCache(pFileCache);
+	}
+	pWatcher->Start();
 
 	// Create and bind the listen socket
 	sListen=socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -234,25 +477,215 @@ bool Startup()
 	// Launch the listen thread
 	_beginthread(ListenThread,0,NULL);
 
+	// Metrics are only offered on the loopback interface; a local agent
+	// can forward them if they are wanted elsewhere
+	if (pMetrics) {
+		ZeroMemory(&saiMetrics,sizeof(SOCKADDR_IN));
+		saiMetrics.sin_family=AF_INET;
+		saiMetrics.sin_addr.S_un.S_addr=htonl(INADDR_LOOPBACK);
+		saiMetrics.sin_port=htons((u_short)dwMetricsPort);
+		sMetrics=socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (bind(sMetrics,(SOCKADDR *)&saiMetrics,sizeof(SOCKADDR_IN)) || listen(sMetrics,SOMAXCONN)) {
+			pLog->Log(L"Unable to bind the metrics socket. Metrics will be counted but not served.");
+			closesocket(sMetrics);
+		} else {
+			hMetricsThread = (HANDLE)_beginthreadex(NULL, 0, MetricsThread, NULL, 0, NULL);
+		}
+	}
+
+	// Reload the users when asked to, or when the config script is saved
+	hReloadEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	hReloadStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	hReloadThread = (HANDLE)_beginthreadex(NULL, 0, ReloadThread, NULL, 0, NULL);
+
 	return true;
 }
 
 void Cleanup()
 {
+	wchar_t sz[512];
+	LONGLONG llHits, llMisses, llServed, llChecks, llFailures, llTimeouts, llRecoveries, llLines, llDropped, llSpilled, llSessions, llEvents;
+	DWORD dwUnavailable;
+	size_t stBytes;
+
+	// Stop answering metrics scrapes before anything they read is freed
+	if (hMetricsThread) {
+		closesocket(sMetrics);
+		WaitForSingleObject(hMetricsThread, INFINITE);
+		CloseHandle(hMetricsThread);
+	}
+
 	// Cleanup Winsock
 	WSACleanup();
 
+	// Stop reloading the config
+	if (hReloadThread) {
+		SetEvent(hReloadStop);
+		WaitForSingleObject(hReloadThread, INFINITE);
+		CloseHandle(hReloadThread);
+	}
+	if (hReloadEvent) CloseHandle(hReloadEvent);
+	if (hReloadStop) CloseHandle(hReloadStop);
+
+	// Stop checking the mounted folders
+	if (pMountCheck) {
+		pMountCheck->GetStats(&llChecks, &llTimeouts, &llRecoveries, &dwUnavailable);
+		swprintf_s(sz, L"Mount checks: %I64d, %I64d timed out, %I64d folders came back; %u still unavailable.", llChecks, llTimeouts, llRecoveries, dwUnavailable);
+		pLog->Log(sz);
+		VFS::SetMountCheck(NULL);
+		delete pMountCheck;
+	}
+
+	// Stop watching for changes and release the caches
+	delete pWatcher;
+	if (pListingCache) {
+		pListingCache->GetStats(&llHits, &llMisses, &stBytes);
+		swprintf_s(sz, L"Listing cache: %I64d hits, %I64d misses.", llHits, llMisses);
+		pLog->Log(sz);
+		VFS::SetListingCache(NULL);
+		delete pListingCache;
+	}
+	if (pStatCache) {
+		pStatCache->GetStats(&llHits, &llMisses);
+		swprintf_s(sz, L"Metadata cache: %I64d hits, %I64d misses.", llHits, llMisses);
+		pLog->Log(sz);
+		VFS::SetStatCache(NULL);
+		delete pStatCache;
+	}
+	if (pHandleCache) {
+		pHandleCache->GetStats(&llHits, &llMisses, &stBytes);
+		swprintf_s(sz, L"Handle cache: %I64d hits, %I64d misses.", llHits, llMisses);
+		pLog->Log(sz);
+		VFS::SetHandleCache(NULL);
+		delete pHandleCache;
+	}
+	if (pFileCache) {
+		pFileCache->GetStats(&llHits, &llMisses, &llServed, &stBytes);
+		swprintf_s(sz, L"Memory cache: %I64d hits, %I64d misses, %I64d bytes served.", llHits, llMisses, llServed);
+		pLog->Log(sz);
+		VFS::SetFileCache(NULL);
+		delete pFileCache;
+	}
+	if (pAuth) {
+		pAuth->GetStats(&llChecks, &llHits, &llFailures);
+		swprintf_s(sz, L"Password checks: %I64d, %I64d answered from cache, %I64d failed.", llChecks, llHits, llFailures);
+		pLog->Log(sz);
+	}
+
+	if (pTransferLog) {
+		pTransferLog->GetStats(&llLines, &llDropped, &llSpilled);
+		swprintf_s(sz, L"Transfer log: %I64d transfers; %I64d dropped while the buffer was full.", llLines, llDropped);
+		pLog->Log(sz);
+	}
+	if (pTracer) {
+		pTracer->GetStats(&llSessions, &llEvents, &llDropped);
+		swprintf_s(sz, L"Trace: %I64d sessions sampled, %I64d events written, %I64d dropped past the size limit.", llSessions, llEvents, llDropped);
+		pLog->Log(sz);
+	}
+	pLog->GetStats(&llLines, &llDropped, &llSpilled);
+	swprintf_s(sz, L"Log: %I64d lines before this one; %I64d dropped and %I64d spilled while the buffer was full.", llLines, llDropped, llSpilled);
+	pLog->Log(sz);
+
 	// Log the stop of the service
 	if (isService) pLog->Log(L"The SlimFTPd service has stopped.");
 	else pLog->Log(L"SlimFTPd has stopped.");
 
-	// Deallocate the user database
-	delete pUsers;
+	// Deallocate the user database, then what checks its passwords
+	delete pConfig;
+	delete pAuth;
+	delete pMetrics;
 
-	// Shut down the logger thread
+	// Shut down the logger threads
+	delete pTracer;
+	delete pTransferLog;
 	delete pLog;
 }
 
+unsigned __stdcall ReloadThread(void *pParam)
+// Reloads the users and groups when the service is sent a parameter change,
+// or when SlimFTPd.conf or the user store it names is saved. Editors often
+// save in several writes, so the files are only read once they have been
+// left alone for a moment.
+{
+	wchar_t szFolder[512], szConfFile[512], szStoreFolder[MAX_PATH];
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	FILETIME ftLast, ftStoreLast;
+	wstring strStore;
+	HANDLE h[4], hConfWatch, hStoreWatch = INVALID_HANDLE_VALUE;
+	DWORD dw, dwHandles;
+	bool isChanged;
+
+	GetModuleFileName(0, szFolder, ARRAYSIZE(szFolder));
+	*wcsrchr(szFolder, L'\\') = 0;
+	swprintf_s(szConfFile, L"%s\\SlimFTPd.conf", szFolder);
+	ZeroMemory(&ftLast, sizeof(FILETIME));
+	ZeroMemory(&ftStoreLast, sizeof(FILETIME));
+	if (GetFileAttributesEx(szConfFile, GetFileExInfoStandard, &fad)) ftLast = fad.ftLastWriteTime;
+	hConfWatch = FindFirstChangeNotification(szFolder, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE);
+
+	for (;;) {
+		// The user store may be in another folder, and a reload may name
+		// another store or none
+		if (_wcsicmp(strStore.c_str(), pConfig->current()->strUserStore.c_str())) {
+			strStore = pConfig->current()->strUserStore;
+			if (hStoreWatch != INVALID_HANDLE_VALUE) FindCloseChangeNotification(hStoreWatch);
+			hStoreWatch = INVALID_HANDLE_VALUE;
+			ZeroMemory(&ftStoreLast, sizeof(FILETIME));
+			if (!strStore.empty()) {
+				if (GetFileAttributesEx(strStore.c_str(), GetFileExInfoStandard, &fad)) ftStoreLast = fad.ftLastWriteTime;
+				wcscpy_s(szStoreFolder, strStore.c_str());
+				*wcsrchr(szStoreFolder, L'\\') = 0;
+				if (_wcsicmp(szStoreFolder, szFolder)) hStoreWatch = FindFirstChangeNotification(szStoreFolder, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE);
+			}
+		}
+
+		h[0] = hReloadStop;
+		h[1] = hReloadEvent;
+		dwHandles = 2;
+		if (hConfWatch != INVALID_HANDLE_VALUE) h[dwHandles++] = hConfWatch;
+		if (hStoreWatch != INVALID_HANDLE_VALUE) h[dwHandles++] = hStoreWatch;
+
+		dw = WaitForMultipleObjects(dwHandles, h, FALSE, INFINITE);
+		if ((dw >= WAIT_OBJECT_0 + 2) && (dw < WAIT_OBJECT_0 + dwHandles)) {
+			// Something in the folder was written, perhaps only the log
+			FindNextChangeNotification(h[dw - WAIT_OBJECT_0]);
+			if (WaitForSingleObject(hReloadStop, RELOAD_SETTLE_TIME) == WAIT_OBJECT_0) break;
+			isChanged = false;
+			if (GetFileAttributesEx(szConfFile, GetFileExInfoStandard, &fad) && CompareFileTime(&fad.ftLastWriteTime, &ftLast)) {
+				ftLast = fad.ftLastWriteTime;
+				isChanged = true;
+			}
+			if (!strStore.empty() && GetFileAttributesEx(strStore.c_str(), GetFileExInfoStandard, &fad) && CompareFileTime(&fad.ftLastWriteTime, &ftStoreLast)) {
+				ftStoreLast = fad.ftLastWriteTime;
+				isChanged = true;
+			}
+			if (!isChanged) continue;
+		}
+		else if (dw == WAIT_OBJECT_0 + 1) {
+			if (GetFileAttributesEx(szConfFile, GetFileExInfoStandard, &fad)) ftLast = fad.ftLastWriteTime;
+			if (!strStore.empty() && GetFileAttributesEx(strStore.c_str(), GetFileExInfoStandard, &fad)) ftStoreLast = fad.ftLastWriteTime;
+		}
+		else {
+			break;
+		}
+		ConfReload(szConfFile);
+	}
+
+	if (hConfWatch != INVALID_HANDLE_VALUE) FindCloseChangeNotification(hConfWatch);
+	if (hStoreWatch != INVALID_HANDLE_VALUE) FindCloseChangeNotification(hStoreWatch);
+	return 0;
+}
+
+CONFIG::~CONFIG()
+// The user store's index is closed first, so that it can be deleted if the
+// store has changed since this config was read.
+{
+	delete pUsers;
+	delete pUserStore;
+	delete pImage;
+	if (!strUserStore.empty()) ConfRemoveStaleUserStores(strUserStore.c_str());
+}
+
 void LogConfError(const wchar_t *pszError, DWORD dwLine, const wchar_t *pszArg)
 {
 	wchar_t sz[1024];
@@ -260,44 +693,66 @@ void LogConfError(const wchar_t *pszError, DWORD dwLine, const wchar_t *pszArg)
 	pLog->Log(sz);
 }
 
-bool ConfParseScript(const wchar_t *pszFileName)
+bool ConfParseScript(const wchar_t *pszFileName, CONFIG *pconf, bool isReload, bool isImageAllowed)
 {
-// Opens and parses a SlimFTPd configuration script file.
-// Returns false on error, or true on success.
+// Opens and parses a SlimFTPd configuration script file into pconf.
+// Returns false on error, or true on success. A reload skips the settings
+// that only take effect at startup. Users and groups are taken from the
+// compiled config only if isImageAllowed is set.
 
 	wchar_t sz[512], *psz, *psz2;
-	wstring strUser;
-	DWORD dwLen, dwLine, dwTokens;
-	HANDLE hFile;
+	wstring strUser, strGroup;
+	DWORD dwLen, dwLine, dwTokens, dwTicks;
+	ConfDirective directive;
+	ConfFile file;
+	vector<MountCheck::MOUNT> mounts;
 
 	swprintf_s(sz,L"Executing \"%s\"...",wcsrchr(pszFileName,L'\\')+1);
 	pLog->Log(sz);
 
-	// Open config file
-	hFile=CreateFile(pszFileName,GENERIC_READ,0,0,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,0);
-	if (hFile==INVALID_HANDLE_VALUE) {
+	// Read the whole config file
+	dwTicks=GetTickCount();
+	if (!file.Open(pszFileName)) {
 		pLog->Log(L"Unable to open \"SlimFTPd.conf\".");
 		return false;
 	}
 
-	FileSkipBOM(hFile);
+	// Users and groups come from the compiled config if it is up to date
+	pconf->strImage = wstring(pszFileName) + L".cache";
+	pconf->qwSourceHash = file.GetHash();
+	if (isImageAllowed && ConfLoadImage(pconf, &mounts)) pLog->Log(L"Users and groups loaded from \"SlimFTPd.conf.cache\".");
 
 	for (dwLine=1;;dwLine++) {
-		dwLen=FileReadLine(hFile, sz, ARRAYSIZE(sz));
-		if (dwLen==-1) {
-			CloseHandle(hFile);
+		psz=file.ReadLine(&dwLen);
+		if (!psz) {
 			if (!strUser.empty()) {
 				LogConfError(L"Premature end of script encountered: unterminated User block.",dwLine,0);
 				return false;
+			} else if (!strGroup.empty()) {
+				LogConfError(L"Premature end of script encountered: unterminated Group block.",dwLine,0);
+				return false;
+			} else if (!ConfCheckMounts(mounts, true)) {
+				if (!pconf->pImage) break;
+				// The image does not say which line mounts a folder, so read
+				// the users and groups from the text to report it
+				pLog->Log(L"A folder mounted in \"SlimFTPd.conf.cache\" is missing; reading the users and groups from the script instead.");
+				delete pconf->pUsers;
+				pconf->pUsers = new UserDB;
+				delete pconf->pUserStore;
+				pconf->pUserStore = NULL;
+				pconf->strUserStore.clear();
+				delete pconf->pImage;
+				pconf->pImage = NULL;
+				return ConfParseScript(pszFileName, pconf, isReload, false);
 			} else {
-				pLog->Log(L"Configuration script parsed successfully.");
+				swprintf_s(sz, L"Configuration script parsed successfully in %u ms.", GetTickCount() - dwTicks);
+				pLog->Log(sz);
 				return true;
 			}
 		} else if (dwLen>=512) {
 			LogConfError(L"Line is too long to parse.",dwLine,0);
 			break;
 		}
-		psz=sz;
 		while (*psz==L' ' || *psz==L'\t') psz++;
 		if (!*psz || *psz==L'#') continue;
 
@@ -318,8 +773,11 @@ bool ConfParseScript(const wchar_t *pszFileName)
 		}
 
 		dwTokens=SplitTokens(psz);
+		directive=ConfFindDirective(psz);
+		if (isReload && !ConfIsReloadable(directive)) continue;
+		if (pconf->pImage && ConfIsCompiled(directive)) continue;
 
-		if (!_wcsicmp(psz,L"BindInterface")) {
+		if (directive==ConfDirective::BIND_INTERFACE) {
 			if (dwTokens==2) {
 				if (!ConfSetBindInterface(GetToken(psz,2),dwLine)) break;
 			} else {
@@ -328,7 +786,7 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"BindPort")) {
+		else if (directive==ConfDirective::BIND_PORT) {
 			if (dwTokens==2) {
 				if (!ConfSetBindPort(GetToken(psz,2),dwLine)) break;
 			} else {
@@ -337,7 +795,7 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"MaxConnections")) {
+		else if (directive==ConfDirective::MAX_CONNECTIONS) {
 			if (dwTokens==2) {
 				if (!ConfSetMaxConnections(GetToken(psz,2),dwLine)) break;
 			} else {
@@ -346,7 +804,7 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"CommandTimeout")) {
+		else if (directive==ConfDirective::COMMAND_TIMEOUT) {
 			if (dwTokens==2) {
 				if (!ConfSetCommandTimeout(GetToken(psz,2),dwLine)) break;
 			} else {
@@ -355,7 +813,7 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"ConnectTimeout")) {
+		else if (directive==ConfDirective::CONNECT_TIMEOUT) {
 			if (dwTokens==2) {
 				if (!ConfSetConnectTimeout(GetToken(psz,2),dwLine)) break;
 			} else {
@@ -364,7 +822,7 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"LookupHosts")) {
+		else if (directive==ConfDirective::LOOKUP_HOSTS) {
 			if (dwTokens==2) {
 				if (!ConfSetLookupHosts(GetToken(psz,2),dwLine)) break;
 			} else {
@@ -373,12 +831,222 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"User")) {
+		else if (directive==ConfDirective::UPLOAD_DIGEST) {
+			if (dwTokens>=2) {
+				if (!ConfSetUploadDigest(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"UploadDigest directive should have at least 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::LISTING_CACHE_SIZE) {
+			if (dwTokens==2) {
+				if (!ConfSetListingCacheSize(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"ListingCacheSize directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::LISTING_CACHE_TTL) {
+			if (dwTokens==2) {
+				if (!ConfSetListingCacheTTL(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"ListingCacheTTL directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::STAT_CACHE_TTL) {
+			if (dwTokens==2) {
+				if (!ConfSetStatCacheTTL(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"StatCacheTTL directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::HANDLE_CACHE_ENTRIES) {
+			if (dwTokens==2) {
+				if (!ConfSetHandleCacheEntries(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"HandleCacheEntries directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::MEMORY_CACHE_SIZE) {
+			if (dwTokens==2) {
+				if (!ConfSetMemoryCacheSize(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"MemoryCacheSize directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::MEMORY_CACHE_FILE_LIMIT) {
+			if (dwTokens==2) {
+				if (!ConfSetMemoryCacheFileLimit(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"MemoryCacheFileLimit directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::USER_STORE) {
+			if (dwTokens==2) {
+				if (!ConfSetUserStore(pconf,GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"UserStore directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::USER_CACHE_ENTRIES) {
+			if (dwTokens==2) {
+				if (!ConfSetUserCacheEntries(pconf,GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"UserCacheEntries directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::AUTH_HELPER) {
+			if (dwTokens==2) {
+				if (!ConfSetAuthHelper(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"AuthHelper directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::AUTH_THREADS) {
+			if (dwTokens==2) {
+				if (!ConfSetAuthThreads(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"AuthThreads directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::AUTH_CACHE_TTL) {
+			if (dwTokens==2) {
+				if (!ConfSetAuthCacheTTL(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"AuthCacheTTL directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::AUTH_NEGATIVE_CACHE_TTL) {
+			if (dwTokens==2) {
+				if (!ConfSetAuthNegativeCacheTTL(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"AuthNegativeCacheTTL directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::MAP_THRESHOLD) {
+			if (dwTokens==2) {
+				if (!ConfSetMapThreshold(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"MapThreshold directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::MOUNT_CHECK) {
+			if (dwTokens==2) {
+				if (!ConfSetMountCheck(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"MountCheck directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::MOUNT_CHECK_TIMEOUT) {
+			if (dwTokens==2) {
+				if (!ConfSetMountCheckTimeout(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"MountCheckTimeout directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::LOG_FULL_POLICY) {
+			if (dwTokens==2) {
+				if (!ConfSetLogFullPolicy(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"LogFullPolicy directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::TRANSFER_LOG) {
+			if (dwTokens==2) {
+				if (!ConfSetTransferLog(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"TransferLog directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::TRANSFER_LOG_MAX_SIZE) {
+			if (dwTokens==2) {
+				if (!ConfSetTransferLogMaxSize(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"TransferLogMaxSize directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::TRANSFER_LOG_ROTATE) {
+			if (dwTokens==2) {
+				if (!ConfSetTransferLogRotate(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"TransferLogRotate directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::TRANSFER_LOG_COMPRESS) {
+			if (dwTokens==2) {
+				if (!ConfSetTransferLogCompress(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"TransferLogCompress directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::METRICS_PORT) {
+			if (dwTokens==2) {
+				if (!ConfSetMetricsPort(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"MetricsPort directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::TRACE) {
+			if (dwTokens==2) {
+				if (!ConfSetTrace(GetToken(psz,2),dwLine)) break;
+			} else {
+				LogConfError(L"Trace directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::USER) {
 			if (!strUser.empty()) {
 				LogConfError(L"<User> directive invalid inside User block.",dwLine,0);
 				break;
+			} else if (!strGroup.empty()) {
+				LogConfError(L"<User> directive invalid inside Group block.",dwLine,0);
+				break;
 			} else if (dwTokens==2) {
-				if (ConfAddUser(GetToken(psz,2),dwLine)) {
+				if (ConfAddUser(pconf->pUsers,GetToken(psz,2),dwLine)) {
 					strUser = GetToken(psz, 2);
 				} else {
 					break;
@@ -389,7 +1057,7 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 		
-		else if (!_wcsicmp(psz,L"/User")) {
+		else if (directive==ConfDirective::END_USER) {
 			if (strUser.empty()) {
 				LogConfError(L"</User> directive invalid outside of User block.",dwLine,0);
 				break;
@@ -401,48 +1069,86 @@ bool ConfParseScript(const wchar_t *pszFileName)
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"Password")) {
+		else if (directive==ConfDirective::GROUP) {
+			// Inside a User block this names the group the user belongs to
+			if (!strUser.empty()) {
+				if (dwTokens==2) {
+					if (!ConfSetUserGroup(pconf->pUsers, strUser.c_str(), GetToken(psz, 2), dwLine)) break;
+				} else {
+					LogConfError(L"Group directive should have exactly 1 argument.",dwLine,0);
+					break;
+				}
+			} else if (!strGroup.empty()) {
+				LogConfError(L"<Group> directive invalid inside Group block.",dwLine,0);
+				break;
+			} else if (dwTokens==2) {
+				if (ConfAddGroup(pconf->pUsers,GetToken(psz,2),dwLine)) {
+					strGroup = GetToken(psz, 2);
+				} else {
+					break;
+				}
+			} else {
+				LogConfError(L"<Group> directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::END_GROUP) {
+			if (strGroup.empty()) {
+				LogConfError(L"</Group> directive invalid outside of Group block.",dwLine,0);
+				break;
+			} else if (dwTokens==1) {
+				strGroup.clear();
+			} else {
+				LogConfError(L"</Group> directive should not have any arguments.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::PASSWORD) {
 			if (strUser.empty()) {
 				LogConfError(L"Password directive invalid outside of User block.",dwLine,0);
 				break;
 			} else if (dwTokens==2) {
-				if (!ConfSetUserPassword(strUser.c_str(), GetToken(psz, 2), dwLine)) break;
+				if (!ConfSetUserPassword(pconf->pUsers, strUser.c_str(), GetToken(psz, 2), dwLine)) break;
 			} else {
 				LogConfError(L"Password directive should have exactly 1 argument.",dwLine,0);
 				break;
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"Mount")) {
-			if (strUser.empty()) {
-				LogConfError(L"Mount directive invalid outside of User block.",dwLine,0);
+		else if (directive==ConfDirective::MOUNT) {
+			if (strUser.empty() && strGroup.empty()) {
+				LogConfError(L"Mount directive invalid outside of User or Group block.",dwLine,0);
 				break;
 			} else if (dwTokens==3) {
-				if (!ConfSetMountPoint(strUser.c_str(), GetToken(psz, 2), GetToken(psz, 3), dwLine)) break;
+				if (!ConfSetMountPoint(strUser.empty() ? pconf->pUsers->GetGroupVFS(strGroup.c_str()) : pconf->pUsers->GetVFSForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), 0, dwLine, &mounts)) break;
+			} else if (dwTokens==4) {
+				if (!ConfSetMountPoint(strUser.empty() ? pconf->pUsers->GetGroupVFS(strGroup.c_str()) : pconf->pUsers->GetVFSForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), GetToken(psz, 4), dwLine, &mounts)) break;
 			} else {
-				LogConfError(L"Mount directive should have exactly 2 arguments.",dwLine,0);
+				LogConfError(L"Mount directive should have 2 or 3 arguments.",dwLine,0);
 				break;
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"Allow")) {
-			if (strUser.empty()) {
-				LogConfError(L"Allow directive invalid outside of User block.",dwLine,0);
+		else if (directive==ConfDirective::ALLOW) {
+			if (strUser.empty() && strGroup.empty()) {
+				LogConfError(L"Allow directive invalid outside of User or Group block.",dwLine,0);
 				break;
 			} else if (dwTokens>=3) {
-				if (!ConfSetPermission(1, strUser.c_str(), GetToken(psz, 2), GetToken(psz, 3), dwLine)) break;
+				if (!ConfSetPermission(1, strUser.empty() ? pconf->pUsers->GetGroupPermDB(strGroup.c_str()) : pconf->pUsers->GetPermDBForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), dwLine)) break;
 			} else {
 				LogConfError(L"Allow directive should have at least 2 arguments.",dwLine,0);
 				break;
 			}
 		}
 
-		else if (!_wcsicmp(psz,L"Deny")) {
-			if (strUser.empty()) {
-				LogConfError(L"Deny directive invalid outside of User block.",dwLine,0);
+		else if (directive==ConfDirective::DENY) {
+			if (strUser.empty() && strGroup.empty()) {
+				LogConfError(L"Deny directive invalid outside of User or Group block.",dwLine,0);
 				break;
 			} else if (dwTokens>=3) {
-				if (!ConfSetPermission(0, strUser.c_str(), GetToken(psz, 2), GetToken(psz, 3), dwLine)) break;
+				if (!ConfSetPermission(0, strUser.empty() ? pconf->pUsers->GetGroupPermDB(strGroup.c_str()) : pconf->pUsers->GetPermDBForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), dwLine)) break;
 			} else {
 				LogConfError(L"Deny directive should have at least 2 arguments.",dwLine,0);
 				break;
@@ -455,44 +1161,162 @@ bool ConfParseScript(const wchar_t *pszFileName)
 		}
 	}
 
-	CloseHandle(hFile);
 	pLog->Log(L"Failed parsing configuration script.");
 	return false;
 }
 
-bool ConfSetBindInterface(const wchar_t *pszArg, DWORD dwLine)
+ConfDirective ConfFindDirective(const wchar_t *pszDirective)
+// Looks a directive up by hash rather than comparing it with each name in
+// turn. The names are in the order of ConfDirective.
 {
-	char sz[512];
-	HOSTENT *phe;
-	DWORD dw;
+	static const wchar_t * const ppszDirectives[] = {
+		L"BindInterface", L"BindPort", L"MaxConnections", L"CommandTimeout", L"ConnectTimeout", L"LookupHosts", L"UploadDigest",
+		L"ListingCacheSize", L"ListingCacheTTL", L"StatCacheTTL", L"HandleCacheEntries", L"MemoryCacheSize", L"MemoryCacheFileLimit",
+		L"UserStore", L"UserCacheEntries", L"AuthHelper", L"AuthThreads", L"AuthCacheTTL", L"AuthNegativeCacheTTL", L"MapThreshold",
+		L"MountCheck", L"MountCheckTimeout", L"LogFullPolicy",
+		L"TransferLog", L"TransferLogMaxSize", L"TransferLogRotate", L"TransferLogCompress", L"MetricsPort", L"Trace",
+		L"User", L"/User", L"Group", L"/Group", L"Password", L"Mount", L"Allow", L"Deny"
+	};
+	static const ConfKeywords keywords(ppszDirectives, ARRAYSIZE(ppszDirectives));
+
+	return (ConfDirective)keywords.Find(pszDirective);
+}
 
-	if (!_wcsicmp(pszArg,L"All")) {
-		saiListen.sin_addr.S_un.S_addr=INADDR_ANY;
-	} else if (!_wcsicmp(pszArg,L"Local")) {
-		saiListen.sin_addr.S_un.S_addr=htonl(INADDR_LOOPBACK);
-	} else if (!_wcsicmp(pszArg,L"LAN")) {
-		saiListen.sin_addr.S_un.S_addr=INADDR_NONE;
-		gethostname(sz,ARRAYSIZE(sz));
-		phe=gethostbyname(sz);
-		if (phe) {
-			for (dw=0;phe->h_addr_list[dw];dw++) {
-				if (GetIPAddressType(*(IN_ADDR*)phe->h_addr_list[dw]) == IpAddressType::LAN) {
-					saiListen.sin_addr.S_un.S_addr=((IN_ADDR*)phe->h_addr_list[dw])->S_un.S_addr;
-					break;
-				}
-			}
-		}
-		if (saiListen.sin_addr.S_un.S_addr==INADDR_NONE) {
-			LogConfError(L"BindInterface directive could not find a LAN interface.",dwLine,0);
+bool ConfIsReloadable(ConfDirective directive)
+// Only the users, groups and user store are replaced by a reload. The
+// listen socket, caches and password checkers are set up once at startup.
+{
+	switch (directive) {
+		case ConfDirective::USER_STORE:
+		case ConfDirective::USER_CACHE_ENTRIES:
+		case ConfDirective::USER:
+		case ConfDirective::END_USER:
+		case ConfDirective::GROUP:
+		case ConfDirective::END_GROUP:
+		case ConfDirective::PASSWORD:
+		case ConfDirective::MOUNT:
+		case ConfDirective::ALLOW:
+		case ConfDirective::DENY:
+			return true;
+		default:
 			return false;
-		}
-	} else if (!_wcsicmp(pszArg,L"WAN")) {
-		saiListen.sin_addr.S_un.S_addr=INADDR_NONE;
-		gethostname(sz,ARRAYSIZE(sz));
-		phe=gethostbyname(sz);
-		if (phe) {
-			for (dw=0;phe->h_addr_list[dw];dw++) {
-				if (GetIPAddressType(*(IN_ADDR*)phe->h_addr_list[dw]) == IpAddressType::WAN) {
+	}
+}
+
+bool ConfIsCompiled(ConfDirective directive)
+// These directives build the users and groups, which a compiled config
+// already holds.
+{
+	switch (directive) {
+		case ConfDirective::USER:
+		case ConfDirective::END_USER:
+		case ConfDirective::GROUP:
+		case ConfDirective::END_GROUP:
+		case ConfDirective::PASSWORD:
+		case ConfDirective::MOUNT:
+		case ConfDirective::ALLOW:
+		case ConfDirective::DENY:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool ConfLoadImage(CONFIG *pconf, vector<MountCheck::MOUNT> *pmounts)
+// Attaches the users and groups of the compiled config saved for this
+// script, if there is one and it was compiled from the same text, and adds
+// the folders they mount to pmounts. Leaves pconf and pmounts as they were
+// if the image cannot be used.
+{
+	ConfImage *pimage = new ConfImage;
+
+	if (pimage->Open(pconf->strImage.c_str(), pconf->qwSourceHash) && pconf->pUsers->LoadImage(pimage, pmounts)) {
+		pconf->pImage = pimage;
+		return true;
+	}
+	pmounts->clear();
+	delete pconf->pUsers;
+	pconf->pUsers = new UserDB;
+	delete pimage;
+	return false;
+}
+
+void ConfFinish(CONFIG *pconf)
+// Readies a parsed config for sessions to log in under, and compiles it
+// for the next start if it was read from the text.
+{
+	wchar_t sz[512];
+	size_t stUsers, stGroups, stOverridden, stBytes, stUnsharedBytes;
+	ConfImageWriter writer;
+
+	pconf->pUsers->Freeze();
+	if (!pconf->pImage) {
+		pconf->pUsers->SaveImage(&writer);
+		if (!writer.Save(pconf->strImage.c_str(), pconf->qwSourceHash)) pLog->Log(L"Unable to save \"SlimFTPd.conf.cache\"; the script will be read in full on the next start.");
+	}
+	if (pconf->pUserStore) pconf->pUsers->SetStore(pconf->pUserStore, pconf->dwUserCacheEntries, ConfLoadUser);
+	pconf->pUsers->SetAuthenticator(pAuth);
+	pconf->pUsers->GetMemoryUsage(&stUsers, &stGroups, &stOverridden, &stBytes, &stUnsharedBytes);
+	swprintf_s(sz, L"%Iu users in %Iu groups, %Iu with their own mounts or permissions; mount and permission trees take %Iu KB (%Iu KB unshared).", stUsers, stGroups, stOverridden, (stBytes + 1023) / 1024, (stUnsharedBytes + 1023) / 1024);
+	pLog->Log(sz);
+}
+
+bool ConfReload(const wchar_t *pszFileName)
+// Reads the config script into a new set of users and publishes it for the
+// next logins. Sessions already logged in keep the set they logged in
+// under, which is freed once the last of them logs out. If the script has
+// an error, the set in use is kept.
+{
+	wchar_t sz[512];
+	CONFIG *pconf = new CONFIG;
+	DWORD dwTicks = GetTickCount();
+
+	if (!ConfParseScript(pszFileName, pconf, true, true)) {
+		delete pconf;
+		pLog->Log(L"The configuration was not reloaded; the users in use are kept.");
+		return false;
+	}
+	ConfFinish(pconf);
+	pconf->dwGeneration = pConfig->current()->dwGeneration + 1;
+	pConfig->publish(pconf);
+	swprintf_s(sz, L"Configuration %u reloaded in %u ms; %Iu earlier ones are still in use by sessions. Settings other than users and groups take effect on restart.", pconf->dwGeneration, GetTickCount() - dwTicks, pConfig->retired());
+	pLog->Log(sz);
+	return true;
+}
+
+bool ConfSetBindInterface(const wchar_t *pszArg, DWORD dwLine)
+{
+	char sz[512];
+	HOSTENT *phe;
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"All")) {
+		saiListen.sin_addr.S_un.S_addr=INADDR_ANY;
+	} else if (!_wcsicmp(pszArg,L"Local")) {
+		saiListen.sin_addr.S_un.S_addr=htonl(INADDR_LOOPBACK);
+	} else if (!_wcsicmp(pszArg,L"LAN")) {
+		saiListen.sin_addr.S_un.S_addr=INADDR_NONE;
+		gethostname(sz,ARRAYSIZE(sz));
+		phe=gethostbyname(sz);
+		if (phe) {
+			for (dw=0;phe->h_addr_list[dw];dw++) {
+				if (GetIPAddressType(*(IN_ADDR*)phe->h_addr_list[dw]) == IpAddressType::LAN) {
+					saiListen.sin_addr.S_un.S_addr=((IN_ADDR*)phe->h_addr_list[dw])->S_un.S_addr;
+					break;
+				}
+			}
+		}
+		if (saiListen.sin_addr.S_un.S_addr==INADDR_NONE) {
+			LogConfError(L"BindInterface directive could not find a LAN interface.",dwLine,0);
+			return false;
+		}
+	} else if (!_wcsicmp(pszArg,L"WAN")) {
+		saiListen.sin_addr.S_un.S_addr=INADDR_NONE;
+		gethostname(sz,ARRAYSIZE(sz));
+		phe=gethostbyname(sz);
+		if (phe) {
+			for (dw=0;phe->h_addr_list[dw];dw++) {
+				if (GetIPAddressType(*(IN_ADDR*)phe->h_addr_list[dw]) == IpAddressType::WAN) {
 					saiListen.sin_addr.S_un.S_addr=((IN_ADDR*)phe->h_addr_list[dw])->S_un.S_addr;
 					break;
 				}
@@ -508,114 +1332,804 @@ bool ConfSetBindInterface(const wchar_t *pszArg, DWORD dwLine)
 			return false;
 		}
 	}
-	return true;
+	return true;
+}
+
+bool ConfSetBindPort(const wchar_t *pszArg, DWORD dwLine)
+{
+	WORD wPort;
+
+	wPort = (WORD)StrToInt(pszArg);
+	if (wPort) {
+		saiListen.sin_port=htons(wPort);
+		return true;
+	} else {
+		LogConfError(L"BindPort directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetMaxConnections(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwMaxConnections=-1;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwMaxConnections=dw;
+			return true;
+		} else {
+			LogConfError(L"MaxConnections directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetCommandTimeout(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	dw = StrToInt(pszArg);
+	if (dw) {
+		dwCommandTimeout=dw;
+		return true;
+	} else {
+		LogConfError(L"CommandTimeout directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetConnectTimeout(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	dw = StrToInt(pszArg);
+	if (dw) {
+		dwConnectTimeout=dw;
+		return true;
+	} else {
+		LogConfError(L"ConnectTimeout directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetLookupHosts(const wchar_t *pszArg, DWORD dwLine)
+{
+	if (!_wcsicmp(pszArg,L"Off")) {
+		bLookupHosts = false;
+		return true;
+	} else if (!_wcsicmp(pszArg,L"On")) {
+		bLookupHosts = true;
+		return true;
+	} else {
+		LogConfError(L"LookupHosts directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetUploadDigest(const wchar_t *pszArgs, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArgs,L"Off")) {
+		dwUploadDigests = 0;
+		return true;
+	}
+	dwUploadDigests = 0;
+	while (*pszArgs) {
+		dw = Digest::ParseAlgorithm(pszArgs);
+		if (!dw) {
+			LogConfError(L"UploadDigest directive does not recognize argument \"%s\".",dwLine,pszArgs);
+			return false;
+		}
+		dwUploadDigests |= dw;
+		pszArgs=GetToken(pszArgs,2);
+	}
+	return true;
+}
+
+bool ConfSetListingCacheSize(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwListingCacheSize=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwListingCacheSize=dw;
+			return true;
+		} else {
+			LogConfError(L"ListingCacheSize directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetListingCacheTTL(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwListingCacheTTL=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwListingCacheTTL=dw;
+			return true;
+		} else {
+			LogConfError(L"ListingCacheTTL directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetStatCacheTTL(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwStatCacheTTL=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwStatCacheTTL=dw;
+			return true;
+		} else {
+			LogConfError(L"StatCacheTTL directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetHandleCacheEntries(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwHandleCacheEntries=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwHandleCacheEntries=dw;
+			return true;
+		} else {
+			LogConfError(L"HandleCacheEntries directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetMemoryCacheSize(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwMemoryCacheSize=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwMemoryCacheSize=dw;
+			return true;
+		} else {
+			LogConfError(L"MemoryCacheSize directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetMemoryCacheFileLimit(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	dw = StrToInt(pszArg);
+	if (dw) {
+		dwMemoryCacheFileLimit=dw;
+		return true;
+	} else {
+		LogConfError(L"MemoryCacheFileLimit directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetUserStore(CONFIG *pconf, const wchar_t *pszArg, DWORD dwLine)
+// Opens the index of a file of User blocks, building it first if there is
+// none for the file as it is now. A relative path is taken from the
+// program's folder.
+//
+// Each index is named for the time the file was written, so a reload that
+// finds the file changed builds a new one beside the index that sessions
+// under the earlier config still have open. Indexes of earlier versions of
+// the file are deleted once no config is using them.
+{
+	wchar_t szSource[MAX_PATH], szIndex[MAX_PATH], sz[512];
+	WIN32_FILE_ATTRIBUTE_DATA fadSource;
+	DWORD dwTicks;
+
+	if (pconf->pUserStore) {
+		LogConfError(L"UserStore directive may only be given once.",dwLine,0);
+		return false;
+	}
+	if (PathIsRelative(pszArg)) {
+		GetModuleFileName(0, szSource, ARRAYSIZE(szSource));
+		*wcsrchr(szSource, L'\\') = 0;
+		if (!PathAppend(szSource, pszArg)) szSource[0] = 0;
+	}
+	else {
+		wcscpy_s(szSource, pszArg);
+	}
+	if (!GetFileAttributesEx(szSource, GetFileExInfoStandard, &fadSource)) {
+		LogConfError(L"UserStore directive cannot find \"%s\".",dwLine,pszArg);
+		return false;
+	}
+	ConfGetUserStoreIndex(szSource, &fadSource.ftLastWriteTime, szIndex, ARRAYSIZE(szIndex));
+	pconf->pUserStore = new UserStore;
+	pconf->strUserStore = szSource;
+	if (!pconf->pUserStore->Open(szIndex)) {
+		dwTicks = GetTickCount();
+		if (!ConfBuildUserStore(szSource, szIndex)) {
+			LogConfError(L"UserStore directive could not index \"%s\".",dwLine,pszArg);
+			return false;
+		}
+		swprintf_s(sz, L"Indexed user store \"%s\" in %u ms.", pszArg, GetTickCount() - dwTicks);
+		pLog->Log(sz);
+		if (!pconf->pUserStore->Open(szIndex)) {
+			LogConfError(L"UserStore directive cannot open index \"%s\".",dwLine,szIndex);
+			return false;
+		}
+	}
+	ConfRemoveStaleUserStores(szSource);
+	swprintf_s(sz, L"User store \"%s\" holds %u users.", pszArg, pconf->pUserStore->GetCount());
+	pLog->Log(sz);
+	return true;
+}
+
+void ConfGetUserStoreIndex(const wchar_t *pszSource, const FILETIME *pftSource, wchar_t *pszIndex, size_t stIndex)
+// Names the index built from the user store as it was at *pftSource.
+{
+	swprintf_s(pszIndex, stIndex, L"%s.idx.%08x%08x", pszSource, pftSource->dwHighDateTime, pftSource->dwLowDateTime);
+}
+
+void ConfRemoveStaleUserStores(const wchar_t *pszSource)
+// Deletes the indexes of earlier versions of the user store. One that a
+// config still has open cannot be deleted yet; it goes when that config
+// is freed.
+{
+	wchar_t szPattern[MAX_PATH], szCurrent[MAX_PATH], szFile[MAX_PATH], *pszName;
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	WIN32_FIND_DATA wfd;
+	HANDLE hFind;
+
+	if (!GetFileAttributesEx(pszSource, GetFileExInfoStandard, &fad)) return;
+	ConfGetUserStoreIndex(pszSource, &fad.ftLastWriteTime, szCurrent, ARRAYSIZE(szCurrent));
+	swprintf_s(szPattern, L"%s.idx*", pszSource);
+	wcscpy_s(szFile, pszSource);
+	pszName = wcsrchr(szFile, L'\\') + 1;
+	hFind = FindFirstFile(szPattern, &wfd);
+	if (hFind == INVALID_HANDLE_VALUE) return;
+	do {
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+		wcscpy_s(pszName, ARRAYSIZE(szFile) - (pszName - szFile), wfd.cFileName);
+		if (_wcsicmp(szFile, szCurrent)) ::DeleteFile(szFile);
+	} while (FindNextFile(hFind, &wfd));
+	FindClose(hFind);
+}
+
+bool ConfSetUserCacheEntries(CONFIG *pconf, const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		pconf->dwUserCacheEntries=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			pconf->dwUserCacheEntries=dw;
+			return true;
+		} else {
+			LogConfError(L"UserCacheEntries directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetAuthHelper(const wchar_t *pszArg, DWORD dwLine)
+// Names the pipe of the helper that checks {Helper} passwords, such as
+// \\.\pipe\SlimFTPd-auth.
+{
+	if (_wcsnicmp(pszArg, L"\\\\.\\pipe\\", 9) || !pszArg[9]) {
+		LogConfError(L"AuthHelper directive needs a local pipe name like \\\\.\\pipe\\name, not \"%s\".",dwLine,pszArg);
+		return false;
+	}
+	strAuthHelper = pszArg;
+	return true;
+}
+
+bool ConfSetAuthThreads(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	dw = StrToInt(pszArg);
+	if (dw && (dw <= MAXIMUM_WAIT_OBJECTS)) {
+		dwAuthThreads=dw;
+		return true;
+	} else {
+		LogConfError(L"AuthThreads directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetAuthCacheTTL(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwAuthCacheTTL=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwAuthCacheTTL=dw;
+			return true;
+		} else {
+			LogConfError(L"AuthCacheTTL directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetAuthNegativeCacheTTL(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwAuthNegativeCacheTTL=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwAuthNegativeCacheTTL=dw;
+			return true;
+		} else {
+			LogConfError(L"AuthNegativeCacheTTL directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfBuildUserStore(const wchar_t *pszSource, const wchar_t *pszIndex)
+// Copies every User block in pszSource into a new hashed index. Only User
+// blocks and comments may appear in the file; what is inside the blocks is
+// checked when each user is first loaded. Errors refer to lines of pszSource.
+{
+	wchar_t *psz, *psz2, *pszLine;
+	wstring strUser, strBlock;
+	DWORD dwLen, dwLine, dwFirstLine = 0, dwTokens;
+	size_t stBlockLen = 0;
+	ConfFile file;
+	UserStoreWriter writer;
+
+	if (!file.Open(pszSource)) return false;
+	if (!writer.Create(pszIndex)) return false;
+
+	for (dwLine=1;;dwLine++) {
+		pszLine=file.ReadLine(&dwLen);
+		if (!pszLine) {
+			if (!strUser.empty()) {
+				LogConfError(L"Premature end of user store encountered: unterminated User block.",dwLine,0);
+				return false;
+			}
+			return writer.Finish();
+		} else if (dwLen>=512) {
+			LogConfError(L"Line is too long to parse.",dwLine,0);
+			break;
+		}
+		if (!strUser.empty()) {
+			// Keep the line as written before it is split, unless it ends the block
+			stBlockLen = strBlock.length();
+			strBlock.append(pszLine, dwLen);
+			strBlock += L'\n';
+		}
+		psz=pszLine;
+		while (*psz==L' ' || *psz==L'\t') psz++;
+		if (*psz==L'<') {
+			psz2=wcschr(psz,L'>');
+			if (psz2) {
+				*psz2=0;
+				psz++;
+			}
+		}
+		if (!strUser.empty()) {
+			dwTokens=SplitTokens(psz);
+			if ((dwTokens==1) && (ConfFindDirective(psz)==ConfDirective::END_USER)) {
+				strBlock.resize(stBlockLen);
+				if (!writer.Add(strUser.c_str(), dwFirstLine, strBlock.c_str(), strBlock.length())) {
+					LogConfError(L"User \"%s\" already defined.",dwLine,strUser.c_str());
+					break;
+				}
+				strUser.clear();
+			}
+			continue;
+		}
+		if (!*psz || *psz==L'#') continue;
+		dwTokens=SplitTokens(psz);
+		if (ConfFindDirective(psz)!=ConfDirective::USER) {
+			LogConfError(L"Only User blocks may appear in the user store; found \"%s\".",dwLine,psz);
+			break;
+		} else if (dwTokens!=2) {
+			LogConfError(L"<User> directive should have exactly 1 argument.",dwLine,0);
+			break;
+		} else if (wcslen(GetToken(psz,2))>=32) {
+			LogConfError(L"Argument to User directive must be less than 32 characters long.",dwLine,0);
+			break;
+		}
+		strUser = GetToken(psz,2);
+		strBlock.clear();
+		dwFirstLine = dwLine + 1;
+	}
+
+	return false;
+}
+
+bool ConfLoadUser(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszBlock, DWORD dwLine)
+// Runs the body of a User block from the user store for a user who has just
+// been added to pdb, the first time they log in. Line numbers in errors
+// refer to the user store's source file.
+{
+	wchar_t sz[512], *psz;
+	const wchar_t *pszEnd;
+	DWORD dwTokens;
+	ConfDirective directive;
+	wstring strUser = pszUser;
+	vector<MountCheck::MOUNT> mounts;
+
+	for (;; dwLine++) {
+		if (!*pszBlock) return ConfCheckMounts(mounts, false);
+		pszEnd = wcschr(pszBlock, L'\n');
+		if (!pszEnd) pszEnd = pszBlock + wcslen(pszBlock);
+		wcsncpy_s(sz, pszBlock, min((size_t)(pszEnd - pszBlock), ARRAYSIZE(sz) - 1));
+		pszBlock = *pszEnd ? pszEnd + 1 : pszEnd;
+		psz=sz;
+		while (*psz==L' ' || *psz==L'\t') psz++;
+		if (!*psz || *psz==L'#') continue;
+
+		dwTokens=SplitTokens(psz);
+		directive=ConfFindDirective(psz);
+
+		if (directive==ConfDirective::PASSWORD) {
+			if (dwTokens==2) {
+				if (!ConfSetUserPassword(pdb, strUser.c_str(), GetToken(psz, 2), dwLine)) break;
+			} else {
+				LogConfError(L"Password directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::GROUP) {
+			if (dwTokens==2) {
+				if (!ConfSetUserGroup(pdb, strUser.c_str(), GetToken(psz, 2), dwLine)) break;
+			} else {
+				LogConfError(L"Group directive should have exactly 1 argument.",dwLine,0);
+				break;
+			}
+		}
+
+		else if (directive==ConfDirective::MOUNT) {
+			if (dwTokens==3) {
+				if (!ConfSetMountPoint(pdb->GetVFSForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), 0, dwLine, &mounts)) break;
+			} else if (dwTokens==4) {
+				if (!ConfSetMountPoint(pdb->GetVFSForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), GetToken(psz, 4), dwLine, &mounts)) break;
+			} else {
+				LogConfError(L"Mount directive should have 2 or 3 arguments.",dwLine,0);
+				break;
+			}
+		}
+
+		else if ((directive==ConfDirective::ALLOW) || (directive==ConfDirective::DENY)) {
+			if (dwTokens>=3) {
+				if (!ConfSetPermission((directive==ConfDirective::ALLOW) ? 1 : 0, pdb->GetPermDBForUpdate(strUser.c_str()), GetToken(psz, 2), GetToken(psz, 3), dwLine)) break;
+			} else {
+				LogConfError(L"%s directive should have at least 2 arguments.",dwLine,psz);
+				break;
+			}
+		}
+
+		else {
+			LogConfError(L"Directive \"%s\" not recognized in a User block.",dwLine,psz);
+			break;
+		}
+	}
+
+	swprintf_s(sz, L"Failed loading user \"%s\" from the user store.", strUser.c_str());
+	pLog->Log(sz);
+	return false;
+}
+
+bool ConfAddUser(UserDB *pdb, const wchar_t *pszArg, DWORD dwLine)
+{
+	if (wcslen(pszArg)<32) {
+		if (pdb->Add(pszArg)) {
+			return true;
+		} else {
+			LogConfError(L"User \"%s\" already defined.",dwLine,pszArg);
+			return false;
+		}
+	} else {
+		LogConfError(L"Argument to User directive must be less than 32 characters long.",dwLine,0);
+		return false;
+	}
+}
+
+bool ConfSetUserPassword(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszArg, DWORD dwLine)
+// A password may name a scheme: {PBKDF2}iterations$salt$hash, or {Helper}
+// to ask the AuthHelper. Anything else is a plain text password.
+{
+	if (Authenticator::IsScheme(pszArg)) {
+		if (!Authenticator::IsValid(pszArg)) {
+			LogConfError(L"Password directive has a malformed {PBKDF2} hash in \"%s\".",dwLine,pszArg);
+			return false;
+		} else if (Authenticator::IsHelper(pszArg) && strAuthHelper.empty()) {
+			LogConfError(L"AuthHelper directive must come before any {Helper} password.",dwLine,0);
+			return false;
+		}
+		pdb->SetPassword(pszUser,pszArg);
+		return true;
+	} else if (wcslen(pszArg)<32) {
+		pdb->SetPassword(pszUser,pszArg);
+		return true;
+	} else {
+		LogConfError(L"Argument to Password directive must be less than 32 characters long.",dwLine,0);
+		return false;
+	}
+}
+
+bool ConfSetUserGroup(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszArg, DWORD dwLine)
+{
+	if (!pdb->GetGroupVFS(pszArg)) {
+		LogConfError(L"Group \"%s\" is not defined. Groups must be defined before the users in them.",dwLine,pszArg);
+		return false;
+	} else if (!pdb->SetGroup(pszUser,pszArg)) {
+		LogConfError(L"Group directive must come only once in a User block, before any Mount, Allow or Deny directive.",dwLine,0);
+		return false;
+	}
+	return true;
+}
+
+bool ConfAddGroup(UserDB *pdb, const wchar_t *pszArg, DWORD dwLine)
+{
+	if (wcslen(pszArg)<32) {
+		if (pdb->AddGroup(pszArg)) {
+			return true;
+		} else {
+			LogConfError(L"Group \"%s\" already defined.",dwLine,pszArg);
+			return false;
+		}
+	} else {
+		LogConfError(L"Argument to Group directive must be less than 32 characters long.",dwLine,0);
+		return false;
+	}
+}
+
+bool ConfSetMapThreshold(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		VFS::SetDefaultMapThreshold(0);
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw) {
+			VFS::SetDefaultMapThreshold(dw);
+			return true;
+		} else {
+			LogConfError(L"MapThreshold directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
+	}
+}
+
+bool ConfSetMountCheck(const wchar_t *pszArg, DWORD dwLine)
+{
+	if (!_wcsicmp(pszArg,L"Off")) {
+		mountCheckMode = MountCheckMode::OFF;
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Strict")) {
+		mountCheckMode = MountCheckMode::STRICT;
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Lazy")) {
+		mountCheckMode = MountCheckMode::LAZY;
+		return true;
+	} else {
+		LogConfError(L"MountCheck directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfSetMountCheckTimeout(const wchar_t *pszArg, DWORD dwLine)
+{
+	DWORD dw;
+
+	dw = StrToInt(pszArg);
+	if (dw) {
+		dwMountCheckTimeout=dw;
+		return true;
+	} else {
+		LogConfError(L"MountCheckTimeout directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
+}
+
+bool ConfCheckMounts(const vector<MountCheck::MOUNT> &mounts, bool isRecheck)
+// Checks the folders mounted by the config just read. isRecheck checks
+// again those found before, as a reload of the whole script does. In strict
+// mode a folder that cannot be found fails the config; in lazy mode it is
+// logged and its mounts fail until a background check finds it.
+{
+	wchar_t sz[512];
+	vector<MountCheck::FAILURE> failures;
+	bool isStrict = mountCheckMode == MountCheckMode::STRICT;
+
+	pMountCheck->SetMode(mountCheckMode, dwMountCheckTimeout);
+	pMountCheck->Validate(mounts, isRecheck, failures);
+	for (size_t st = 0; st < failures.size(); st++) {
+		if (isStrict && failures[st].dwLine) {
+			LogConfError(failures[st].isTimedOut ? L"Mount directive timed out looking for local path \"%s\"." : L"Mount directive cannot find local path \"%s\".", failures[st].dwLine, failures[st].strLocal.c_str());
+		} else {
+			swprintf_s(sz, failures[st].isTimedOut ? L"Timed out looking for mounted local path \"%s\"." : L"Cannot find mounted local path \"%s\".", failures[st].strLocal.c_str());
+			pLog->Log(sz);
+		}
+	}
+	if (!isStrict && !failures.empty()) {
+		swprintf_s(sz, L"%Iu mounted folders are unavailable; they will be checked again every %u seconds.", failures.size(), MOUNTCHECK_RECHECK_INTERVAL / 1000);
+		pLog->Log(sz);
+	}
+	return !isStrict || failures.empty();
+}
+
+bool ConfSetLogFullPolicy(const wchar_t *pszArg, DWORD dwLine)
+{
+	if (!_wcsicmp(pszArg,L"Block")) {
+		pLog->SetFullPolicy(LogFullPolicy::BLOCK);
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Drop")) {
+		pLog->SetFullPolicy(LogFullPolicy::DROP);
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Spill")) {
+		pLog->SetFullPolicy(LogFullPolicy::SPILL);
+		return true;
+	} else {
+		LogConfError(L"LogFullPolicy directive does not recognize argument \"%s\".",dwLine,pszArg);
+		return false;
+	}
 }
 
-bool ConfSetBindPort(const wchar_t *pszArg, DWORD dwLine)
+bool ConfSetTransferLog(const wchar_t *pszArg, DWORD dwLine)
 {
-	WORD wPort;
-
-	wPort = (WORD)StrToInt(pszArg);
-	if (wPort) {
-		saiListen.sin_port=htons(wPort);
+	if (!_wcsicmp(pszArg,L"Off")) {
+		transferLogFormat = TransferLogFormat::OFF;
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Xferlog")) {
+		transferLogFormat = TransferLogFormat::XFERLOG;
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Json")) {
+		transferLogFormat = TransferLogFormat::JSON;
 		return true;
 	} else {
-		LogConfError(L"BindPort directive does not recognize argument \"%s\".",dwLine,pszArg);
+		LogConfError(L"TransferLog directive does not recognize argument \"%s\".",dwLine,pszArg);
 		return false;
 	}
 }
 
-bool ConfSetMaxConnections(const wchar_t *pszArg, DWORD dwLine)
+bool ConfSetTransferLogMaxSize(const wchar_t *pszArg, DWORD dwLine)
 {
 	DWORD dw;
 
 	if (!_wcsicmp(pszArg,L"Off")) {
-		dwMaxConnections=-1;
+		dwTransferLogMaxSize=0;
 		return true;
 	} else {
 		dw = StrToInt(pszArg);
 		if (dw) {
-			dwMaxConnections=dw;
+			dwTransferLogMaxSize=dw;
 			return true;
 		} else {
-			LogConfError(L"MaxConnections directive does not recognize argument \"%s\".",dwLine,pszArg);
+			LogConfError(L"TransferLogMaxSize directive does not recognize argument \"%s\".",dwLine,pszArg);
 			return false;
 		}
 	}
 }
 
-bool ConfSetCommandTimeout(const wchar_t *pszArg, DWORD dwLine)
+bool ConfSetTransferLogRotate(const wchar_t *pszArg, DWORD dwLine)
 {
-	DWORD dw;
-
-	dw = StrToInt(pszArg);
-	if (dw) {
-		dwCommandTimeout=dw;
+	if (!_wcsicmp(pszArg,L"Off")) {
+		transferLogRotate = LogRotate::OFF;
 		return true;
-	} else {
-		LogConfError(L"CommandTimeout directive does not recognize argument \"%s\".",dwLine,pszArg);
-		return false;
-	}
-}
-
-bool ConfSetConnectTimeout(const wchar_t *pszArg, DWORD dwLine)
-{
-	DWORD dw;
-
-	dw = StrToInt(pszArg);
-	if (dw) {
-		dwConnectTimeout=dw;
+	} else if (!_wcsicmp(pszArg,L"Hourly")) {
+		transferLogRotate = LogRotate::HOURLY;
+		return true;
+	} else if (!_wcsicmp(pszArg,L"Daily")) {
+		transferLogRotate = LogRotate::DAILY;
 		return true;
 	} else {
-		LogConfError(L"ConnectTimeout directive does not recognize argument \"%s\".",dwLine,pszArg);
+		LogConfError(L"TransferLogRotate directive does not recognize argument \"%s\".",dwLine,pszArg);
 		return false;
 	}
 }
 
-bool ConfSetLookupHosts(const wchar_t *pszArg, DWORD dwLine)
+bool ConfSetTransferLogCompress(const wchar_t *pszArg, DWORD dwLine)
 {
 	if (!_wcsicmp(pszArg,L"Off")) {
-		bLookupHosts = false;
+		bTransferLogCompress = false;
 		return true;
 	} else if (!_wcsicmp(pszArg,L"On")) {
-		bLookupHosts = true;
+		bTransferLogCompress = true;
 		return true;
 	} else {
-		LogConfError(L"LookupHosts directive does not recognize argument \"%s\".",dwLine,pszArg);
+		LogConfError(L"TransferLogCompress directive does not recognize argument \"%s\".",dwLine,pszArg);
 		return false;
 	}
 }
 
-bool ConfAddUser(const wchar_t *pszArg, DWORD dwLine)
+bool ConfSetMetricsPort(const wchar_t *pszArg, DWORD dwLine)
 {
-	if (wcslen(pszArg)<32) {
-		if (pUsers->Add(pszArg)) {
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwMetricsPort=0;
+		return true;
+	} else {
+		dw = StrToInt(pszArg);
+		if (dw && dw < 65536) {
+			dwMetricsPort=dw;
 			return true;
 		} else {
-			LogConfError(L"User \"%s\" already defined.",dwLine,pszArg);
+			LogConfError(L"MetricsPort directive does not recognize argument \"%s\".",dwLine,pszArg);
 			return false;
 		}
-	} else {
-		LogConfError(L"Argument to User directive must be less than 32 characters long.",dwLine,0);
-		return false;
 	}
 }
 
-bool ConfSetUserPassword(const wchar_t *pszUser, const wchar_t *pszArg, DWORD dwLine)
+bool ConfSetTrace(const wchar_t *pszArg, DWORD dwLine)
+// Traces one session in every N, or every session for 1
 {
-	if (wcslen(pszArg)<32) {
-		pUsers->SetPassword(pszUser,pszArg);
+	DWORD dw;
+
+	if (!_wcsicmp(pszArg,L"Off")) {
+		dwTraceSample=0;
 		return true;
 	} else {
-		LogConfError(L"Argument to Password directive must be less than 32 characters long.",dwLine,0);
-		return false;
+		dw = StrToInt(pszArg);
+		if (dw) {
+			dwTraceSample=dw;
+			return true;
+		} else {
+			LogConfError(L"Trace directive does not recognize argument \"%s\".",dwLine,pszArg);
+			return false;
+		}
 	}
 }
 
-bool ConfSetMountPoint(const wchar_t *pszUser, const wchar_t *pszVirtual, const wchar_t *pszLocal, DWORD dwLine)
+void ConfWatchMount(void *pContext, const wchar_t *pszLocal)
+// Starts watching a mounted folder once it has been found.
+{
+	((FSWatcher *)pContext)->Watch(pszLocal);
+}
+
+bool ConfSetMountPoint(VFS *pvfs, const wchar_t *pszVirtual, const wchar_t *pszLocal, const wchar_t *pszMapThreshold, DWORD dwLine, vector<MountCheck::MOUNT> *pmounts)
 {
-	VFS *pvfs;
 	wstring strVirtual, strLocal;
+	DWORD dwMapThreshold = MAP_THRESHOLD_DEFAULT;
+	MountCheck::MOUNT mount;
 
 	VFS::CleanVirtualPath(pszVirtual, strVirtual);
 
@@ -629,20 +2143,28 @@ bool ConfSetMountPoint(const wchar_t *pszUser, const wchar_t *pszVirtual, const
 		if (*strLocal.rbegin() == L'\\') {
 			strLocal = strLocal.substr(0, strLocal.length() - 1);
 		}
-		if (GetFileAttributes(strLocal.c_str()) == INVALID_FILE_ATTRIBUTES) {
-			LogConfError(L"Mount directive cannot find local path \"%s\".", dwLine, strLocal.c_str());
-			return false;
+		// Checked with the other mounted folders once the script is read
+		mount.strLocal = strLocal;
+		mount.dwLine = dwLine;
+		pmounts->push_back(mount);
+	}
+	if (pszMapThreshold) {
+		if (!_wcsicmp(pszMapThreshold, L"Off")) {
+			dwMapThreshold = 0;
+		} else {
+			dwMapThreshold = StrToInt(pszMapThreshold);
+			if (!dwMapThreshold) {
+				LogConfError(L"Mount directive does not recognize map threshold \"%s\".", dwLine, pszMapThreshold);
+				return false;
+			}
 		}
 	}
-	pvfs=pUsers->GetVFS(pszUser);
-	if (pvfs) pvfs->Mount(pszVirtual, pszLocal);
+	if (pvfs) pvfs->Mount(pszVirtual, pszLocal, dwMapThreshold);
 	return true;
 }
 
-bool ConfSetPermission(DWORD dwMode, const wchar_t *pszUser, const wchar_t *pszVirtual, const wchar_t *pszPerms, DWORD dwLine)
+bool ConfSetPermission(DWORD dwMode, PermDB *pperms, const wchar_t *pszVirtual, const wchar_t *pszPerms, DWORD dwLine)
 {
-	PermDB *pperms;
-
 	wstring strVirtual;
 	VFS::CleanVirtualPath(pszVirtual, strVirtual);
 
@@ -655,7 +2177,6 @@ bool ConfSetPermission(DWORD dwMode, const wchar_t *pszUser, const wchar_t *pszV
 		return false;
 	}
 
-	pperms=pUsers->GetPermDB(pszUser);
 	if (!pperms) return false;
 
 	while (*pszPerms) {
@@ -693,31 +2214,143 @@ void __cdecl ListenThread(void *)
 
 	// Accept incoming connections and pass them to connection threads
 	while ((sIncoming=accept(sListen,0,0))!=INVALID_SOCKET) {
+		if (pMetrics) pMetrics->Count(MetricsCounter::CONNECTIONS_ACCEPTED);
 		_beginthread(ConnectionThread,0,(void *)sIncoming);
 	}
 
 	closesocket(sListen);
 }
 
+unsigned __stdcall MetricsThread(void *)
+// Answers scrapes of /metrics on the loopback interface, one at a time.
+// Ends when Cleanup closes the socket.
+{
+	SOCKET sClient;
+	char szRequest[METRICS_REQUEST_SIZE], szHeader[256];
+	string strBody;
+	DWORD dw;
+	int i, nLen;
+
+	while ((sClient=accept(sMetrics,0,0))!=INVALID_SOCKET) {
+		dw = METRICS_REQUEST_TIMEOUT;
+		setsockopt(sClient, SOL_SOCKET, SO_RCVTIMEO, (const char *)&dw, sizeof(dw));
+		nLen = 0;
+		szRequest[0] = 0;
+		while ((nLen < (int)sizeof(szRequest) - 1) && ((i = recv(sClient, szRequest + nLen, sizeof(szRequest) - 1 - nLen, 0)) > 0)) {
+			nLen += i;
+			szRequest[nLen] = 0;
+			if (strstr(szRequest, "\r\n\r\n")) break;
+		}
+		strBody.clear();
+		if (!strncmp(szRequest, "GET /metrics ", 13) || !strncmp(szRequest, "GET /metrics?", 13)) {
+			RenderMetrics(strBody);
+			sprintf_s(szHeader, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %Iu\r\nConnection: close\r\n\r\n", strBody.length());
+		} else {
+			strBody = "Only /metrics is served here.\n";
+			sprintf_s(szHeader, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: %Iu\r\nConnection: close\r\n\r\n", strBody.length());
+		}
+		if (send(sClient, szHeader, (int)strlen(szHeader), 0) != SOCKET_ERROR) send(sClient, strBody.data(), (int)strBody.length(), 0);
+		shutdown(sClient, SD_SEND);
+		closesocket(sClient);
+	}
+	return 0;
+}
+
+void RenderMetrics(string &str)
+// Appends what the sessions have counted, then the state of the server
+// and the counts its caches and logger already keep
+{
+	LONGLONG llHits, llMisses, llServed, llChecks, llFailures, llTimeouts, llRecoveries, llLines, llDropped, llSpilled;
+	DWORD dwUnavailable;
+	size_t stBytes;
+
+	pMetrics->Render(str);
+
+	Metrics::AppendHeader(str, "slimftpd_sessions_active", "gauge", "Users logged in now.");
+	Metrics::AppendValue(str, "slimftpd_sessions_active", NULL, dwActiveConnections);
+
+	// Hit ratios are left to the query, as hits / (hits + misses)
+	Metrics::AppendHeader(str, "slimftpd_cache_hits_total", "counter", "Lookups answered from a cache.");
+	Metrics::AppendHeader(str, "slimftpd_cache_misses_total", "counter", "Lookups a cache could not answer.");
+	if (pListingCache) {
+		pListingCache->GetStats(&llHits, &llMisses, &stBytes);
+		Metrics::AppendValue(str, "slimftpd_cache_hits_total", "cache=\"listing\"", llHits);
+		Metrics::AppendValue(str, "slimftpd_cache_misses_total", "cache=\"listing\"", llMisses);
+	}
+	if (pStatCache) {
+		pStatCache->GetStats(&llHits, &llMisses);
+		Metrics::AppendValue(str, "slimftpd_cache_hits_total", "cache=\"stat\"", llHits);
+		Metrics::AppendValue(str, "slimftpd_cache_misses_total", "cache=\"stat\"", llMisses);
+	}
+	if (pHandleCache) {
+		pHandleCache->GetStats(&llHits, &llMisses, &stBytes);
+		Metrics::AppendValue(str, "slimftpd_cache_hits_total", "cache=\"handle\"", llHits);
+		Metrics::AppendValue(str, "slimftpd_cache_misses_total", "cache=\"handle\"", llMisses);
+	}
+	if (pFileCache) {
+		pFileCache->GetStats(&llHits, &llMisses, &llServed, &stBytes);
+		Metrics::AppendValue(str, "slimftpd_cache_hits_total", "cache=\"memory\"", llHits);
+		Metrics::AppendValue(str, "slimftpd_cache_misses_total", "cache=\"memory\"", llMisses);
+	}
+	if (pAuth) {
+		pAuth->GetStats(&llChecks, &llHits, &llFailures);
+		Metrics::AppendValue(str, "slimftpd_cache_hits_total", "cache=\"password\"", llHits);
+		Metrics::AppendValue(str, "slimftpd_cache_misses_total", "cache=\"password\"", llChecks - llHits);
+	}
+
+	pMountCheck->GetStats(&llChecks, &llTimeouts, &llRecoveries, &dwUnavailable);
+	Metrics::AppendHeader(str, "slimftpd_mounts_unavailable", "gauge", "Mounted folders that could not be found when last checked.");
+	Metrics::AppendValue(str, "slimftpd_mounts_unavailable", NULL, dwUnavailable);
+
+	pLog->GetStats(&llLines, &llDropped, &llSpilled);
+	Metrics::AppendHeader(str, "slimftpd_log_lines_dropped_total", "counter", "Log lines lost because the log buffer was full.");
+	Metrics::AppendValue(str, "slimftpd_log_lines_dropped_total", NULL, llDropped);
+}
+
 void __cdecl ConnectionThread(void *pParam)
 {
 	SOCKET sCmd = (SOCKET)pParam;
 	SOCKET sData=0, sPasv=0;
 	SOCKADDR_IN saiCmd, saiCmdPeer, saiData, saiPasv;
-	wchar_t szPeerName[64], szOutput[1024], szCmd[512], *pszParam;
-	wstring strUser, strCurrentVirtual, strNewVirtual, strRnFr;
-	DWORD dw, dwRestOffset=0;
+	wchar_t szPeerName[64], szOutput[1024], szCmd[512], szHex[80], szStats[256], *pszParam, *psz;
+	wstring strUser, strCurrentVirtual, strNewVirtual, strRnFr, strCpFr;
+	DWORD dw, dwRestOffset=0, dwHashAlgorithm, dwVerb = 0, dwPerm;
 	ReceiveStatus status;
-	bool isLoggedIn = false;
-	HANDLE hFile;
+	bool isLoggedIn = false, isRecursive, isSent, isMapped;
+	HANDLE hFile, hStream;
 	SYSTEMTIME st;
 	FILETIME ft;
+	rcu<CONFIG>::READER reader;
+	CONFIG *pConf = NULL;
+	UserDB::user_ptr pUser;
 	VFS *pVFS = NULL;
 	PermDB *pPerms = NULL;
+	PermDB::SESSIONCACHE permcache;
 	VFS::listing_type listing;
+	VFS::RESOLVED res;
+	ListWalker *pWalker;
+	wstring strSection;
+	Digest *pDigest;
+	Digest::DIGESTRECORD dr;
+	StatCache::STATINFO si;
+	HandleCache::FILEREF *pRef;
+	FileCache::content_ptr pContent;
+	ULONGLONG qwOffset, qwCommandStarted = 0;
+	TRANSFERSTATS ts;
+	TraceSession *pTrace = NULL;
+	LARGE_INTEGER liSize;
+	LONGLONG llHits, llMisses, llServed;
+	size_t stBytes;
 	UINT_PTR i;
 
 	ZeroMemory(&saiData, sizeof(SOCKADDR_IN));
+	pConfig->enter(&reader);
+
+	// Default HASH algorithm is the strongest one recorded on upload
+	if (dwUploadDigests & DIGEST_SHA256) dwHashAlgorithm = DIGEST_SHA256;
+	else if (dwUploadDigests & DIGEST_XXH64) dwHashAlgorithm = DIGEST_XXH64;
+	else if (dwUploadDigests & DIGEST_CRC32C) dwHashAlgorithm = DIGEST_CRC32C;
+	else dwHashAlgorithm = DIGEST_SHA256;
 
 	// Get peer address
 	dw=sizeof(SOCKADDR_IN);
@@ -728,6 +2361,12 @@ void __cdecl ConnectionThread(void *pParam)
 	swprintf_s(szOutput, L"[%u] Incoming connection from %s:%u.", sCmd, szPeerName, ntohs(saiCmdPeer.sin_port));
 	pLog->Log(szOutput);
 
+	// Only sampled sessions are traced; the rest pay one test per phase
+	if (pTracer) {
+		swprintf_s(szOutput, L"[%u] %s:%u", sCmd, szPeerName, ntohs(saiCmdPeer.sin_port));
+		pTrace = pTracer->StartSession(szOutput);
+	}
+
 	// Send greeting
 	swprintf_s(szOutput, L"220-%s\r\n220-You are connecting from %s:%u.\r\n220 Proceed with login.\r\n", SERVERID, szPeerName, ntohs(saiCmdPeer.sin_port));
 	SocketSendString(sCmd, szOutput);
@@ -739,13 +2378,22 @@ void __cdecl ConnectionThread(void *pParam)
 	// Command processing loop
 	for (;;) {
 
+		// A command is timed until the next is read, however its handler ended
+		if (qwCommandStarted) {
+			pMetrics->RecordCommand(dwVerb, qwCommandStarted);
+			qwCommandStarted = 0;
+		}
+		if (pTrace) pTrace->EndCommand();
+
 		status=SocketReceiveString(sCmd,szCmd,ARRAYSIZE(szCmd),&dw);
+		if (pTrace) pTrace->Lap("receive");
 
 		if (status==ReceiveStatus::NETWORK_ERROR) {
 			SocketSendString(sCmd,L"421 Network error.\r\n");
 			break;
 		} else if (status==ReceiveStatus::TIMEOUT) {
 			SocketSendString(sCmd,L"421 Connection timed out.\r\n");
+			if (pMetrics) pMetrics->Count(MetricsCounter::COMMAND_TIMEOUTS);
 			break;
 		} else if (status==ReceiveStatus::INVALID_DATA) {
 			SocketSendString(sCmd,L"500 Malformed request.\r\n");
@@ -758,6 +2406,12 @@ void __cdecl ConnectionThread(void *pParam)
 		if (pszParam = wcschr(szCmd, L' ')) *(pszParam++) = 0;
 		else pszParam = szCmd+wcslen(szCmd);
 
+		if (pMetrics) {
+			dwVerb = Metrics::FindVerb(szCmd);
+			qwCommandStarted = Metrics::GetTicks();
+		}
+		if (pTrace) pTrace->BeginCommand(szCmd, _wcsicmp(szCmd, L"PASS") ? pszParam : NULL);
+
 		if (!_wcsicmp(szCmd, L"USER")) {
 			if (!*pszParam) {
 				SocketSendString(sCmd, L"501 Syntax error in parameters or arguments.\r\n");
@@ -766,8 +2420,10 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"503 Already logged in. Use REIN to change users.\r\n");
 				continue;
 			} else {
+				// Log in under the latest config; it is kept until logout
+				pConf = pConfig->acquire(&reader);
 				strUser = pszParam;
-				if (pUsers->CheckPassword(strUser.c_str(), L"")) {
+				if (pConf->pUsers->CheckPassword(strUser.c_str(), L"")) {
 					wcscpy_s(szCmd, L"PASS");
 					szCmd[5] = 0;
 				} else {
@@ -784,24 +2440,31 @@ void __cdecl ConnectionThread(void *pParam)
 			} else if (isLoggedIn) {
 				SocketSendString(sCmd, L"503 Already logged in. Use REIN to change users.\r\n");
 			} else {
-				if (pUsers->CheckPassword(strUser.c_str(), pszParam)) {
+				// Holding the record keeps a user loaded from the user store in memory
+				pUser = pConf->pUsers->GetUser(strUser.c_str());
+				if (pUser && pConf->pUsers->CheckPassword(strUser.c_str(), pUser, pszParam)) {
 					if (InterlockedIncrement(&dwActiveConnections) <= dwMaxConnections) {
+						if (pMetrics) pMetrics->Count(MetricsCounter::LOGINS);
 						isLoggedIn = true;
 						strCurrentVirtual = L"/";
 						swprintf_s(szOutput, L"230 User \"%s\" logged in.\r\n", strUser.c_str());
 						SocketSendString(sCmd, szOutput);
 						swprintf_s(szOutput, L"[%u] User \"%s\" logged in.", sCmd, strUser.c_str());
 						pLog->Log(szOutput);
-						pVFS = pUsers->GetVFS(strUser.c_str());
-						pPerms = pUsers->GetPermDB(strUser.c_str());
+						pVFS = pUser->pvfs.get();
+						pPerms = pUser->pperms.get();
+						permcache.Reset();
 					} else {
 						InterlockedDecrement(&dwActiveConnections);
+						if (pMetrics) pMetrics->Count(MetricsCounter::CONNECTIONS_REFUSED);
 						SocketSendString(sCmd, L"421 Your login was refused due to a server connection limit.\r\n");
 						swprintf_s(szOutput, L"[%u] Login for user \"%s\" refused due to connection limit.", sCmd, strUser.c_str());
 						pLog->Log(szOutput);
 						break;
 					}
 				} else {
+					pUser.reset();
+					if (pMetrics) pMetrics->Count(MetricsCounter::LOGIN_FAILURES);
 					SocketSendString(sCmd,L"530 Incorrect password.\r\n");
 				}
 			}
@@ -816,7 +2479,13 @@ void __cdecl ConnectionThread(void *pParam)
 				swprintf_s(szOutput, L"[%u] User \"%s\" logged out.", sCmd, strUser.c_str());
 				pLog->Log(szOutput);
 				strUser.clear();
+				pUser.reset();
+				permcache.Reset();
+				pConfig->release(&reader);
+				pConf = NULL;
 			}
+			strRnFr.clear();
+			strCpFr.clear();
 			SocketSendString(sCmd, L"220 REIN command successful.\r\n");
 		}
 
@@ -825,7 +2494,9 @@ void __cdecl ConnectionThread(void *pParam)
 		}
 
 		else if (!_wcsicmp(szCmd, L"FEAT")) {
-			SocketSendString(sCmd, L"211-Extensions supported:\r\n SIZE\r\n REST STREAM\r\n MDTM\r\n TVFS\r\n UTF8\r\n211 END\r\n");
+			swprintf_s(szOutput, L"211-Extensions supported:\r\n SIZE\r\n REST STREAM\r\n MDTM\r\n TVFS\r\n UTF8\r\n HASH CRC32C%s;SHA-256%s;XXH64%s\r\n211 END\r\n",
+				(dwHashAlgorithm == DIGEST_CRC32C) ? L"*" : L"", (dwHashAlgorithm == DIGEST_SHA256) ? L"*" : L"", (dwHashAlgorithm == DIGEST_XXH64) ? L"*" : L"");
+			SocketSendString(sCmd, szOutput);
 		}
 
 		else if (!_wcsicmp(szCmd, L"SYST")) {
@@ -960,24 +2631,75 @@ void __cdecl ConnectionThread(void *pParam)
 			if (!isLoggedIn) {
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
-				if (*pszParam == L'-') if (pszParam = wcschr(pszParam, L' ')) pszParam++;
+				isRecursive = false;
+				if (*pszParam == L'-') {
+					for (psz = pszParam; *psz && *psz != L' '; psz++) {
+						if (*psz == L'R') isRecursive = true;
+					}
+					if (pszParam = wcschr(pszParam, L' ')) pszParam++;
+				}
 				if (pszParam && *pszParam) {
 					pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
 				}
 				else {
 					strNewVirtual = strCurrentVirtual;
 				}
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_LIST) == 1) {
-					if (pVFS->GetDirectoryListing(strNewVirtual.c_str(), _wcsicmp(szCmd, L"LIST"), listing)) {
+				if (pTrace) pTrace->Lap("resolve");
+				dwPerm = pPerms->GetPerm(strNewVirtual.c_str(), PERM_LIST, &permcache);
+				if (pTrace) pTrace->Lap("permission");
+				if (dwPerm == 1) {
+					if (isRecursive) {
+						pWalker = new ListWalker(pVFS, pPerms, _wcsicmp(szCmd, L"LIST"));
+						if (pWalker->Start(strNewVirtual.c_str())) {
+							if (pTrace) pTrace->Lap("open");
+							swprintf_s(szOutput, L"150 Opening %s mode data connection for recursive listing of \"%s\".\r\n", sPasv ? L"passive" : L"active", strNewVirtual.c_str());
+							SocketSendString(sCmd, szOutput);
+							if (pTrace) pTrace->Lap("reply");
+							sData = EstablishDataConnection(&saiData, &sPasv);
+							if (pTrace) pTrace->Lap("data connection");
+							if (sData!=INVALID_SOCKET) {
+								isSent = true;
+								dw = 0;
+								while (pWalker->Next(strSection)) {
+									// A deep tree can take a while; stop between
+									// folders if the client has given up on it
+									if (CheckForAbort(sCmd, &dw) || IsConnectionClosed(sData) ||
+										(!strSection.empty() && !SocketSendString(sData, strSection.c_str()))) {
+										isSent = false;
+										break;
+									}
+								}
+								closesocket(sData);
+								if (pTrace) pTrace->Lap("transfer");
+								if (isSent) {
+									swprintf_s(szOutput, L"226 %s command successful.\r\n", _wcsicmp(szCmd, L"NLST") ? L"LIST" : L"NLST");
+									SocketSendString(sCmd, szOutput);
+								} else {
+									SocketSendString(sCmd, L"426 Connection closed; transfer aborted.\r\n");
+									if (dw) SocketSendString(sCmd, L"226 ABOR command successful.\r\n");
+								}
+							} else {
+								SocketSendString(sCmd, L"425 Can't open data connection.\r\n");
+							}
+						} else {
+							swprintf_s(szOutput, L"550 \"%s\": Path not found.\r\n", strNewVirtual.c_str());
+							SocketSendString(sCmd, szOutput);
+						}
+						delete pWalker;
+					} else if (pVFS->GetDirectoryListing(strNewVirtual.c_str(), _wcsicmp(szCmd, L"LIST"), listing, NULL)) {
+						if (pTrace) pTrace->Lap("open");
 						swprintf_s(szOutput, L"150 Opening %s mode data connection for listing of \"%s\".\r\n", sPasv ? L"passive" : L"active", strNewVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
+						if (pTrace) pTrace->Lap("reply");
 						sData = EstablishDataConnection(&saiData, &sPasv);
+						if (pTrace) pTrace->Lap("data connection");
 						if (sData!=INVALID_SOCKET) {
 							for (VFS::listing_type::const_iterator it = listing.begin(); it != listing.end(); ++it) {
 								SocketSendString(sData, it->second.c_str());
 							}
 							listing.clear();
 							closesocket(sData);
+							if (pTrace) pTrace->Lap("transfer");
 							swprintf_s(szOutput, L"226 %s command successful.\r\n", _wcsicmp(szCmd, L"NLST") ? L"LIST" : L"NLST");
 							SocketSendString(sCmd, szOutput);
 						} else {
@@ -1006,8 +2728,8 @@ void __cdecl ConnectionThread(void *pParam)
 				else {
 					strNewVirtual = strCurrentVirtual;
 				}
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_LIST) == 1) {
-					if (pVFS->GetDirectoryListing(strNewVirtual.c_str(), 0, listing)) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_LIST, &permcache) == 1) {
+					if (pVFS->GetDirectoryListing(strNewVirtual.c_str(), 0, listing, NULL)) {
 						swprintf_s(szOutput, L"212-Sending directory listing of \"%s\".\r\n", strNewVirtual.c_str());
 						SocketSendString(sCmd,szOutput);
 						for (VFS::listing_type::const_iterator it = listing.begin(); it != listing.end(); ++it) {
@@ -1032,42 +2754,74 @@ void __cdecl ConnectionThread(void *pParam)
 			} else if (!isLoggedIn) {
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
-				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ) == 1) {
-					hFile = pVFS->CreateFile(strNewVirtual.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
-					if (hFile == INVALID_HANDLE_VALUE) {
-						swprintf_s(szOutput, L"550 \"%s\": Unable to open file.\r\n", strNewVirtual.c_str());
+				// One pass cleans and maps the path into buffers kept for the session
+				pVFS->Resolve(strCurrentVirtual.c_str(), pszParam, res);
+				if (pTrace) pTrace->Lap("resolve");
+				dwPerm = pPerms->GetPerm(res.strVirtual.c_str(), PERM_READ, &permcache);
+				if (pTrace) pTrace->Lap("permission");
+				if (dwPerm == 1) {
+					// Hot files are sent from memory or read through one handle shared by every session
+					pContent = pVFS->GetCachedContent(res);
+					pRef = pContent ? NULL : pVFS->OpenShared(res);
+					if (pContent || pRef) hFile = INVALID_HANDLE_VALUE;
+					else hFile = pVFS->CreateFile(res, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
+					if (pTrace) pTrace->Lap("open");
+					if (!pContent && !pRef && (hFile == INVALID_HANDLE_VALUE)) {
+						swprintf_s(szOutput, L"550 \"%s\": Unable to open file.\r\n", res.strVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
 					} else {
+						qwOffset = dwRestOffset;
 						if (dwRestOffset) {
-							SetFilePointer(hFile, dwRestOffset, 0, FILE_BEGIN);
+							if (hFile != INVALID_HANDLE_VALUE) SetFilePointer(hFile, dwRestOffset, 0, FILE_BEGIN);
 							dwRestOffset = 0;
 						}
-						swprintf_s(szOutput, L"150 Opening %s mode data connection for \"%s\".\r\n", sPasv ? L"passive" : L"active", strNewVirtual.c_str());
+						// Files up to the mount point's threshold are sent straight from a mapped view
+						isMapped = false;
+						if (!pContent && (res.qwMapThreshold != 0)) {
+							if (pRef) isMapped = (pRef->uliSize.QuadPart <= res.qwMapThreshold);
+							else isMapped = (GetFileSizeEx(hFile, &liSize) && ((ULONGLONG)liSize.QuadPart <= res.qwMapThreshold));
+						}
+						swprintf_s(szOutput, L"150 Opening %s mode data connection for \"%s\".\r\n", sPasv ? L"passive" : L"active", res.strVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
+						if (pTrace) pTrace->Lap("reply");
 						sData = EstablishDataConnection(&saiData, &sPasv);
+						if (pTrace) pTrace->Lap("data connection");
 						if (sData!=INVALID_SOCKET) {
-							swprintf_s(szOutput, L"[%u] User \"%s\" began downloading \"%s\".", sCmd, strUser.c_str(), strNewVirtual.c_str());
+							swprintf_s(szOutput, L"[%u] User \"%s\" began downloading \"%s\".", sCmd, strUser.c_str(), res.strVirtual.c_str());
 							pLog->Log(szOutput);
-							if (DoSocketFileIO(sCmd, sData, hFile, SocketFileIODirection::SEND, &dw)) {
-								swprintf_s(szOutput, L"226 \"%s\" transferred successfully.\r\n", strNewVirtual.c_str());
+							BeginTransfer(&ts);
+							if (pContent) isSent = DoSocketMemorySend(sCmd, sData, pContent.get(), qwOffset, &dw, &ts);
+							else if (isMapped) isSent = DoSocketMappedSend(sCmd, sData, pRef ? pRef->hFile : hFile, qwOffset, &dw, &ts);
+							else if (pRef) isSent = DoSocketSharedSend(sCmd, sData, pRef, qwOffset, &dw, &ts);
+							else isSent = DoSocketFileIO(sCmd, sData, hFile, SocketFileIODirection::SEND, &dw, 0, &ts);
+							EndTransfer(&ts);
+							if (pTrace) pTrace->LapTransfer(ts.qwBytes, ts.qwDiskMicroseconds, ts.qwNetworkMicroseconds);
+							if (pMetrics) pMetrics->RecordTransfer(false, ts.qwBytes, ts.qwMicroseconds, isSent);
+							LogTransfer(sCmd, &saiCmdPeer, szPeerName, strUser, res.strVirtual, SocketFileIODirection::SEND, &ts, isSent);
+							if (isSent) {
+								FormatTransferStats(&ts, false, szStats, ARRAYSIZE(szStats));
+								swprintf_s(szOutput, L"226 \"%s\" transferred successfully: %s.\r\n", res.strVirtual.c_str(), szStats);
 								SocketSendString(sCmd, szOutput);
-								swprintf_s(szOutput, L"[%u] Download completed.", sCmd);
+								FormatTransferStats(&ts, true, szStats, ARRAYSIZE(szStats));
+								swprintf_s(szOutput, L"[%u] Download completed: %s", sCmd, szStats);
 								pLog->Log(szOutput);
 							} else {
 								SocketSendString(sCmd, L"426 Connection closed; transfer aborted.\r\n");
 								if (dw) SocketSendString(sCmd, L"226 ABOR command successful.\r\n");
-								swprintf_s(szOutput, L"[%u] Download aborted.", sCmd);
+								FormatTransferStats(&ts, true, szStats, ARRAYSIZE(szStats));
+								swprintf_s(szOutput, L"[%u] Download aborted: %s", sCmd, szStats);
 								pLog->Log(szOutput);
 							}
 							closesocket(sData);
 						} else {
 							SocketSendString(sCmd,L"425 Can't open data connection.\r\n");
 						}
-						CloseHandle(hFile);
+						if (pContent) pContent.reset();
+						else if (pRef) pVFS->CloseShared(pRef);
+						else CloseHandle(hFile);
 					}
 				} else {
-					swprintf_s(szOutput, L"550 \"%s\": Read permission denied.\r\n", strNewVirtual.c_str());
+					swprintf_s(szOutput, L"550 \"%s\": Read permission denied.\r\n", res.strVirtual.c_str());
 					SocketSendString(sCmd, szOutput);
 				}
 			}
@@ -1080,41 +2834,90 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd,L"530 Not logged in.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE) == 1) {
+				if (pTrace) pTrace->Lap("resolve");
+				dwPerm = pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE, &permcache);
+				if (pTrace) pTrace->Lap("permission");
+				if (dwPerm == 1) {
 					hFile = pVFS->CreateFile(strNewVirtual.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_ALWAYS);
+					if (pTrace) pTrace->Lap("open");
 					if (hFile == INVALID_HANDLE_VALUE) {
 						swprintf_s(szOutput, L"550 \"%s\": Unable to open file.\r\n", strNewVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
 					} else {
+						// Digests are only computed when the upload covers the whole file
+						pDigest = NULL;
 						if (_wcsicmp(szCmd, L"APPE") == 0) {
 							SetFilePointer(hFile, 0, 0, FILE_END);
 						}
 						else {
 							SetFilePointer(hFile, dwRestOffset, 0, FILE_BEGIN);
 							SetEndOfFile(hFile);
+							if (dwUploadDigests && !dwRestOffset) pDigest = new Digest(dwUploadDigests);
 						}
 						dwRestOffset = 0;
 						swprintf_s(szOutput, L"150 Opening %s mode data connection for \"%s\".\r\n", sPasv ? L"passive" : L"active", strNewVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
+						if (pTrace) pTrace->Lap("reply");
 						sData = EstablishDataConnection(&saiData, &sPasv);
+						if (pTrace) pTrace->Lap("data connection");
 						if (sData!=INVALID_SOCKET) {
 							swprintf_s(szOutput, L"[%u] User \"%s\" began uploading \"%s\".", sCmd, strUser.c_str(), strNewVirtual.c_str());
 							pLog->Log(szOutput);
-							if (DoSocketFileIO(sCmd, sData, hFile, SocketFileIODirection::RECEIVE, 0)) {
-								swprintf_s(szOutput, L"226 \"%s\" transferred successfully.\r\n", strNewVirtual.c_str());
-								SocketSendString(sCmd, szOutput);
-								swprintf_s(szOutput, L"[%u] Upload completed.", sCmd);
-								pLog->Log(szOutput);
+							BeginTransfer(&ts);
+							isSent = DoSocketFileIO(sCmd, sData, hFile, SocketFileIODirection::RECEIVE, 0, pDigest, &ts);
+							EndTransfer(&ts);
+							if (pTrace) pTrace->LapTransfer(ts.qwBytes, ts.qwDiskMicroseconds, ts.qwNetworkMicroseconds);
+							if (pMetrics) pMetrics->RecordTransfer(true, ts.qwBytes, ts.qwMicroseconds, isSent);
+							LogTransfer(sCmd, &saiCmdPeer, szPeerName, strUser, strNewVirtual, SocketFileIODirection::RECEIVE, &ts, isSent);
+							if (isSent) {
+								FormatTransferStats(&ts, false, szStats, ARRAYSIZE(szStats));
+								if (pDigest) {
+									pDigest->Finish(&dr);
+									GetFileTime(hFile, 0, 0, &dr.ftLastWrite);
+									dr.uliSize.LowPart = GetFileSize(hFile, &dr.uliSize.HighPart);
+									hStream = pVFS->CreateStream(strNewVirtual.c_str(), DIGEST_STREAM, GENERIC_WRITE, 0, CREATE_ALWAYS);
+									if (hStream != INVALID_HANDLE_VALUE) {
+										Digest::WriteRecord(hStream, &dr);
+										CloseHandle(hStream);
+										// Writing the stream touches the file; keep the time the record was made for
+										SetFileTime(hFile, 0, 0, &dr.ftLastWrite);
+									}
+									swprintf_s(szOutput, L"226-\"%s\" transferred successfully: %s.\r\n", strNewVirtual.c_str(), szStats);
+									for (dw = 1; dw <= DIGEST_ALL; dw <<= 1) {
+										if (Digest::FormatHex(&dr, dw, szHex, ARRAYSIZE(szHex))) {
+											swprintf_s(szOutput + wcslen(szOutput), ARRAYSIZE(szOutput) - wcslen(szOutput), L" %s %s\r\n", Digest::GetAlgorithmName(dw), szHex);
+										}
+									}
+									wcscat_s(szOutput, L"226 End of digests.\r\n");
+									SocketSendString(sCmd, szOutput);
+									FormatTransferStats(&ts, true, szStats, ARRAYSIZE(szStats));
+									swprintf_s(szOutput, L"[%u] Upload completed: %s", sCmd, szStats);
+									for (dw = 1; dw <= DIGEST_ALL; dw <<= 1) {
+										if (Digest::FormatHex(&dr, dw, szHex, ARRAYSIZE(szHex))) {
+											swprintf_s(szOutput + wcslen(szOutput), ARRAYSIZE(szOutput) - wcslen(szOutput), L" %s=%s", Digest::GetAlgorithmName(dw), szHex);
+										}
+									}
+									pLog->Log(szOutput);
+								} else {
+									swprintf_s(szOutput, L"226 \"%s\" transferred successfully: %s.\r\n", strNewVirtual.c_str(), szStats);
+									SocketSendString(sCmd, szOutput);
+									FormatTransferStats(&ts, true, szStats, ARRAYSIZE(szStats));
+									swprintf_s(szOutput, L"[%u] Upload completed: %s", sCmd, szStats);
+									pLog->Log(szOutput);
+								}
 							} else {
 								SocketSendString(sCmd, L"426 Connection closed; transfer aborted.\r\n");
-								swprintf_s(szOutput, L"[%u] Upload aborted.", sCmd);
+								FormatTransferStats(&ts, true, szStats, ARRAYSIZE(szStats));
+								swprintf_s(szOutput, L"[%u] Upload aborted: %s", sCmd, szStats);
 								pLog->Log(szOutput);
 							}
 							closesocket(sData);
 						} else {
 							SocketSendString(sCmd,L"425 Can't open data connection.\r\n");
 						}
+						delete pDigest;
 						CloseHandle(hFile);
+						pVFS->Changed(strNewVirtual.c_str());
 					}
 				} else {
 					swprintf_s(szOutput, L"550 \"%s\": Write permission denied.\r\n", strNewVirtual.c_str());
@@ -1139,15 +2942,13 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ) == 1) {
-					hFile = pVFS->CreateFile(strNewVirtual.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
-					if (hFile == INVALID_HANDLE_VALUE) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ, &permcache) == 1) {
+					if (!pVFS->GetFileInfo(strNewVirtual.c_str(), &si) || (si.dwAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
 						swprintf_s(szOutput, L"550 \"%s\": File not found.\r\n", strNewVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
 					} else {
-						swprintf_s(szOutput, L"213 %u\r\n", GetFileSize(hFile, 0));
+						swprintf_s(szOutput, L"213 %I64u\r\n", si.uliSize.QuadPart);
 						SocketSendString(sCmd, szOutput);
-						CloseHandle(hFile);
 					}
 				} else {
 					swprintf_s(szOutput, L"550 \"%s\": Read permission denied.\r\n", strNewVirtual.c_str());
@@ -1189,7 +2990,7 @@ void __cdecl ConnectionThread(void *pParam)
 				}
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
 				if (dw) {
-					if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE) == 1) {
+					if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE, &permcache) == 1) {
 						hFile = pVFS->CreateFile(strNewVirtual.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
 						if (hFile == INVALID_HANDLE_VALUE) {
 							swprintf_s(szOutput, L"550 \"%s\": File not found.\r\n", strNewVirtual.c_str());
@@ -1198,6 +2999,7 @@ void __cdecl ConnectionThread(void *pParam)
 							SystemTimeToFileTime(&st, &ft);
 							SetFileTime(hFile, 0, 0, &ft);
 							CloseHandle(hFile);
+							pVFS->Changed(strNewVirtual.c_str());
 							SocketSendString(sCmd, L"250 MDTM command successful.\r\n");
 						}
 					} else {
@@ -1205,15 +3007,12 @@ void __cdecl ConnectionThread(void *pParam)
 						SocketSendString(sCmd, szOutput);
 					}
 				} else {
-					if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ) == 1) {
-						hFile = pVFS->CreateFile(strNewVirtual.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
-						if (hFile == INVALID_HANDLE_VALUE) {
+					if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ, &permcache) == 1) {
+						if (!pVFS->GetFileInfo(strNewVirtual.c_str(), &si) || (si.dwAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
 							swprintf_s(szOutput, L"550 \"%s\": File not found.\r\n", strNewVirtual.c_str());
 							SocketSendString(sCmd, szOutput);
 						} else {
-							GetFileTime(hFile, 0, 0, &ft);
-							CloseHandle(hFile);
-							FileTimeToSystemTime(&ft, &st);
+							FileTimeToSystemTime(&si.ftLastWrite, &st);
 							swprintf_s(szOutput, L"213 %04u%02u%02u%02u%02u%02u\r\n", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
 							SocketSendString(sCmd, szOutput);
 						}
@@ -1225,6 +3024,42 @@ void __cdecl ConnectionThread(void *pParam)
 			}
 		}
 
+		else if (!_wcsicmp(szCmd, L"HASH")) {
+			if (!*pszParam) {
+				SocketSendString(sCmd, L"501 Syntax error in parameters or arguments.\r\n");
+			} else if (!isLoggedIn) {
+				SocketSendString(sCmd, L"530 Not logged in.\r\n");
+			} else {
+				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ, &permcache) == 1) {
+					// Only the file's metadata is queried; the digest comes from the record made on upload
+					if (!pVFS->GetFileInfo(strNewVirtual.c_str(), &si) || (si.dwAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+						swprintf_s(szOutput, L"550 \"%s\": File not found.\r\n", strNewVirtual.c_str());
+						SocketSendString(sCmd, szOutput);
+					} else {
+						dw = 1;
+						hStream = pVFS->CreateStream(strNewVirtual.c_str(), DIGEST_STREAM, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+						if (hStream != INVALID_HANDLE_VALUE) {
+							if (!Digest::ReadRecord(hStream, &dr)) dw = 0;
+							CloseHandle(hStream);
+						} else {
+							dw = 0;
+						}
+						if (dw && !CompareFileTime(&dr.ftLastWrite, &si.ftLastWrite) && (dr.uliSize.QuadPart == si.uliSize.QuadPart) && Digest::FormatHex(&dr, dwHashAlgorithm, szHex, ARRAYSIZE(szHex))) {
+							swprintf_s(szOutput, L"213 %s 0-%I64u %s %s\r\n", Digest::GetAlgorithmName(dwHashAlgorithm), dr.uliSize.QuadPart, szHex, pszParam);
+							SocketSendString(sCmd, szOutput);
+						} else {
+							swprintf_s(szOutput, L"556 \"%s\": No %s digest recorded for this file.\r\n", strNewVirtual.c_str(), Digest::GetAlgorithmName(dwHashAlgorithm));
+							SocketSendString(sCmd, szOutput);
+						}
+					}
+				} else {
+					swprintf_s(szOutput, L"550 \"%s\": Read permission denied.\r\n", strNewVirtual.c_str());
+					SocketSendString(sCmd, szOutput);
+				}
+			}
+		}
+
 		else if (!_wcsicmp(szCmd, L"DELE")) {
 			if (!*pszParam) {
 				SocketSendString(sCmd, L"501 Syntax error in parameters or arguments.\r\n");
@@ -1232,7 +3067,7 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN) == 1) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN, &permcache) == 1) {
 					if (pVFS->FileExists(strNewVirtual.c_str())) {
 						if (pVFS->DeleteFile(strNewVirtual.c_str())) {
 							swprintf_s(szOutput, L"250 \"%s\" deleted successfully.\r\n", strNewVirtual.c_str());
@@ -1261,7 +3096,7 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN) == 1) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN, &permcache) == 1) {
 					if (pVFS->FileExists(strNewVirtual.c_str())) {
 						strRnFr = strNewVirtual;
 						swprintf_s(szOutput, L"350 \"%s\": File exists; proceed with RNTO.\r\n", strNewVirtual.c_str());
@@ -1286,7 +3121,7 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"503 Bad sequence of commands. Send RNFR first.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN) == 1) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN, &permcache) == 1) {
 					if (pVFS->MoveFile(strRnFr.c_str(), strNewVirtual.c_str())) {
 						SocketSendString(sCmd, L"250 RNTO command successful.\r\n");
 						swprintf_s(szOutput, L"[%u] User \"%s\" renamed \"%s\" to \"%s\".", sCmd, strUser.c_str(), strRnFr.c_str(), strNewVirtual.c_str());
@@ -1302,6 +3137,78 @@ void __cdecl ConnectionThread(void *pParam)
 			}
 		}
 
+		else if (!_wcsicmp(szCmd, L"SITE")) {
+			if (!*pszParam) {
+				SocketSendString(sCmd, L"501 Syntax error in parameters or arguments.\r\n");
+			} else if (!isLoggedIn) {
+				SocketSendString(sCmd, L"530 Not logged in.\r\n");
+			} else if (!_wcsnicmp(pszParam, L"CPFR ", 5) && pszParam[5]) {
+				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam + 5, strNewVirtual);
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_READ, &permcache) == 1) {
+					if (pVFS->FileExists(strNewVirtual.c_str()) && !pVFS->IsFolder(strNewVirtual.c_str())) {
+						strCpFr = strNewVirtual;
+						swprintf_s(szOutput, L"350 \"%s\": File exists; proceed with SITE CPTO.\r\n", strNewVirtual.c_str());
+						SocketSendString(sCmd, szOutput);
+					} else {
+						swprintf_s(szOutput, L"550 \"%s\": File not found.\r\n", strNewVirtual.c_str());
+						SocketSendString(sCmd, szOutput);
+					}
+				} else {
+					swprintf_s(szOutput, L"550 \"%s\": Read permission denied.\r\n", strNewVirtual.c_str());
+					SocketSendString(sCmd, szOutput);
+				}
+			} else if (!_wcsnicmp(pszParam, L"CPTO ", 5) && pszParam[5]) {
+				if (strCpFr.length() == 0) {
+					SocketSendString(sCmd, L"503 Bad sequence of commands. Send SITE CPFR first.\r\n");
+				} else {
+					pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam + 5, strNewVirtual);
+					if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE, &permcache) == 1) {
+						if (pVFS->CopyFile(strCpFr.c_str(), strNewVirtual.c_str())) {
+							SocketSendString(sCmd, L"250 SITE CPTO command successful.\r\n");
+							swprintf_s(szOutput, L"[%u] User \"%s\" copied \"%s\" to \"%s\".", sCmd, strUser.c_str(), strCpFr.c_str(), strNewVirtual.c_str());
+							pLog->Log(szOutput);
+							strCpFr.clear();
+						} else {
+							swprintf_s(szOutput, L"553 \"%s\": Unable to copy file.\r\n", strNewVirtual.c_str());
+							SocketSendString(sCmd, szOutput);
+						}
+					} else {
+						swprintf_s(szOutput, L"550 \"%s\": Write permission denied.\r\n", strNewVirtual.c_str());
+						SocketSendString(sCmd, szOutput);
+					}
+				}
+			} else if (!_wcsicmp(pszParam, L"STATS")) {
+				if (pPerms->GetPerm(L"/", PERM_ADMIN, &permcache) == 1) {
+					SocketSendString(sCmd, L"211-Server statistics:\r\n");
+					if (pListingCache) {
+						pListingCache->GetStats(&llHits, &llMisses, &stBytes);
+						swprintf_s(szOutput, L" Listing cache: %I64d hits, %I64d misses, %Iu bytes.\r\n", llHits, llMisses, stBytes);
+						SocketSendString(sCmd, szOutput);
+					}
+					if (pStatCache) {
+						pStatCache->GetStats(&llHits, &llMisses);
+						swprintf_s(szOutput, L" Metadata cache: %I64d hits, %I64d misses.\r\n", llHits, llMisses);
+						SocketSendString(sCmd, szOutput);
+					}
+					if (pHandleCache) {
+						pHandleCache->GetStats(&llHits, &llMisses, &stBytes);
+						swprintf_s(szOutput, L" Handle cache: %I64d hits, %I64d misses, %Iu open.\r\n", llHits, llMisses, stBytes);
+						SocketSendString(sCmd, szOutput);
+					}
+					if (pFileCache) {
+						pFileCache->GetStats(&llHits, &llMisses, &llServed, &stBytes);
+						swprintf_s(szOutput, L" Memory cache: %I64d hits, %I64d misses (%I64d%% hit ratio), %I64d bytes served, %Iu bytes used.\r\n", llHits, llMisses, (llHits + llMisses) ? llHits * 100 / (llHits + llMisses) : 0, llServed, stBytes);
+						SocketSendString(sCmd, szOutput);
+					}
+					SocketSendString(sCmd, L"211 End of statistics.\r\n");
+				} else {
+					SocketSendString(sCmd, L"550 Admin permission denied.\r\n");
+				}
+			} else {
+				SocketSendString(sCmd, L"501 SITE command not understood.\r\n");
+			}
+		}
+
 		else if (!_wcsicmp(szCmd, L"MKD") || !_wcsicmp(szCmd, L"XMKD")) {
 			if (!*pszParam) {
 				SocketSendString(sCmd, L"501 Syntax error in parameters or arguments.\r\n");
@@ -1309,7 +3216,7 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE) == 1) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_WRITE, &permcache) == 1) {
 					if (pVFS->CreateDirectory(strNewVirtual.c_str())) {
 						swprintf_s(szOutput, L"250 \"%s\" created successfully.\r\n", strNewVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
@@ -1333,7 +3240,7 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"530 Not logged in.\r\n");
 			} else {
 				pVFS->ResolveRelative(strCurrentVirtual.c_str(), pszParam, strNewVirtual);
-				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN) == 1) {
+				if (pPerms->GetPerm(strNewVirtual.c_str(), PERM_ADMIN, &permcache) == 1) {
 					if (pVFS->RemoveDirectory(strNewVirtual.c_str())) {
 						swprintf_s(szOutput, L"250 \"%s\" removed successfully.\r\n", strNewVirtual.c_str());
 						SocketSendString(sCmd, szOutput);
@@ -1355,6 +3262,14 @@ void __cdecl ConnectionThread(void *pParam)
 				SocketSendString(sCmd, L"501 Syntax error in parameters or arguments.\r\n");
 			} else if (!_wcsicmp(pszParam, L"UTF8 On")) {
 				SocketSendString(sCmd, L"200 Always in UTF8 mode.\r\n");
+			} else if (!_wcsnicmp(pszParam, L"HASH ", 5)) {
+				if (dw = Digest::ParseAlgorithm(pszParam + 5)) {
+					dwHashAlgorithm = dw;
+					swprintf_s(szOutput, L"200 %s\r\n", Digest::GetAlgorithmName(dwHashAlgorithm));
+					SocketSendString(sCmd, szOutput);
+				} else {
+					SocketSendString(sCmd, L"501 Unknown algorithm.\r\n");
+				}
 			} else {
 				SocketSendString(sCmd, L"501 Option not understood.\r\n");
 			}
@@ -1366,6 +3281,8 @@ void __cdecl ConnectionThread(void *pParam)
 		}
 
 	}
+	if (qwCommandStarted) pMetrics->RecordCommand(dwVerb, qwCommandStarted);
+	delete pTrace;
 
 	if (sPasv) closesocket(sPasv);
 	closesocket(sCmd);
@@ -1373,6 +3290,8 @@ void __cdecl ConnectionThread(void *pParam)
 	if (isLoggedIn) {
 		InterlockedDecrement(&dwActiveConnections);
 	}
+	pUser.reset();
+	pConfig->leave(&reader);
 
 	swprintf_s(szOutput,L"[%u] Connection closed.",sCmd);
 	pLog->Log(szOutput);
@@ -1529,6 +3448,7 @@ SOCKET EstablishDataConnection(SOCKADDR_IN *psaiData, SOCKET *psPasv)
 			dw=sizeof(SOCKADDR_IN);
 			sData=accept(*psPasv,(SOCKADDR *)psaiData,(int *)&dw);
 		} else {
+			if (pMetrics) pMetrics->Count(dw ? MetricsCounter::DATA_CONNECT_FAILURES : MetricsCounter::DATA_CONNECT_TIMEOUTS);
 			sData=0;
 		}
 		closesocket(*psPasv);
@@ -1537,6 +3457,7 @@ SOCKET EstablishDataConnection(SOCKADDR_IN *psaiData, SOCKET *psPasv)
 	} else {
 		sData=socket(AF_INET,SOCK_STREAM, IPPROTO_TCP);
 		if (connect(sData,(SOCKADDR *)psaiData,sizeof(SOCKADDR_IN))) {
+			if (pMetrics) pMetrics->Count(MetricsCounter::DATA_CONNECT_FAILURES);
 			closesocket(sData);
 			return INVALID_SOCKET;
 		} else {
@@ -1566,37 +3487,46 @@ void LookupHost(const SOCKADDR_IN *sai, wchar_t *pszHostName, size_t stHostName)
 	wcscpy_s(pszHostName, stHostName, L"???");
 }
 
-bool DoSocketFileIO(SOCKET sCmd, SOCKET sData, HANDLE hFile, SocketFileIODirection direction, DWORD *pdwAbortFlag)
+bool DoSocketFileIO(SOCKET sCmd, SOCKET sData, HANDLE hFile, SocketFileIODirection direction, DWORD *pdwAbortFlag, Digest *pDigest, TRANSFERSTATS *pts)
+// Moves data between the file and the data connection. When pDigest is
+// given, every buffer received is fed to it as it is written, so the
+// uploaded file never has to be read back to be checksummed. The bytes
+// moved and the time spent waiting on the file and on the connection are
+// added to *pts, whether or not the transfer completes.
 {
 	char szBuffer[PACKET_SIZE];
-	wchar_t szCmd[512];
+	ULONGLONG qwTicks;
 	DWORD dw;
+	bool isAborted;
 
 	if (pdwAbortFlag) *pdwAbortFlag = 0;
+	qwTicks = Metrics::GetTicks();
 	switch (direction) {
 	case SocketFileIODirection::SEND:
 		for (;;) {
 			if (!ReadFile(hFile, szBuffer, PACKET_SIZE, &dw, 0)) return false;
+			pts->qwDiskTicks += Metrics::Lap(&qwTicks);
 			if (!dw) return true;
 			if (send(sData, szBuffer, dw, 0) == SOCKET_ERROR) return false;
-			ioctlsocket(sCmd, FIONREAD, &dw);
-			if (dw) {
-				if (SocketReceiveString(sCmd, szCmd, ARRAYSIZE(szCmd), &dw) == ReceiveStatus::OK) {
-					if (!_wcsicmp(szCmd, L"ABOR")) {
-						*pdwAbortFlag = 1;
-						return false;
-					} else {
-						SocketSendString(sCmd, L"500 Only command allowed at this time is ABOR.\r\n");
-					}
-				}
-			}
+			pts->qwBytes += dw;
+			isAborted = CheckForAbort(sCmd, pdwAbortFlag);
+			pts->qwNetworkTicks += Metrics::Lap(&qwTicks);
+			if (isAborted) return false;
 		}
 		break;
 	case SocketFileIODirection::RECEIVE:
 		for (;;) {
 			if (SocketReceiveData(sData, szBuffer, PACKET_SIZE, &dw) != ReceiveStatus::OK) return false;
+			pts->qwNetworkTicks += Metrics::Lap(&qwTicks);
 			if (dw == 0) return true;
 			if (!WriteFile(hFile, szBuffer, dw, &dw, 0)) return false;
+			pts->qwDiskTicks += Metrics::Lap(&qwTicks);
+			pts->qwBytes += dw;
+			if (pDigest) {
+				// Hashing is neither; it shows as the rest of the wall time
+				pDigest->Update(szBuffer, dw);
+				Metrics::Lap(&qwTicks);
+			}
 		}
 		break;
 	default:
@@ -1604,52 +3534,233 @@ bool DoSocketFileIO(SOCKET sCmd, SOCKET sData, HANDLE hFile, SocketFileIODirecti
 	}
 }
 
-bool FileSkipBOM(HANDLE hFile)
+bool DoSocketSharedSend(SOCKET sCmd, SOCKET sData, HandleCache::FILEREF *pref, ULONGLONG qwOffset, DWORD *pdwAbortFlag, TRANSFERSTATS *pts)
+// Sends a file from a shared handle, starting at qwOffset. Reads are
+// positional, so any number of sessions can send from the same handle.
 {
-	DWORD dw, dwBytesRead;
-	wchar_t chBOM;
+	char szBuffer[SHARED_READ_SIZE];
+	HANDLE hEvent;
+	ULONGLONG qwTicks;
+	DWORD dw;
+	bool bSuccess = false, isAborted;
 
-	if (SetFilePointer(hFile, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-		return false;
+	*pdwAbortFlag = 0;
+	hEvent = CreateEvent(0, TRUE, FALSE, 0);
+	if (!hEvent) return false;
+	qwTicks = Metrics::GetTicks();
+	for (;;) {
+		if (!HandleCache::Read(pref, qwOffset, szBuffer, SHARED_READ_SIZE, &dw, hEvent)) break;
+		pts->qwDiskTicks += Metrics::Lap(&qwTicks);
+		if (!dw) {
+			bSuccess = true;
+			break;
+		}
+		if (send(sData, szBuffer, dw, 0) == SOCKET_ERROR) break;
+		qwOffset += dw;
+		pts->qwBytes += dw;
+		isAborted = CheckForAbort(sCmd, pdwAbortFlag);
+		pts->qwNetworkTicks += Metrics::Lap(&qwTicks);
+		if (isAborted) break;
+	}
+	CloseHandle(hEvent);
+	return bSuccess;
+}
+
+bool DoSocketMemorySend(SOCKET sCmd, SOCKET sData, const FileCache::CONTENT *pcontent, ULONGLONG qwOffset, DWORD *pdwAbortFlag, TRANSFERSTATS *pts)
+// Sends a file held in the memory cache, starting at qwOffset. No time is
+// spent on the disk, so all of it is put down to the connection.
+{
+	ULONGLONG qwTicks;
+	size_t st;
+	int i;
+	bool bSuccess = true;
+
+	*pdwAbortFlag = 0;
+	qwTicks = Metrics::GetTicks();
+	for (st = (size_t)min(qwOffset, (ULONGLONG)pcontent->data.size()); st < pcontent->data.size(); st += i) {
+		i = (int)min(pcontent->data.size() - st, (size_t)SHARED_READ_SIZE);
+		if (send(sData, &pcontent->data[st], i, 0) == SOCKET_ERROR) {
+			bSuccess = false;
+			break;
+		}
+		pFileCache->Served(i);
+		pts->qwBytes += i;
+		if (CheckForAbort(sCmd, pdwAbortFlag)) {
+			bSuccess = false;
+			break;
+		}
 	}
+	pts->qwNetworkTicks += Metrics::Lap(&qwTicks);
+	return bSuccess;
+}
 
-	dw = ReadFile(hFile, &chBOM, sizeof(wchar_t), &dwBytesRead, 0);
-	if (!dw) {
+bool DoSocketMappedSend(SOCKET sCmd, SOCKET sData, HANDLE hFile, ULONGLONG qwOffset, DWORD *pdwAbortFlag, TRANSFERSTATS *pts)
+// Sends a file from mapped views of it, starting at qwOffset, without
+// copying it through a buffer first. The file cannot be truncated while it
+// is mapped, so the size read after the mapping is made holds to the end.
+// An I/O error while paging in (e.g. a network share going away) makes send
+// fail rather than fault, since only the network stack touches the view.
+// For the same reason, time spent paging in counts as time on the
+// connection; only mapping each view counts as time on the disk.
+{
+	SYSTEM_INFO si;
+	HANDLE hMapping;
+	LARGE_INTEGER liSize;
+	ULONGLONG qwBase, qwView, qwTicks;
+	const char *pView;
+	size_t st;
+	int i;
+	bool bSuccess = true;
+
+	*pdwAbortFlag = 0;
+	qwTicks = Metrics::GetTicks();
+	hMapping = CreateFileMapping(hFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (!hMapping) {
+		// Empty files cannot be mapped and have nothing to send
+		return (GetFileSizeEx(hFile, &liSize) && ((ULONGLONG)liSize.QuadPart <= qwOffset));
+	}
+	if (!GetFileSizeEx(hFile, &liSize)) {
+		CloseHandle(hMapping);
 		return false;
 	}
+	GetSystemInfo(&si);
+	while (bSuccess && (qwOffset < (ULONGLONG)liSize.QuadPart)) {
+		qwBase = qwOffset - (qwOffset % si.dwAllocationGranularity);
+		qwView = min((ULONGLONG)liSize.QuadPart - qwBase, (ULONGLONG)MAPPED_VIEW_SIZE);
+		pView = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, (DWORD)(qwBase >> 32), (DWORD)qwBase, (SIZE_T)qwView);
+		pts->qwDiskTicks += Metrics::Lap(&qwTicks);
+		if (!pView) {
+			bSuccess = false;
+			break;
+		}
+		for (st = (size_t)(qwOffset - qwBase); st < qwView; st += i) {
+			i = (int)min(qwView - st, (ULONGLONG)MAPPED_SEND_SIZE);
+			if (send(sData, pView + st, i, 0) == SOCKET_ERROR) {
+				bSuccess = false;
+				break;
+			}
+			pts->qwBytes += i;
+			if (CheckForAbort(sCmd, pdwAbortFlag)) {
+				bSuccess = false;
+				break;
+			}
+		}
+		pts->qwNetworkTicks += Metrics::Lap(&qwTicks);
+		UnmapViewOfFile(pView);
+		qwOffset = qwBase + qwView;
+	}
+	CloseHandle(hMapping);
+	return bSuccess;
+}
 
-	if (dwBytesRead > 0) {
-		if (dwBytesRead < sizeof(wchar_t) || chBOM!=0xFEFF) {
-			SetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+bool CheckForAbort(SOCKET sCmd, DWORD *pdwAbortFlag)
+// Handles a command sent during a download. Returns true if it was ABOR.
+{
+	wchar_t szCmd[512];
+	DWORD dw;
+
+	ioctlsocket(sCmd, FIONREAD, &dw);
+	if (dw) {
+		if (SocketReceiveString(sCmd, szCmd, ARRAYSIZE(szCmd), &dw) == ReceiveStatus::OK) {
+			if (!_wcsicmp(szCmd, L"ABOR")) {
+				*pdwAbortFlag = 1;
+				return true;
+			} else {
+				SocketSendString(sCmd, L"500 Only command allowed at this time is ABOR.\r\n");
+			}
 		}
 	}
+	return false;
+}
 
-	return true;
+bool IsConnectionClosed(SOCKET s)
+// Returns true if the peer has closed or reset a connection it is only
+// meant to read from, such as the data connection of a listing.
+{
+	char ch;
+	TIMEVAL tv;
+	fd_set fds;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	FD_ZERO(&fds);
+	FD_SET(s, &fds);
+	if (select(0, &fds, 0, 0, &tv) != 1) return false;
+	return (recv(s, &ch, 1, MSG_PEEK) <= 0);
+}
+
+void BeginTransfer(TRANSFERSTATS *pts)
+{
+	ZeroMemory(pts, sizeof(TRANSFERSTATS));
+	pts->qwStartTicks = Metrics::GetTicks();
 }
 
-DWORD FileReadLine(HANDLE hFile, wchar_t *pszBuf, DWORD dwBufLen)
+void EndTransfer(TRANSFERSTATS *pts)
 {
-// Reads a line from an open text file into a character buffer, discarding the
-// trailing CR/LF, up to dwBufLen bytes. Any additional bytes are discarded.
-// Returns the number of characters in the line, excluding the CR/LF, or -1 if
-// the end of the file was reached. May be greater than dwBufLen to indicate
-// that bytes were discarded. Note that a return value of 0 does not
-// necessarily indicate an error; it could mean a blank line was read.
+	pts->qwMicroseconds = Metrics::GetMicroseconds(pts->qwStartTicks);
+	pts->qwDiskMicroseconds = Metrics::TicksToMicroseconds(pts->qwDiskTicks);
+	pts->qwNetworkMicroseconds = Metrics::TicksToMicroseconds(pts->qwNetworkTicks);
+}
 
-	DWORD dw, dwBytesRead, dwCount;
+void FormatTransferStats(const TRANSFERSTATS *pts, bool isLogLine, wchar_t *pszOut, size_t stOut)
+// Formats what a transfer moved, how fast, and whether the disk or the
+// connection held it up: readably for a reply, or as key=value pairs for
+// the log. Whatever time is on neither went on hashing and abort checks.
+{
+	ULONGLONG qwRate;
 
-	for (dwCount=0;;) {
-		dw=ReadFile(hFile,pszBuf,sizeof(wchar_t),&dwBytesRead,0);
-		if (!dw || (dw && !dwBytesRead && !dwCount)) return -1;
-		if (dwBytesRead!=sizeof(wchar_t) || *pszBuf==L'\n') break;
-		if (*pszBuf!=L'\r') {
-			dwCount++;
-			if (dwCount<dwBufLen) pszBuf++;
-		}
+	qwRate = pts->qwBytes * 1000000 / max(pts->qwMicroseconds, (ULONGLONG)1);
+	if (isLogLine) {
+		swprintf_s(pszOut, stOut, L"bytes=%I64u seconds=%.3f rate=%I64u disk_seconds=%.3f network_seconds=%.3f bound=%s",
+			pts->qwBytes, pts->qwMicroseconds / 1e6, qwRate, pts->qwDiskMicroseconds / 1e6, pts->qwNetworkMicroseconds / 1e6,
+			(pts->qwDiskMicroseconds > pts->qwNetworkMicroseconds) ? L"disk" : L"network");
+	} else {
+		swprintf_s(pszOut, stOut, (qwRate >= 1048576) ? L"%I64u bytes in %.3f s (%.2f MB/s); %.3f s on disk, %.3f s on the network" : L"%I64u bytes in %.3f s (%.1f KB/s); %.3f s on disk, %.3f s on the network",
+			pts->qwBytes, pts->qwMicroseconds / 1e6, (qwRate >= 1048576) ? qwRate / 1048576.0 : qwRate / 1024.0, pts->qwDiskMicroseconds / 1e6, pts->qwNetworkMicroseconds / 1e6);
 	}
-	*pszBuf=0;
+}
 
-	return dwCount;
+void LogTransfer(SOCKET sCmd, const SOCKADDR_IN *psaiPeer, const wchar_t *pszPeerName, const wstring &strUser, const wstring &strVirtual, SocketFileIODirection direction, const TRANSFERSTATS *pts, bool isComplete)
+// Writes a line for a finished or aborted transfer to the transfer log. The
+// xferlog format is the one wu-ftpd wrote, field for field, so existing
+// log analyzers can read it; its fields are separated by spaces, so any
+// whitespace in a name is written as an underscore. Every transfer is in
+// binary, since TYPE is accepted but not acted on.
+{
+	static const wchar_t * const ppszDays[] = { L"Sun", L"Mon", L"Tue", L"Wed", L"Thu", L"Fri", L"Sat" };
+	static const wchar_t * const ppszMonths[] = { L"Jan", L"Feb", L"Mar", L"Apr", L"May", L"Jun", L"Jul", L"Aug", L"Sep", L"Oct", L"Nov", L"Dec" };
+	wchar_t sz[256];
+	wstring strLine, strPath, strName;
+	SYSTEMTIME st;
+	size_t stPos;
+
+	if (!pTransferLog) return;
+	if (transferLogFormat == TransferLogFormat::XFERLOG) {
+		strPath = strVirtual;
+		for (stPos = 0; stPos < strPath.length(); stPos++) if (strPath[stPos] <= L' ') strPath[stPos] = L'_';
+		strName = strUser;
+		for (stPos = 0; stPos < strName.length(); stPos++) if (strName[stPos] <= L' ') strName[stPos] = L'_';
+		GetLocalTime(&st);
+		swprintf_s(sz, L"%s %s %2u %02u:%02u:%02u %u %u %s %I64u ", ppszDays[st.wDayOfWeek], ppszMonths[st.wMonth - 1], st.wDay, st.wHour, st.wMinute, st.wSecond, st.wYear, (DWORD)((pts->qwMicroseconds + 500000) / 1000000), pszPeerName, pts->qwBytes);
+		strLine = sz;
+		strLine += strPath;
+		strLine += (direction == SocketFileIODirection::SEND) ? L" b _ o r " : L" b _ i r ";
+		strLine += strName;
+		strLine += isComplete ? L" ftp 0 * c" : L" ftp 0 * i";
+	} else {
+		GetSystemTime(&st);
+		swprintf_s(sz, L"{\"time\":\"%04u-%02u-%02uT%02u:%02u:%02u.%03uZ\",\"session\":%u,\"ip\":\"%u.%u.%u.%u\",\"remote\":\"", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds, sCmd,
+			psaiPeer->sin_addr.S_un.S_un_b.s_b1, psaiPeer->sin_addr.S_un.S_un_b.s_b2, psaiPeer->sin_addr.S_un.S_un_b.s_b3, psaiPeer->sin_addr.S_un.S_un_b.s_b4);
+		strLine = sz;
+		AppendJsonString(strLine, pszPeerName);
+		strLine += L"\",\"user\":\"";
+		AppendJsonString(strLine, strUser.c_str());
+		strLine += (direction == SocketFileIODirection::SEND) ? L"\",\"direction\":\"download\",\"path\":\"" : L"\",\"direction\":\"upload\",\"path\":\"";
+		AppendJsonString(strLine, strVirtual.c_str());
+		swprintf_s(sz, L"\",\"bytes\":%I64u,\"duration_ms\":%I64u,\"disk_ms\":%I64u,\"network_ms\":%I64u,\"status\":\"%s\"}", pts->qwBytes, pts->qwMicroseconds / 1000, pts->qwDiskMicroseconds / 1000, pts->qwNetworkMicroseconds / 1000, isComplete ? L"complete" : L"aborted");
+		strLine += sz;
+	}
+	pTransferLog->Log(strLine.c_str());
 }
 
 DWORD SplitTokens(wchar_t *pszIn)
@@ -1721,3 +3832,4 @@ IpAddressType GetIPAddressType(IN_ADDR ia)
 		return IpAddressType::WAN;
 	}
 }
+
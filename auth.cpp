@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "auth.h"
+#include <process.h>
+
+// Slow checks are handed to a small pool of threads, so a session waiting on
+// a hash or on the helper holds up nothing but itself, and the helper never
+// sees more than one request per thread at a time. Verdicts are remembered
+// for a while under a salted hash of the user, the stored value and the
+// password, so a client that logs in again and again is answered at once.
+
+static bool ParseHex(const wchar_t *psz, size_t stLen, vector<BYTE> &bytes)
+// Decodes stLen hex digits at psz. Returns false if any is not a hex digit.
+{
+	BYTE b;
+
+	if (stLen & 1) return false;
+	bytes.resize(stLen / 2);
+	for (size_t i = 0; i < stLen; i++) {
+		if ((psz[i] >= L'0') && (psz[i] <= L'9')) b = (BYTE)(psz[i] - L'0');
+		else if ((psz[i] >= L'a') && (psz[i] <= L'f')) b = (BYTE)(psz[i] - L'a' + 10);
+		else if ((psz[i] >= L'A') && (psz[i] <= L'F')) b = (BYTE)(psz[i] - L'A' + 10);
+		else return false;
+		if (i & 1) bytes[i / 2] |= b;
+		else bytes[i / 2] = (BYTE)(b << 4);
+	}
+	return true;
+}
+
+static void AppendUTF8(string &str, const wchar_t *psz)
+{
+	int nLen = (int)wcslen(psz);
+	int nBytes;
+
+	if (!nLen) return;
+	nBytes = WideCharToMultiByte(CP_UTF8, 0, psz, nLen, NULL, 0, NULL, NULL);
+	if (nBytes <= 0) return;
+	size_t stOffset = str.size();
+	str.resize(stOffset + nBytes);
+	WideCharToMultiByte(CP_UTF8, 0, psz, nLen, &str[stOffset], nBytes, NULL, NULL);
+}
+
+static void WipeString(string &str)
+{
+	if (!str.empty()) SecureZeroMemory(&str[0], str.size());
+	str.clear();
+}
+
+HashAuthBackend::HashAuthBackend()
+{
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_hAlg, BCRYPT_SHA256_ALGORITHM, NULL, BCRYPT_ALG_HANDLE_HMAC_FLAG))) _hAlg = NULL;
+}
+
+HashAuthBackend::~HashAuthBackend()
+{
+	if (_hAlg) BCryptCloseAlgorithmProvider(_hAlg, 0);
+}
+
+bool HashAuthBackend::Parse(const wchar_t *pszStored, DWORD *pdwIterations, vector<BYTE> &salt, vector<BYTE> &hash)
+// Splits a {PBKDF2} value into its parts. Returns false if it is malformed.
+{
+	const wchar_t *psz, *pszSalt, *pszHash;
+	ULONGLONG qwIterations = 0;
+
+	if (_wcsnicmp(pszStored, L"{PBKDF2}", 8)) return false;
+	for (psz = pszStored + 8; (*psz >= L'0') && (*psz <= L'9'); psz++) {
+		qwIterations = qwIterations * 10 + (*psz - L'0');
+		if (qwIterations > AUTH_MAX_ITERATIONS) return false;
+	}
+	if (!qwIterations || (*psz != L'$')) return false;
+	pszSalt = psz + 1;
+	pszHash = wcschr(pszSalt, L'$');
+	if (!pszHash) return false;
+	pszHash++;
+	if (!ParseHex(pszSalt, pszHash - 1 - pszSalt, salt) || !ParseHex(pszHash, wcslen(pszHash), hash)) return false;
+	if ((salt.size() < 8) || (hash.size() < 16) || (hash.size() > 64)) return false;
+	*pdwIterations = (DWORD)qwIterations;
+	return true;
+}
+
+bool HashAuthBackend::IsValid(const wchar_t *pszStored)
+{
+	DWORD dwIterations;
+	vector<BYTE> salt, hash;
+
+	return Parse(pszStored, &dwIterations, salt, hash);
+}
+
+DWORD HashAuthBackend::Verify(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword)
+{
+	DWORD dwIterations;
+	vector<BYTE> salt, hash, derived;
+	string strPassword;
+	BYTE bDiff = 0;
+
+	if (!_hAlg || !Parse(pszStored, &dwIterations, salt, hash)) return AUTH_FAILED;
+	AppendUTF8(strPassword, pszPassword);
+	derived.resize(hash.size());
+	if (!BCRYPT_SUCCESS(BCryptDeriveKeyPBKDF2(_hAlg, (PUCHAR)strPassword.data(), (ULONG)strPassword.size(), &salt[0], (ULONG)salt.size(), dwIterations, &derived[0], (ULONG)derived.size(), 0))) {
+		WipeString(strPassword);
+		return AUTH_FAILED;
+	}
+	WipeString(strPassword);
+
+	// Look at every byte, so the time taken says nothing about the hash
+	for (size_t i = 0; i < hash.size(); i++) bDiff |= hash[i] ^ derived[i];
+	return bDiff ? AUTH_REJECT : AUTH_ACCEPT;
+}
+
+HelperAuthBackend::HelperAuthBackend(const wchar_t *pszPipe)
+{
+	_strPipe = pszPipe;
+	InitializeCriticalSection(&_cs);
+}
+
+HelperAuthBackend::~HelperAuthBackend()
+{
+	for (size_t i = 0; i < _idle.size(); i++) Disconnect(&_idle[i]);
+	DeleteCriticalSection(&_cs);
+}
+
+bool HelperAuthBackend::Connect(CONNECTION *pconn)
+// Opens a new connection to the helper, waiting a while if all of its pipe
+// instances are busy.
+{
+	// The helper may identify the server's account but not act as it
+	for (int i = 0; i < 2; i++) {
+		pconn->hPipe = CreateFile(_strPipe.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, NULL);
+		if (pconn->hPipe != INVALID_HANDLE_VALUE) break;
+		if ((GetLastError() != ERROR_PIPE_BUSY) || !WaitNamedPipe(_strPipe.c_str(), AUTH_TIMEOUT)) return false;
+	}
+	if (pconn->hPipe == INVALID_HANDLE_VALUE) return false;
+	pconn->hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!pconn->hEvent) {
+		CloseHandle(pconn->hPipe);
+		return false;
+	}
+	return true;
+}
+
+void HelperAuthBackend::Disconnect(CONNECTION *pconn)
+{
+	CloseHandle(pconn->hPipe);
+	CloseHandle(pconn->hEvent);
+}
+
+bool HelperAuthBackend::Transfer(CONNECTION *pconn, bool isWrite, char *pb, DWORD dwLen, DWORD *pdwDone)
+// Reads or writes with a time limit, so a helper that stops answering ties
+// up a pool thread for no longer than a session waits for it.
+{
+	OVERLAPPED ov;
+	BOOL b;
+
+	ZeroMemory(&ov, sizeof(ov));
+	ov.hEvent = pconn->hEvent;
+	if (isWrite) b = WriteFile(pconn->hPipe, pb, dwLen, NULL, &ov);
+	else b = ReadFile(pconn->hPipe, pb, dwLen, NULL, &ov);
+	if (!b && (GetLastError() != ERROR_IO_PENDING)) return false;
+	if (WaitForSingleObject(pconn->hEvent, AUTH_TIMEOUT) != WAIT_OBJECT_0) CancelIo(pconn->hPipe);
+	return GetOverlappedResult(pconn->hPipe, &ov, pdwDone, TRUE) && *pdwDone;
+}
+
+DWORD HelperAuthBackend::Exchange(CONNECTION *pconn, string &strRequest)
+// Sends one request and reads the helper's answer.
+{
+	char ach[16];
+	DWORD dwDone, dwLen = 0;
+
+	for (size_t st = 0; st < strRequest.size(); st += dwDone) {
+		if (!Transfer(pconn, true, &strRequest[st], (DWORD)(strRequest.size() - st), &dwDone)) return AUTH_FAILED;
+	}
+	do {
+		if ((dwLen == sizeof(ach)) || !Transfer(pconn, false, ach + dwLen, sizeof(ach) - dwLen, &dwDone)) return AUTH_FAILED;
+		dwLen += dwDone;
+	} while (ach[dwLen - 1] != '\n');
+
+	if ((dwLen == 3) && !memcmp(ach, "OK\n", 3)) return AUTH_ACCEPT;
+	if ((dwLen == 3) && !memcmp(ach, "NO\n", 3)) return AUTH_REJECT;
+	return AUTH_FAILED;
+}
+
+DWORD HelperAuthBackend::Verify(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword)
+{
+	CONNECTION conn;
+	string strRequest;
+	bool isReused = false;
+	DWORD dwVerdict;
+
+	// A tab or line break cannot be sent, and no client could have typed one
+	if (wcspbrk(pszUser, L"\t\r\n") || wcspbrk(pszPassword, L"\t\r\n")) return AUTH_REJECT;
+	AppendUTF8(strRequest, pszUser);
+	strRequest += '\t';
+	AppendUTF8(strRequest, pszPassword);
+	strRequest += '\n';
+
+	EnterCriticalSection(&_cs);
+	if (!_idle.empty()) {
+		conn = _idle.back();
+		_idle.pop_back();
+		isReused = true;
+	}
+	LeaveCriticalSection(&_cs);
+
+	if (!isReused && !Connect(&conn)) {
+		WipeString(strRequest);
+		return AUTH_FAILED;
+	}
+	dwVerdict = Exchange(&conn, strRequest);
+	if ((dwVerdict == AUTH_FAILED) && isReused) {
+		// The helper may have restarted since the connection was last used
+		Disconnect(&conn);
+		if (!Connect(&conn)) {
+			WipeString(strRequest);
+			return AUTH_FAILED;
+		}
+		dwVerdict = Exchange(&conn, strRequest);
+	}
+	WipeString(strRequest);
+
+	if (dwVerdict == AUTH_FAILED) {
+		Disconnect(&conn);
+	} else {
+		EnterCriticalSection(&_cs);
+		_idle.push_back(conn);
+		LeaveCriticalSection(&_cs);
+	}
+	return dwVerdict;
+}
+
+Authenticator::Authenticator(DWORD dwThreads, DWORD dwAcceptTTL, DWORD dwRejectTTL, const wchar_t *pszHelperPipe)
+{
+	HANDLE hThread;
+
+	_pHelper = pszHelperPipe ? new HelperAuthBackend(pszHelperPipe) : NULL;
+	_qwAcceptTTL = (ULONGLONG)dwAcceptTTL * 1000;
+	_qwRejectTTL = (ULONGLONG)dwRejectTTL * 1000;
+	_isStopping = false;
+	_llChecks = 0;
+	_llHits = 0;
+	_llFailures = 0;
+	InitializeCriticalSection(&_cs);
+	InitializeConditionVariable(&_cvWork);
+	InitializeConditionVariable(&_cvDone);
+
+	// Cache keys are salted afresh on every start
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_hKeyAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0))) _hKeyAlg = NULL;
+	if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, _abKeySalt, sizeof(_abKeySalt), BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+		if (_hKeyAlg) BCryptCloseAlgorithmProvider(_hKeyAlg, 0);
+		_hKeyAlg = NULL;
+	}
+
+	for (DWORD dw = 0; dw < dwThreads; dw++) {
+		hThread = (HANDLE)_beginthreadex(NULL, 0, WorkerThread, this, 0, NULL);
+		if (!hThread) break;
+		_threads.push_back(hThread);
+	}
+}
+
+Authenticator::~Authenticator()
+{
+	EnterCriticalSection(&_cs);
+	_isStopping = true;
+	WakeAllConditionVariable(&_cvWork);
+	LeaveCriticalSection(&_cs);
+	if (!_threads.empty()) {
+		WaitForMultipleObjects((DWORD)_threads.size(), &_threads[0], TRUE, INFINITE);
+		for (size_t i = 0; i < _threads.size(); i++) CloseHandle(_threads[i]);
+	}
+	delete _pHelper;
+	if (_hKeyAlg) BCryptCloseAlgorithmProvider(_hKeyAlg, 0);
+	DeleteCriticalSection(&_cs);
+}
+
+bool Authenticator::IsScheme(const wchar_t *pszStored)
+// Only the schemes known here count. Any other password, even one that
+// starts with a brace, is plain text.
+{
+	return IsHelper(pszStored) || !_wcsnicmp(pszStored, L"{PBKDF2}", 8);
+}
+
+bool Authenticator::IsHelper(const wchar_t *pszStored)
+{
+	return !_wcsicmp(pszStored, L"{Helper}");
+}
+
+bool Authenticator::IsValid(const wchar_t *pszStored)
+// Returns true if pszStored names a known scheme and is well formed for it.
+{
+	return IsHelper(pszStored) || HashAuthBackend::IsValid(pszStored);
+}
+
+AuthBackend * Authenticator::GetBackend(const wchar_t *pszStored)
+{
+	if (IsHelper(pszStored)) return _pHelper;
+	if (!_wcsnicmp(pszStored, L"{PBKDF2}", 8)) return &_hash;
+	return NULL;
+}
+
+bool Authenticator::MakeKey(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword, string &strKey)
+// Hashes everything the verdict depends on. User names are matched without
+// regard to case, so the name is folded first.
+{
+	BCRYPT_HASH_HANDLE hHash;
+	wstring strUser(pszUser);
+	BYTE abKey[32];
+	bool isMade;
+
+	if (!_hKeyAlg || !BCRYPT_SUCCESS(BCryptCreateHash(_hKeyAlg, &hHash, NULL, 0, NULL, 0, 0))) return false;
+	if (!strUser.empty()) CharLowerBuff(&strUser[0], (DWORD)strUser.size());
+	isMade = BCRYPT_SUCCESS(BCryptHashData(hHash, _abKeySalt, sizeof(_abKeySalt), 0)) &&
+		BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)strUser.c_str(), (ULONG)(strUser.size() + 1) * sizeof(wchar_t), 0)) &&
+		BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)pszStored, (ULONG)(wcslen(pszStored) + 1) * sizeof(wchar_t), 0)) &&
+		BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)pszPassword, (ULONG)wcslen(pszPassword) * sizeof(wchar_t), 0)) &&
+		BCRYPT_SUCCESS(BCryptFinishHash(hHash, abKey, sizeof(abKey), 0));
+	BCryptDestroyHash(hHash);
+	if (isMade) strKey.assign((const char *)abKey, sizeof(abKey));
+	return isMade;
+}
+
+void Authenticator::Remember(const string &strKey, DWORD dwVerdict)
+// Caches a verdict. Called with the lock held.
+{
+	ULONGLONG qwTTL = (dwVerdict == AUTH_ACCEPT) ? _qwAcceptTTL : _qwRejectTTL;
+	ULONGLONG qwNow = GetTickCount64();
+
+	if (!qwTTL || strKey.empty()) return;
+	if (_cache.size() >= AUTH_CACHE_ENTRIES) {
+		for (cache_type::iterator it = _cache.begin(); it != _cache.end(); ) {
+			if (it->second.qwExpires <= qwNow) it = _cache.erase(it);
+			else ++it;
+		}
+		if (_cache.size() >= AUTH_CACHE_ENTRIES) _cache.clear();
+	}
+	VERDICT &v = _cache[strKey];
+	v.dwVerdict = dwVerdict;
+	v.qwExpires = qwNow + qwTTL;
+}
+
+DWORD Authenticator::Check(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword)
+// Checks a password against a stored value in one of the schemes, waiting
+// no longer than AUTH_TIMEOUT for a pool thread to do it.
+{
+	AuthBackend *pbackend = GetBackend(pszStored);
+	request_ptr preq;
+	cache_type::const_iterator it;
+	ULONGLONG qwNow, qwDeadline;
+	string strKey;
+	DWORD dwVerdict;
+
+	if (pbackend && (_qwAcceptTTL || _qwRejectTTL)) MakeKey(pszUser, pszStored, pszPassword, strKey);
+
+	EnterCriticalSection(&_cs);
+	_llChecks++;
+	if (!pbackend) {
+		_llFailures++;
+		LeaveCriticalSection(&_cs);
+		return AUTH_FAILED;
+	}
+	if (!strKey.empty()) {
+		it = _cache.find(strKey);
+		if ((it != _cache.end()) && (it->second.qwExpires > GetTickCount64())) {
+			_llHits++;
+			dwVerdict = it->second.dwVerdict;
+			LeaveCriticalSection(&_cs);
+			return dwVerdict;
+		}
+	}
+
+	if (_threads.empty()) {
+		// No pool threads could be started; check it here instead
+		LeaveCriticalSection(&_cs);
+		dwVerdict = pbackend->Verify(pszUser, pszStored, pszPassword);
+		EnterCriticalSection(&_cs);
+	} else {
+		preq = make_shared<REQUEST>();
+		preq->strUser = pszUser;
+		preq->strStored = pszStored;
+		preq->strPassword = pszPassword;
+		preq->pbackend = pbackend;
+		preq->dwVerdict = AUTH_FAILED;
+		preq->isDone = false;
+		_queue.push_back(preq);
+		WakeConditionVariable(&_cvWork);
+
+		qwDeadline = GetTickCount64() + AUTH_TIMEOUT;
+		while (!preq->isDone) {
+			qwNow = GetTickCount64();
+			if (qwNow >= qwDeadline) break;
+			SleepConditionVariableCS(&_cvDone, &_cs, (DWORD)(qwDeadline - qwNow));
+		}
+		if (!preq->isDone) {
+			// Withdraw the request if no thread has taken it yet
+			for (deque<request_ptr>::iterator itq = _queue.begin(); itq != _queue.end(); ++itq) {
+				if (*itq == preq) {
+					_queue.erase(itq);
+					break;
+				}
+			}
+		}
+		dwVerdict = preq->dwVerdict;
+	}
+
+	if (dwVerdict == AUTH_FAILED) _llFailures++;
+	else Remember(strKey, dwVerdict);
+	LeaveCriticalSection(&_cs);
+	return dwVerdict;
+}
+
+void Authenticator::GetStats(LONGLONG *pllChecks, LONGLONG *pllHits, LONGLONG *pllFailures)
+{
+	EnterCriticalSection(&_cs);
+	*pllChecks = _llChecks;
+	*pllHits = _llHits;
+	*pllFailures = _llFailures;
+	LeaveCriticalSection(&_cs);
+}
+
+unsigned __stdcall Authenticator::WorkerThread(void *pParam)
+{
+	Authenticator *pthis = (Authenticator *)pParam;
+	request_ptr preq;
+	DWORD dwVerdict;
+
+	EnterCriticalSection(&pthis->_cs);
+	for (;;) {
+		while (!pthis->_isStopping && pthis->_queue.empty()) {
+			SleepConditionVariableCS(&pthis->_cvWork, &pthis->_cs, INFINITE);
+		}
+		if (pthis->_isStopping) break;
+		preq = pthis->_queue.front();
+		pthis->_queue.pop_front();
+		LeaveCriticalSection(&pthis->_cs);
+
+		dwVerdict = preq->pbackend->Verify(preq->strUser.c_str(), preq->strStored.c_str(), preq->strPassword.c_str());
+		SecureZeroMemory(&preq->strPassword[0], preq->strPassword.size() * sizeof(wchar_t));
+
+		EnterCriticalSection(&pthis->_cs);
+		preq->dwVerdict = dwVerdict;
+		preq->isDone = true;
+		preq.reset();
+		WakeAllConditionVariable(&pthis->_cvDone);
+	}
+	LeaveCriticalSection(&pthis->_cs);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_AUTH_H
+#define _INCL_AUTH_H
+
+#include <windows.h>
+#include <bcrypt.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#define AUTH_REJECT 0
+#define AUTH_ACCEPT 1
+#define AUTH_FAILED 2
+
+#define AUTH_THREADS_DEFAULT 4
+#define AUTH_TIMEOUT 10000
+#define AUTH_CACHE_ENTRIES 4096
+#define AUTH_MAX_ITERATIONS 10000000
+
+// A stored password that begins with a scheme name in braces is not the
+// password itself but something a backend checks the password against.
+class AuthBackend
+{
+public:
+	virtual ~AuthBackend() {}
+	// Called on one of the authenticator's threads, so it may block
+	virtual DWORD Verify(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword) = 0;
+};
+
+// {PBKDF2}iterations$salt$hash holds PBKDF2-HMAC-SHA256 of the UTF-8
+// password, with the salt and hash in hex.
+class HashAuthBackend : public AuthBackend
+{
+private:
+	BCRYPT_ALG_HANDLE _hAlg;
+
+	static bool Parse(const wchar_t *pszStored, DWORD *pdwIterations, vector<BYTE> &salt, vector<BYTE> &hash);
+
+public:
+	HashAuthBackend();
+	~HashAuthBackend();
+	static bool IsValid(const wchar_t *pszStored);
+	DWORD Verify(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword);
+};
+
+// {Helper} asks a helper process listening on a local named pipe. Each
+// request is the line "user<TAB>password<LF>" in UTF-8, and the helper
+// answers "OK<LF>" or "NO<LF>"; anything else counts as a failure. The
+// helper may answer any number of requests on a connection, and idle
+// connections are kept for the next request.
+class HelperAuthBackend : public AuthBackend
+{
+private:
+	struct CONNECTION {
+		HANDLE hPipe;
+		HANDLE hEvent;
+	};
+
+	wstring _strPipe;
+	vector<CONNECTION> _idle;
+	CRITICAL_SECTION _cs;
+
+	bool Connect(CONNECTION *pconn);
+	static void Disconnect(CONNECTION *pconn);
+	static bool Transfer(CONNECTION *pconn, bool isWrite, char *pb, DWORD dwLen, DWORD *pdwDone);
+	static DWORD Exchange(CONNECTION *pconn, string &strRequest);
+
+public:
+	HelperAuthBackend(const wchar_t *pszPipe);
+	~HelperAuthBackend();
+	DWORD Verify(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword);
+};
+
+class Authenticator
+{
+private:
+	struct REQUEST {
+		wstring strUser;
+		wstring strStored;
+		wstring strPassword;
+		AuthBackend *pbackend;
+		DWORD dwVerdict;
+		bool isDone;
+	};
+	struct VERDICT {
+		DWORD dwVerdict;
+		ULONGLONG qwExpires;
+	};
+	typedef shared_ptr<REQUEST> request_ptr;
+	typedef unordered_map<string, VERDICT> cache_type;
+
+	HashAuthBackend _hash;
+	HelperAuthBackend *_pHelper;
+	deque<request_ptr> _queue;
+	cache_type _cache;
+	BCRYPT_ALG_HANDLE _hKeyAlg;
+	BYTE _abKeySalt[16];
+	ULONGLONG _qwAcceptTTL;
+	ULONGLONG _qwRejectTTL;
+	bool _isStopping;
+	CRITICAL_SECTION _cs;
+	CONDITION_VARIABLE _cvWork;
+	CONDITION_VARIABLE _cvDone;
+	vector<HANDLE> _threads;
+	LONGLONG _llChecks;
+	LONGLONG _llHits;
+	LONGLONG _llFailures;
+
+	AuthBackend * GetBackend(const wchar_t *pszStored);
+	bool MakeKey(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword, string &strKey);
+	void Remember(const string &strKey, DWORD dwVerdict);
+	static unsigned __stdcall WorkerThread(void *pParam);
+
+public:
+	Authenticator(DWORD dwThreads, DWORD dwAcceptTTL, DWORD dwRejectTTL, const wchar_t *pszHelperPipe);
+	~Authenticator();
+	static bool IsScheme(const wchar_t *pszStored);
+	static bool IsHelper(const wchar_t *pszStored);
+	static bool IsValid(const wchar_t *pszStored);
+	DWORD Check(const wchar_t *pszUser, const wchar_t *pszStored, const wchar_t *pszPassword);
+	void GetStats(LONGLONG *pllChecks, LONGLONG *pllHits, LONGLONG *pllFailures);
+};
+
+#endif
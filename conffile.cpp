@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "conffile.h"
+#include "digest.h"
+
+static wchar_t FoldChar(wchar_t ch)
+{
+	return ((ch >= L'A') && (ch <= L'Z')) ? (ch - L'A' + L'a') : ch;
+}
+
+ConfFile::ConfFile()
+{
+	_stNext = 0;
+	_qwHash = 0;
+}
+
+bool ConfFile::Open(const wchar_t *pszFileName)
+// Reads the whole file with one ReadFile and decodes it. Returns false if
+// it cannot be read.
+{
+	HANDLE hFile;
+	LARGE_INTEGER liSize;
+	vector<BYTE> bytes;
+	vector<wchar_t> wide;
+	DWORD dwRead;
+	const BYTE *pb;
+	size_t stBytes;
+	int nChars;
+	bool isWide;
+
+	Close();
+	hFile = CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hFile == INVALID_HANDLE_VALUE) return false;
+	if (!GetFileSizeEx(hFile, &liSize) || (liSize.QuadPart > CONFFILE_MAX_SIZE)) {
+		CloseHandle(hFile);
+		return false;
+	}
+	bytes.resize((size_t)liSize.QuadPart);
+	if (bytes.size() && (!ReadFile(hFile, &bytes[0], (DWORD)bytes.size(), &dwRead, 0) || (dwRead != bytes.size()))) {
+		CloseHandle(hFile);
+		return false;
+	}
+	CloseHandle(hFile);
+
+	pb = bytes.size() ? &bytes[0] : NULL;
+	stBytes = bytes.size();
+	_qwHash = Digest::HashXXH64(pb, stBytes);
+	if ((stBytes >= 2) && (pb[0] == 0xFF) && (pb[1] == 0xFE)) {
+		pb += 2;
+		stBytes -= 2;
+		isWide = true;
+	}
+	else if ((stBytes >= 3) && (pb[0] == 0xEF) && (pb[1] == 0xBB) && (pb[2] == 0xBF)) {
+		pb += 3;
+		stBytes -= 3;
+		isWide = false;
+	}
+	else {
+		// Without a byte order mark, an ASCII first character shows UTF-16
+		isWide = (stBytes >= 2) && !pb[1];
+	}
+
+	_text.reserve(stBytes + 2);
+	if (isWide) {
+		Append((const wchar_t *)pb, stBytes / sizeof(wchar_t));
+	}
+	else if (stBytes) {
+		nChars = MultiByteToWideChar(CP_UTF8, 0, (const char *)pb, (int)stBytes, NULL, 0);
+		wide.resize(nChars + 1);
+		if (nChars) MultiByteToWideChar(CP_UTF8, 0, (const char *)pb, (int)stBytes, &wide[0], nChars);
+		Append(&wide[0], nChars);
+	}
+	return true;
+}
+
+void ConfFile::Append(const wchar_t *pch, size_t stCount)
+// Copies the decoded text, dropping CRs and NULs and ending every line,
+// including an unterminated last one, with two terminators.
+{
+	const wchar_t *pchEnd = pch + stCount;
+	bool isLineOpen = false;
+
+	for (; pch < pchEnd; pch++) {
+		if (*pch == L'\n') {
+			_text.push_back(0);
+			_text.push_back(0);
+			isLineOpen = false;
+		}
+		else if (*pch && (*pch != L'\r')) {
+			_text.push_back(*pch);
+			isLineOpen = true;
+		}
+	}
+	if (isLineOpen) {
+		_text.push_back(0);
+		_text.push_back(0);
+	}
+}
+
+wchar_t * ConfFile::ReadLine(DWORD *pdwLen)
+// Returns the next line and its length, or NULL at the end of the file. The
+// line may be changed in place, up to one character past its terminator.
+{
+	wchar_t *psz;
+	size_t stLen;
+
+	if (_stNext >= _text.size()) return NULL;
+	psz = &_text[_stNext];
+	stLen = wcslen(psz);
+	_stNext += stLen + 2;
+	*pdwLen = (DWORD)stLen;
+	return psz;
+}
+
+ULONGLONG ConfFile::GetHash() const
+// Returns the XXH64 of the file as it was read, before decoding.
+{
+	return _qwHash;
+}
+
+void ConfFile::Close()
+{
+	vector<wchar_t>().swap(_text);
+	_stNext = 0;
+	_qwHash = 0;
+}
+
+ConfKeywords::ConfKeywords(const wchar_t * const *ppsz, size_t stCount)
+// The table must have fewer than half as many names as there are slots.
+{
+	DWORD dw;
+
+	ZeroMemory(_slots, sizeof(_slots));
+	for (size_t i = 0; i < stCount; i++) {
+		for (dw = Hash(ppsz[i]) & (CONFKEYWORDS_SLOTS - 1); _slots[dw].psz; dw = (dw + 1) & (CONFKEYWORDS_SLOTS - 1));
+		_slots[dw].psz = ppsz[i];
+		_slots[dw].dwId = (DWORD)i + 1;
+	}
+}
+
+DWORD ConfKeywords::Hash(const wchar_t *psz)
+{
+	DWORD dwHash = 2166136261U;
+
+	for (; *psz; psz++) dwHash = (dwHash ^ FoldChar(*psz)) * 16777619;
+	return dwHash ^ (dwHash >> 15);
+}
+
+DWORD ConfKeywords::Find(const wchar_t *psz) const
+{
+	DWORD dw;
+
+	for (dw = Hash(psz) & (CONFKEYWORDS_SLOTS - 1); _slots[dw].psz; dw = (dw + 1) & (CONFKEYWORDS_SLOTS - 1)) {
+		if (!_wcsicmp(psz, _slots[dw].psz)) return _slots[dw].dwId;
+	}
+	return 0;
+}
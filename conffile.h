@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_CONFFILE_H
+#define _INCL_CONFFILE_H
+
+#include <windows.h>
+#include <vector>
+
+using namespace std;
+
+#define CONFFILE_MAX_SIZE 0x40000000
+#define CONFKEYWORDS_SLOTS 128
+
+// A text file read whole and split into lines, for the config script and
+// the user store. The file may be UTF-16 (little-endian, with or without a
+// byte order mark) or UTF-8 (with or without one). Lines are handed out in
+// place: each is followed by two terminators, so SplitTokens can rewrite it
+// without copying.
+
+class ConfFile
+{
+private:
+	vector<wchar_t> _text;
+	size_t _stNext;
+	ULONGLONG _qwHash;
+
+	void Append(const wchar_t *pch, size_t stCount);
+
+public:
+	ConfFile();
+	bool Open(const wchar_t *pszFileName);
+	wchar_t * ReadLine(DWORD *pdwLen);
+	ULONGLONG GetHash() const;
+	void Close();
+};
+
+// Maps directive names to ids without regard to case. The ids are one more
+// than each name's index in the table given to the constructor; a name not
+// in the table is 0.
+
+class ConfKeywords
+{
+private:
+	struct SLOT {
+		const wchar_t *psz;
+		DWORD dwId;
+	};
+	SLOT _slots[CONFKEYWORDS_SLOTS];
+
+	static DWORD Hash(const wchar_t *psz);
+
+public:
+	ConfKeywords(const wchar_t * const *ppsz, size_t stCount);
+	DWORD Find(const wchar_t *psz) const;
+};
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "confimage.h"
+#include "digest.h"
+
+ConfImage::ConfImage()
+{
+	_hFile = INVALID_HANDLE_VALUE;
+	_hMapping = NULL;
+	_pbView = NULL;
+	_dwSize = 0;
+	_dwNext = 0;
+}
+
+ConfImage::~ConfImage()
+{
+	Close();
+}
+
+void ConfImage::Close()
+{
+	if (_pbView) UnmapViewOfFile(_pbView);
+	if (_hMapping) CloseHandle(_hMapping);
+	if (_hFile != INVALID_HANDLE_VALUE) CloseHandle(_hFile);
+	_hFile = INVALID_HANDLE_VALUE;
+	_hMapping = NULL;
+	_pbView = NULL;
+	_dwSize = 0;
+	_dwNext = 0;
+}
+
+bool ConfImage::Open(const wchar_t *pszFile, ULONGLONG qwSourceHash)
+// Maps an image and checks that it was compiled from a script with the
+// given hash and has not been changed since. Reading starts after the
+// header. Windows will not replace the file while it is mapped, so a
+// reload that changes the script cannot save over an image in use.
+{
+	const IMAGEHEADER *phdr;
+	LARGE_INTEGER liSize;
+
+	Close();
+	_hFile = ::CreateFile(pszFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 0, 0);
+	if (_hFile == INVALID_HANDLE_VALUE) return false;
+	if (!GetFileSizeEx(_hFile, &liSize) || (liSize.QuadPart < sizeof(IMAGEHEADER)) || (liSize.QuadPart > MAXDWORD)) {
+		Close();
+		return false;
+	}
+	_dwSize = (DWORD)liSize.QuadPart;
+	_hMapping = CreateFileMapping(_hFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (_hMapping) _pbView = (const BYTE *)MapViewOfFile(_hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!_pbView) {
+		Close();
+		return false;
+	}
+	phdr = (const IMAGEHEADER *)_pbView;
+	if ((phdr->dwMagic != CONFIMAGE_MAGIC) || (phdr->dwVersion != CONFIMAGE_VERSION) || (phdr->qwSourceHash != qwSourceHash) ||
+		(phdr->dwBytes != _dwSize - sizeof(IMAGEHEADER)) || (phdr->qwChecksum != Digest::HashXXH64(phdr + 1, phdr->dwBytes))) {
+		Close();
+		return false;
+	}
+	_dwNext = sizeof(IMAGEHEADER);
+	return true;
+}
+
+bool ConfImage::ReadDword(DWORD *pdw)
+{
+	if (_dwSize - _dwNext < sizeof(DWORD)) return false;
+	*pdw = *(const DWORD *)(_pbView + _dwNext);
+	_dwNext += sizeof(DWORD);
+	return true;
+}
+
+bool ConfImage::ReadString(wstring &str)
+{
+	DWORD dwLen;
+	const BYTE *pb = ReadBlock(&dwLen);
+
+	if (!pb || (dwLen % sizeof(wchar_t))) return false;
+	str.assign((const wchar_t *)pb, dwLen / sizeof(wchar_t));
+	return true;
+}
+
+const BYTE * ConfImage::ReadBlock(DWORD *pdwBytes)
+// Returns a block in place in the mapping, which stays valid until the
+// image is destroyed.
+{
+	const BYTE *pb;
+	DWORD dwLen;
+
+	if (!ReadDword(&dwLen)) return NULL;
+	if (_dwSize - _dwNext < dwLen) return NULL;
+	pb = _pbView + _dwNext;
+	_dwNext += dwLen;
+	_dwNext += (4 - (_dwNext & 3)) & 3;
+	if (_dwNext > _dwSize) _dwNext = _dwSize;
+	*pdwBytes = dwLen;
+	return pb;
+}
+
+bool ConfImage::AtEnd() const
+{
+	return _dwNext == _dwSize;
+}
+
+ConfImageWriter::ConfImageWriter()
+{
+	_image.resize(sizeof(ConfImage::IMAGEHEADER));
+}
+
+void ConfImageWriter::Pad()
+{
+	while (_image.size() & 3) _image.push_back(0);
+}
+
+void ConfImageWriter::WriteDword(DWORD dw)
+{
+	_image.insert(_image.end(), (const BYTE *)&dw, (const BYTE *)&dw + sizeof(DWORD));
+}
+
+void ConfImageWriter::WriteString(const wstring &str)
+{
+	BYTE *pb = WriteBlock(str.length() * sizeof(wchar_t));
+
+	if (str.length()) memcpy(pb, str.c_str(), str.length() * sizeof(wchar_t));
+}
+
+BYTE * ConfImageWriter::WriteBlock(size_t stBytes)
+// Adds a block of stBytes and returns where to fill it in. The pointer is
+// only good until the next item is written.
+{
+	size_t st;
+
+	WriteDword((DWORD)stBytes);
+	st = _image.size();
+	_image.resize(st + stBytes);
+	Pad();
+	return &_image[st];
+}
+
+bool ConfImageWriter::Save(const wchar_t *pszFile, ULONGLONG qwSourceHash)
+// Writes the image to a temporary file and then puts it in place of
+// pszFile, so a reader never sees half of one.
+{
+	ConfImage::IMAGEHEADER *phdr = (ConfImage::IMAGEHEADER *)&_image[0];
+	wstring strTemp = wstring(pszFile) + L".tmp";
+	HANDLE hFile;
+	DWORD dw;
+	bool isWritten;
+
+	if (_image.size() > MAXDWORD) return false;
+	phdr->dwMagic = CONFIMAGE_MAGIC;
+	phdr->dwVersion = CONFIMAGE_VERSION;
+	phdr->qwSourceHash = qwSourceHash;
+	phdr->dwBytes = (DWORD)(_image.size() - sizeof(ConfImage::IMAGEHEADER));
+	phdr->dwReserved = 0;
+	phdr->qwChecksum = Digest::HashXXH64(phdr + 1, phdr->dwBytes);
+
+	hFile = ::CreateFile(strTemp.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hFile == INVALID_HANDLE_VALUE) return false;
+	isWritten = WriteFile(hFile, &_image[0], (DWORD)_image.size(), &dw, 0) && (dw == _image.size());
+	CloseHandle(hFile);
+	if (!isWritten || !MoveFileEx(strTemp.c_str(), pszFile, MOVEFILE_REPLACE_EXISTING)) {
+		::DeleteFile(strTemp.c_str());
+		return false;
+	}
+	return true;
+}
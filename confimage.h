@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_CONFIMAGE_H
+#define _INCL_CONFIMAGE_H
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A compiled config script: its users and groups with their mount and
+// permission trees already frozen, saved so that a restart can map the file
+// and use the trees in place instead of building them from the text again.
+//
+// Layout: an IMAGEHEADER, then a stream of items, each a multiple of four
+// bytes long. A DWORD is itself; a string or block is a DWORD length
+// followed by that many characters or bytes, padded. What the items mean
+// is up to the writer; UserDB::SaveImage and LoadImage agree on it.
+//
+// The header holds the XXH64 of the script the image was compiled from and
+// of every byte after the header. An image that fails either check, or has
+// another version, is not used.
+
+#define CONFIMAGE_MAGIC 0x49434653
+#define CONFIMAGE_VERSION 1
+
+class ConfImage
+{
+public:
+	struct IMAGEHEADER {
+		DWORD dwMagic;
+		DWORD dwVersion;
+		ULONGLONG qwSourceHash;
+		ULONGLONG qwChecksum;
+		DWORD dwBytes;
+		DWORD dwReserved;
+	};
+
+private:
+	HANDLE _hFile;
+	HANDLE _hMapping;
+	const BYTE *_pbView;
+	DWORD _dwSize;
+	DWORD _dwNext;
+
+	void Close();
+	ConfImage(const ConfImage &);
+	ConfImage & operator=(const ConfImage &);
+
+public:
+	ConfImage();
+	~ConfImage();
+	bool Open(const wchar_t *pszFile, ULONGLONG qwSourceHash);
+	bool ReadDword(DWORD *pdw);
+	bool ReadString(wstring &str);
+	const BYTE * ReadBlock(DWORD *pdwBytes);
+	bool AtEnd() const;
+};
+
+class ConfImageWriter
+{
+private:
+	vector<BYTE> _image;
+
+	void Pad();
+
+public:
+	ConfImageWriter();
+	void WriteDword(DWORD dw);
+	void WriteString(const wstring &str);
+	BYTE * WriteBlock(size_t stBytes);
+	bool Save(const wchar_t *pszFile, ULONGLONG qwSourceHash);
+};
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "digest.h"
+#include <intrin.h>
+#include <nmmintrin.h>
+
+#define DIGEST_SIGNATURE 0x47444653 // 'SFDG'
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+static struct CRC32CTABLE {
+	DWORD dwTable[256];
+	bool bHardware;
+	CRC32CTABLE()
+	{
+		int cpuinfo[4];
+		DWORD dw;
+
+		for (DWORD i = 0; i < 256; i++) {
+			dw = i;
+			for (int j = 0; j < 8; j++) dw = (dw >> 1) ^ ((dw & 1) ? 0x82F63B78 : 0);
+			dwTable[i] = dw;
+		}
+		__cpuid(cpuinfo, 1);
+		bHardware = (cpuinfo[2] & (1 << 20)) != 0; // SSE4.2
+	}
+} crc32c;
+
+static inline ULONGLONG XXH64Round(ULONGLONG qwAcc, ULONGLONG qwInput)
+{
+	qwAcc += qwInput * XXH64_PRIME2;
+	qwAcc = _rotl64(qwAcc, 31);
+	return qwAcc * XXH64_PRIME1;
+}
+
+static inline ULONGLONG XXH64MergeRound(ULONGLONG qwAcc, ULONGLONG qwVal)
+{
+	qwAcc ^= XXH64Round(0, qwVal);
+	return qwAcc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+Digest::Digest(DWORD dwAlgorithms)
+{
+	_dwAlgorithms = dwAlgorithms;
+	_dwCRC32C = 0xFFFFFFFF;
+	_hSHA256Alg = NULL;
+	_hSHA256 = NULL;
+	if (_dwAlgorithms & DIGEST_SHA256) {
+		if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&_hSHA256Alg, BCRYPT_SHA256_ALGORITHM, NULL, 0)) ||
+			!BCRYPT_SUCCESS(BCryptCreateHash(_hSHA256Alg, &_hSHA256, NULL, 0, NULL, 0, 0))) {
+			_dwAlgorithms &= ~DIGEST_SHA256;
+		}
+	}
+	_qwXXH64[0] = XXH64_PRIME1 + XXH64_PRIME2;
+	_qwXXH64[1] = XXH64_PRIME2;
+	_qwXXH64[2] = 0;
+	_qwXXH64[3] = 0 - XXH64_PRIME1;
+	_qwXXH64Total = 0;
+	_dwXXH64BufLen = 0;
+}
+
+Digest::~Digest()
+{
+	if (_hSHA256) BCryptDestroyHash(_hSHA256);
+	if (_hSHA256Alg) BCryptCloseAlgorithmProvider(_hSHA256Alg, 0);
+}
+
+DWORD Digest::GetAlgorithms()
+{
+	return _dwAlgorithms;
+}
+
+void Digest::Update(const void *pData, DWORD dwLen)
+// Feeds the next chunk of a stream to every selected algorithm.
+{
+	const BYTE *pb = (const BYTE *)pData;
+
+	if (_dwAlgorithms & DIGEST_CRC32C) _dwCRC32C = UpdateCRC32C(_dwCRC32C, pb, dwLen);
+	if (_dwAlgorithms & DIGEST_SHA256) BCryptHashData(_hSHA256, (PUCHAR)pb, dwLen, 0);
+	if (_dwAlgorithms & DIGEST_XXH64) UpdateXXH64(pb, dwLen);
+}
+
+void Digest::Finish(DIGESTRECORD *pdr)
+// Completes the digests and stores them in pdr. The caller fills in the
+// file size and time stamp.
+{
+	DWORD dw;
+	ULONGLONG qw;
+
+	ZeroMemory(pdr, sizeof(DIGESTRECORD));
+	pdr->dwSignature = DIGEST_SIGNATURE;
+	pdr->dwAlgorithms = _dwAlgorithms;
+	if (_dwAlgorithms & DIGEST_CRC32C) {
+		dw = ~_dwCRC32C;
+		for (int i = 3; i >= 0; i--, dw >>= 8) pdr->abCRC32C[i] = (BYTE)dw;
+	}
+	if (_dwAlgorithms & DIGEST_SHA256) {
+		BCryptFinishHash(_hSHA256, pdr->abSHA256, sizeof(pdr->abSHA256), 0);
+	}
+	if (_dwAlgorithms & DIGEST_XXH64) {
+		qw = FinishXXH64();
+		for (int i = 7; i >= 0; i--, qw >>= 8) pdr->abXXH64[i] = (BYTE)qw;
+	}
+}
+
+DWORD Digest::UpdateCRC32C(DWORD dwCRC, const BYTE *pb, DWORD dwLen)
+// Castagnoli CRC, using the SSE4.2 instruction where the CPU has it.
+{
+	if (crc32c.bHardware) {
+		while (dwLen && ((UINT_PTR)pb & 3)) {
+			dwCRC = _mm_crc32_u8(dwCRC, *pb++);
+			dwLen--;
+		}
+		while (dwLen >= 4) {
+			dwCRC = _mm_crc32_u32(dwCRC, *(const DWORD *)pb);
+			pb += 4;
+			dwLen -= 4;
+		}
+		while (dwLen--) dwCRC = _mm_crc32_u8(dwCRC, *pb++);
+	} else {
+		while (dwLen--) dwCRC = crc32c.dwTable[(dwCRC ^ *pb++) & 0xFF] ^ (dwCRC >> 8);
+	}
+	return dwCRC;
+}
+
+void Digest::UpdateXXH64(const BYTE *pb, DWORD dwLen)
+{
+	DWORD dw;
+
+	_qwXXH64Total += dwLen;
+	if (_dwXXH64BufLen) {
+		dw = min(dwLen, 32 - _dwXXH64BufLen);
+		memcpy(_abXXH64Buf + _dwXXH64BufLen, pb, dw);
+		_dwXXH64BufLen += dw;
+		pb += dw;
+		dwLen -= dw;
+		if (_dwXXH64BufLen < 32) return;
+		for (int i = 0; i < 4; i++) _qwXXH64[i] = XXH64Round(_qwXXH64[i], ((const ULONGLONG *)_abXXH64Buf)[i]);
+		_dwXXH64BufLen = 0;
+	}
+	while (dwLen >= 32) {
+		for (int i = 0; i < 4; i++) _qwXXH64[i] = XXH64Round(_qwXXH64[i], *(const ULONGLONG UNALIGNED *)(pb + i * 8));
+		pb += 32;
+		dwLen -= 32;
+	}
+	if (dwLen) {
+		memcpy(_abXXH64Buf, pb, dwLen);
+		_dwXXH64BufLen = dwLen;
+	}
+}
+
+ULONGLONG Digest::FinishXXH64()
+{
+	ULONGLONG qw;
+	const BYTE *pb = _abXXH64Buf;
+	DWORD dwLen = _dwXXH64BufLen;
+
+	if (_qwXXH64Total >= 32) {
+		qw = _rotl64(_qwXXH64[0], 1) + _rotl64(_qwXXH64[1], 7) + _rotl64(_qwXXH64[2], 12) + _rotl64(_qwXXH64[3], 18);
+		for (int i = 0; i < 4; i++) qw = XXH64MergeRound(qw, _qwXXH64[i]);
+	} else {
+		qw = XXH64_PRIME5;
+	}
+	qw += _qwXXH64Total;
+	for (; dwLen >= 8; pb += 8, dwLen -= 8) {
+		qw ^= XXH64Round(0, *(const ULONGLONG UNALIGNED *)pb);
+		qw = _rotl64(qw, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+	}
+	if (dwLen >= 4) {
+		qw ^= (ULONGLONG)*(const DWORD UNALIGNED *)pb * XXH64_PRIME1;
+		qw = _rotl64(qw, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+		pb += 4;
+		dwLen -= 4;
+	}
+	for (; dwLen; pb++, dwLen--) {
+		qw ^= *pb * XXH64_PRIME5;
+		qw = _rotl64(qw, 11) * XXH64_PRIME1;
+	}
+	qw ^= qw >> 33;
+	qw *= XXH64_PRIME2;
+	qw ^= qw >> 29;
+	qw *= XXH64_PRIME3;
+	qw ^= qw >> 32;
+	return qw;
+}
+
+ULONGLONG Digest::HashXXH64(const void *pData, size_t stLen)
+// Returns the XXH64 of a buffer, for checking files the server writes
+// itself.
+{
+	Digest digest(DIGEST_XXH64);
+	const BYTE *pb = (const BYTE *)pData;
+	DWORD dw;
+
+	for (; stLen; pb += dw, stLen -= dw) {
+		dw = (DWORD)min(stLen, (size_t)0x40000000);
+		digest.UpdateXXH64(pb, dw);
+	}
+	return digest.FinishXXH64();
+}
+
+bool Digest::WriteRecord(HANDLE hStream, const DIGESTRECORD *pdr)
+{
+	DWORD dw;
+
+	return WriteFile(hStream, pdr, sizeof(DIGESTRECORD), &dw, 0) && (dw == sizeof(DIGESTRECORD));
+}
+
+bool Digest::ReadRecord(HANDLE hStream, DIGESTRECORD *pdr)
+{
+	DWORD dw;
+
+	return ReadFile(hStream, pdr, sizeof(DIGESTRECORD), &dw, 0) && (dw == sizeof(DIGESTRECORD)) && (pdr->dwSignature == DIGEST_SIGNATURE);
+}
+
+bool Digest::FormatHex(const DIGESTRECORD *pdr, DWORD dwAlgorithm, wchar_t *pszHex, size_t stHex)
+// Writes the lowercase hex form of one digest from pdr into pszHex.
+// Returns false if pdr does not hold that digest.
+{
+	const BYTE *pb;
+	size_t stLen;
+
+	if (!(pdr->dwAlgorithms & dwAlgorithm)) return false;
+	switch (dwAlgorithm) {
+	case DIGEST_CRC32C: pb = pdr->abCRC32C; stLen = sizeof(pdr->abCRC32C); break;
+	case DIGEST_SHA256: pb = pdr->abSHA256; stLen = sizeof(pdr->abSHA256); break;
+	case DIGEST_XXH64: pb = pdr->abXXH64; stLen = sizeof(pdr->abXXH64); break;
+	default: return false;
+	}
+	if (stHex < stLen * 2 + 1) return false;
+	for (size_t i = 0; i < stLen; i++) {
+		pszHex[i * 2] = L"0123456789abcdef"[pb[i] >> 4];
+		pszHex[i * 2 + 1] = L"0123456789abcdef"[pb[i] & 0xF];
+	}
+	pszHex[stLen * 2] = 0;
+	return true;
+}
+
+DWORD Digest::ParseAlgorithm(const wchar_t *pszName)
+// Returns the DIGEST_* flag for an algorithm name, or 0 if unknown.
+{
+	if (!_wcsicmp(pszName, L"CRC32C")) return DIGEST_CRC32C;
+	else if (!_wcsicmp(pszName, L"SHA-256") || !_wcsicmp(pszName, L"SHA256")) return DIGEST_SHA256;
+	else if (!_wcsicmp(pszName, L"XXH64") || !_wcsicmp(pszName, L"xxHash")) return DIGEST_XXH64;
+	else return 0;
+}
+
+const wchar_t * Digest::GetAlgorithmName(DWORD dwAlgorithm)
+{
+	switch (dwAlgorithm) {
+	case DIGEST_CRC32C: return L"CRC32C";
+	case DIGEST_SHA256: return L"SHA-256";
+	case DIGEST_XXH64: return L"XXH64";
+	default: return L"";
+	}
+}
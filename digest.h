@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_DIGEST_H
+#define _INCL_DIGEST_H
+
+#include <windows.h>
+#include <bcrypt.h>
+
+#define DIGEST_CRC32C 0x1
+#define DIGEST_SHA256 0x2
+#define DIGEST_XXH64 0x4
+#define DIGEST_ALL (DIGEST_CRC32C | DIGEST_SHA256 | DIGEST_XXH64)
+
+#define DIGEST_STREAM L"SlimFTPd.digest"
+
+class Digest
+{
+public:
+	struct DIGESTRECORD {
+		DWORD dwSignature;
+		DWORD dwAlgorithms;
+		FILETIME ftLastWrite;
+		ULARGE_INTEGER uliSize;
+		BYTE abCRC32C[4];
+		BYTE abSHA256[32];
+		BYTE abXXH64[8];
+	};
+
+private:
+	DWORD _dwAlgorithms;
+	DWORD _dwCRC32C;
+	BCRYPT_ALG_HANDLE _hSHA256Alg;
+	BCRYPT_HASH_HANDLE _hSHA256;
+	ULONGLONG _qwXXH64[4];
+	ULONGLONG _qwXXH64Total;
+	BYTE _abXXH64Buf[32];
+	DWORD _dwXXH64BufLen;
+
+	static DWORD UpdateCRC32C(DWORD dwCRC, const BYTE *pb, DWORD dwLen);
+	void UpdateXXH64(const BYTE *pb, DWORD dwLen);
+	ULONGLONG FinishXXH64();
+
+public:
+	Digest(DWORD dwAlgorithms);
+	~Digest();
+	DWORD GetAlgorithms();
+	void Update(const void *pData, DWORD dwLen);
+	void Finish(DIGESTRECORD *pdr);
+	static bool WriteRecord(HANDLE hStream, const DIGESTRECORD *pdr);
+	static bool ReadRecord(HANDLE hStream, DIGESTRECORD *pdr);
+	static bool FormatHex(const DIGESTRECORD *pdr, DWORD dwAlgorithm, wchar_t *pszHex, size_t stHex);
+	static DWORD ParseAlgorithm(const wchar_t *pszName);
+	static ULONGLONG HashXXH64(const void *pData, size_t stLen);
+	static const wchar_t * GetAlgorithmName(DWORD dwAlgorithm);
+};
+
+#endif
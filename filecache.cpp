@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "filecache.h"
+
+// Contents of small, frequently downloaded files, held in memory and shared
+// by every session. A file is only let in if it has been asked for more
+// often than the entries it would push out (TinyLFU): each request bumps a
+// set of small counters in a count-min sketch, and the counters are halved
+// at regular intervals so that old popularity fades. Entries are checked
+// against the file's size and write time on every hit, and are dropped as
+// soon as FSWatcher or the server itself reports a change.
+
+#define FILECACHE_ENTRY_OVERHEAD 128
+#define FILECACHE_AVERAGE_FILE 4096
+
+FileCache::FileCache(size_t stMaxBytes, size_t stMaxFileBytes)
+{
+	size_t stWidth;
+
+	_stBytes = 0;
+	_stMaxBytes = stMaxBytes;
+	_stMaxFileBytes = stMaxFileBytes;
+	_qwGeneration = 0;
+	_llHits = 0;
+	_llMisses = 0;
+	_llBytesServed = 0;
+
+	// Size the sketch after the number of files the budget could hold
+	for (stWidth = 256; (stWidth < 0x100000) && (stWidth < stMaxBytes / FILECACHE_AVERAGE_FILE); stWidth <<= 1);
+	_pSketch = new BYTE[stWidth * FILECACHE_SKETCH_DEPTH];
+	ZeroMemory(_pSketch, stWidth * FILECACHE_SKETCH_DEPTH);
+	_stSketchMask = stWidth - 1;
+	_stSamples = 0;
+	_stSampleLimit = stWidth * 10;
+
+	InitializeCriticalSection(&_cs);
+}
+
+FileCache::~FileCache()
+{
+	delete[] _pSketch;
+	DeleteCriticalSection(&_cs);
+}
+
+void FileCache::MakeKey(const wchar_t *pszLocal, wstring &strKey)
+{
+	strKey = pszLocal;
+	if (strKey.length()) CharUpperBuff(&strKey[0], (DWORD)strKey.length());
+}
+
+void FileCache::RecordAccess(size_t stHash)
+// Counts one request for the file with the given hash. Must be called
+// inside the critical section.
+{
+	size_t stStep = (stHash >> 17) | 1;
+	BYTE *pb;
+
+	for (int i = 0; i < FILECACHE_SKETCH_DEPTH; i++) {
+		pb = &_pSketch[i * (_stSketchMask + 1) + ((stHash + i * stStep) & _stSketchMask)];
+		if (*pb < FILECACHE_COUNTER_MAX) (*pb)++;
+	}
+	if (++_stSamples >= _stSampleLimit) {
+		for (size_t st = 0; st < (_stSketchMask + 1) * FILECACHE_SKETCH_DEPTH; st++) _pSketch[st] >>= 1;
+		_stSamples /= 2;
+	}
+}
+
+DWORD FileCache::EstimateFrequency(size_t stHash)
+{
+	size_t stStep = (stHash >> 17) | 1;
+	DWORD dw, dwMin = FILECACHE_COUNTER_MAX;
+
+	for (int i = 0; i < FILECACHE_SKETCH_DEPTH; i++) {
+		dw = _pSketch[i * (_stSketchMask + 1) + ((stHash + i * stStep) & _stSketchMask)];
+		if (dw < dwMin) dwMin = dw;
+	}
+	return dwMin;
+}
+
+bool FileCache::Admit(size_t stHash, size_t stBytes)
+// Decides whether a file of stBytes is worth the entries that would have to
+// be evicted to make room for it. Must be called inside the critical section.
+{
+	DWORD dwFrequency;
+	size_t stFreed;
+	list<wstring>::iterator it;
+
+	if (stBytes > _stMaxBytes) return false;
+	if (_stBytes + stBytes <= _stMaxBytes) return true;
+	dwFrequency = EstimateFrequency(stHash);
+	for (stFreed = 0, it = _lru.begin(); (it != _lru.end()) && (_stBytes - stFreed + stBytes > _stMaxBytes); ++it) {
+		if (EstimateFrequency(hash<wstring>()(*it)) >= dwFrequency) return false;
+		stFreed += _entries.find(*it)->second.stBytes;
+	}
+	return true;
+}
+
+void FileCache::Remove(map_type::iterator it)
+{
+	_stBytes -= it->second.stBytes;
+	_lru.erase(it->second.itLRU);
+	_entries.erase(it);
+}
+
+FileCache::content_ptr FileCache::ReadContent(const wchar_t *pszLocal, const FILETIME *pftLastWrite, ULONGLONG qwSize)
+// Reads a whole file, provided it still has the given size and write time.
+{
+	shared_ptr<CONTENT> pcontent;
+	BY_HANDLE_FILE_INFORMATION bhfi;
+	HANDLE hFile;
+	DWORD dw;
+	size_t st;
+
+	hFile = ::CreateFile(pszLocal, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hFile == INVALID_HANDLE_VALUE) return content_ptr();
+	if (GetFileInformationByHandle(hFile, &bhfi) && !CompareFileTime(&bhfi.ftLastWriteTime, pftLastWrite) && !bhfi.nFileSizeHigh && (bhfi.nFileSizeLow == qwSize)) {
+		pcontent = make_shared<CONTENT>();
+		pcontent->data.resize((size_t)qwSize);
+		pcontent->ftLastWrite = *pftLastWrite;
+		for (st = 0; st < pcontent->data.size(); st += dw) {
+			if (!ReadFile(hFile, &pcontent->data[st], (DWORD)(pcontent->data.size() - st), &dw, 0) || !dw) {
+				pcontent.reset();
+				break;
+			}
+		}
+	}
+	CloseHandle(hFile);
+	return pcontent;
+}
+
+FileCache::content_ptr FileCache::Fetch(const wchar_t *pszLocal, const FILETIME *pftLastWrite, const ULARGE_INTEGER *puliSize)
+// Returns the contents of a file that matches the given size and write
+// time, from memory or freshly read if the file earns a place in the cache.
+// Returns an empty pointer if the file should be read from disk as usual.
+{
+	wstring strKey;
+	map_type::iterator it;
+	content_ptr pcontent;
+	ENTRY entry;
+	ULONGLONG qwGeneration;
+	size_t stHash, stBytes;
+	bool isAdmitted;
+
+	if (puliSize->QuadPart > _stMaxFileBytes) return content_ptr();
+	MakeKey(pszLocal, strKey);
+	stHash = hash<wstring>()(strKey);
+	stBytes = (size_t)puliSize->QuadPart + strKey.length() * sizeof(wchar_t) + FILECACHE_ENTRY_OVERHEAD;
+
+	EnterCriticalSection(&_cs);
+	RecordAccess(stHash);
+	it = _entries.find(strKey);
+	if (it != _entries.end()) {
+		pcontent = it->second.pcontent;
+		if (!CompareFileTime(&pcontent->ftLastWrite, pftLastWrite) && (pcontent->data.size() == puliSize->QuadPart)) {
+			_lru.splice(_lru.end(), _lru, it->second.itLRU);
+			LeaveCriticalSection(&_cs);
+			InterlockedIncrement64(&_llHits);
+			return pcontent;
+		}
+		pcontent.reset();
+		Remove(it);
+	}
+	isAdmitted = Admit(stHash, stBytes);
+	qwGeneration = _qwGeneration;
+	LeaveCriticalSection(&_cs);
+	InterlockedIncrement64(&_llMisses);
+
+	if (!isAdmitted) return content_ptr();
+	pcontent = ReadContent(pszLocal, pftLastWrite, puliSize->QuadPart);
+	if (!pcontent) return content_ptr();
+
+	// Skip storing it if anything changed while it was being read
+	EnterCriticalSection(&_cs);
+	if ((qwGeneration == _qwGeneration) && (_entries.find(strKey) == _entries.end())) {
+		while ((_stBytes + stBytes > _stMaxBytes) && !_lru.empty()) Remove(_entries.find(_lru.front()));
+		_lru.push_back(strKey);
+		entry.pcontent = pcontent;
+		entry.stBytes = stBytes;
+		entry.itLRU = --_lru.end();
+		_entries[strKey] = entry;
+		_stBytes += stBytes;
+	}
+	LeaveCriticalSection(&_cs);
+
+	return pcontent;
+}
+
+void FileCache::Served(ULONGLONG qwBytes)
+// Counts bytes sent to clients straight from the cache.
+{
+	InterlockedExchangeAdd64(&_llBytesServed, (LONGLONG)qwBytes);
+}
+
+void FileCache::Invalidate(const wchar_t *pszLocal, bool isTree)
+// Drops the contents of pszLocal, and if isTree, of every file below it.
+{
+	wstring strKey;
+	map_type::iterator it;
+
+	MakeKey(pszLocal, strKey);
+	while ((strKey.length() > 3) && (*strKey.rbegin() == L'\\')) strKey.erase(strKey.length() - 1);
+
+	EnterCriticalSection(&_cs);
+	_qwGeneration++;
+	it = _entries.find(strKey);
+	if (it != _entries.end()) Remove(it);
+	if (isTree) {
+		strKey += L'\\';
+		for (it = _entries.begin(); it != _entries.end(); ) {
+			if (!it->first.compare(0, strKey.length(), strKey)) Remove(it++);
+			else ++it;
+		}
+	}
+	LeaveCriticalSection(&_cs);
+}
+
+void FileCache::GetStats(LONGLONG *pllHits, LONGLONG *pllMisses, LONGLONG *pllBytesServed, size_t *pstBytes)
+{
+	EnterCriticalSection(&_cs);
+	*pstBytes = _stBytes;
+	LeaveCriticalSection(&_cs);
+	*pllHits = _llHits;
+	*pllMisses = _llMisses;
+	*pllBytesServed = _llBytesServed;
+}
+
+void FileCache::OnChange(void *pContext, const wchar_t *pszLocal, bool isTree)
+{
+	((FileCache *)pContext)->Invalidate(pszLocal, isTree);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_FILECACHE_H
+#define _INCL_FILECACHE_H
+
+#include <windows.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#define FILECACHE_SKETCH_DEPTH 4
+#define FILECACHE_COUNTER_MAX 15
+
+class FileCache
+{
+public:
+	struct CONTENT {
+		vector<char> data;
+		FILETIME ftLastWrite;
+	};
+	typedef shared_ptr<const CONTENT> content_ptr;
+
+private:
+	struct ENTRY {
+		content_ptr pcontent;
+		size_t stBytes;
+		list<wstring>::iterator itLRU;
+	};
+	typedef unordered_map<wstring, ENTRY> map_type;
+
+	map_type _entries;
+	list<wstring> _lru;
+	size_t _stBytes;
+	size_t _stMaxBytes;
+	size_t _stMaxFileBytes;
+	ULONGLONG _qwGeneration;
+	BYTE *_pSketch;
+	size_t _stSketchMask;
+	size_t _stSamples;
+	size_t _stSampleLimit;
+	volatile LONGLONG _llHits;
+	volatile LONGLONG _llMisses;
+	volatile LONGLONG _llBytesServed;
+	CRITICAL_SECTION _cs;
+
+	static void MakeKey(const wchar_t *pszLocal, wstring &strKey);
+	static content_ptr ReadContent(const wchar_t *pszLocal, const FILETIME *pftLastWrite, ULONGLONG qwSize);
+	void RecordAccess(size_t stHash);
+	DWORD EstimateFrequency(size_t stHash);
+	bool Admit(size_t stHash, size_t stBytes);
+	void Remove(map_type::iterator it);
+
+public:
+	FileCache(size_t stMaxBytes, size_t stMaxFileBytes);
+	~FileCache();
+	content_ptr Fetch(const wchar_t *pszLocal, const FILETIME *pftLastWrite, const ULARGE_INTEGER *puliSize);
+	void Served(ULONGLONG qwBytes);
+	void Invalidate(const wchar_t *pszLocal, bool isTree);
+	void GetStats(LONGLONG *pllHits, LONGLONG *pllMisses, LONGLONG *pllBytesServed, size_t *pstBytes);
+	static void OnChange(void *pContext, const wchar_t *pszLocal, bool isTree);
+};
+
+#endif
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_FROZENTREE_H
+#define _INCL_FROZENTREE_H
+
+#include <windows.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "tree.h"
+#include "treeindex.h"
+
+using namespace std;
+
+// A tree<T> laid out in one block once it is complete. Nodes are stored
+// breadth first, so each node's children are a contiguous run, and parents
+// and children are referred to by index. A hash table over (parent, name)
+// follows the nodes, and every string is interned once in a pool at the end
+// of the block. Names are matched case-insensitively, as in treeindex.
+//
+// F is the frozen form of each node's data. It must be safe to copy with
+// memcpy, so any strings in it are kept as pool offsets. Copying or freeing
+// a frozen tree is a single allocation.
+//
+// The block can also be saved to a file and used from a read-only mapping
+// of it with attach. An attached tree does not own its block; a copy of one
+// does.
+
+template <class F>
+class frozentree
+{
+public:
+	struct NODE {
+		DWORD dwParent;
+		DWORD dwFirstChild;
+		DWORD dwChildren;
+		DWORD dwName;
+		DWORD dwNameLen;
+		F data;
+	};
+
+	// Collects the strings of a tree being frozen, storing each only once
+	class pool
+	{
+	private:
+		vector<wchar_t> _chars;
+		unordered_map<wstring, DWORD> _offsets;
+
+	public:
+		DWORD intern(const wstring &str)
+		// Returns the offset of a null-terminated copy of str.
+		{
+			unordered_map<wstring, DWORD>::const_iterator it = _offsets.find(str);
+			DWORD dw;
+
+			if (it != _offsets.end()) return it->second;
+			dw = (DWORD)_chars.size();
+			_chars.insert(_chars.end(), str.c_str(), str.c_str() + str.length() + 1);
+			_offsets[str] = dw;
+			return dw;
+		}
+		const vector<wchar_t> & chars() const { return _chars; }
+	};
+
+private:
+	struct SLOT {
+		DWORD dwHash;
+		DWORD dwNode;
+	};
+
+	// A saved block is preceded by its sizes
+	struct IMAGE {
+		DWORD dwNodes;
+		DWORD dwSlots;
+		DWORD dwBytes;
+		DWORD dwReserved;
+	};
+
+	BYTE *_pb;
+	DWORD _dwNodes;
+	DWORD _dwSlots;
+	size_t _stBytes;
+	bool _isAttached;
+
+	static wchar_t fold(wchar_t ch)
+	{
+		return ((ch >= L'a') && (ch <= L'z')) ? (ch - L'a' + L'A') : ch;
+	}
+
+	static DWORD hash(DWORD dwParent, const wchar_t *psz, size_t stlen)
+	{
+		DWORD dwhash = (dwParent + 1) * 2654435761U;
+
+		for (size_t st = 0; st < stlen; st++) dwhash = (dwhash ^ fold(psz[st])) * 16777619;
+		return dwhash ^ (dwhash >> 15);
+	}
+
+	NODE * nodes() const { return (NODE *)_pb; }
+	SLOT * slots() const { return (SLOT *)(_pb + _dwNodes * sizeof(NODE)); }
+	const wchar_t * chars() const { return (const wchar_t *)(_pb + _dwNodes * sizeof(NODE) + _dwSlots * sizeof(SLOT)); }
+
+public:
+	frozentree()
+	{
+		_pb = 0;
+		_dwNodes = 0;
+		_dwSlots = 0;
+		_stBytes = 0;
+		_isAttached = false;
+	}
+
+	frozentree(const frozentree &ft)
+	{
+		_pb = ft._pb ? new BYTE[ft._stBytes] : 0;
+		if (_pb) memcpy(_pb, ft._pb, ft._stBytes);
+		_dwNodes = ft._dwNodes;
+		_dwSlots = ft._dwSlots;
+		_stBytes = ft._stBytes;
+		_isAttached = false;
+	}
+
+	~frozentree()
+	{
+		if (!_isAttached) delete [] _pb;
+	}
+
+	frozentree & operator=(const frozentree &ft)
+	{
+		if (this != &ft) {
+			frozentree copy(ft);
+			swap(_pb, copy._pb);
+			swap(_dwNodes, copy._dwNodes);
+			swap(_dwSlots, copy._dwSlots);
+			swap(_stBytes, copy._stBytes);
+			swap(_isAttached, copy._isAttached);
+		}
+		return *this;
+	}
+
+	template <class T, class FREEZE>
+	void build(const tree<T> *proot, FREEZE freezedata)
+	// Freezes the tree under proot. freezedata(const T &, F &, pool &) fills
+	// in each node's frozen data. T must have a wstring member strVirtual
+	// holding the node's name.
+	{
+		vector<const tree<T> *> queue;
+		vector<NODE> built;
+		pool strings;
+		const tree<T> *pchild;
+		size_t stPool;
+		BYTE *pb;
+
+		queue.push_back(proot);
+		for (size_t st = 0; st < queue.size(); st++) {
+			NODE node;
+			node.dwParent = 0;
+			node.dwFirstChild = (DWORD)queue.size();
+			node.dwChildren = 0;
+			for (pchild = queue[st]->_pdown; pchild; pchild = pchild->_pright) {
+				queue.push_back(pchild);
+				node.dwChildren++;
+			}
+			node.dwName = strings.intern(queue[st]->_data.strVirtual);
+			node.dwNameLen = (DWORD)queue[st]->_data.strVirtual.length();
+			freezedata(queue[st]->_data, node.data, strings);
+			built.push_back(node);
+		}
+		for (size_t st = 0; st < built.size(); st++) {
+			for (DWORD dw = 0; dw < built[st].dwChildren; dw++) built[built[st].dwFirstChild + dw].dwParent = (DWORD)st;
+		}
+
+		// Keep the table no more than half full
+		_dwNodes = (DWORD)built.size();
+		for (_dwSlots = 2; _dwSlots < _dwNodes * 2; _dwSlots *= 2);
+		stPool = strings.chars().size();
+		_stBytes = _dwNodes * sizeof(NODE) + _dwSlots * sizeof(SLOT) + stPool * sizeof(wchar_t);
+		pb = new BYTE[_stBytes];
+		if (!_isAttached) delete [] _pb;
+		_pb = pb;
+		_isAttached = false;
+		memcpy(nodes(), &built[0], _dwNodes * sizeof(NODE));
+		memset(slots(), 0, _dwSlots * sizeof(SLOT));
+		memcpy((wchar_t *)chars(), &strings.chars()[0], stPool * sizeof(wchar_t));
+
+		for (DWORD dw = 1; dw < _dwNodes; dw++) {
+			DWORD dwHash = hash(built[dw].dwParent, chars() + built[dw].dwName, built[dw].dwNameLen);
+			DWORD dwSlot = dwHash & (_dwSlots - 1);
+			while (slots()[dwSlot].dwNode) dwSlot = (dwSlot + 1) & (_dwSlots - 1);
+			slots()[dwSlot].dwHash = dwHash;
+			slots()[dwSlot].dwNode = dw + 1;
+		}
+	}
+
+	template <class T, class THAW>
+	void thaw(tree<T> *proot, treeindex<T> &index, THAW thawdata) const
+	// Rebuilds the pointer form under proot, which must have no children.
+	// thawdata(const F &, T &, const frozentree &) restores each node's data.
+	{
+		vector<tree<T> *> built(_dwNodes);
+
+		if (!_pb) return;
+		built[0] = proot;
+		thawdata(nodes()[0].data, proot->_data, *this);
+		// Breadth first order puts every parent before its children
+		for (DWORD dw = 1; dw < _dwNodes; dw++) {
+			built[dw] = new tree<T>(built[nodes()[dw].dwParent]);
+			built[dw]->_data.strVirtual.assign(chars() + nodes()[dw].dwName, nodes()[dw].dwNameLen);
+			thawdata(nodes()[dw].data, built[dw]->_data, *this);
+			index.insert(built[dw]);
+		}
+	}
+
+	void clear()
+	{
+		if (!_isAttached) delete [] _pb;
+		_pb = 0;
+		_dwNodes = 0;
+		_dwSlots = 0;
+		_stBytes = 0;
+		_isAttached = false;
+	}
+
+	size_t image_size() const
+	// Returns the bytes save will write.
+	{
+		return sizeof(IMAGE) + _stBytes;
+	}
+
+	void save(BYTE *pb) const
+	// Writes the block, preceded by its sizes, to image_size() bytes at pb.
+	{
+		IMAGE img;
+
+		img.dwNodes = _dwNodes;
+		img.dwSlots = _dwSlots;
+		img.dwBytes = (DWORD)_stBytes;
+		img.dwReserved = 0;
+		memcpy(pb, &img, sizeof(IMAGE));
+		if (_stBytes) memcpy(pb + sizeof(IMAGE), _pb, _stBytes);
+	}
+
+	bool attach(const BYTE *pb, size_t stBytes)
+	// Uses a block written by save in place, without copying it. The block
+	// must stay mapped for as long as this tree uses it. Returns false if
+	// its sizes do not add up.
+	{
+		IMAGE img;
+		ULONGLONG qwNeeded;
+
+		if (stBytes < sizeof(IMAGE)) return false;
+		memcpy(&img, pb, sizeof(IMAGE));
+		if ((img.dwBytes != stBytes - sizeof(IMAGE)) || (!img.dwNodes != !img.dwBytes)) return false;
+		if (img.dwNodes) {
+			if ((img.dwSlots < 2) || (img.dwSlots & (img.dwSlots - 1)) || (img.dwSlots < img.dwNodes)) return false;
+			qwNeeded = (ULONGLONG)img.dwNodes * sizeof(NODE) + (ULONGLONG)img.dwSlots * sizeof(SLOT);
+			if (qwNeeded > img.dwBytes) return false;
+		}
+		clear();
+		if (img.dwNodes) {
+			_pb = (BYTE *)(pb + sizeof(IMAGE));
+			_dwNodes = img.dwNodes;
+			_dwSlots = img.dwSlots;
+			_stBytes = img.dwBytes;
+			_isAttached = true;
+		}
+		return true;
+	}
+
+	DWORD count() const
+	// Returns the number of nodes, which follow root() in memory.
+	{
+		return _dwNodes;
+	}
+
+	bool empty() const
+	{
+		return !_pb;
+	}
+
+	const NODE * root() const
+	{
+		return _pb ? nodes() : 0;
+	}
+
+	const NODE * child(const NODE *pparent, DWORD dwChild) const
+	// Returns the dwChild'th child of pparent; there are pparent->dwChildren.
+	{
+		return nodes() + pparent->dwFirstChild + dwChild;
+	}
+
+	const NODE * find(const NODE *pparent, const wchar_t *psz, size_t stlen) const
+	// Returns the child of pparent named by the first stlen characters of
+	// psz, or 0.
+	{
+		DWORD dwParent, dwHash, dwSlot;
+		const NODE *pnode;
+
+		if (!pparent->dwChildren) return 0;
+		dwParent = (DWORD)(pparent - nodes());
+		dwHash = hash(dwParent, psz, stlen);
+		for (dwSlot = dwHash & (_dwSlots - 1); slots()[dwSlot].dwNode; dwSlot = (dwSlot + 1) & (_dwSlots - 1)) {
+			if (slots()[dwSlot].dwHash != dwHash) continue;
+			pnode = nodes() + slots()[dwSlot].dwNode - 1;
+			if ((pnode->dwParent == dwParent) && (pnode->dwNameLen == stlen) && !_wcsnicmp(psz, chars() + pnode->dwName, stlen)) return pnode;
+		}
+		return 0;
+	}
+
+	const wchar_t * name(const NODE *pnode) const
+	{
+		return chars() + pnode->dwName;
+	}
+
+	const wchar_t * str(DWORD dwOffset) const
+	// Returns a string interned while the tree was built.
+	{
+		return chars() + dwOffset;
+	}
+
+	size_t memory() const
+	// Returns the bytes taken by the block.
+	{
+		return _stBytes;
+	}
+};
+
+#endif
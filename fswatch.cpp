@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fswatch.h"
+#include <process.h>
+
+#define FSWATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+FSWatcher::FSWatcher()
+{
+	_hPort = NULL;
+	_hThread = NULL;
+	_hDrained = CreateEvent(NULL, TRUE, FALSE, NULL);
+	_lPending = 0;
+	_isStopping = false;
+	InitializeCriticalSection(&_cs);
+}
+
+FSWatcher::~FSWatcher()
+{
+	// A cancelled read may still complete into its watch, on a network
+	// redirector long after CancelIoEx returns, so the watches are only
+	// freed once the thread has dequeued every read that was pending
+	EnterCriticalSection(&_cs);
+	_isStopping = true;
+	for (size_t i = 0; i < _watches.size(); i++) {
+		if (_watches[i]->isLive) CancelIoEx(_watches[i]->hDir, NULL);
+	}
+	LeaveCriticalSection(&_cs);
+	if (_hThread) {
+		if (InterlockedCompareExchange(&_lPending, 0, 0)) WaitForSingleObject(_hDrained, INFINITE);
+		PostQueuedCompletionStatus(_hPort, 0, 0, NULL);
+		WaitForSingleObject(_hThread, INFINITE);
+		CloseHandle(_hThread);
+	}
+	for (size_t i = 0; i < _watches.size(); i++) {
+		if (_watches[i]->hDir != INVALID_HANDLE_VALUE) CloseHandle(_watches[i]->hDir);
+		delete _watches[i];
+	}
+	if (_hPort) CloseHandle(_hPort);
+	if (_hDrained) CloseHandle(_hDrained);
+	DeleteCriticalSection(&_cs);
+}
+
+void FSWatcher::AddClient(FSWATCHPROC pfn, void *pContext)
+// Registers a cache to be told about changes. Must be called before Start.
+{
+	CLIENT client;
+
+	client.pfn = pfn;
+	client.pContext = pContext;
+	_clients.push_back(client);
+}
+
+void FSWatcher::Watch(const wchar_t *pszLocal)
+// Adds a folder tree to watch. Folders inside one already being watched
+// are ignored. Folders added after Start, such as the mounts of a reloaded
+// config, are opened straight away.
+{
+	wstring str = pszLocal;
+
+	while (str.length() && (*str.rbegin() == L'\\')) str.erase(str.length() - 1);
+	EnterCriticalSection(&_cs);
+	for (size_t i = 0; i < _roots.size(); i++) {
+		if ((str.length() >= _roots[i].length()) && !_wcsnicmp(str.c_str(), _roots[i].c_str(), _roots[i].length()) &&
+			((str.length() == _roots[i].length()) || (str[_roots[i].length()] == L'\\'))) {
+			LeaveCriticalSection(&_cs);
+			return;
+		}
+	}
+	_roots.push_back(str);
+	if (_hPort && !_isStopping) Open(str);
+	LeaveCriticalSection(&_cs);
+}
+
+void FSWatcher::Start()
+// Opens every watched folder and starts the notification thread. Does
+// nothing if no cache has registered an interest.
+{
+	EnterCriticalSection(&_cs);
+	if (!_clients.empty()) _hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (_hPort) {
+		for (size_t i = 0; i < _roots.size(); i++) Open(_roots[i]);
+		_hThread = (HANDLE)_beginthreadex(NULL, 0, WatcherThread, this, 0, NULL);
+	}
+	LeaveCriticalSection(&_cs);
+}
+
+void FSWatcher::Open(const wstring &strLocal)
+// Opens a folder and starts reading its changes. A folder that cannot be
+// watched yet is kept, and tried again every FSWATCH_RETRY_INTERVAL
+// milliseconds. Called with _cs held.
+{
+	WATCH *pwatch = new WATCH;
+
+	pwatch->strLocal = strLocal;
+	pwatch->hDir = INVALID_HANDLE_VALUE;
+	pwatch->isLive = false;
+	_watches.push_back(pwatch);
+	Reopen(pwatch);
+}
+
+bool FSWatcher::Reopen(WATCH *pwatch)
+// Opens a watch's folder again and starts reading its changes. Called with
+// _cs held.
+{
+	pwatch->hDir = ::CreateFile(pwatch->strLocal.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+	if ((pwatch->hDir == INVALID_HANDLE_VALUE) || !CreateIoCompletionPort(pwatch->hDir, _hPort, (ULONG_PTR)pwatch, 0) || !Arm(pwatch)) {
+		if (pwatch->hDir != INVALID_HANDLE_VALUE) CloseHandle(pwatch->hDir);
+		pwatch->hDir = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	pwatch->isLive = true;
+	return true;
+}
+
+void FSWatcher::Lost(WATCH *pwatch)
+// Closes a watch whose read failed, such as on a share that has dropped,
+// and tells the clients that anything under it may now be stale. It is
+// opened again by Retry. Called on the watcher thread once the read has
+// completed, so nothing is pending on the handle.
+{
+	EnterCriticalSection(&_cs);
+	pwatch->isLive = false;
+	if (pwatch->hDir != INVALID_HANDLE_VALUE) CloseHandle(pwatch->hDir);
+	pwatch->hDir = INVALID_HANDLE_VALUE;
+	LeaveCriticalSection(&_cs);
+	Changed(pwatch->strLocal.c_str(), true);
+}
+
+void FSWatcher::Retry()
+// Opens again the folders that could not be watched. Changes made while a
+// folder was not watched were missed, so the clients drop what they hold
+// under it.
+{
+	vector<WATCH *> reopened;
+
+	EnterCriticalSection(&_cs);
+	for (size_t i = 0; i < _watches.size(); i++) {
+		if (!_watches[i]->isLive && !_isStopping && Reopen(_watches[i])) reopened.push_back(_watches[i]);
+	}
+	LeaveCriticalSection(&_cs);
+	for (size_t i = 0; i < reopened.size(); i++) Changed(reopened[i]->strLocal.c_str(), true);
+}
+
+bool FSWatcher::IsWatched(const wchar_t *pszLocal)
+// Returns true if pszLocal is under a folder whose changes are being read
+// right now. What is cached about other paths could go stale unnoticed.
+{
+	size_t stLen = wcslen(pszLocal);
+	bool isWatched = false;
+
+	EnterCriticalSection(&_cs);
+	for (size_t i = 0; i < _watches.size(); i++) {
+		const wstring &strRoot = _watches[i]->strLocal;
+		if ((stLen >= strRoot.length()) && !_wcsnicmp(pszLocal, strRoot.c_str(), strRoot.length()) &&
+			((stLen == strRoot.length()) || (pszLocal[strRoot.length()] == L'\\'))) {
+			isWatched = _watches[i]->isLive;
+			break;
+		}
+	}
+	LeaveCriticalSection(&_cs);
+	return isWatched;
+}
+
+void FSWatcher::Changed(const wchar_t *pszLocal, bool isTree)
+// Passes a change on to every client. The server calls this directly for
+// changes it makes itself, so they are seen without waiting for the OS.
+{
+	for (size_t i = 0; i < _clients.size(); i++) _clients[i].pfn(_clients[i].pContext, pszLocal, isTree);
+}
+
+bool FSWatcher::Arm(WATCH *pwatch)
+// Starts the next read of a folder's changes and counts it as pending until
+// its completion is dequeued. Called with _cs held, so a read is never
+// started after the destructor has cancelled the others.
+{
+	if (_isStopping) return false;
+	ZeroMemory(&pwatch->ov, sizeof(OVERLAPPED));
+	InterlockedIncrement(&_lPending);
+	if (ReadDirectoryChangesW(pwatch->hDir, pwatch->dwBuffer, sizeof(pwatch->dwBuffer), TRUE, FSWATCH_FILTER, NULL, &pwatch->ov, NULL)) return true;
+	Completed();
+	return false;
+}
+
+void FSWatcher::Completed()
+// Counts a read as finished, and tells the destructor once the last one
+// has finished after it cancelled them
+{
+	if (!InterlockedDecrement(&_lPending) && _isStopping) SetEvent(_hDrained);
+}
+
+unsigned __stdcall FSWatcher::WatcherThread(void *pParam)
+{
+	FSWatcher *pthis = (FSWatcher *)pParam;
+	WATCH *pwatch;
+	FILE_NOTIFY_INFORMATION *pfni;
+	OVERLAPPED *pov;
+	ULONG_PTR ulKey;
+	DWORD dwBytes;
+	bool isArmed;
+	wstring str;
+
+	for (;;) {
+		if (!GetQueuedCompletionStatus(pthis->_hPort, &dwBytes, &ulKey, &pov, FSWATCH_RETRY_INTERVAL)) {
+			if (!pov) {
+				if (GetLastError() != WAIT_TIMEOUT) break;
+				pthis->Retry();
+				continue;
+			}
+			// The read was cancelled or the folder has gone
+			pthis->Completed();
+			if (!pthis->_isStopping) pthis->Lost((WATCH *)ulKey);
+			continue;
+		}
+		if (!ulKey) break;
+		pwatch = (WATCH *)ulKey;
+		pthis->Completed();
+		if (pthis->_isStopping) continue;
+		if (!dwBytes) {
+			// The buffer overflowed; anything under this folder may be stale
+			pthis->Changed(pwatch->strLocal.c_str(), true);
+		} else {
+			pfni = (FILE_NOTIFY_INFORMATION *)pwatch->dwBuffer;
+			for (;;) {
+				str = pwatch->strLocal;
+				str += L'\\';
+				str.append(pfni->FileName, pfni->FileNameLength / sizeof(wchar_t));
+				pthis->Changed(str.c_str(), (pfni->Action == FILE_ACTION_REMOVED) || (pfni->Action == FILE_ACTION_RENAMED_OLD_NAME));
+				if (!pfni->NextEntryOffset) break;
+				pfni = (FILE_NOTIFY_INFORMATION *)((BYTE *)pfni + pfni->NextEntryOffset);
+			}
+		}
+		EnterCriticalSection(&pthis->_cs);
+		isArmed = pthis->Arm(pwatch);
+		LeaveCriticalSection(&pthis->_cs);
+		if (!isArmed && !pthis->_isStopping) pthis->Lost(pwatch);
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_FSWATCH_H
+#define _INCL_FSWATCH_H
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define FSWATCH_BUFFER_SIZE 16384
+#define FSWATCH_RETRY_INTERVAL 30000
+
+// Called with the local path of a file or folder that changed. If isTree is
+// true, anything below that path may have changed as well.
+typedef void (*FSWATCHPROC)(void *pContext, const wchar_t *pszLocal, bool isTree);
+
+class FSWatcher
+{
+private:
+	struct WATCH {
+		OVERLAPPED ov;
+		HANDLE hDir;
+		wstring strLocal;
+		bool isLive;
+		DWORD dwBuffer[FSWATCH_BUFFER_SIZE / sizeof(DWORD)];
+	};
+	struct CLIENT {
+		FSWATCHPROC pfn;
+		void *pContext;
+	};
+
+	vector<wstring> _roots;
+	vector<WATCH *> _watches;
+	vector<CLIENT> _clients;
+	HANDLE _hPort;
+	HANDLE _hThread;
+	HANDLE _hDrained;
+	volatile LONG _lPending;
+	volatile bool _isStopping;
+	CRITICAL_SECTION _cs;
+
+	void Open(const wstring &strLocal);
+	bool Reopen(WATCH *pwatch);
+	void Lost(WATCH *pwatch);
+	void Retry();
+	bool Arm(WATCH *pwatch);
+	void Completed();
+	static unsigned __stdcall WatcherThread(void *pParam);
+
+public:
+	FSWatcher();
+	~FSWatcher();
+	void AddClient(FSWATCHPROC pfn, void *pContext);
+	void Watch(const wchar_t *pszLocal);
+	void Start();
+	void Changed(const wchar_t *pszLocal, bool isTree);
+	bool IsWatched(const wchar_t *pszLocal);
+};
+
+#endif
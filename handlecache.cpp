@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "handlecache.h"
+
+// Read-only handles to files being downloaded, shared by every session.
+// Each handle is opened for overlapped I/O so that any number of transfers
+// can read from it at their own offsets at the same time, and the system
+// cache serves them all from one set of pages. A handle stays open after its
+// last reader is done, up to a fixed number of idle handles, so the next
+// RETR of a hot file skips the open. Entries are keyed by local path and
+// checked against the file's current size and write time before reuse.
+
+HandleCache::HandleCache(DWORD dwMaxEntries)
+{
+	_stMaxEntries = dwMaxEntries;
+	_llHits = 0;
+	_llMisses = 0;
+	InitializeCriticalSection(&_cs);
+}
+
+HandleCache::~HandleCache()
+{
+	list<FILEREF *> closing;
+
+	// Every transfer has ended by now, so nothing is still referenced
+	for (map_type::iterator it = _entries.begin(); it != _entries.end(); ++it) closing.push_back(it->second);
+	_entries.clear();
+	_idle.clear();
+	Close(closing);
+	DeleteCriticalSection(&_cs);
+}
+
+void HandleCache::MakeKey(const wchar_t *pszLocal, wstring &strKey)
+{
+	strKey = pszLocal;
+	if (strKey.length()) CharUpperBuff(&strKey[0], (DWORD)strKey.length());
+}
+
+void HandleCache::Detach(map_type::iterator it, list<FILEREF *> &closing)
+// Removes an entry from the map. The handle is closed now if nobody is
+// reading from it, otherwise by whoever releases it last.
+{
+	FILEREF *pref = it->second;
+
+	_entries.erase(it);
+	pref->isCached = false;
+	if (!pref->lRefs) {
+		_idle.erase(pref->itIdle);
+		closing.push_back(pref);
+	}
+}
+
+void HandleCache::Trim(list<FILEREF *> &closing)
+// Evicts the least recently used idle handles until the cache is in bounds.
+{
+	map_type::iterator it;
+
+	while ((_entries.size() > _stMaxEntries) && !_idle.empty()) {
+		it = _entries.find(_idle.front()->strKey);
+		Detach(it, closing);
+	}
+}
+
+void HandleCache::Close(list<FILEREF *> &closing)
+{
+	for (list<FILEREF *>::iterator it = closing.begin(); it != closing.end(); ++it) {
+		CloseHandle((*it)->hFile);
+		delete *it;
+	}
+	closing.clear();
+}
+
+HandleCache::FILEREF * HandleCache::Acquire(const wchar_t *pszLocal, const FILETIME *pftLastWrite, const ULARGE_INTEGER *puliSize)
+// Returns a shared handle to pszLocal, opening the file if no handle matching
+// the given size and write time is cached. Returns NULL if it cannot be
+// opened. Every successful call must be paired with a call to Release.
+{
+	wstring strKey;
+	map_type::iterator it;
+	list<FILEREF *> closing;
+	FILEREF *pref;
+	BY_HANDLE_FILE_INFORMATION bhfi;
+	HANDLE hFile;
+
+	MakeKey(pszLocal, strKey);
+
+	EnterCriticalSection(&_cs);
+	it = _entries.find(strKey);
+	if (it != _entries.end()) {
+		pref = it->second;
+		if (!CompareFileTime(&pref->ftLastWrite, pftLastWrite) && (pref->uliSize.QuadPart == puliSize->QuadPart)) {
+			if (!pref->lRefs++) _idle.erase(pref->itIdle);
+			LeaveCriticalSection(&_cs);
+			InterlockedIncrement64(&_llHits);
+			return pref;
+		}
+		Detach(it, closing);
+	}
+	LeaveCriticalSection(&_cs);
+	Close(closing);
+	InterlockedIncrement64(&_llMisses);
+
+	// FILE_SHARE_DELETE keeps idle handles from blocking deletes and renames
+	hFile = ::CreateFile(pszLocal, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hFile == INVALID_HANDLE_VALUE) return NULL;
+	if (!GetFileInformationByHandle(hFile, &bhfi) || (bhfi.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		CloseHandle(hFile);
+		return NULL;
+	}
+
+	pref = new FILEREF;
+	pref->strKey = strKey;
+	pref->hFile = hFile;
+	pref->uliSize.LowPart = bhfi.nFileSizeLow;
+	pref->uliSize.HighPart = bhfi.nFileSizeHigh;
+	pref->ftLastWrite = bhfi.ftLastWriteTime;
+	pref->lRefs = 1;
+	pref->isCached = true;
+
+	// Another session may have opened the same file meanwhile; the newer handle wins
+	EnterCriticalSection(&_cs);
+	it = _entries.find(strKey);
+	if (it != _entries.end()) Detach(it, closing);
+	_entries[strKey] = pref;
+	Trim(closing);
+	LeaveCriticalSection(&_cs);
+	Close(closing);
+
+	return pref;
+}
+
+void HandleCache::Release(FILEREF *pref)
+// Drops a reference taken by Acquire.
+{
+	list<FILEREF *> closing;
+
+	EnterCriticalSection(&_cs);
+	if (!--pref->lRefs) {
+		if (pref->isCached) {
+			_idle.push_back(pref);
+			pref->itIdle = --_idle.end();
+			Trim(closing);
+		} else {
+			closing.push_back(pref);
+		}
+	}
+	LeaveCriticalSection(&_cs);
+	Close(closing);
+}
+
+bool HandleCache::Read(FILEREF *pref, ULONGLONG qwOffset, void *pBuffer, DWORD dwBytes, DWORD *pdwRead, HANDLE hEvent)
+// Reads from a shared handle at the given offset, without touching any file
+// pointer. hEvent must be a manual-reset event owned by the caller. Returns
+// true with *pdwRead set to 0 at the end of the file.
+{
+	OVERLAPPED ov;
+
+	ZeroMemory(&ov, sizeof(OVERLAPPED));
+	ov.Offset = (DWORD)qwOffset;
+	ov.OffsetHigh = (DWORD)(qwOffset >> 32);
+	ov.hEvent = hEvent;
+	*pdwRead = 0;
+	if (!ReadFile(pref->hFile, pBuffer, dwBytes, pdwRead, &ov)) {
+		if (GetLastError() == ERROR_HANDLE_EOF) return true;
+		if (GetLastError() != ERROR_IO_PENDING) return false;
+	}
+	if (!GetOverlappedResult(pref->hFile, &ov, pdwRead, TRUE)) {
+		*pdwRead = 0;
+		return (GetLastError() == ERROR_HANDLE_EOF);
+	}
+	return true;
+}
+
+void HandleCache::Invalidate(const wchar_t *pszLocal, bool isTree)
+// Forgets the handle to pszLocal, and if isTree, every handle below it.
+// Called before the server changes a file as well as after, since an idle
+// handle could otherwise keep a deleted name around or a folder from
+// being renamed.
+{
+	wstring strKey;
+	map_type::iterator it;
+	list<FILEREF *> closing;
+
+	MakeKey(pszLocal, strKey);
+	while ((strKey.length() > 3) && (*strKey.rbegin() == L'\\')) strKey.erase(strKey.length() - 1);
+
+	EnterCriticalSection(&_cs);
+	it = _entries.find(strKey);
+	if (it != _entries.end()) Detach(it, closing);
+	if (isTree) {
+		strKey += L'\\';
+		for (it = _entries.begin(); it != _entries.end(); ) {
+			if (!it->first.compare(0, strKey.length(), strKey)) Detach(it++, closing);
+			else ++it;
+		}
+	}
+	LeaveCriticalSection(&_cs);
+	Close(closing);
+}
+
+void HandleCache::GetStats(LONGLONG *pllHits, LONGLONG *pllMisses, size_t *pstOpen)
+{
+	EnterCriticalSection(&_cs);
+	*pstOpen = _entries.size();
+	LeaveCriticalSection(&_cs);
+	*pllHits = _llHits;
+	*pllMisses = _llMisses;
+}
+
+void HandleCache::OnChange(void *pContext, const wchar_t *pszLocal, bool isTree)
+{
+	((HandleCache *)pContext)->Invalidate(pszLocal, isTree);
+}
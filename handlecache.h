@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_HANDLECACHE_H
+#define _INCL_HANDLECACHE_H
+
+#include <windows.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+class HandleCache
+{
+public:
+	struct FILEREF {
+		wstring strKey;
+		HANDLE hFile;
+		ULARGE_INTEGER uliSize;
+		FILETIME ftLastWrite;
+		LONG lRefs;
+		bool isCached;
+		list<FILEREF *>::iterator itIdle;
+	};
+
+private:
+	typedef unordered_map<wstring, FILEREF *> map_type;
+
+	map_type _entries;
+	list<FILEREF *> _idle;
+	size_t _stMaxEntries;
+	volatile LONGLONG _llHits;
+	volatile LONGLONG _llMisses;
+	CRITICAL_SECTION _cs;
+
+	static void MakeKey(const wchar_t *pszLocal, wstring &strKey);
+	void Detach(map_type::iterator it, list<FILEREF *> &closing);
+	void Trim(list<FILEREF *> &closing);
+	static void Close(list<FILEREF *> &closing);
+
+public:
+	HandleCache(DWORD dwMaxEntries);
+	~HandleCache();
+	FILEREF * Acquire(const wchar_t *pszLocal, const FILETIME *pftLastWrite, const ULARGE_INTEGER *puliSize);
+	void Release(FILEREF *pref);
+	static bool Read(FILEREF *pref, ULONGLONG qwOffset, void *pBuffer, DWORD dwBytes, DWORD *pdwRead, HANDLE hEvent);
+	void Invalidate(const wchar_t *pszLocal, bool isTree);
+	void GetStats(LONGLONG *pllHits, LONGLONG *pllMisses, size_t *pstOpen);
+	static void OnChange(void *pContext, const wchar_t *pszLocal, bool isTree);
+};
+
+#endif
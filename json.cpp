@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "json.h"
+#include <stdio.h>
+
+void AppendJsonString(wstring &str, const wchar_t *psz)
+{
+	wchar_t sz[8];
+
+	for (; *psz; psz++) {
+		if (*psz == L'"' || *psz == L'\\') {
+			str += L'\\';
+			str += *psz;
+		} else if (*psz < L' ') {
+			swprintf_s(sz, L"\\u%04x", (unsigned)*psz);
+			str += sz;
+		} else {
+			str += *psz;
+		}
+	}
+}
+
+void AppendJsonString(string &str, const wchar_t *psz)
+// The escapes are all ASCII, so escaping before the conversion to UTF-8
+// gives the same bytes as escaping after it.
+{
+	wstring strEscaped;
+	size_t stOld;
+	int nBytes;
+
+	AppendJsonString(strEscaped, psz);
+	if (strEscaped.empty()) return;
+	nBytes = WideCharToMultiByte(CP_UTF8, 0, strEscaped.c_str(), (int)strEscaped.length(), NULL, 0, NULL, NULL);
+	if (nBytes <= 0) return;
+	stOld = str.length();
+	str.resize(stOld + nBytes);
+	WideCharToMultiByte(CP_UTF8, 0, strEscaped.c_str(), (int)strEscaped.length(), &str[stOld], nBytes, NULL, NULL);
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "listcache.h"
+
+// Formatted listings of local folders, shared by every session whose mount
+// points lead to the same folder. Entries are dropped when the folder
+// changes (see FSWatcher), when the date rolls over (listing lines show the
+// time or the year depending on the file's age), after a few seconds in case
+// a change notification was missed, and least recently used first when the
+// cache grows beyond its budget.
+
+ListingCache::ListingCache(size_t stMaxBytes, DWORD dwTTLSeconds)
+{
+	_stBytes = 0;
+	_stMaxBytes = stMaxBytes;
+	_qwTTL = (ULONGLONG)dwTTLSeconds * 1000;
+	_qwGeneration = 0;
+	_llHits = 0;
+	_llMisses = 0;
+	InitializeCriticalSection(&_cs);
+}
+
+ListingCache::~ListingCache()
+{
+	DeleteCriticalSection(&_cs);
+}
+
+void ListingCache::MakeKey(const wchar_t *pszLocal, wstring &strKey)
+{
+	strKey = pszLocal;
+	while (strKey.length() && (*strKey.rbegin() == L'\\')) strKey.erase(strKey.length() - 1);
+	if (strKey.length()) CharUpperBuff(&strKey[0], (DWORD)strKey.length());
+}
+
+ULONGLONG ListingCache::GetDay()
+{
+	ULARGE_INTEGER uli;
+
+	GetSystemTimeAsFileTime((FILETIME *)&uli);
+	return uli.QuadPart / 864000000000ULL;
+}
+
+bool ListingCache::IsFresh(const ENTRY &entry) const
+{
+	// A TTL of 0 trusts the change notifications alone
+	return (entry.qwDay == GetDay()) && (!_qwTTL || (entry.qwExpires > GetTickCount64()));
+}
+
+ListingCache::snapshot_ptr ListingCache::Get(const wchar_t *pszLocal, DWORD dwIsNLST, ULONGLONG *pqwGeneration)
+// Returns the cached listing of a local folder, or an empty pointer. On a
+// miss, *pqwGeneration receives a token to hand back to Put.
+{
+	wstring strKey;
+	snapshot_ptr psnap;
+	map_type::iterator it;
+
+	MakeKey(pszLocal, strKey);
+	EnterCriticalSection(&_cs);
+	it = _entries.find(strKey);
+	if ((it != _entries.end()) && IsFresh(it->second)) {
+		psnap = it->second.psnap[dwIsNLST ? 1 : 0];
+		if (psnap) _lru.splice(_lru.begin(), _lru, it->second.itLRU);
+	}
+	*pqwGeneration = _qwGeneration;
+	LeaveCriticalSection(&_cs);
+	if (psnap) InterlockedIncrement64(&_llHits);
+	else InterlockedIncrement64(&_llMisses);
+	return psnap;
+}
+
+void ListingCache::Put(const wchar_t *pszLocal, DWORD dwIsNLST, snapshot_ptr psnap, ULONGLONG qwGeneration)
+// Stores a listing read from disk. It is discarded if anything was
+// invalidated since the matching Get, since it may already be out of date.
+{
+	wstring strKey;
+	map_type::iterator it;
+	size_t stBytes = sizeof(ENTRY) + sizeof(SNAPSHOT);
+
+	for (map<wstring, wstring>::const_iterator itLine = psnap->listing.begin(); itLine != psnap->listing.end(); ++itLine) {
+		stBytes += (itLine->first.length() + itLine->second.length()) * sizeof(wchar_t) + 64;
+	}
+	for (size_t i = 0; i < psnap->folders.size(); i++) stBytes += psnap->folders[i].length() * sizeof(wchar_t) + 32;
+	if (stBytes > _stMaxBytes / 4) return;
+
+	MakeKey(pszLocal, strKey);
+	EnterCriticalSection(&_cs);
+	if (qwGeneration == _qwGeneration) {
+		it = _entries.find(strKey);
+		if ((it != _entries.end()) && !IsFresh(it->second)) {
+			Remove(it);
+			it = _entries.end();
+		}
+		if (it == _entries.end()) {
+			it = _entries.insert(make_pair(strKey, ENTRY())).first;
+			it->second.stBytes = 0;
+			it->second.qwDay = GetDay();
+			it->second.qwExpires = GetTickCount64() + _qwTTL;
+			_lru.push_front(strKey);
+			it->second.itLRU = _lru.begin();
+		} else {
+			_lru.splice(_lru.begin(), _lru, it->second.itLRU);
+		}
+		if (!it->second.psnap[dwIsNLST ? 1 : 0]) {
+			it->second.psnap[dwIsNLST ? 1 : 0] = psnap;
+			it->second.stBytes += stBytes;
+			_stBytes += stBytes;
+		}
+		while ((_stBytes > _stMaxBytes) && !_lru.empty()) Remove(_entries.find(_lru.back()));
+	}
+	LeaveCriticalSection(&_cs);
+}
+
+void ListingCache::Invalidate(const wchar_t *pszLocal, bool isTree)
+// Drops the listing of the folder containing pszLocal, and of pszLocal
+// itself if it is a folder. If isTree, also drops everything below it.
+{
+	wstring strKey, strParent;
+	map_type::iterator it;
+	size_t st;
+
+	MakeKey(pszLocal, strKey);
+	st = strKey.rfind(L'\\');
+	if (st != wstring::npos) strParent = strKey.substr(0, st);
+
+	EnterCriticalSection(&_cs);
+	_qwGeneration++;
+	if ((it = _entries.find(strParent)) != _entries.end()) Remove(it);
+	it = _entries.lower_bound(strKey);
+	while ((it != _entries.end()) && !it->first.compare(0, strKey.length(), strKey)) {
+		if (it->first.length() == strKey.length()) {
+			Remove(it++);
+		} else if (isTree && (it->first[strKey.length()] == L'\\')) {
+			Remove(it++);
+		} else {
+			++it;
+		}
+	}
+	LeaveCriticalSection(&_cs);
+}
+
+void ListingCache::Remove(map_type::iterator it)
+{
+	_stBytes -= it->second.stBytes;
+	_lru.erase(it->second.itLRU);
+	_entries.erase(it);
+}
+
+void ListingCache::GetStats(LONGLONG *pllHits, LONGLONG *pllMisses, size_t *pstBytes)
+{
+	*pllHits = _llHits;
+	*pllMisses = _llMisses;
+	*pstBytes = _stBytes;
+}
+
+void ListingCache::OnChange(void *pContext, const wchar_t *pszLocal, bool isTree)
+{
+	((ListingCache *)pContext)->Invalidate(pszLocal, isTree);
+}
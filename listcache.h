@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_LISTCACHE_H
+#define _INCL_LISTCACHE_H
+
+#include <windows.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class ListingCache
+{
+public:
+	struct SNAPSHOT {
+		map<wstring, wstring> listing;
+		vector<wstring> folders;
+	};
+	typedef shared_ptr<const SNAPSHOT> snapshot_ptr;
+
+private:
+	struct ENTRY {
+		snapshot_ptr psnap[2];
+		size_t stBytes;
+		ULONGLONG qwDay;
+		ULONGLONG qwExpires;
+		list<wstring>::iterator itLRU;
+	};
+	typedef map<wstring, ENTRY> map_type;
+
+	map_type _entries;
+	list<wstring> _lru;
+	size_t _stBytes;
+	size_t _stMaxBytes;
+	ULONGLONG _qwTTL;
+	ULONGLONG _qwGeneration;
+	volatile LONGLONG _llHits;
+	volatile LONGLONG _llMisses;
+	CRITICAL_SECTION _cs;
+
+	static void MakeKey(const wchar_t *pszLocal, wstring &strKey);
+	static ULONGLONG GetDay();
+	bool IsFresh(const ENTRY &entry) const;
+	void Remove(map_type::iterator it);
+
+public:
+	ListingCache(size_t stMaxBytes, DWORD dwTTLSeconds);
+	~ListingCache();
+	snapshot_ptr Get(const wchar_t *pszLocal, DWORD dwIsNLST, ULONGLONG *pqwGeneration);
+	void Put(const wchar_t *pszLocal, DWORD dwIsNLST, snapshot_ptr psnap, ULONGLONG qwGeneration);
+	void Invalidate(const wchar_t *pszLocal, bool isTree);
+	void GetStats(LONGLONG *pllHits, LONGLONG *pllMisses, size_t *pstBytes);
+	static void OnChange(void *pContext, const wchar_t *pszLocal, bool isTree);
+};
+
+#endif
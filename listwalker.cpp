@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "listwalker.h"
+#include <process.h>
+
+// Directories are listed by a small pool of worker threads in the order they
+// are discovered (breadth first). The session thread hands out new work only
+// as it sends finished sections, in that same order, so the output is
+// deterministic however the workers are scheduled, and no more than
+// LISTWALKER_WINDOW listings are ever held in memory ahead of the socket.
+
+ListWalker::ListWalker(VFS *pVFS, PermDB *pPerms, DWORD dwIsNLST)
+{
+	_pVFS = pVFS;
+	_pPerms = pPerms;
+	_dwIsNLST = dwIsNLST;
+	_stNextWork = 0;
+	_stNextSend = 0;
+	_isStopping = false;
+	_dwThreads = 0;
+	InitializeCriticalSection(&_cs);
+	InitializeConditionVariable(&_cvWork);
+	InitializeConditionVariable(&_cvDone);
+}
+
+ListWalker::~ListWalker()
+{
+	EnterCriticalSection(&_cs);
+	_isStopping = true;
+	WakeAllConditionVariable(&_cvWork);
+	LeaveCriticalSection(&_cs);
+	if (_dwThreads) {
+		WaitForMultipleObjects(_dwThreads, _hThreads, TRUE, INFINITE);
+		for (DWORD dw = 0; dw < _dwThreads; dw++) CloseHandle(_hThreads[dw]);
+	}
+	for (size_t i = 0; i < _nodes.size(); i++) delete _nodes[i];
+	DeleteCriticalSection(&_cs);
+}
+
+bool ListWalker::Start(const wchar_t *pszVirtual)
+// Lists pszVirtual itself and starts the workers for its subfolders.
+// Returns false if pszVirtual could not be listed.
+{
+	NODE *pnode = new NODE;
+
+	pnode->strVirtual = pszVirtual;
+	pnode->dwDepth = 0;
+	pnode->isListed = (_pVFS->GetDirectoryListing(pszVirtual, _dwIsNLST, pnode->listing, &pnode->folders) != 0);
+	pnode->isDone = true;
+	_nodes.push_back(pnode);
+	_stNextWork = 1;
+	if (!pnode->isListed) return false;
+
+	for (_dwThreads = 0; _dwThreads < LISTWALKER_THREADS; _dwThreads++) {
+		_hThreads[_dwThreads] = (HANDLE)_beginthreadex(NULL, 0, WorkerThread, this, 0, NULL);
+		if (!_hThreads[_dwThreads]) break;
+	}
+	return true;
+}
+
+bool ListWalker::Next(wstring &strSection)
+// Fills strSection with the next folder's part of the listing, preceded by
+// a header naming the folder for all but the first. Returns false when the
+// whole tree has been sent.
+{
+	NODE *pnode;
+	wstring str;
+
+	strSection.clear();
+	EnterCriticalSection(&_cs);
+	while (_stNextSend < _nodes.size()) {
+		pnode = _nodes[_stNextSend];
+		if (!pnode->isDone && !_dwThreads) {
+			// No workers could be started; list the folder here instead
+			_stNextWork++;
+			LeaveCriticalSection(&_cs);
+			if (_pPerms->GetPerm(pnode->strVirtual.c_str(), PERM_LIST) == 1) {
+				pnode->isListed = (_pVFS->GetDirectoryListing(pnode->strVirtual.c_str(), _dwIsNLST, pnode->listing, &pnode->folders) != 0);
+			}
+			EnterCriticalSection(&_cs);
+			pnode->isDone = true;
+		}
+		while (!pnode->isDone) SleepConditionVariableCS(&_cvDone, &_cs, INFINITE);
+		_nodes[_stNextSend++] = NULL;
+		if (pnode->isListed && (pnode->dwDepth < LISTWALKER_MAX_DEPTH)) {
+			for (VFS::folder_list_type::const_iterator it = pnode->folders.begin(); it != pnode->folders.end(); ++it) {
+				NODE *pchild = new NODE;
+				VFS::ResolveRelative(pnode->strVirtual.c_str(), it->c_str(), pchild->strVirtual);
+				pchild->dwDepth = pnode->dwDepth + 1;
+				pchild->isDone = false;
+				pchild->isListed = false;
+				_nodes.push_back(pchild);
+			}
+		}
+		WakeAllConditionVariable(&_cvWork);
+		if (pnode->isListed) {
+			LeaveCriticalSection(&_cs);
+			if (pnode->dwDepth) {
+				strSection = L"\r\n";
+				strSection += pnode->strVirtual;
+				strSection += L":\r\n";
+			}
+			for (VFS::listing_type::const_iterator it = pnode->listing.begin(); it != pnode->listing.end(); ++it) {
+				strSection += it->second;
+			}
+			delete pnode;
+			return true;
+		}
+		delete pnode;
+	}
+	LeaveCriticalSection(&_cs);
+	return false;
+}
+
+unsigned __stdcall ListWalker::WorkerThread(void *pParam)
+{
+	ListWalker *pthis = (ListWalker *)pParam;
+	NODE *pnode;
+
+	EnterCriticalSection(&pthis->_cs);
+	for (;;) {
+		while (!pthis->_isStopping && !((pthis->_stNextWork < pthis->_nodes.size()) && (pthis->_stNextWork < pthis->_stNextSend + LISTWALKER_WINDOW))) {
+			SleepConditionVariableCS(&pthis->_cvWork, &pthis->_cs, INFINITE);
+		}
+		if (pthis->_isStopping) break;
+		pnode = pthis->_nodes[pthis->_stNextWork++];
+		LeaveCriticalSection(&pthis->_cs);
+
+		// Every level is subject to its own List permission
+		if (pthis->_pPerms->GetPerm(pnode->strVirtual.c_str(), PERM_LIST) == 1) {
+			pnode->isListed = (pthis->_pVFS->GetDirectoryListing(pnode->strVirtual.c_str(), pthis->_dwIsNLST, pnode->listing, &pnode->folders) != 0);
+		}
+
+		EnterCriticalSection(&pthis->_cs);
+		pnode->isDone = true;
+		WakeAllConditionVariable(&pthis->_cvDone);
+	}
+	LeaveCriticalSection(&pthis->_cs);
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_LISTWALKER_H
+#define _INCL_LISTWALKER_H
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include "vfs.h"
+#include "permdb.h"
+
+using namespace std;
+
+#define LISTWALKER_THREADS 4
+#define LISTWALKER_WINDOW 64
+#define LISTWALKER_MAX_DEPTH 32
+
+class ListWalker
+{
+private:
+	struct NODE {
+		wstring strVirtual;
+		DWORD dwDepth;
+		bool isDone;
+		bool isListed;
+		VFS::listing_type listing;
+		VFS::folder_list_type folders;
+	};
+
+	VFS *_pVFS;
+	PermDB *_pPerms;
+	DWORD _dwIsNLST;
+	vector<NODE *> _nodes;
+	size_t _stNextWork;
+	size_t _stNextSend;
+	bool _isStopping;
+	CRITICAL_SECTION _cs;
+	CONDITION_VARIABLE _cvWork;
+	CONDITION_VARIABLE _cvDone;
+	HANDLE _hThreads[LISTWALKER_THREADS];
+	DWORD _dwThreads;
+
+	static unsigned __stdcall WorkerThread(void *pParam);
+
+public:
+	ListWalker(VFS *pVFS, PermDB *pPerms, DWORD dwIsNLST);
+	~ListWalker();
+	bool Start(const wchar_t *pszVirtual);
+	bool Next(wstring &strSection);
+};
+
+#endif
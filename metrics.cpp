@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "metrics.h"
+#include "conffile.h"
+#include <intrin.h>
+
+// The verbs ConnectionThread handles, in the order of their histograms;
+// any other verb is counted under "other"
+static const wchar_t * const ppszVerbs[METRICS_VERBS] = {
+	L"USER", L"PASS", L"REIN", L"HELP", L"FEAT", L"SYST", L"QUIT", L"NOOP", L"PWD", L"XPWD", L"CWD", L"XCWD", L"CDUP", L"XCUP",
+	L"TYPE", L"REST", L"PORT", L"PASV", L"LIST", L"NLST", L"STAT", L"RETR", L"STOR", L"APPE", L"ABOR", L"SIZE", L"MDTM",
+	L"HASH", L"DELE", L"RNFR", L"RNTO", L"SITE", L"MKD", L"XMKD", L"RMD", L"XRMD", L"OPTS"
+};
+
+static const char * const ppszCounters[(int)MetricsCounter::COUNT][2] = {
+	{ "slimftpd_connections_accepted_total", "Control connections accepted." },
+	{ "slimftpd_connections_refused_total", "Logins refused at the connection limit." },
+	{ "slimftpd_logins_total", "Successful logins." },
+	{ "slimftpd_login_failures_total", "Logins refused for a wrong user name or password." },
+	{ "slimftpd_command_timeouts_total", "Sessions closed for sending no command within CommandTimeout." },
+	{ "slimftpd_data_connection_timeouts_total", "Passive data connections the client did not open within ConnectTimeout." },
+	{ "slimftpd_data_connection_failures_total", "Active data connections that could not be opened." }
+};
+
+static const char * const ppszDirections[2] = { "download", "upload" };
+
+Metrics::Metrics()
+{
+	_pshards = new SHARD[METRICS_SHARDS];
+	ZeroMemory((void *)_pshards, sizeof(SHARD) * METRICS_SHARDS);
+}
+
+Metrics::~Metrics()
+{
+	delete [] _pshards;
+}
+
+Metrics::SHARD * Metrics::GetShard()
+// Thread IDs are multiples of four, so their low bits are dropped first
+{
+	return &_pshards[(GetCurrentThreadId() >> 2) % METRICS_SHARDS];
+}
+
+ULONGLONG Metrics::GetTicks()
+{
+	LARGE_INTEGER li;
+
+	QueryPerformanceCounter(&li);
+	return li.QuadPart;
+}
+
+ULONGLONG Metrics::GetMicroseconds(ULONGLONG qwStartTicks)
+// Returns the microseconds since GetTicks returned qwStartTicks
+{
+	return TicksToMicroseconds(GetTicks() - qwStartTicks);
+}
+
+ULONGLONG Metrics::TicksToMicroseconds(ULONGLONG qwTicks)
+{
+	LARGE_INTEGER liFrequency;
+
+	QueryPerformanceFrequency(&liFrequency);
+	return (qwTicks / liFrequency.QuadPart) * 1000000 + (qwTicks % liFrequency.QuadPart) * 1000000 / liFrequency.QuadPart;
+}
+
+ULONGLONG Metrics::Lap(ULONGLONG *pqwTicks)
+// Returns the ticks since *pqwTicks and moves it on to now, so timing a run
+// of phases back to back reads the clock once per phase
+{
+	ULONGLONG qwNow = GetTicks(), qwLap = qwNow - *pqwTicks;
+
+	*pqwTicks = qwNow;
+	return qwLap;
+}
+
+DWORD Metrics::FindVerb(const wchar_t *pszVerb)
+// Returns the histogram for a verb: one more than its place in the verb
+// table, or 0 for a verb not in it
+{
+	static const ConfKeywords verbs(ppszVerbs, METRICS_VERBS);
+
+	return verbs.Find(pszVerb);
+}
+
+DWORD Metrics::GetBucket(ULONGLONG qwMicroseconds)
+// Values below twice the number of sub-buckets have a bucket each; above
+// that, each power of two is split into METRICS_SUB_BUCKETS equal parts.
+{
+	unsigned long ulExponent;
+
+	if (qwMicroseconds < 2 * METRICS_SUB_BUCKETS) return (DWORD)qwMicroseconds;
+	if (qwMicroseconds >> 32) {
+		_BitScanReverse(&ulExponent, (unsigned long)(qwMicroseconds >> 32));
+		ulExponent += 32;
+	} else {
+		_BitScanReverse(&ulExponent, (unsigned long)qwMicroseconds);
+	}
+	if (ulExponent > METRICS_MAX_EXPONENT) return METRICS_BUCKETS - 1;
+	return (ulExponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + (DWORD)((qwMicroseconds >> (ulExponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+ULONGLONG Metrics::GetBucketLimit(DWORD dwBucket)
+// Returns the smallest value above dwBucket
+{
+	DWORD dwShift;
+
+	if (dwBucket < 2 * METRICS_SUB_BUCKETS) return dwBucket + 1;
+	dwShift = dwBucket / METRICS_SUB_BUCKETS - 1;
+	return (ULONGLONG)(METRICS_SUB_BUCKETS + dwBucket % METRICS_SUB_BUCKETS + 1) << dwShift;
+}
+
+void Metrics::Record(HISTOGRAM *phist, ULONGLONG qwMicroseconds)
+{
+	InterlockedIncrement64(&phist->allBuckets[GetBucket(qwMicroseconds)]);
+	InterlockedIncrement64(&phist->llCount);
+	InterlockedExchangeAdd64(&phist->llSum, (LONGLONG)qwMicroseconds);
+}
+
+void Metrics::Add(HISTOGRAM *pdst, const HISTOGRAM *psrc)
+{
+	for (DWORD dw = 0; dw < METRICS_BUCKETS; dw++) pdst->allBuckets[dw] += psrc->allBuckets[dw];
+	pdst->llCount += psrc->llCount;
+	pdst->llSum += psrc->llSum;
+}
+
+void Metrics::Count(MetricsCounter counter)
+{
+	InterlockedIncrement64(&GetShard()->allCounters[(int)counter]);
+}
+
+void Metrics::RecordCommand(DWORD dwVerb, ULONGLONG qwStartTicks)
+// Records a command that began at qwStartTicks and has been answered
+{
+	Record(&GetShard()->commands[dwVerb], GetMicroseconds(qwStartTicks));
+}
+
+void Metrics::RecordTransfer(bool isUpload, ULONGLONG qwBytes, ULONGLONG qwMicroseconds, bool isComplete)
+{
+	SHARD *pshard = GetShard();
+
+	Record(&pshard->transfers[isUpload], qwMicroseconds);
+	InterlockedIncrement64(&pshard->allTransfers[isUpload][isComplete]);
+	InterlockedExchangeAdd64(&pshard->allBytes[isUpload], (LONGLONG)qwBytes);
+}
+
+void Metrics::Render(string &str)
+// Appends every metric in the Prometheus text format. The shards are summed
+// into a copy first, so sessions go on recording while this runs.
+{
+	SHARD *ptotal = new SHARD;
+	char szLabels[64];
+	DWORD dw, dwShard, dwDirection;
+
+	ZeroMemory((void *)ptotal, sizeof(SHARD));
+	for (dwShard = 0; dwShard < METRICS_SHARDS; dwShard++) {
+		for (dw = 0; dw < (DWORD)MetricsCounter::COUNT; dw++) ptotal->allCounters[dw] += _pshards[dwShard].allCounters[dw];
+		for (dw = 0; dw <= METRICS_VERBS; dw++) Add(&ptotal->commands[dw], &_pshards[dwShard].commands[dw]);
+		for (dwDirection = 0; dwDirection < 2; dwDirection++) {
+			Add(&ptotal->transfers[dwDirection], &_pshards[dwShard].transfers[dwDirection]);
+			ptotal->allTransfers[dwDirection][0] += _pshards[dwShard].allTransfers[dwDirection][0];
+			ptotal->allTransfers[dwDirection][1] += _pshards[dwShard].allTransfers[dwDirection][1];
+			ptotal->allBytes[dwDirection] += _pshards[dwShard].allBytes[dwDirection];
+		}
+	}
+
+	for (dw = 0; dw < (DWORD)MetricsCounter::COUNT; dw++) {
+		AppendHeader(str, ppszCounters[dw][0], "counter", ppszCounters[dw][1]);
+		AppendValue(str, ppszCounters[dw][0], NULL, ptotal->allCounters[dw]);
+	}
+
+	// Verbs no session has sent are left out rather than listed as empty
+	AppendHeader(str, "slimftpd_command_duration_seconds", "histogram", "Time from receiving an FTP command to finishing its reply, transfers included.");
+	for (dw = 0; dw <= METRICS_VERBS; dw++) {
+		if (!ptotal->commands[dw].llCount) continue;
+		sprintf_s(szLabels, "verb=\"%S\"", dw ? ppszVerbs[dw - 1] : L"other");
+		AppendHistogram(str, "slimftpd_command_duration_seconds", szLabels, &ptotal->commands[dw]);
+	}
+	AppendHeader(str, "slimftpd_command_duration_quantile_seconds", "gauge", "Quantiles of slimftpd_command_duration_seconds since startup, to within 12.5%.");
+	for (dw = 0; dw <= METRICS_VERBS; dw++) {
+		if (!ptotal->commands[dw].llCount) continue;
+		sprintf_s(szLabels, "verb=\"%S\"", dw ? ppszVerbs[dw - 1] : L"other");
+		AppendQuantiles(str, "slimftpd_command_duration_quantile_seconds", szLabels, &ptotal->commands[dw]);
+	}
+
+	AppendHeader(str, "slimftpd_transfer_duration_seconds", "histogram", "Time spent moving a file over the data connection.");
+	for (dwDirection = 0; dwDirection < 2; dwDirection++) {
+		sprintf_s(szLabels, "direction=\"%s\"", ppszDirections[dwDirection]);
+		AppendHistogram(str, "slimftpd_transfer_duration_seconds", szLabels, &ptotal->transfers[dwDirection]);
+	}
+	AppendHeader(str, "slimftpd_transfers_total", "counter", "Transfers that ended, by how they ended.");
+	for (dwDirection = 0; dwDirection < 2; dwDirection++) {
+		sprintf_s(szLabels, "direction=\"%s\",status=\"aborted\"", ppszDirections[dwDirection]);
+		AppendValue(str, "slimftpd_transfers_total", szLabels, ptotal->allTransfers[dwDirection][0]);
+		sprintf_s(szLabels, "direction=\"%s\",status=\"complete\"", ppszDirections[dwDirection]);
+		AppendValue(str, "slimftpd_transfers_total", szLabels, ptotal->allTransfers[dwDirection][1]);
+	}
+	AppendHeader(str, "slimftpd_transfer_bytes_total", "counter", "File data sent and received over data connections.");
+	for (dwDirection = 0; dwDirection < 2; dwDirection++) {
+		sprintf_s(szLabels, "direction=\"%s\"", ppszDirections[dwDirection]);
+		AppendValue(str, "slimftpd_transfer_bytes_total", szLabels, ptotal->allBytes[dwDirection]);
+	}
+
+	delete ptotal;
+}
+
+void Metrics::AppendHistogram(string &str, const char *pszName, const char *pszLabels, const HISTOGRAM *phist)
+// Writes a bucket for every power of two microseconds from 16us up. Each
+// is a boundary between fine buckets, so the counts are exact.
+{
+	char sz[256];
+	LONGLONG llCumulative = 0;
+	DWORD dwBucket = 0;
+	ULONGLONG qwLimit;
+
+	for (qwLimit = 2 * METRICS_SUB_BUCKETS; qwLimit <= ((ULONGLONG)1 << METRICS_MAX_EXPONENT); qwLimit <<= 1) {
+		for (; dwBucket < METRICS_BUCKETS && GetBucketLimit(dwBucket) <= qwLimit; dwBucket++) llCumulative += phist->allBuckets[dwBucket];
+		sprintf_s(sz, "%s_bucket{%s,le=\"%g\"} %I64d\n", pszName, pszLabels, qwLimit / 1e6, llCumulative);
+		str += sz;
+	}
+	sprintf_s(sz, "%s_bucket{%s,le=\"+Inf\"} %I64d\n%s_sum{%s} %.6f\n%s_count{%s} %I64d\n", pszName, pszLabels, phist->llCount, pszName, pszLabels, phist->llSum / 1e6, pszName, pszLabels, phist->llCount);
+	str += sz;
+}
+
+void Metrics::AppendQuantiles(string &str, const char *pszName, const char *pszLabels, const HISTOGRAM *phist)
+// Reports the top of the bucket each quantile falls in, as HDR histograms do
+{
+	static const double adQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	char sz[256];
+	LONGLONG llCumulative, llRank;
+	DWORD dwBucket;
+
+	for (size_t st = 0; st < ARRAYSIZE(adQuantiles); st++) {
+		llRank = (LONGLONG)(adQuantiles[st] * phist->llCount);
+		if (llRank < 1) llRank = 1;
+		llCumulative = 0;
+		for (dwBucket = 0; dwBucket < METRICS_BUCKETS - 1; dwBucket++) {
+			llCumulative += phist->allBuckets[dwBucket];
+			if (llCumulative >= llRank) break;
+		}
+		sprintf_s(sz, "%s{%s,quantile=\"%g\"} %.6f\n", pszName, pszLabels, adQuantiles[st], GetBucketLimit(dwBucket) / 1e6);
+		str += sz;
+	}
+}
+
+void Metrics::AppendHeader(string &str, const char *pszName, const char *pszType, const char *pszHelp)
+{
+	str += "# HELP ";
+	str += pszName;
+	str += ' ';
+	str += pszHelp;
+	str += "\n# TYPE ";
+	str += pszName;
+	str += ' ';
+	str += pszType;
+	str += '\n';
+}
+
+void Metrics::AppendValue(string &str, const char *pszName, const char *pszLabels, LONGLONG llValue)
+{
+	char sz[256];
+
+	if (pszLabels) sprintf_s(sz, "%s{%s} %I64d\n", pszName, pszLabels, llValue);
+	else sprintf_s(sz, "%s %I64d\n", pszName, llValue);
+	str += sz;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_METRICS_H
+#define _INCL_METRICS_H
+
+#include <windows.h>
+#include <string>
+
+using namespace std;
+
+#define METRICS_SHARDS 8
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_EXPONENT 36
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_VERBS 37
+
+enum class MetricsCounter {
+	CONNECTIONS_ACCEPTED = 0,
+	CONNECTIONS_REFUSED,
+	LOGINS,
+	LOGIN_FAILURES,
+	COMMAND_TIMEOUTS,
+	DATA_CONNECT_TIMEOUTS,
+	DATA_CONNECT_FAILURES,
+	COUNT
+};
+
+// Counts what the sessions do and how long their commands take. Each thread
+// records into one of several shards with interlocked adds, so sessions
+// never take a lock or contend on a single cache line; the shards are only
+// summed when the metrics are read. Latencies are kept in log-linear
+// buckets, eight to each power of two of microseconds, which holds any
+// latency to within 12.5% however long it is.
+class Metrics
+{
+private:
+	struct HISTOGRAM {
+		volatile LONGLONG allBuckets[METRICS_BUCKETS];
+		volatile LONGLONG llCount;
+		volatile LONGLONG llSum;
+	};
+	struct SHARD {
+		volatile LONGLONG allCounters[(int)MetricsCounter::COUNT];
+		HISTOGRAM commands[METRICS_VERBS + 1];
+		HISTOGRAM transfers[2];
+		volatile LONGLONG allTransfers[2][2];
+		volatile LONGLONG allBytes[2];
+	};
+
+	SHARD *_pshards;
+
+	SHARD * GetShard();
+	static DWORD GetBucket(ULONGLONG qwMicroseconds);
+	static ULONGLONG GetBucketLimit(DWORD dwBucket);
+	static void Record(HISTOGRAM *phist, ULONGLONG qwMicroseconds);
+	static void Add(HISTOGRAM *pdst, const HISTOGRAM *psrc);
+	static void AppendHistogram(string &str, const char *pszName, const char *pszLabels, const HISTOGRAM *phist);
+	static void AppendQuantiles(string &str, const char *pszName, const char *pszLabels, const HISTOGRAM *phist);
+
+public:
+	Metrics();
+	~Metrics();
+	static ULONGLONG GetTicks();
+	static ULONGLONG GetMicroseconds(ULONGLONG qwStartTicks);
+	static ULONGLONG TicksToMicroseconds(ULONGLONG qwTicks);
+	static ULONGLONG Lap(ULONGLONG *pqwTicks);
+	static DWORD FindVerb(const wchar_t *pszVerb);
+	void Count(MetricsCounter counter);
+	void RecordCommand(DWORD dwVerb, ULONGLONG qwStartTicks);
+	void RecordTransfer(bool isUpload, ULONGLONG qwBytes, ULONGLONG qwMicroseconds, bool isComplete);
+	void Render(string &str);
+	static void AppendHeader(string &str, const char *pszName, const char *pszType, const char *pszHelp);
+	static void AppendValue(string &str, const char *pszName, const char *pszLabels, LONGLONG llValue);
+};
+
+#endif
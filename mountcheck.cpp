@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mountcheck.h"
+#include <process.h>
+
+MountCheck::MountCheck(MOUNTCHECKPROC pfn, void *pContext)
+{
+	_mode = MountCheckMode::STRICT;
+	_dwTimeout = MOUNTCHECK_TIMEOUT_DEFAULT * 1000;
+	_pfn = pfn;
+	_pContext = pContext;
+	_lUnavailable = 0;
+	_hThread = NULL;
+	_hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	_llChecks = 0;
+	_llTimeouts = 0;
+	_llRecoveries = 0;
+	InitializeCriticalSection(&_cs);
+}
+
+MountCheck::~MountCheck()
+{
+	if (_hThread) {
+		SetEvent(_hStop);
+		WaitForSingleObject(_hThread, INFINITE);
+		CloseHandle(_hThread);
+	}
+	if (_hStop) CloseHandle(_hStop);
+	DeleteCriticalSection(&_cs);
+}
+
+void MountCheck::SetMode(MountCheckMode mode, DWORD dwTimeout)
+// Sets how the next Validate treats a folder it cannot find, and how many
+// seconds it waits for each folder.
+{
+	_mode = mode;
+	_dwTimeout = dwTimeout * 1000;
+}
+
+DWORD MountCheck::Validate(const vector<MOUNT> &mounts, bool isRecheck, vector<FAILURE> &failures)
+// Checks the folders in mounts and returns how many were checked. A folder
+// already known is checked again only if isRecheck is set, as it is when
+// the whole config is read. Those that could not be found are added to
+// failures, with the first line that mounts them. In lazy mode they are
+// also marked unavailable until a background check finds them.
+//
+// Several configs may be read at once, so each call checks its own copy of
+// its folders and only then updates what is known about them.
+{
+	map<wstring, DWORD, NOCASE_LESS> lines;
+	map<wstring, DWORD, NOCASE_LESS>::const_iterator itLine;
+	map<wstring, target_ptr, NOCASE_LESS>::iterator it;
+	vector<target_ptr> targets, found;
+	target_ptr ptarget;
+	FAILURE failure;
+	size_t st;
+
+	for (st = 0; st < mounts.size(); st++) lines.insert(std::make_pair(mounts[st].strLocal, mounts[st].dwLine));
+
+	EnterCriticalSection(&_cs);
+	for (itLine = lines.begin(); itLine != lines.end(); ++itLine) {
+		if (!isRecheck && (_targets.find(itLine->first) != _targets.end())) continue;
+		ptarget = make_shared<TARGET>();
+		ptarget->strLocal = itLine->first;
+		ptarget->dwLine = itLine->second;
+		ptarget->lState = TARGET_PENDING;
+		ptarget->dwStarted = 0;
+		ptarget->isUnavailable = false;
+		targets.push_back(ptarget);
+	}
+	LeaveCriticalSection(&_cs);
+	if (targets.empty()) return 0;
+
+	if (_mode == MountCheckMode::OFF) {
+		for (st = 0; st < targets.size(); st++) targets[st]->lState = TARGET_FOUND;
+	} else {
+		Run(targets);
+	}
+
+	EnterCriticalSection(&_cs);
+	for (st = 0; st < targets.size(); st++) {
+		it = _targets.find(targets[st]->strLocal);
+		if (targets[st]->lState == TARGET_FOUND) {
+			if (it == _targets.end()) {
+				_targets[targets[st]->strLocal] = targets[st];
+				found.push_back(targets[st]);
+			} else if (it->second->isUnavailable) {
+				it->second->isUnavailable = false;
+				InterlockedDecrement(&_lUnavailable);
+				_llRecoveries++;
+				found.push_back(targets[st]);
+			}
+			continue;
+		}
+		failure.strLocal = targets[st]->strLocal;
+		failure.dwLine = targets[st]->dwLine;
+		failure.isTimedOut = targets[st]->lState == TARGET_TIMED_OUT;
+		failures.push_back(failure);
+		if (_mode != MountCheckMode::LAZY) continue;
+		if (it == _targets.end()) {
+			targets[st]->isUnavailable = true;
+			_targets[targets[st]->strLocal] = targets[st];
+			InterlockedIncrement(&_lUnavailable);
+		} else if (!it->second->isUnavailable) {
+			it->second->isUnavailable = true;
+			InterlockedIncrement(&_lUnavailable);
+		}
+	}
+	if (_lUnavailable && !_hThread) _hThread = (HANDLE)_beginthreadex(NULL, 0, RecheckThread, this, 0, NULL);
+	LeaveCriticalSection(&_cs);
+
+	for (st = 0; st < found.size(); st++) _pfn(_pContext, found[st]->strLocal.c_str());
+	return (_mode == MountCheckMode::OFF) ? 0 : (DWORD)targets.size();
+}
+
+bool MountCheck::IsAvailable(const wchar_t *pszLocal)
+// Returns false for a folder that lazy checking has marked unavailable.
+// Costs nothing beyond a read while every folder is available.
+{
+	map<wstring, target_ptr, NOCASE_LESS>::const_iterator it;
+	bool isAvailable = true;
+
+	if (!_lUnavailable) return true;
+	EnterCriticalSection(&_cs);
+	it = _targets.find(pszLocal);
+	if (it != _targets.end()) isAvailable = !it->second->isUnavailable;
+	LeaveCriticalSection(&_cs);
+	return isAvailable;
+}
+
+void MountCheck::GetStats(LONGLONG *pllChecks, LONGLONG *pllTimeouts, LONGLONG *pllRecoveries, DWORD *pdwUnavailable)
+{
+	EnterCriticalSection(&_cs);
+	*pllChecks = _llChecks;
+	*pllTimeouts = _llTimeouts;
+	*pllRecoveries = _llRecoveries;
+	*pdwUnavailable = (DWORD)_lUnavailable;
+	LeaveCriticalSection(&_cs);
+}
+
+void MountCheck::Run(const vector<target_ptr> &targets)
+// Checks targets on up to MOUNTCHECK_THREADS threads and returns when each
+// has been found, found missing or timed out.
+{
+	BATCH *pbatch = new BATCH;
+	DWORD dw, dwThreads, dwStarted, dwElapsed, dwWait;
+	LONGLONG llTimeouts = 0;
+	bool isDone;
+	size_t st;
+
+	for (st = 0; st < targets.size(); st++) {
+		targets[st]->lState = TARGET_PENDING;
+		targets[st]->dwStarted = 0;
+	}
+	pbatch->targets = targets;
+	pbatch->lNext = 0;
+	pbatch->lRefs = 1;
+	pbatch->hProgress = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	dwThreads = (DWORD)min(targets.size(), (size_t)MOUNTCHECK_THREADS);
+	for (dw = 0; dw < dwThreads; dw++) {
+		if (!StartThread(pbatch)) break;
+	}
+	if (!dw) {
+		// No thread could be started, so check them here, without a timeout
+		InterlockedIncrement(&pbatch->lRefs);
+		CheckThread(pbatch);
+	}
+
+	for (;;) {
+		dwWait = _dwTimeout;
+		isDone = true;
+		for (st = 0; st < targets.size(); st++) {
+			if (targets[st]->lState != TARGET_PENDING) continue;
+			isDone = false;
+			dwStarted = targets[st]->dwStarted;
+			if (!dwStarted) continue;
+			// Read after dwStarted, which the low bit set may put a tick ahead
+			dwElapsed = GetTickCount() - dwStarted;
+			if ((LONG)dwElapsed < 0) dwElapsed = 0;
+			if (dwElapsed < _dwTimeout) {
+				dwWait = min(dwWait, _dwTimeout - dwElapsed);
+			} else if (InterlockedCompareExchange(&targets[st]->lState, TARGET_TIMED_OUT, TARGET_PENDING) == TARGET_PENDING) {
+				// Its thread is stuck; start another for the targets left
+				llTimeouts++;
+				StartThread(pbatch);
+			}
+		}
+		if (isDone) break;
+		WaitForSingleObject(pbatch->hProgress, dwWait);
+	}
+	Release(pbatch);
+
+	EnterCriticalSection(&_cs);
+	_llChecks += targets.size();
+	_llTimeouts += llTimeouts;
+	LeaveCriticalSection(&_cs);
+}
+
+bool MountCheck::StartThread(BATCH *pbatch)
+{
+	HANDLE hThread;
+
+	InterlockedIncrement(&pbatch->lRefs);
+	hThread = (HANDLE)_beginthreadex(NULL, 0, CheckThread, pbatch, 0, NULL);
+	if (!hThread) {
+		Release(pbatch);
+		return false;
+	}
+	CloseHandle(hThread);
+	return true;
+}
+
+void MountCheck::Release(BATCH *pbatch)
+{
+	if (!InterlockedDecrement(&pbatch->lRefs)) {
+		CloseHandle(pbatch->hProgress);
+		delete pbatch;
+	}
+}
+
+unsigned __stdcall MountCheck::CheckThread(void *pParam)
+// Takes targets from the batch until none are left. A result that comes
+// in after its target timed out is dropped.
+{
+	BATCH *pbatch = (BATCH *)pParam;
+	TARGET *ptarget;
+	LONG l;
+
+	while ((l = InterlockedIncrement(&pbatch->lNext) - 1) < (LONG)pbatch->targets.size()) {
+		ptarget = pbatch->targets[l].get();
+		ptarget->dwStarted = GetTickCount() | 1;
+		l = (GetFileAttributes(ptarget->strLocal.c_str()) != INVALID_FILE_ATTRIBUTES) ? TARGET_FOUND : TARGET_MISSING;
+		InterlockedCompareExchange(&ptarget->lState, l, TARGET_PENDING);
+		SetEvent(pbatch->hProgress);
+	}
+	Release(pbatch);
+	return 0;
+}
+
+unsigned __stdcall MountCheck::RecheckThread(void *pParam)
+// Checks the unavailable folders again every MOUNTCHECK_RECHECK_INTERVAL
+// milliseconds, and makes available those that are found.
+{
+	MountCheck *pThis = (MountCheck *)pParam;
+	map<wstring, target_ptr, NOCASE_LESS>::iterator it;
+	vector<target_ptr> targets, found;
+	size_t st;
+
+	while (WaitForSingleObject(pThis->_hStop, MOUNTCHECK_RECHECK_INTERVAL) == WAIT_TIMEOUT) {
+		targets.clear();
+		found.clear();
+		EnterCriticalSection(&pThis->_cs);
+		for (it = pThis->_targets.begin(); it != pThis->_targets.end(); ++it) {
+			if (it->second->isUnavailable) targets.push_back(it->second);
+		}
+		LeaveCriticalSection(&pThis->_cs);
+		if (targets.empty()) continue;
+
+		pThis->Run(targets);
+
+		EnterCriticalSection(&pThis->_cs);
+		for (st = 0; st < targets.size(); st++) {
+			// A config read meanwhile may have found it already
+			if ((targets[st]->lState != TARGET_FOUND) || !targets[st]->isUnavailable) continue;
+			targets[st]->isUnavailable = false;
+			InterlockedDecrement(&pThis->_lUnavailable);
+			pThis->_llRecoveries++;
+			found.push_back(targets[st]);
+		}
+		LeaveCriticalSection(&pThis->_cs);
+		for (st = 0; st < found.size(); st++) pThis->_pfn(pThis->_pContext, found[st]->strLocal.c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_MOUNTCHECK_H
+#define _INCL_MOUNTCHECK_H
+
+#include <windows.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define MOUNTCHECK_THREADS 16
+#define MOUNTCHECK_TIMEOUT_DEFAULT 10
+#define MOUNTCHECK_RECHECK_INTERVAL 30000
+
+// Strict fails the config if a mounted folder cannot be found; lazy marks
+// the folder unavailable and keeps checking it in the background.
+enum class MountCheckMode { OFF, STRICT, LAZY };
+
+// Called with a mounted folder once it has been found, and again each time
+// it comes back after being unavailable.
+typedef void (*MOUNTCHECKPROC)(void *pContext, const wchar_t *pszLocal);
+
+// Checks the local folders that mounts point at. Each reading of the config,
+// and each user loaded from the store, collects the folders it mounts and
+// has them checked together; a folder is checked once however many users
+// mount it, and the checks run several at a time so that one slow share
+// does not hold up the rest. A check that takes longer than the timeout
+// counts as failed; its thread cannot be interrupted, so it is left to
+// finish on its own and another takes its place.
+class MountCheck
+{
+public:
+	// A folder mounted by the config being read, and the line that mounts
+	// it, or 0 if it came from a compiled config
+	struct MOUNT {
+		wstring strLocal;
+		DWORD dwLine;
+	};
+	struct FAILURE {
+		wstring strLocal;
+		DWORD dwLine;
+		bool isTimedOut;
+	};
+
+private:
+	enum { TARGET_PENDING, TARGET_FOUND, TARGET_MISSING, TARGET_TIMED_OUT };
+	struct TARGET {
+		wstring strLocal;
+		DWORD dwLine;
+		volatile LONG lState;
+		volatile DWORD dwStarted;
+		bool isUnavailable;
+	};
+	typedef shared_ptr<TARGET> target_ptr;
+	// Shared by the threads of one round of checks, and freed by whichever
+	// lets go of it last, since a timed out thread may outlive the round
+	struct BATCH {
+		vector<target_ptr> targets;
+		volatile LONG lNext;
+		volatile LONG lRefs;
+		HANDLE hProgress;
+	};
+	struct NOCASE_LESS {
+		bool operator()(const wstring &str1, const wstring &str2) const { return _wcsicmp(str1.c_str(), str2.c_str()) < 0; }
+	};
+
+	map<wstring, target_ptr, NOCASE_LESS> _targets;
+	MountCheckMode _mode;
+	DWORD _dwTimeout;
+	MOUNTCHECKPROC _pfn;
+	void *_pContext;
+	volatile LONG _lUnavailable;
+	HANDLE _hThread;
+	HANDLE _hStop;
+	CRITICAL_SECTION _cs;
+	LONGLONG _llChecks, _llTimeouts, _llRecoveries;
+
+	void Run(const vector<target_ptr> &targets);
+	static bool StartThread(BATCH *pbatch);
+	static void Release(BATCH *pbatch);
+	static unsigned __stdcall CheckThread(void *pParam);
+	static unsigned __stdcall RecheckThread(void *pParam);
+
+public:
+	MountCheck(MOUNTCHECKPROC pfn, void *pContext);
+	~MountCheck();
+	void SetMode(MountCheckMode mode, DWORD dwTimeout);
+	DWORD Validate(const vector<MOUNT> &mounts, bool isRecheck, vector<FAILURE> &failures);
+	bool IsAvailable(const wchar_t *pszLocal);
+	void GetStats(LONGLONG *pllChecks, LONGLONG *pllTimeouts, LONGLONG *pllRecoveries, DWORD *pdwUnavailable);
+};
+
+#endif
@@ -38,19 +38,94 @@ PermDB::PermDB()
 	_root._data.dwPerms[PERM_ADMIN] = 0;
 }
 
+PermDB::PermDB(const shared_ptr<PermDB> &pbase) : _pbase(pbase)
+// Makes an empty tree for a user's own permissions, laid over a group's.
+// Its root sets nothing, so the group's root permissions hold.
+{
+	_root._data.dwPerms[PERM_READ] = -1;
+	_root._data.dwPerms[PERM_WRITE] = -1;
+	_root._data.dwPerms[PERM_LIST] = -1;
+	_root._data.dwPerms[PERM_ADMIN] = -1;
+}
+
+const PermDB * PermDB::GetBase() const
+{
+	return _pbase.get();
+}
+
+size_t PermDB::GetMemoryUsage() const
+// Returns roughly how many bytes the permission tree and its index take,
+// not counting a group tree it is laid over.
+{
+	return sizeof(PermDB) + GetTreeMemoryUsage(&_root) - sizeof(_root) + _index.memory() + _frozen.memory();
+}
+
+void PermDB::Freeze()
+// Builds the frozen form that lookups use and frees the pointer tree. Must
+// be called once the permissions are all set; does nothing if nothing has
+// changed since the last call.
+{
+	if (!_frozen.empty()) return;
+	_frozen.build(&_root, [](const FTPPERM &perm, FROZENPERM &fp, frozen_type::pool &) {
+		memcpy(fp.dwPerms, perm.dwPerms, sizeof(fp.dwPerms));
+	});
+	while (_root._pdown) delete _root._pdown;
+	_index.clear();
+}
+
+size_t PermDB::GetImageSize() const
+// Returns the bytes SaveImage writes. The tree must be frozen.
+{
+	return _frozen.image_size();
+}
+
+void PermDB::SaveImage(BYTE *pb) const
+// Writes the frozen tree for a compiled config.
+{
+	_frozen.save(pb);
+}
+
+bool PermDB::AttachImage(const BYTE *pb, size_t stBytes)
+// Uses a frozen tree saved by SaveImage in place.
+{
+	if (!_frozen.attach(pb, stBytes)) return false;
+	while (_root._pdown) delete _root._pdown;
+	_index.clear();
+	return true;
+}
+
+void PermDB::Thaw()
+// Turns a frozen tree back into pointers so that permissions can be set.
+{
+	if (_frozen.empty()) return;
+	_frozen.thaw(&_root, _index, [](const FROZENPERM &fp, FTPPERM &perm, const frozen_type &) {
+		memcpy(perm.dwPerms, fp.dwPerms, sizeof(perm.dwPerms));
+	});
+	_frozen.clear();
+}
+
+size_t PermDB::GetTreeMemoryUsage(const tree<FTPPERM> *ptree)
+{
+	size_t st;
+
+	st = sizeof(*ptree) + (ptree->_data.strVirtual.capacity() + 1) * sizeof(wchar_t);
+	for (ptree = ptree->_pdown; ptree; ptree = ptree->_pright) st += GetTreeMemoryUsage(ptree);
+	return st;
+}
+
 void PermDB::SetPerm(const wchar_t *pszVirtual, DWORD dwPermId, DWORD dwStatus)
 {
 	tree<FTPPERM> *ptree, *pparent;
 	wchar_t sz[512], *psz, *pszCut;
 
+	Thaw();
 	ptree = &_root;
 	wcscpy_s(sz, pszVirtual + 1);
 	psz = sz;
 	while (*psz) {
 		if (pszCut = wcschr(psz, L'/')) *pszCut = 0;
 		pparent = ptree;
-		ptree = ptree->_pdown;
-		while (ptree && _wcsicmp(ptree->_data.strVirtual.c_str(), psz)) ptree = ptree->_pright;
+		ptree = _index.find(pparent, psz, wcslen(psz));
 		if (!ptree) {
 			ptree=new tree<FTPPERM>(pparent);
 			ptree->_data.strVirtual = psz;
@@ -58,6 +133,7 @@ void PermDB::SetPerm(const wchar_t *pszVirtual, DWORD dwPermId, DWORD dwStatus)
 			ptree->_data.dwPerms[PERM_WRITE] = -1;
 			ptree->_data.dwPerms[PERM_LIST] = -1;
 			ptree->_data.dwPerms[PERM_ADMIN] = -1;
+			_index.insert(ptree);
 		}
 		if (!pszCut) break;
 		psz = pszCut + 1;
@@ -66,32 +142,111 @@ void PermDB::SetPerm(const wchar_t *pszVirtual, DWORD dwPermId, DWORD dwStatus)
 	ptree->_data.dwPerms[dwPermId] = dwStatus;
 }
 
+const PermDB::frozen_type::NODE * PermDB::Walk(const wchar_t *pszVirtual, size_t stLen, DWORD *pdwPerms, const frozen_type::NODE **ppbaseNode) const
+// Fills pdwPerms with the permissions in force at the first stLen characters
+// of pszVirtual. Each folder on the way takes a permission from this tree
+// if it sets one there, and from the group tree under it otherwise.
+// Returns the folder's own node, or NULL if it has none, and sets
+// *ppbaseNode to the group tree's.
+{
+	const frozen_type::NODE *pnode, *pbaseNode;
+	const wchar_t *psz, *pszEnd;
+	size_t st;
+	DWORD dw;
+
+	pnode = _frozen.root();
+	pbaseNode = _pbase ? _pbase->_frozen.root() : NULL;
+	for (dw = 0; dw < 4; dw++) pdwPerms[dw] = 0;
+	Apply(pbaseNode, pdwPerms);
+	Apply(pnode, pdwPerms);
+	for (psz = pszVirtual, pszEnd = pszVirtual + stLen; (psz < pszEnd) && (pnode || pbaseNode); psz += st) {
+		psz++;
+		for (st = 0; (psz + st < pszEnd) && (psz[st] != L'/'); st++);
+		if (pnode) pnode = _frozen.find(pnode, psz, st);
+		if (pbaseNode) pbaseNode = _pbase->_frozen.find(pbaseNode, psz, st);
+		Apply(pbaseNode, pdwPerms);
+		Apply(pnode, pdwPerms);
+	}
+	*ppbaseNode = pbaseNode;
+	return pnode;
+}
+
+void PermDB::Apply(const frozen_type::NODE *pnode, DWORD dwPermId, DWORD *pdwPerm)
+// Takes a permission from a node that sets it
+{
+	if (pnode && (pnode->data.dwPerms[dwPermId] != -1)) *pdwPerm = pnode->data.dwPerms[dwPermId];
+}
+
+void PermDB::Apply(const frozen_type::NODE *pnode, DWORD *pdwPerms)
+{
+	for (DWORD dw = 0; dw < 4; dw++) Apply(pnode, dw, &pdwPerms[dw]);
+}
+
+void PermDB::GetPerms(const wchar_t *pszVirtual, DWORD *pdwPerms)
+// Fills pdwPerms, indexed by PERM_*, with what GetPerm would return for each.
+{
+	const frozen_type::NODE *pbaseNode;
+
+	// The root's name is empty, so the path must begin with a slash
+	if (*pszVirtual && (*pszVirtual != L'/')) {
+		pdwPerms[PERM_READ] = pdwPerms[PERM_WRITE] = pdwPerms[PERM_LIST] = pdwPerms[PERM_ADMIN] = -1;
+		return;
+	}
+	Walk(pszVirtual, wcslen(pszVirtual), pdwPerms, &pbaseNode);
+}
+
 DWORD PermDB::GetPerm(const wchar_t *pszVirtual, DWORD dwPermId)
+// Returns the permission set on the deepest folder along pszVirtual that
+// has one, or -1 if none does.
 {
-	return GetPermFunc(pszVirtual, dwPermId, &_root);
+	DWORD dwPerms[4];
+
+	GetPerms(pszVirtual, dwPerms);
+	return dwPerms[dwPermId];
 }
 
-DWORD PermDB::GetPermFunc(const wchar_t *pszVirtual, DWORD dwPermId, tree<FTPPERM> *ptree)
+void PermDB::SESSIONCACHE::Reset()
 {
-	const wchar_t *psz;
-	DWORD dw;
-	UINT_PTR dwLen;
-
-	psz = wcschr(pszVirtual, L'/');
-	if (psz) dwLen = psz - pszVirtual;
-	else dwLen = wcslen(pszVirtual);
-	while (ptree) {
-		if ((ptree->_data.strVirtual.length() == dwLen) && (!dwLen || !_wcsnicmp(pszVirtual, ptree->_data.strVirtual.c_str(), dwLen))) {
-			if (psz) {
-				dw = GetPermFunc(psz + 1, dwPermId, ptree->_pdown);
-				if (dw != -1) return dw;
-				else return ptree->_data.dwPerms[dwPermId];
-			} else {
-				return ptree->_data.dwPerms[dwPermId];
-			}
-		} else {
-			ptree = ptree->_pright;
+	for (DWORD dw = 0; dw < PERMDB_SESSION_ENTRIES; dw++) entries[dw].isValid = false;
+	pperms = NULL;
+	dwNext = 0;
+}
+
+DWORD PermDB::GetPerm(const wchar_t *pszVirtual, DWORD dwPermId, SESSIONCACHE *pcache)
+// As GetPerm, but looks up the path's parent folder in pcache first.
+{
+	const wchar_t *pszLeaf;
+	SESSIONCACHE::ENTRY *pentry = NULL;
+	size_t stParent;
+	DWORD dw, dwPerm;
+
+	if (*pszVirtual != L'/') return GetPerm(pszVirtual, dwPermId);
+
+	if (pcache->pperms != this) {
+		pcache->Reset();
+		pcache->pperms = this;
+	}
+
+	pszLeaf = wcsrchr(pszVirtual, L'/') + 1;
+	stParent = pszLeaf - 1 - pszVirtual;
+	for (dw = 0; dw < PERMDB_SESSION_ENTRIES; dw++) {
+		if (pcache->entries[dw].isValid && (pcache->entries[dw].strParent.length() == stParent) &&
+			!wmemcmp(pcache->entries[dw].strParent.c_str(), pszVirtual, stParent)) {
+			pentry = &pcache->entries[dw];
+			break;
 		}
 	}
-	return -1;
+	if (!pentry) {
+		pentry = &pcache->entries[pcache->dwNext];
+		pcache->dwNext = (pcache->dwNext + 1) % PERMDB_SESSION_ENTRIES;
+		pentry->strParent.assign(pszVirtual, stParent);
+		pentry->pparent = Walk(pszVirtual, stParent, pentry->dwPerms, &pentry->pbaseParent);
+		pentry->isValid = true;
+	}
+
+	// Only the file itself is left to look at
+	dwPerm = pentry->dwPerms[dwPermId];
+	if (pentry->pbaseParent) Apply(_pbase->_frozen.find(pentry->pbaseParent, pszLeaf, wcslen(pszLeaf)), dwPermId, &dwPerm);
+	if (pentry->pparent) Apply(_frozen.find(pentry->pparent, pszLeaf, wcslen(pszLeaf)), dwPermId, &dwPerm);
+	return dwPerm;
 }
@@ -31,8 +31,11 @@
 #define _INCL_PERMDB_H
 
 #include <windows.h>
+#include <memory>
 #include <string>
+#include "frozentree.h"
 #include "tree.h"
+#include "treeindex.h"
 
 using namespace std;
 
@@ -41,6 +44,8 @@ using namespace std;
 #define PERM_LIST 2
 #define PERM_ADMIN 3
 
+#define PERMDB_SESSION_ENTRIES 4
+
 class PermDB
 {
 private:
@@ -48,15 +53,64 @@ private:
 		wstring strVirtual;
 		DWORD dwPerms[4];
 	};
+	struct FROZENPERM {
+		DWORD dwPerms[4];
+	};
+	typedef frozentree<FROZENPERM> frozen_type;
 
+	// Permissions are set in the pointer tree while the config is read, and
+	// looked up only in the frozen form built from it afterwards
 	tree<FTPPERM> _root;
+	treeindex<FTPPERM> _index;
+	frozen_type _frozen;
+	// A user's own permissions are laid over the group's tree, which is
+	// shared and never changed; a permission here wins over the group's
+	// for the same folder
+	shared_ptr<PermDB> _pbase;
 
-	static DWORD GetPermFunc(const wchar_t *pszVirtual, DWORD dwPermId, tree<FTPPERM> *ptree);
+	const frozen_type::NODE * Walk(const wchar_t *pszVirtual, size_t stLen, DWORD *pdwPerms, const frozen_type::NODE **ppbaseNode) const;
+	static void Apply(const frozen_type::NODE *pnode, DWORD dwPermId, DWORD *pdwPerm);
+	static void Apply(const frozen_type::NODE *pnode, DWORD *pdwPerms);
+	void Thaw();
+	static size_t GetTreeMemoryUsage(const tree<FTPPERM> *ptree);
+	PermDB(const PermDB &);
+	PermDB & operator=(const PermDB &);
 
 public:
+	// Remembers what a session found for the last few folders it used, so
+	// that commands on files in the same folder skip the walk from the root.
+	// It holds on to one tree, which is frozen and so never changes while a
+	// session uses it; asking another tree empties it. A session resets it
+	// whenever it logs in, since a new tree may take the address of one
+	// that has since been freed.
+	struct SESSIONCACHE {
+		struct ENTRY {
+			wstring strParent;
+			DWORD dwPerms[4];
+			const frozen_type::NODE *pparent;
+			const frozen_type::NODE *pbaseParent;
+			bool isValid;
+			ENTRY() : pparent(NULL), pbaseParent(NULL), isValid(false) {}
+		};
+		const PermDB *pperms;
+		DWORD dwNext;
+		ENTRY entries[PERMDB_SESSION_ENTRIES];
+		SESSIONCACHE() : pperms(NULL), dwNext(0) {}
+		void Reset();
+	};
+
 	PermDB();
+	explicit PermDB(const shared_ptr<PermDB> &pbase);
+	const PermDB * GetBase() const;
+	size_t GetMemoryUsage() const;
+	void Freeze();
+	size_t GetImageSize() const;
+	void SaveImage(BYTE *pb) const;
+	bool AttachImage(const BYTE *pb, size_t stBytes);
 	void SetPerm(const wchar_t *pszVirtual, DWORD dwPermId, DWORD dwStatus);
 	DWORD GetPerm(const wchar_t *pszVirtual, DWORD dwPermId);
+	DWORD GetPerm(const wchar_t *pszVirtual, DWORD dwPermId, SESSIONCACHE *pcache);
+	void GetPerms(const wchar_t *pszVirtual, DWORD *pdwPerms);
 };
 
 #endif
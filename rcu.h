@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_RCU_H
+#define _INCL_RCU_H
+
+#include <windows.h>
+#include <vector>
+
+using namespace std;
+
+// Holds the current version of some read-mostly state, such as the user
+// database. A writer builds a new version off to the side and publishes it
+// with one pointer swap; readers pick up whichever version is current
+// without taking a lock and keep using it for as long as they like.
+//
+// Each reader has a slot naming the version it holds. A version replaced by
+// publish is retired, and freed once no slot names it. Slots are only
+// scanned under the lock, when a version is published or a reader leaves;
+// the versions found free are deleted after the lock is released, since
+// freeing one can take a while.
+
+template <class T>
+class rcu
+{
+public:
+	struct READER {
+		T * volatile pheld;
+		READER() : pheld(NULL) {}
+	};
+
+private:
+	T * volatile _pcurrent;
+	vector<READER *> _readers;
+	vector<T *> _retired;
+	CRITICAL_SECTION _cs;
+
+	void reclaim(vector<T *> &freed)
+	// Moves the retired versions no reader holds to freed, for the caller
+	// to delete once it has left _cs. Called with _cs held.
+	{
+		size_t i, j;
+
+		for (i = 0; i < _retired.size();) {
+			for (j = 0; j < _readers.size(); j++) {
+				if (_readers[j]->pheld == _retired[i]) break;
+			}
+			if (j < _readers.size()) {
+				i++;
+			}
+			else {
+				freed.push_back(_retired[i]);
+				_retired[i] = _retired.back();
+				_retired.pop_back();
+			}
+		}
+	}
+
+	static void destroy(vector<T *> &freed)
+	{
+		for (size_t i = 0; i < freed.size(); i++) delete freed[i];
+	}
+
+	rcu(const rcu &);
+	rcu & operator=(const rcu &);
+
+public:
+	rcu(T *pinitial) : _pcurrent(pinitial) { InitializeCriticalSection(&_cs); }
+	~rcu()
+	{
+		for (size_t i = 0; i < _retired.size(); i++) delete _retired[i];
+		delete _pcurrent;
+		DeleteCriticalSection(&_cs);
+	}
+
+	void enter(READER *pr)
+	// Registers a reader. It holds nothing until it calls acquire.
+	{
+		pr->pheld = NULL;
+		EnterCriticalSection(&_cs);
+		_readers.push_back(pr);
+		LeaveCriticalSection(&_cs);
+	}
+
+	void leave(READER *pr)
+	// Unregisters a reader, freeing the version it held if it was the last
+	// to hold a retired one.
+	{
+		vector<T *> freed;
+
+		EnterCriticalSection(&_cs);
+		for (size_t i = 0; i < _readers.size(); i++) {
+			if (_readers[i] == pr) {
+				_readers[i] = _readers.back();
+				_readers.pop_back();
+				break;
+			}
+		}
+		pr->pheld = NULL;
+		reclaim(freed);
+		LeaveCriticalSection(&_cs);
+		destroy(freed);
+	}
+
+	T * acquire(READER *pr)
+	// Returns the current version and holds it in the reader's slot until
+	// the next acquire, release or leave. The version is read again after
+	// the slot is written, so a publish that raced with us either sees the
+	// slot or has already been seen here.
+	{
+		T *p;
+
+		do {
+			p = _pcurrent;
+			InterlockedExchangePointer((PVOID volatile *)&pr->pheld, p);
+		} while (p != _pcurrent);
+		return p;
+	}
+
+	void release(READER *pr)
+	// Stops holding a version. It is freed by the next publish or leave.
+	{
+		pr->pheld = NULL;
+	}
+
+	T * current() const { return _pcurrent; }
+
+	void publish(T *p)
+	// Makes p the current version and retires the one it replaces. Readers
+	// holding the old version go on using it.
+	{
+		vector<T *> freed;
+
+		EnterCriticalSection(&_cs);
+		_retired.push_back((T *)InterlockedExchangePointer((PVOID volatile *)&_pcurrent, p));
+		reclaim(freed);
+		LeaveCriticalSection(&_cs);
+		destroy(freed);
+	}
+
+	size_t retired()
+	// Returns how many replaced versions are still held by a reader.
+	{
+		size_t st;
+
+		EnterCriticalSection(&_cs);
+		st = _retired.size();
+		LeaveCriticalSection(&_cs);
+		return st;
+	}
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "statcache.h"
+
+// Attributes, size and write time of local paths, shared by every session.
+// Paths that do not exist are cached too, as INVALID_FILE_ATTRIBUTES. The
+// map is split into shards by hash so that sessions looking up different
+// paths rarely wait on the same lock. Entries expire after a fixed time in
+// case a change notification is missed (network shares), and are dropped
+// at once when FSWatcher or the server itself reports a change.
+
+StatCache::StatCache(DWORD dwTTLSeconds)
+{
+	_qwTTL = (ULONGLONG)dwTTLSeconds * 1000;
+	_llHits = 0;
+	_llMisses = 0;
+	for (int i = 0; i < STATCACHE_SHARDS; i++) {
+		InitializeCriticalSection(&_shards[i].cs);
+		_shards[i].qwGeneration = 0;
+	}
+}
+
+StatCache::~StatCache()
+{
+	for (int i = 0; i < STATCACHE_SHARDS; i++) DeleteCriticalSection(&_shards[i].cs);
+}
+
+void StatCache::MakeKey(const wchar_t *pszLocal, wstring &strKey)
+{
+	strKey = pszLocal;
+	while ((strKey.length() > 3) && (*strKey.rbegin() == L'\\')) strKey.erase(strKey.length() - 1);
+	if (strKey.length()) CharUpperBuff(&strKey[0], (DWORD)strKey.length());
+}
+
+StatCache::SHARD * StatCache::GetShard(const wstring &strKey)
+{
+	return &_shards[hash<wstring>()(strKey) % STATCACHE_SHARDS];
+}
+
+bool StatCache::Stat(const wchar_t *pszLocal, STATINFO *psi)
+// Fills psi with what is known about pszLocal. Returns true if it exists.
+{
+	wstring strKey;
+	SHARD *pshard;
+	unordered_map<wstring, ENTRY>::iterator it;
+	WIN32_FILE_ATTRIBUTE_DATA wfad;
+	ULONGLONG qwNow, qwGeneration;
+	ENTRY entry;
+
+	MakeKey(pszLocal, strKey);
+	pshard = GetShard(strKey);
+	qwNow = GetTickCount64();
+
+	EnterCriticalSection(&pshard->cs);
+	it = pshard->entries.find(strKey);
+	if ((it != pshard->entries.end()) && (it->second.qwExpires > qwNow)) {
+		*psi = it->second.si;
+		LeaveCriticalSection(&pshard->cs);
+		InterlockedIncrement64(&_llHits);
+		return (psi->dwAttributes != INVALID_FILE_ATTRIBUTES);
+	}
+	qwGeneration = pshard->qwGeneration;
+	LeaveCriticalSection(&pshard->cs);
+	InterlockedIncrement64(&_llMisses);
+
+	if (GetFileAttributesEx(pszLocal, GetFileExInfoStandard, &wfad)) {
+		entry.si.dwAttributes = wfad.dwFileAttributes;
+		entry.si.uliSize.LowPart = wfad.nFileSizeLow;
+		entry.si.uliSize.HighPart = wfad.nFileSizeHigh;
+		entry.si.ftLastWrite = wfad.ftLastWriteTime;
+	} else {
+		ZeroMemory(&entry.si, sizeof(STATINFO));
+		entry.si.dwAttributes = INVALID_FILE_ATTRIBUTES;
+	}
+	entry.qwExpires = qwNow + _qwTTL;
+	*psi = entry.si;
+
+	// Skip storing it if the path may have changed while it was being read
+	EnterCriticalSection(&pshard->cs);
+	if (qwGeneration == pshard->qwGeneration) {
+		if (pshard->entries.size() >= STATCACHE_SHARD_ENTRIES) {
+			for (it = pshard->entries.begin(); it != pshard->entries.end(); ) {
+				if (it->second.qwExpires <= qwNow) it = pshard->entries.erase(it);
+				else ++it;
+			}
+			if (pshard->entries.size() >= STATCACHE_SHARD_ENTRIES) pshard->entries.erase(pshard->entries.begin());
+		}
+		pshard->entries[strKey] = entry;
+	}
+	LeaveCriticalSection(&pshard->cs);
+
+	return (psi->dwAttributes != INVALID_FILE_ATTRIBUTES);
+}
+
+void StatCache::Erase(const wstring &strKey)
+{
+	SHARD *pshard = GetShard(strKey);
+
+	EnterCriticalSection(&pshard->cs);
+	pshard->entries.erase(strKey);
+	pshard->qwGeneration++;
+	LeaveCriticalSection(&pshard->cs);
+}
+
+void StatCache::Invalidate(const wchar_t *pszLocal, bool isTree)
+// Drops pszLocal and the folder containing it (whose write time changes
+// with its contents). If isTree, also drops everything below pszLocal.
+{
+	wstring strKey;
+	size_t st;
+
+	MakeKey(pszLocal, strKey);
+	Erase(strKey);
+	st = strKey.rfind(L'\\');
+	if (st != wstring::npos) Erase(strKey.substr(0, st));
+
+	if (isTree) {
+		strKey += L'\\';
+		for (int i = 0; i < STATCACHE_SHARDS; i++) {
+			EnterCriticalSection(&_shards[i].cs);
+			for (unordered_map<wstring, ENTRY>::iterator it = _shards[i].entries.begin(); it != _shards[i].entries.end(); ) {
+				if (!it->first.compare(0, strKey.length(), strKey)) it = _shards[i].entries.erase(it);
+				else ++it;
+			}
+			_shards[i].qwGeneration++;
+			LeaveCriticalSection(&_shards[i].cs);
+		}
+	}
+}
+
+void StatCache::GetStats(LONGLONG *pllHits, LONGLONG *pllMisses)
+{
+	*pllHits = _llHits;
+	*pllMisses = _llMisses;
+}
+
+void StatCache::OnChange(void *pContext, const wchar_t *pszLocal, bool isTree)
+{
+	((StatCache *)pContext)->Invalidate(pszLocal, isTree);
+}
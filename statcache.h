@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_STATCACHE_H
+#define _INCL_STATCACHE_H
+
+#include <windows.h>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+#define STATCACHE_SHARDS 16
+#define STATCACHE_SHARD_ENTRIES 4096
+
+class StatCache
+{
+public:
+	struct STATINFO {
+		DWORD dwAttributes;
+		ULARGE_INTEGER uliSize;
+		FILETIME ftLastWrite;
+	};
+
+private:
+	struct ENTRY {
+		STATINFO si;
+		ULONGLONG qwExpires;
+	};
+	struct SHARD {
+		CRITICAL_SECTION cs;
+		unordered_map<wstring, ENTRY> entries;
+		ULONGLONG qwGeneration;
+	};
+
+	SHARD _shards[STATCACHE_SHARDS];
+	ULONGLONG _qwTTL;
+	volatile LONGLONG _llHits;
+	volatile LONGLONG _llMisses;
+
+	static void MakeKey(const wchar_t *pszLocal, wstring &strKey);
+	SHARD * GetShard(const wstring &strKey);
+	void Erase(const wstring &strKey);
+
+public:
+	StatCache(DWORD dwTTLSeconds);
+	~StatCache();
+	bool Stat(const wchar_t *pszLocal, STATINFO *psi);
+	void Invalidate(const wchar_t *pszLocal, bool isTree);
+	void GetStats(LONGLONG *pllHits, LONGLONG *pllMisses);
+	static void OnChange(void *pContext, const wchar_t *pszLocal, bool isTree);
+};
+
+#endif
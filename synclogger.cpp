@@ -28,64 +28,429 @@
  */
 
 #include "synclogger.h"
+#include <deque>
 #include <process.h>
+#include <winioctl.h>
 
-SyncLogger::SyncLogger(const wchar_t *pszFilename)
+SyncLogger::SyncLogger(const wchar_t *pszFilename, DWORD dwFlags, DWORD dwRecords)
 {
-	_hLogFile=CreateFile(pszFilename,GENERIC_WRITE,FILE_SHARE_READ,0,OPEN_ALWAYS,0,0);
-	if (_hLogFile!=INVALID_HANDLE_VALUE) {
-		SetFilePointer(_hLogFile,0,0,FILE_END);
-		_hLoggerThread=(HANDLE)_beginthreadex(NULL,0,SyncLoggerThread,this,0,(unsigned int *)&_dwLoggerThreadId);
-	} else {
-		_hLoggerThread=NULL;
-	}
+	_strFilename = pszFilename;
+	_dwFlags = dwFlags;
+	_hLoggerThread = NULL;
+	_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	for (_lRecords = 2; (DWORD)_lRecords < dwRecords && _lRecords < 0x10000000; _lRecords <<= 1);
+	_precords = new RECORD[_lRecords];
+	for (LONG l = 0; l < _lRecords; l++) _precords[l].lSequence = l;
+	_lEnqueue = 0;
+	_lDequeue = 0;
+	_lSleeping = 0;
+	_isStopping = false;
+	_policy = LogFullPolicy::BLOCK;
+	_qwStampSecond = 0;
+	_llLines = 0;
+	_llDropped = 0;
+	_llSpilled = 0;
+	_llDroppedReported = 0;
+	_qwMaxBytes = 0;
+	_rotate = LogRotate::OFF;
+	_isCompressed = false;
+	_qwPeriodEnd = 0;
+	InitializeCriticalSection(&_cs);
+
+	Open();
+	if (_hLogFile!=INVALID_HANDLE_VALUE && _hWake) _hLoggerThread=(HANDLE)_beginthreadex(NULL,0,SyncLoggerThread,this,0,NULL);
 }
 
 SyncLogger::~SyncLogger()
 {
 	if (_hLoggerThread) {
-		PostThreadMessage(_dwLoggerThreadId,WM_QUIT,0,0);
+		_isStopping = true;
+		SetEvent(_hWake);
 		WaitForSingleObject(_hLoggerThread,INFINITE);
 		CloseHandle(_hLoggerThread);
 	}
 	if (_hLogFile!=INVALID_HANDLE_VALUE) CloseHandle(_hLogFile);
+	if (_hWake) CloseHandle(_hWake);
+	delete [] _precords;
+	DeleteCriticalSection(&_cs);
+}
+
+void SyncLogger::Open()
+// Opens the log for appending and notes how long it already is
+{
+	static const BYTE abBOM[3] = { 0xEF, 0xBB, 0xBF };
+	LARGE_INTEGER liZero, liEnd;
+	BYTE ab[2];
+	DWORD dw;
+
+	_qwFileBytes = 0;
+	_hLogFile=CreateFile(_strFilename.c_str(),GENERIC_READ|GENERIC_WRITE,FILE_SHARE_READ,0,OPEN_ALWAYS,0,0);
+	if (_hLogFile==INVALID_HANDLE_VALUE) return;
+
+	// Earlier versions wrote UTF-16; keep such a log under another name
+	// rather than mix encodings in one file
+	if (!(_dwFlags & LOG_PLAIN) && ReadFile(_hLogFile, ab, 2, &dw, 0) && (dw == 2) && !ab[1]) {
+		CloseHandle(_hLogFile);
+		MoveFileEx(_strFilename.c_str(), (_strFilename + L".old").c_str(), MOVEFILE_REPLACE_EXISTING);
+		_hLogFile=CreateFile(_strFilename.c_str(),GENERIC_READ|GENERIC_WRITE,FILE_SHARE_READ,0,OPEN_ALWAYS,0,0);
+		if (_hLogFile==INVALID_HANDLE_VALUE) return;
+	}
+	liZero.QuadPart = 0;
+	if (!SetFilePointerEx(_hLogFile, liZero, &liEnd, FILE_END)) return;
+	_qwFileBytes = liEnd.QuadPart;
+	if (!_qwFileBytes && !(_dwFlags & LOG_PLAIN)) WriteFile(_hLogFile, abBOM, sizeof(abBOM), &dw, 0);
+}
+
+void SyncLogger::SetFullPolicy(LogFullPolicy policy)
+{
+	_policy = policy;
+}
+
+void SyncLogger::SetRotation(ULONGLONG qwMaxBytes, LogRotate rotate, bool isCompressed)
+// Sets when the writer starts a new file: once the file would grow past
+// qwMaxBytes (0 for no limit), and at the start of every hour or day.
+// The old file keeps the time it was rotated in its name.
+{
+	FILETIME ft;
+
+	GetSystemTimeAsFileTime(&ft);
+	EnterCriticalSection(&_cs);
+	_qwMaxBytes = qwMaxBytes;
+	_rotate = rotate;
+	_isCompressed = isCompressed;
+	_qwPeriodEnd = GetPeriodEnd(((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime, rotate);
+	LeaveCriticalSection(&_cs);
 }
 
 void SyncLogger::Log(const wchar_t *pszText)
+// Claims the next free records, as many as the line needs, converts the
+// line into them and publishes it to the writer. Only a line longer than
+// LOG_LINE_SIZE or a quarter of the ring, or one that finds the ring full
+// under the spill policy, is copied to the heap.
+{
+	RECORD *prec;
+	FILETIME ft;
+	ULONGLONG qwTime;
+	size_t stLen;
+	LONG lPos, lDiff, lRecords;
+	char szLine[LOG_LINE_SIZE];
+	int nLen = 0;
+
+	if (_hLogFile==INVALID_HANDLE_VALUE || !_hLoggerThread || !pszText) return;
+	GetSystemTimeAsFileTime(&ft);
+	qwTime = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	stLen = wcslen(pszText);
+	InterlockedIncrement64(&_llLines);
+
+	// A line that may not fit one record is converted up front to count
+	// the records it needs
+	lRecords = 1;
+	if (stLen * 3 > sizeof(prec->szText)) {
+		nLen = WideCharToMultiByte(CP_UTF8, 0, pszText, (int)stLen, szLine, sizeof(szLine), NULL, NULL);
+		if (!nLen && stLen) {
+			Spill(qwTime, pszText, stLen);
+			return;
+		}
+		lRecords = (LONG)((nLen + sizeof(prec->szText) - 1) / sizeof(prec->szText));
+		if (!lRecords) lRecords = 1;
+		if (lRecords > _lRecords / 4) {
+			Spill(qwTime, pszText, stLen);
+			return;
+		}
+	}
+
+	lPos = _lEnqueue;
+	for (;;) {
+		prec = &_precords[lPos & (_lRecords - 1)];
+		lDiff = (LONG)((DWORD)prec->lSequence - (DWORD)lPos);
+		if (!lDiff && (lRecords > 1)) {
+			// The records are freed in order, so the rest are free if the
+			// last one is
+			lDiff = (LONG)((DWORD)_precords[(lPos + lRecords - 1) & (_lRecords - 1)].lSequence - (DWORD)(lPos + lRecords - 1));
+		}
+		if (!lDiff) {
+			if (InterlockedCompareExchange(&_lEnqueue, lPos + lRecords, lPos) == lPos) break;
+		} else if (lDiff < 0) {
+			// Every record is waiting for the writer
+			if (_policy == LogFullPolicy::DROP) {
+				InterlockedIncrement64(&_llDropped);
+				Wake();
+				return;
+			} else if (_policy == LogFullPolicy::SPILL) {
+				Spill(qwTime, pszText, stLen);
+				return;
+			}
+			Wake();
+			Sleep(1);
+		}
+		lPos = _lEnqueue;
+	}
+	prec->qwTime = qwTime;
+	prec->wRecords = (WORD)lRecords;
+	if (lRecords == 1 && !nLen) {
+		prec->wLen = (WORD)WideCharToMultiByte(CP_UTF8, 0, pszText, (int)stLen, prec->szText, sizeof(prec->szText), NULL, NULL);
+	} else {
+		// The first record is published last, once the whole line is in
+		prec->wLen = (WORD)nLen;
+		for (LONG l = 0; l < lRecords; l++) {
+			size_t stPart = min(sizeof(prec->szText), (size_t)nLen - l * sizeof(prec->szText));
+			memcpy(_precords[(lPos + l) & (_lRecords - 1)].szText, szLine + l * sizeof(prec->szText), stPart);
+		}
+	}
+	InterlockedExchange(&prec->lSequence, lPos + 1);
+	Wake();
+}
+
+void SyncLogger::GetStats(LONGLONG *pllLines, LONGLONG *pllDropped, LONGLONG *pllSpilled)
+{
+	*pllLines = _llLines;
+	*pllDropped = _llDropped;
+	*pllSpilled = _llSpilled;
+}
+
+void SyncLogger::Spill(ULONGLONG qwTime, const wchar_t *pszText, size_t stLen)
+{
+	SPILLED spilled;
+	int nLen;
+
+	spilled.qwTime = qwTime;
+	nLen = WideCharToMultiByte(CP_UTF8, 0, pszText, (int)stLen, NULL, 0, NULL, NULL);
+	spilled.strText.resize(nLen);
+	if (nLen) WideCharToMultiByte(CP_UTF8, 0, pszText, (int)stLen, &spilled.strText[0], nLen, NULL, NULL);
+	// The line goes out after every line that had claimed records by now
+	spilled.lSequence = _lEnqueue;
+	EnterCriticalSection(&_cs);
+	_spilled.push_back(spilled);
+	LeaveCriticalSection(&_cs);
+	InterlockedIncrement64(&_llSpilled);
+	Wake();
+}
+
+bool SyncLogger::SpilledBefore(const SPILLED &a, const SPILLED &b)
+{
+	return (LONG)((DWORD)a.lSequence - (DWORD)b.lSequence) < 0;
+}
+
+void SyncLogger::Wake()
+// Signals the writer only if it has gone to sleep, so a busy log costs no
+// system call per line.
+{
+	if (_lSleeping && InterlockedExchange(&_lSleeping, 0)) SetEvent(_hWake);
+}
+
+void SyncLogger::AppendLine(string &strBatch, ULONGLONG qwTime, const char *pszText, size_t stLen)
+// Adds a line to a batch after its timestamp, which is only formatted
+// again when the second changes.
+{
+	FILETIME ft, ftLocal;
+	SYSTEMTIME st;
+	wchar_t szDate[64], szTime[64], sz[160];
+	char szStamp[480];
+	int nLen;
+
+	if (_dwFlags & LOG_PLAIN) {
+		strBatch.append(pszText, stLen);
+		strBatch += '\n';
+		return;
+	}
+	if (qwTime / 10000000 != _qwStampSecond) {
+		_qwStampSecond = qwTime / 10000000;
+		ft.dwLowDateTime = (DWORD)qwTime;
+		ft.dwHighDateTime = (DWORD)(qwTime >> 32);
+		FileTimeToLocalFileTime(&ft, &ftLocal);
+		FileTimeToSystemTime(&ftLocal, &st);
+		GetDateFormat(LOCALE_SYSTEM_DEFAULT, DATE_SHORTDATE, &st, 0, szDate, ARRAYSIZE(szDate));
+		GetTimeFormat(LOCALE_SYSTEM_DEFAULT, 0, &st, 0, szTime, ARRAYSIZE(szTime));
+		swprintf_s(sz, L"[%s %s] ", szDate, szTime);
+		nLen = WideCharToMultiByte(CP_UTF8, 0, sz, -1, szStamp, sizeof(szStamp), NULL, NULL);
+		_strStamp.assign(szStamp, nLen ? nLen - 1 : 0);
+	}
+	strBatch += _strStamp;
+	strBatch.append(pszText, stLen);
+	strBatch += "\r\n";
+}
+
+ULONGLONG SyncLogger::GetPeriodEnd(ULONGLONG qwTime, LogRotate rotate)
+// Returns when the local hour or day that qwTime falls in ends
+{
+	FILETIME ft, ftLocal;
+	SYSTEMTIME st;
+	ULONGLONG qwPeriod;
+
+	if (rotate == LogRotate::OFF) return 0;
+	qwPeriod = (ULONGLONG)36000000000;
+	ft.dwLowDateTime = (DWORD)qwTime;
+	ft.dwHighDateTime = (DWORD)(qwTime >> 32);
+	FileTimeToLocalFileTime(&ft, &ftLocal);
+	FileTimeToSystemTime(&ftLocal, &st);
+	st.wMinute = st.wSecond = st.wMilliseconds = 0;
+	if (rotate == LogRotate::DAILY) {
+		st.wHour = 0;
+		qwPeriod *= 24;
+	}
+	SystemTimeToFileTime(&st, &ftLocal);
+	LocalFileTimeToFileTime(&ftLocal, &ft);
+	return (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) + qwPeriod;
+}
+
+void SyncLogger::CheckRotation(size_t stBatch)
+// Called by the writer before each batch. An empty file is never rotated,
+// so a quiet log does not leave a trail of empty files behind.
+{
+	FILETIME ft;
+	ULONGLONG qwNow;
+	bool isDue;
+
+	EnterCriticalSection(&_cs);
+	isDue = _qwMaxBytes && (_qwFileBytes + stBatch > _qwMaxBytes);
+	if (_rotate != LogRotate::OFF) {
+		GetSystemTimeAsFileTime(&ft);
+		qwNow = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+		if (qwNow >= _qwPeriodEnd) {
+			isDue = true;
+			_qwPeriodEnd = GetPeriodEnd(qwNow, _rotate);
+		}
+	}
+	LeaveCriticalSection(&_cs);
+	if (isDue && _qwFileBytes > ((_dwFlags & LOG_PLAIN) ? 0 : 3)) Rotate();
+}
+
+void SyncLogger::Rotate()
+// Renames the log after the current local time and starts a new one. If
+// the rename fails the old file is simply reopened and grows on.
 {
-	wchar_t *psz;
-	DWORD dwDateLen, dwTimeLen;
-
-	if (_hLogFile!=INVALID_HANDLE_VALUE && _dwLoggerThreadId && pszText) {
-		dwDateLen=GetDateFormat(LOCALE_SYSTEM_DEFAULT,DATE_SHORTDATE,0,0,0,0);
-		dwTimeLen=GetTimeFormat(LOCALE_SYSTEM_DEFAULT,0,0,0,0,0);
-		size_t buflen = dwDateLen+dwTimeLen+wcslen(pszText)+5;
-		psz=new wchar_t[buflen];
-		psz[0]=L'[';
-		GetDateFormat(LOCALE_SYSTEM_DEFAULT,DATE_SHORTDATE,0,0,psz+1,dwDateLen);
-		psz[dwDateLen]=L' ';
-		GetTimeFormat(LOCALE_SYSTEM_DEFAULT,0,0,0,psz+dwDateLen+1,dwTimeLen);
-		wcscat_s(psz, buflen, L"] ");
-		wcscat_s(psz, buflen, pszText);
-		wcscat_s(psz, buflen, L"\r\n");
-		while (!PostThreadMessage(_dwLoggerThreadId,WM_USER,0,(LPARAM)psz)) Sleep(0);
+	SYSTEMTIME st;
+	wchar_t szSuffix[32];
+	wstring strRotated, *pstr;
+	HANDLE hThread;
+	BOOL isMoved;
+
+	GetLocalTime(&st);
+	swprintf_s(szSuffix, L".%04u%02u%02u-%02u%02u%02u", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+	strRotated = _strFilename + szSuffix;
+	if (_hLogFile!=INVALID_HANDLE_VALUE) CloseHandle(_hLogFile);
+	isMoved = MoveFileEx(_strFilename.c_str(), strRotated.c_str(), 0);
+	Open();
+
+	if (isMoved && _isCompressed) {
+		pstr = new wstring(strRotated);
+		hThread = (HANDLE)_beginthreadex(NULL, 0, CompressThread, pstr, 0, NULL);
+		if (hThread) CloseHandle(hThread);
+		else delete pstr;
 	}
 }
 
+unsigned __stdcall SyncLogger::CompressThread(void *pParam)
+// Turns on NTFS compression for a rotated log. Compressing rewrites the
+// whole file, so it is kept off the writer thread; the file stays
+// readable by anything without a decompression step.
+{
+	wstring *pstr = (wstring *)pParam;
+	USHORT usFormat = COMPRESSION_FORMAT_DEFAULT;
+	HANDLE hFile;
+	DWORD dw;
+
+	hFile = CreateFile(pstr->c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+	if (hFile != INVALID_HANDLE_VALUE) {
+		DeviceIoControl(hFile, FSCTL_SET_COMPRESSION, &usFormat, sizeof(usFormat), NULL, 0, &dw, NULL);
+		CloseHandle(hFile);
+	}
+	delete pstr;
+	return 0;
+}
+
 unsigned __stdcall SyncLogger::SyncLoggerThread(void *pParam)
+// Drains the ring in order, putting each spilled line back after the lines
+// that were logged before it, and writes each batch at once. Sleeps only
+// when there is nothing left to write.
 {
 	SyncLogger *pthis = (SyncLogger *)pParam;
-	MSG msg;
+	RECORD *prec;
+	deque<SPILLED> spilled;
+	deque<SPILLED>::iterator it;
+	vector<SPILLED> taken;
+	string strBatch, strLine;
+	FILETIME ft;
+	LONGLONG llDropped, llSpilled, llTaken = 0;
+	char sz[128];
+	bool isIdle;
 	DWORD dw;
+	WORD wRecords;
+
+	strBatch.reserve(LOG_BATCH_SIZE + LOG_LINE_SIZE * 2);
+	for (;;) {
+		strBatch.clear();
+		while (strBatch.length() < LOG_BATCH_SIZE) {
+			// Pick up what was spilled since the last look. Spill counts a
+			// line before its caller can log another, so a line spilled
+			// before the next record was claimed is always picked up here.
+			llSpilled = pthis->_llSpilled;
+			if (llSpilled != llTaken) {
+				EnterCriticalSection(&pthis->_cs);
+				taken.swap(pthis->_spilled);
+				LeaveCriticalSection(&pthis->_cs);
+				// They arrive nearly in order, so each is placed from the back
+				for (size_t st = 0; st < taken.size(); st++) {
+					for (it = spilled.end(); (it != spilled.begin()) && SpilledBefore(taken[st], *(it - 1)); --it);
+					spilled.insert(it, taken[st]);
+				}
+				taken.clear();
+				llTaken = llSpilled;
+			}
+			prec = &pthis->_precords[pthis->_lDequeue & (pthis->_lRecords - 1)];
+			isIdle = (prec->lSequence != pthis->_lDequeue + 1);
+			// Once the ring is empty on the way out, nothing else can come
+			// before the lines still held back
+			while (!spilled.empty() &&
+				((isIdle && pthis->_isStopping) || ((LONG)((DWORD)spilled.front().lSequence - (DWORD)pthis->_lDequeue) <= 0))) {
+				pthis->AppendLine(strBatch, spilled.front().qwTime, spilled.front().strText.c_str(), spilled.front().strText.length());
+				spilled.pop_front();
+			}
+			if (isIdle) break;
+			wRecords = prec->wRecords;
+			if (wRecords == 1) {
+				pthis->AppendLine(strBatch, prec->qwTime, prec->szText, prec->wLen);
+			} else {
+				strLine.clear();
+				for (WORD w = 0; w < wRecords; w++) {
+					strLine.append(pthis->_precords[(pthis->_lDequeue + w) & (pthis->_lRecords - 1)].szText,
+						min(sizeof(prec->szText), prec->wLen - strLine.length()));
+				}
+				pthis->AppendLine(strBatch, prec->qwTime, strLine.data(), strLine.length());
+			}
+			// Freed in order, as Log relies on
+			for (WORD w = 0; w < wRecords; w++) {
+				InterlockedExchange(&pthis->_precords[(pthis->_lDequeue + w) & (pthis->_lRecords - 1)].lSequence, pthis->_lDequeue + w + pthis->_lRecords);
+			}
+			pthis->_lDequeue += wRecords;
+		}
+		if (strBatch.length() < LOG_BATCH_SIZE) {
+			llDropped = pthis->_llDropped;
+			if (llDropped != pthis->_llDroppedReported) {
+				GetSystemTimeAsFileTime(&ft);
+				sprintf_s(sz, "%I64d log lines were dropped because the log buffer was full.", llDropped - pthis->_llDroppedReported);
+				pthis->AppendLine(strBatch, ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime, sz, strlen(sz));
+				pthis->_llDroppedReported = llDropped;
+			}
+		}
+		if (!strBatch.empty()) {
+			pthis->CheckRotation(strBatch.length());
+			if (WriteFile(pthis->_hLogFile, strBatch.data(), (DWORD)strBatch.length(), &dw, 0)) pthis->_qwFileBytes += dw;
+			continue;
+		}
+		if (pthis->_isStopping) break;
 
-	PeekMessage(&msg,0,0,0,PM_NOREMOVE);
-	while (GetMessage(&msg,0,0,0)) {
-		switch (msg.message) {
-		case WM_USER:
-			WriteFile(pthis->_hLogFile, (wchar_t *)msg.lParam, (DWORD)wcslen((wchar_t *)msg.lParam)*sizeof(wchar_t), &dw, 0);
-			delete[] (wchar_t *)msg.lParam;
-			break;
+		// Look once more after saying we are asleep, for a line published
+		// before a producer could see the flag
+		InterlockedExchange(&pthis->_lSleeping, 1);
+		EnterCriticalSection(&pthis->_cs);
+		isIdle = pthis->_spilled.empty();
+		LeaveCriticalSection(&pthis->_cs);
+		if (!isIdle || (pthis->_precords[pthis->_lDequeue & (pthis->_lRecords - 1)].lSequence == pthis->_lDequeue + 1)) {
+			InterlockedExchange(&pthis->_lSleeping, 0);
+			continue;
 		}
+		WaitForSingleObject(pthis->_hWake, LOG_IDLE_WAIT);
 	}
 
 	return 0;
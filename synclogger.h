@@ -31,20 +31,93 @@
 #define _INCL_SYNCLOGGER_H
 
 #include <windows.h>
+#include <string>
+#include <vector>
 
+using namespace std;
+
+#define LOG_RECORDS 8192
+#define LOG_RECORD_SIZE 256
+#define LOG_LINE_SIZE 8192
+#define LOG_BATCH_SIZE 65536
+#define LOG_IDLE_WAIT 1000
+
+// Lines are written as given, without a timestamp, ending in LF, in a file
+// without a BOM, for logs that other programs parse
+#define LOG_PLAIN 0x1
+
+// What Log does when every record in the ring is waiting to be written:
+// wait for the writer, drop the line and count it, or copy it to the heap
+// for the writer to put back in its place among the lines in the ring.
+enum class LogFullPolicy { BLOCK, DROP, SPILL };
+
+// When the writer starts a new file besides when the size limit is reached
+enum class LogRotate { OFF, HOURLY, DAILY };
+
+// Appends timestamped lines to a UTF-8 log file. Any thread may call Log;
+// the line goes into a fixed ring of records without taking a lock, taking
+// as many records in a row as it needs, and a writer thread drains the ring
+// in batches, one WriteFile per batch. The
+// writer also rotates the file; a rotated file is compressed on a thread
+// of its own.
 class SyncLogger
 {
 private:
+	struct RECORD {
+		volatile LONG lSequence;
+		WORD wLen;
+		WORD wRecords;
+		ULONGLONG qwTime;
+		char szText[LOG_RECORD_SIZE - 16];
+	};
+	struct SPILLED {
+		LONG lSequence;
+		ULONGLONG qwTime;
+		string strText;
+	};
+
+	wstring _strFilename;
+	DWORD _dwFlags;
 	HANDLE _hLogFile;
 	HANDLE _hLoggerThread;
-	DWORD _dwLoggerThreadId;
+	HANDLE _hWake;
+	RECORD *_precords;
+	LONG _lRecords;
+	volatile LONG _lEnqueue;
+	LONG _lDequeue;
+	volatile LONG _lSleeping;
+	volatile bool _isStopping;
+	LogFullPolicy _policy;
+	vector<SPILLED> _spilled;
+	CRITICAL_SECTION _cs;
+	ULONGLONG _qwStampSecond;
+	string _strStamp;
+	volatile LONGLONG _llLines, _llDropped, _llSpilled;
+	LONGLONG _llDroppedReported;
+	ULONGLONG _qwMaxBytes;
+	LogRotate _rotate;
+	bool _isCompressed;
+	ULONGLONG _qwFileBytes;
+	ULONGLONG _qwPeriodEnd;
 
+	void Open();
+	void Spill(ULONGLONG qwTime, const wchar_t *pszText, size_t stLen);
+	static bool SpilledBefore(const SPILLED &a, const SPILLED &b);
+	void Wake();
+	void AppendLine(string &strBatch, ULONGLONG qwTime, const char *pszText, size_t stLen);
+	void CheckRotation(size_t stBatch);
+	void Rotate();
+	static ULONGLONG GetPeriodEnd(ULONGLONG qwTime, LogRotate rotate);
 	static unsigned __stdcall SyncLoggerThread(void *pParam);
+	static unsigned __stdcall CompressThread(void *pParam);
 
 public:
-	SyncLogger(const wchar_t *pszFilename);
+	SyncLogger(const wchar_t *pszFilename, DWORD dwFlags = 0, DWORD dwRecords = LOG_RECORDS);
 	~SyncLogger();
+	void SetFullPolicy(LogFullPolicy policy);
+	void SetRotation(ULONGLONG qwMaxBytes, LogRotate rotate, bool isCompressed);
 	void Log(const wchar_t *pszText);
+	void GetStats(LONGLONG *pllLines, LONGLONG *pllDropped, LONGLONG *pllSpilled);
 };
 
 #endif
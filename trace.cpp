@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "trace.h"
+#include "json.h"
+#include "metrics.h"
+
+TraceSession::TraceSession(Tracer *ptracer, DWORD dwSession, const wchar_t *pszName)
+// Names the session's row after the connection it traces
+{
+	char sz[128];
+
+	_ptracer = ptracer;
+	_dwSession = dwSession;
+	_dwEvents = 0;
+	_qwCommandStart = 0;
+	sprintf_s(sz, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"", _ptracer->GetPid(), _dwSession);
+	_strEvents = sz;
+	AppendJsonString(_strEvents, pszName);
+	_strEvents += "\"}},\n";
+	_dwEvents++;
+	_qwLap = Metrics::GetTicks();
+}
+
+TraceSession::~TraceSession()
+{
+	EndCommand();
+	Flush();
+}
+
+void TraceSession::AddEvent(const char *pszName, const char *pszCategory, ULONGLONG qwStart, ULONGLONG qwEnd, const char *pszArgs)
+// Adds a complete event; pszName and pszArgs must already be escaped
+{
+	char sz[128];
+
+	_strEvents += "{\"name\":\"";
+	_strEvents += pszName;
+	sprintf_s(sz, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%I64u,\"dur\":%I64u,\"pid\":%u,\"tid\":%u", pszCategory, _ptracer->GetTimestamp(qwStart), Metrics::TicksToMicroseconds(qwEnd - qwStart), _ptracer->GetPid(), _dwSession);
+	_strEvents += sz;
+	if (pszArgs && *pszArgs) {
+		_strEvents += ",\"args\":{";
+		_strEvents += pszArgs;
+		_strEvents += "}";
+	}
+	_strEvents += "},\n";
+	_dwEvents++;
+	if (_strEvents.size() >= TRACE_FLUSH_SIZE) Flush();
+}
+
+void TraceSession::Flush()
+{
+	if (!_dwEvents) return;
+	_ptracer->Write(_strEvents, _dwEvents);
+	_strEvents.clear();
+	_dwEvents = 0;
+}
+
+void TraceSession::BeginCommand(const wchar_t *pszVerb, const wchar_t *pszParam)
+// Opens the span of a command; its phases are timed from here. pszParam
+// may be NULL to leave the parameter out of the trace.
+{
+	_strVerb.clear();
+	AppendJsonString(_strVerb, pszVerb);
+	_strArgs.clear();
+	if (pszParam && *pszParam) {
+		_strArgs = "\"param\":\"";
+		AppendJsonString(_strArgs, pszParam);
+		_strArgs += "\"";
+	}
+	_qwCommandStart = _qwLap = Metrics::GetTicks();
+}
+
+void TraceSession::EndCommand()
+// Closes the span of the open command, if any, and starts timing whatever
+// comes next; the wait for the next command is its receive phase. What the
+// command did after its last lap is taken as its reply.
+{
+	ULONGLONG qwNow = Metrics::GetTicks();
+
+	if (_qwCommandStart) {
+		AddEvent("reply", "phase", _qwLap, qwNow, NULL);
+		AddEvent(_strVerb.c_str(), "command", _qwCommandStart, qwNow, _strArgs.c_str());
+		_qwCommandStart = 0;
+	}
+	_qwLap = qwNow;
+}
+
+void TraceSession::Lap(const char *pszPhase)
+{
+	ULONGLONG qwNow = Metrics::GetTicks();
+
+	AddEvent(pszPhase, "phase", _qwLap, qwNow, NULL);
+	_qwLap = qwNow;
+}
+
+void TraceSession::LapTransfer(ULONGLONG qwBytes, ULONGLONG qwDiskMicroseconds, ULONGLONG qwNetworkMicroseconds)
+// Closes the transfer phase, with how its time was split as arguments
+{
+	ULONGLONG qwNow = Metrics::GetTicks();
+	char sz[128];
+
+	sprintf_s(sz, "\"bytes\":%I64u,\"disk_us\":%I64u,\"network_us\":%I64u", qwBytes, qwDiskMicroseconds, qwNetworkMicroseconds);
+	AddEvent("transfer", "phase", _qwLap, qwNow, sz);
+	_qwLap = qwNow;
+}
+
+Tracer::Tracer(const wchar_t *pszFilename, DWORD dwSample)
+{
+	char sz[128];
+	DWORD dw;
+
+	InitializeCriticalSection(&_cs);
+	_qwBase = Metrics::GetTicks();
+	_dwProcess = GetCurrentProcessId();
+	_dwSample = dwSample ? dwSample : 1;
+	_lSessions = 0;
+	_llSampled = 0;
+	_llEvents = 0;
+	_llDropped = 0;
+
+	// The array is opened here and never closed; readers of the format
+	// accept a trailing comma and a missing ]
+	_hFile = CreateFile(pszFilename, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	sprintf_s(sz, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"SlimFTPd\"}},\n", _dwProcess);
+	_qwWritten = strlen(sz);
+	if (_hFile != INVALID_HANDLE_VALUE) WriteFile(_hFile, sz, (DWORD)_qwWritten, &dw, NULL);
+}
+
+Tracer::~Tracer()
+{
+	if (_hFile != INVALID_HANDLE_VALUE) CloseHandle(_hFile);
+	DeleteCriticalSection(&_cs);
+}
+
+TraceSession * Tracer::StartSession(const wchar_t *pszName)
+// Returns the trace of a new session, or NULL if it is not one of those
+// sampled. Sessions are numbered as they start, which also gives each its
+// own row in the trace.
+{
+	DWORD dwSession = (DWORD)InterlockedIncrement(&_lSessions);
+
+	if ((_hFile == INVALID_HANDLE_VALUE) || (dwSession % _dwSample)) return NULL;
+	InterlockedIncrement64(&_llSampled);
+	return new TraceSession(this, dwSession, pszName);
+}
+
+void Tracer::Write(const string &strEvents, DWORD dwEvents)
+// Appends a batch of events with one write, so the batches of different
+// sessions never interleave
+{
+	DWORD dw;
+
+	EnterCriticalSection(&_cs);
+	if (_qwWritten + strEvents.size() > TRACE_MAX_SIZE) {
+		_llDropped += dwEvents;
+	} else {
+		WriteFile(_hFile, strEvents.data(), (DWORD)strEvents.size(), &dw, NULL);
+		_qwWritten += strEvents.size();
+		_llEvents += dwEvents;
+	}
+	LeaveCriticalSection(&_cs);
+}
+
+ULONGLONG Tracer::GetTimestamp(ULONGLONG qwTicks)
+// Returns microseconds since the tracer was started, as the trace counts time
+{
+	return Metrics::TicksToMicroseconds(qwTicks - _qwBase);
+}
+
+DWORD Tracer::GetPid() const
+{
+	return _dwProcess;
+}
+
+void Tracer::GetStats(LONGLONG *pllSessions, LONGLONG *pllEvents, LONGLONG *pllDropped)
+{
+	EnterCriticalSection(&_cs);
+	*pllSessions = _llSampled;
+	*pllEvents = _llEvents;
+	*pllDropped = _llDropped;
+	LeaveCriticalSection(&_cs);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_TRACE_H
+#define _INCL_TRACE_H
+
+#include <windows.h>
+#include <string>
+
+using namespace std;
+
+#define TRACE_FLUSH_SIZE 0x10000
+#define TRACE_MAX_SIZE 0x10000000
+
+class Tracer;
+
+// The spans of one sampled session. Only the session's own thread records
+// into it, so a span costs a clock read and a line appended to a buffer;
+// the buffer is handed to the Tracer when it fills and when the session
+// ends. Phases are timed back to back: each Lap closes the span that began
+// where the last one ended. The session is drawn as a row of its own.
+class TraceSession
+{
+private:
+	Tracer *_ptracer;
+	DWORD _dwSession;
+	string _strEvents;
+	DWORD _dwEvents;
+	string _strVerb;
+	string _strArgs;
+	ULONGLONG _qwCommandStart;
+	ULONGLONG _qwLap;
+
+	void AddEvent(const char *pszName, const char *pszCategory, ULONGLONG qwStart, ULONGLONG qwEnd, const char *pszArgs);
+	void Flush();
+
+public:
+	TraceSession(Tracer *ptracer, DWORD dwSession, const wchar_t *pszName);
+	~TraceSession();
+	void BeginCommand(const wchar_t *pszVerb, const wchar_t *pszParam);
+	void EndCommand();
+	void Lap(const char *pszPhase);
+	void LapTransfer(ULONGLONG qwBytes, ULONGLONG qwDiskMicroseconds, ULONGLONG qwNetworkMicroseconds);
+};
+
+// Writes the spans of one session in every so many to a file in the
+// Chrome trace event format, which chrome://tracing and Perfetto load. The
+// file is a JSON array left open at the end, as the format allows, so
+// sessions are appended as they finish; it is started afresh at startup
+// and no more is written once it reaches TRACE_MAX_SIZE.
+class Tracer
+{
+private:
+	HANDLE _hFile;
+	CRITICAL_SECTION _cs;
+	ULONGLONG _qwBase;
+	DWORD _dwProcess;
+	DWORD _dwSample;
+	volatile LONG _lSessions;
+	ULONGLONG _qwWritten;
+	volatile LONGLONG _llSampled;
+	LONGLONG _llEvents;
+	LONGLONG _llDropped;
+
+public:
+	Tracer(const wchar_t *pszFilename, DWORD dwSample);
+	~Tracer();
+	TraceSession * StartSession(const wchar_t *pszName);
+	void Write(const string &strEvents, DWORD dwEvents);
+	ULONGLONG GetTimestamp(ULONGLONG qwTicks);
+	DWORD GetPid() const;
+	void GetStats(LONGLONG *pllSessions, LONGLONG *pllEvents, LONGLONG *pllDropped);
+};
+
+#endif
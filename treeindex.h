@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_TREEINDEX_H
+#define _INCL_TREEINDEX_H
+
+#include <windows.h>
+#include <vector>
+#include "tree.h"
+
+using namespace std;
+
+// Hash index over the children of every node in a tree<T>, so that a path
+// can be resolved one component at a time without scanning sibling lists.
+// T must have a wstring member strVirtual holding the node's name. Names
+// are matched case-insensitively, like _wcsnicmp in the C locale.
+
+template <class T>
+class treeindex
+{
+private:
+	struct SLOT {
+		size_t sthash;
+		tree<T> *pnode;
+	};
+
+	vector<SLOT> _slots;
+	size_t _stcount;
+
+	static wchar_t fold(wchar_t ch)
+	{
+		return ((ch >= L'a') && (ch <= L'z')) ? (ch - L'a' + L'A') : ch;
+	}
+
+	static size_t hash(const tree<T> *pparent, const wchar_t *psz, size_t stlen)
+	{
+		size_t sthash = (size_t)pparent * 2654435761U;
+
+		for (size_t st = 0; st < stlen; st++) sthash = (sthash ^ fold(psz[st])) * 16777619;
+		return sthash ^ (sthash >> 15);
+	}
+
+	void place(size_t sthash, tree<T> *pnode)
+	{
+		size_t st = sthash & (_slots.size() - 1);
+
+		while (_slots[st].pnode) st = (st + 1) & (_slots.size() - 1);
+		_slots[st].sthash = sthash;
+		_slots[st].pnode = pnode;
+	}
+
+	void grow()
+	{
+		vector<SLOT> old;
+		SLOT slot = { 0, 0 };
+
+		old.swap(_slots);
+		_slots.assign(old.empty() ? 16 : old.size() * 2, slot);
+		for (size_t st = 0; st < old.size(); st++) {
+			if (old[st].pnode) place(old[st].sthash, old[st].pnode);
+		}
+	}
+
+public:
+	treeindex()
+	{
+		_stcount = 0;
+	}
+
+	void insert(tree<T> *pnode)
+	// Adds a node under its parent. Must be called once the node is named.
+	{
+		if ((_stcount + 1) * 2 > _slots.size()) grow();
+		place(hash(pnode->_pup, pnode->_data.strVirtual.c_str(), pnode->_data.strVirtual.length()), pnode);
+		_stcount++;
+	}
+
+	tree<T> * find(const tree<T> *pparent, const wchar_t *psz, size_t stlen) const
+	// Returns the child of pparent named by the first stlen characters of
+	// psz, or 0.
+	{
+		size_t sthash, st;
+		tree<T> *pnode;
+
+		if (!_stcount) return 0;
+		sthash = hash(pparent, psz, stlen);
+		for (st = sthash & (_slots.size() - 1); (pnode = _slots[st].pnode) != 0; st = (st + 1) & (_slots.size() - 1)) {
+			if ((_slots[st].sthash == sthash) && (pnode->_pup == pparent) && (pnode->_data.strVirtual.length() == stlen) && !_wcsnicmp(psz, pnode->_data.strVirtual.c_str(), stlen)) return pnode;
+		}
+		return 0;
+	}
+
+	void clear()
+	// Forgets every node, e.g. once the tree has been frozen.
+	{
+		vector<SLOT>().swap(_slots);
+		_stcount = 0;
+	}
+
+	size_t memory() const
+	// Returns the bytes taken by the slot table.
+	{
+		return _slots.capacity() * sizeof(SLOT);
+	}
+};
+
+#endif
@@ -28,48 +28,408 @@
  */
 
 #include "userdb.h"
+#include <set>
 #include "tree.h"
 
+// How a user's record in a compiled config finds its trees
+#define USERIMAGE_GROUPED 0x1
+#define USERIMAGE_OWN_VFS 0x2
+#define USERIMAGE_OWN_PERMS 0x4
+#define USERIMAGE_CUSTOMIZED 0x8
+
+UserDB::UserDB()
+{
+	_pStore = NULL;
+	_pAuth = NULL;
+	_pfnLoad = NULL;
+	_stMaxStored = 0;
+	InitializeCriticalSection(&_cs);
+	InitializeConditionVariable(&_cvLoaded);
+}
+
+UserDB::~UserDB()
+{
+	DeleteCriticalSection(&_cs);
+}
+
+void UserDB::SetStore(UserStore *pStore, size_t stMaxStored, USERLOADPROC pfnLoad)
+// Users not defined in the config are looked up in pStore on first use and
+// loaded with pfnLoad. Up to stMaxStored of them are kept once no session
+// is using them.
+{
+	_pStore = pStore;
+	_stMaxStored = stMaxStored;
+	_pfnLoad = pfnLoad;
+}
+
+void UserDB::Freeze()
+// Freezes the mount and permission trees of every user and group once the
+// config has been read. Sessions only look paths up in frozen trees.
+{
+	for (group_map_type::iterator it = _groups.begin(); it != _groups.end(); ++it) {
+		it->second.pvfs->Freeze();
+		it->second.pperms->Freeze();
+	}
+	for (map_type::iterator it = _users.begin(); it != _users.end(); ++it) {
+		it->second->pvfs->Freeze();
+		it->second->pperms->Freeze();
+	}
+}
+
+void UserDB::SaveImage(ConfImageWriter *pwriter)
+// Writes the groups and the users defined in the config, with their frozen
+// trees, for LoadImage to read back. A tree shared with a group is written
+// once, with the group. Users loaded from the user store are left out.
+{
+	map<const void *, DWORD> groupindex;
+	group_map_type::const_iterator itGroup;
+	map_type::const_iterator it;
+	map<const void *, DWORD>::const_iterator itIndex;
+	DWORD dw, dwFlags, dwGroup, dwUsers = 0;
+
+	pwriter->WriteDword((DWORD)_groups.size());
+	for (dw = 1, itGroup = _groups.begin(); itGroup != _groups.end(); ++itGroup, dw++) {
+		pwriter->WriteString(itGroup->first);
+		itGroup->second.pvfs->SaveImage(pwriter->WriteBlock(itGroup->second.pvfs->GetImageSize()));
+		itGroup->second.pperms->SaveImage(pwriter->WriteBlock(itGroup->second.pperms->GetImageSize()));
+		groupindex[itGroup->second.pvfs.get()] = dw;
+		groupindex[itGroup->second.pperms.get()] = dw;
+	}
+
+	for (it = _users.begin(); it != _users.end(); ++it) {
+		if (!it->second->isStored) dwUsers++;
+	}
+	pwriter->WriteDword(dwUsers);
+	for (it = _users.begin(); it != _users.end(); ++it) {
+		if (it->second->isStored) continue;
+		dwFlags = (it->second->isGrouped ? USERIMAGE_GROUPED : 0) | (it->second->isCustomized ? USERIMAGE_CUSTOMIZED : 0);
+		// A tree of the user's own names the group tree it is laid over
+		dwGroup = 0;
+		itIndex = groupindex.find(it->second->pvfs.get());
+		if (itIndex == groupindex.end()) {
+			dwFlags |= USERIMAGE_OWN_VFS;
+			itIndex = groupindex.find(it->second->pvfs->GetBase());
+		}
+		if (itIndex != groupindex.end()) dwGroup = itIndex->second;
+		itIndex = groupindex.find(it->second->pperms.get());
+		if (itIndex == groupindex.end()) {
+			dwFlags |= USERIMAGE_OWN_PERMS;
+			itIndex = groupindex.find(it->second->pperms->GetBase());
+		}
+		if (itIndex != groupindex.end()) dwGroup = itIndex->second;
+		pwriter->WriteString(it->first);
+		pwriter->WriteString(it->second->strPassword);
+		pwriter->WriteDword(dwFlags);
+		pwriter->WriteDword(dwGroup);
+		if (dwFlags & USERIMAGE_OWN_VFS) it->second->pvfs->SaveImage(pwriter->WriteBlock(it->second->pvfs->GetImageSize()));
+		if (dwFlags & USERIMAGE_OWN_PERMS) it->second->pperms->SaveImage(pwriter->WriteBlock(it->second->pperms->GetImageSize()));
+	}
+}
+
+bool UserDB::LoadImage(ConfImage *pimage, vector<MountCheck::MOUNT> *pmounts)
+// Fills an empty database from a compiled config written by SaveImage. The
+// trees are used in place in the image, which must outlive the database,
+// and the folders they mount are added to pmounts. Returns false if the
+// image does not read back cleanly.
+{
+	vector<group_map_type::iterator> groups;
+	group_map_type::iterator itGroup;
+	wstring strName;
+	user_ptr puser;
+	const BYTE *pb;
+	DWORD dw, dwCount, dwBytes, dwFlags, dwGroup;
+
+	if (!pimage->ReadDword(&dwCount)) return false;
+	for (dw = 0; dw < dwCount; dw++) {
+		if (!pimage->ReadString(strName) || !AddGroup(strName.c_str())) return false;
+		itGroup = _groups.find(strName);
+		if (!(pb = pimage->ReadBlock(&dwBytes)) || !itGroup->second.pvfs->AttachImage(pb, dwBytes, pmounts)) return false;
+		if (!(pb = pimage->ReadBlock(&dwBytes)) || !itGroup->second.pperms->AttachImage(pb, dwBytes)) return false;
+		groups.push_back(itGroup);
+	}
+
+	if (!pimage->ReadDword(&dwCount)) return false;
+	for (dw = 0; dw < dwCount; dw++) {
+		if (!pimage->ReadString(strName) || (_users.find(strName) != _users.end())) return false;
+		puser = NewRecord();
+		if (!pimage->ReadString(puser->strPassword) || !pimage->ReadDword(&dwFlags) || !pimage->ReadDword(&dwGroup)) return false;
+		if (dwGroup > groups.size()) return false;
+		if ((!(dwFlags & USERIMAGE_OWN_VFS) || !(dwFlags & USERIMAGE_OWN_PERMS)) && !dwGroup) return false;
+		if (dwGroup && (dwFlags & USERIMAGE_GROUPED)) {
+			// The user's own trees, if any, are laid over the group's
+			if (dwFlags & USERIMAGE_OWN_VFS) puser->pvfs = make_shared<VFS>(groups[dwGroup - 1]->second.pvfs);
+			else puser->pvfs = groups[dwGroup - 1]->second.pvfs;
+			if (dwFlags & USERIMAGE_OWN_PERMS) puser->pperms = make_shared<PermDB>(groups[dwGroup - 1]->second.pperms);
+			else puser->pperms = groups[dwGroup - 1]->second.pperms;
+		}
+		if (dwFlags & USERIMAGE_OWN_VFS) {
+			if (!(pb = pimage->ReadBlock(&dwBytes)) || !puser->pvfs->AttachImage(pb, dwBytes, pmounts)) return false;
+		}
+		if (dwFlags & USERIMAGE_OWN_PERMS) {
+			if (!(pb = pimage->ReadBlock(&dwBytes)) || !puser->pperms->AttachImage(pb, dwBytes)) return false;
+		}
+		puser->isGrouped = (dwFlags & USERIMAGE_GROUPED) ? true : false;
+		puser->isCustomized = (dwFlags & USERIMAGE_CUSTOMIZED) ? true : false;
+		_users.insert(std::make_pair(strName, puser));
+	}
+	return pimage->AtEnd();
+}
+
+void UserDB::SetAuthenticator(Authenticator *pAuth)
+// Passwords stored in a scheme such as {PBKDF2} or {Helper} are checked by
+// pAuth. Without one, they never match.
+{
+	_pAuth = pAuth;
+}
+
+UserDB::user_ptr UserDB::NewRecord()
+{
+	user_ptr puser = make_shared<USERDBRECORD>();
+
+	puser->pvfs = make_shared<VFS>();
+	puser->pperms = make_shared<PermDB>();
+	puser->isGrouped = false;
+	puser->isCustomized = false;
+	puser->isStored = false;
+	puser->isLoading = false;
+	return puser;
+}
+
 bool UserDB::Add(const wchar_t *pszUsername)
 {
+	bool isAdded = false;
+
+	EnterCriticalSection(&_cs);
 	if (_users.find(pszUsername) == _users.end()) {
-		_users.insert(std::make_pair(pszUsername, USERDBRECORD()));
-		return true;
-	} else {
-		return false;
+		_users.insert(std::make_pair(pszUsername, NewRecord()));
+		isAdded = true;
 	}
+	LeaveCriticalSection(&_cs);
+	return isAdded;
 }
 
 bool UserDB::SetPassword(const wchar_t *pszUsername, const wchar_t *pszPassword)
 {
+	bool isSet = false;
+
+	EnterCriticalSection(&_cs);
 	map_type::iterator it = _users.find(pszUsername);
 	if (it != _users.end()) {
-		it->second.strPassword = pszPassword;
-		return true;
+		it->second->strPassword = pszPassword;
+		isSet = true;
 	}
-	return false;
+	LeaveCriticalSection(&_cs);
+	return isSet;
 }
 
-VFS * UserDB::GetVFS(const wchar_t *pszUsername)
+UserDB::user_ptr UserDB::GetUser(const wchar_t *pszUsername)
+// Returns the user's record, loading it from the user store the first time
+// it is asked for, or an empty pointer if there is no such user. The record
+// is not dropped from the cache while the pointer is held.
+//
+// A load reads the store and checks the user's mounts, which can take a
+// while, so it runs outside the lock. The record goes in first, marked as
+// loading, and anyone else asking for that user waits for it alone.
 {
+	user_ptr puser;
+	wstring strBlock;
+	DWORD dwLine;
+	bool isLoaded;
+
+	EnterCriticalSection(&_cs);
 	map_type::iterator it = _users.find(pszUsername);
 	if (it != _users.end()) {
-		return &it->second.vfs;
+		puser = it->second;
+		if (puser->isLoading) {
+			while (puser->isLoading) SleepConditionVariableCS(&_cvLoaded, &_cs, INFINITE);
+			// A load that failed has taken the record out again
+			it = _users.find(pszUsername);
+			if ((it == _users.end()) || (it->second != puser)) puser.reset();
+		}
+		if (puser && puser->isStored) _lru.splice(_lru.begin(), _lru, puser->itLRU);
+	}
+	else if (_pStore) {
+		// The block's directives find the user by name, so it goes in first
+		puser = NewRecord();
+		puser->isStored = true;
+		puser->isLoading = true;
+		_lru.push_front(pszUsername);
+		puser->itLRU = _lru.begin();
+		_users.insert(std::make_pair(pszUsername, puser));
+		LeaveCriticalSection(&_cs);
+
+		isLoaded = _pStore->Find(pszUsername, strBlock, &dwLine) && _pfnLoad(this, pszUsername, strBlock.c_str(), dwLine);
+		if (isLoaded) {
+			puser->pvfs->Freeze();
+			puser->pperms->Freeze();
+		}
+
+		EnterCriticalSection(&_cs);
+		puser->isLoading = false;
+		if (isLoaded) {
+			Trim();
+		}
+		else {
+			_users.erase(pszUsername);
+			_lru.erase(puser->itLRU);
+			puser.reset();
+		}
+		WakeAllConditionVariable(&_cvLoaded);
+	}
+	LeaveCriticalSection(&_cs);
+	return puser;
+}
+
+void UserDB::Trim()
+// Drops the least recently used of the users loaded from the store while
+// there are too many of them, skipping those a session is logged in as or
+// that are still loading.
+{
+	list<wstring>::iterator it = _lru.end();
+	map_type::iterator itUser;
+	size_t stCount = _lru.size();
+
+	while ((stCount > _stMaxStored) && (it != _lru.begin())) {
+		--it;
+		itUser = _users.find(*it);
+		if (itUser->second.use_count() == 1) {
+			_users.erase(itUser);
+			it = _lru.erase(it);
+			stCount--;
+		}
 	}
-	return NULL;
 }
 
-PermDB * UserDB::GetPermDB(const wchar_t *pszUsername)
+VFS * UserDB::GetVFSForUpdate(const wchar_t *pszUsername)
+// Returns the user's own mount tree for changing. A user still sharing the
+// group's tree is first given an empty one laid over it.
 {
+	VFS *pvfs = NULL;
+
+	EnterCriticalSection(&_cs);
 	map_type::iterator it = _users.find(pszUsername);
 	if (it != _users.end()) {
-		return &it->second.perms;
+		if (it->second->isGrouped && !it->second->pvfs->GetBase()) it->second->pvfs = make_shared<VFS>(it->second->pvfs);
+		it->second->isCustomized = true;
+		pvfs = it->second->pvfs.get();
 	}
-	return NULL;
+	LeaveCriticalSection(&_cs);
+	return pvfs;
+}
+
+PermDB * UserDB::GetPermDBForUpdate(const wchar_t *pszUsername)
+// Returns the user's own permission tree for changing. A user still
+// sharing the group's tree is first given an empty one laid over it.
+{
+	PermDB *pperms = NULL;
+
+	EnterCriticalSection(&_cs);
+	map_type::iterator it = _users.find(pszUsername);
+	if (it != _users.end()) {
+		if (it->second->isGrouped && !it->second->pperms->GetBase()) it->second->pperms = make_shared<PermDB>(it->second->pperms);
+		it->second->isCustomized = true;
+		pperms = it->second->pperms.get();
+	}
+	LeaveCriticalSection(&_cs);
+	return pperms;
 }
 
 bool UserDB::CheckPassword(const wchar_t *pszUsername, const wchar_t *pszPassword)
 {
+	user_ptr puser = GetUser(pszUsername);
+	return puser && CheckPassword(pszUsername, puser, pszPassword);
+}
+
+bool UserDB::CheckPassword(const wchar_t *pszUsername, const user_ptr &puser, const wchar_t *pszPassword)
+{
+	if (!Authenticator::IsScheme(puser->strPassword.c_str())) return puser->strPassword == pszPassword;
+
+	// An empty password is only ever the test for an anonymous login
+	if (!_pAuth || !*pszPassword) return false;
+	return _pAuth->Check(pszUsername, puser->strPassword.c_str(), pszPassword) == AUTH_ACCEPT;
+}
+
+bool UserDB::AddGroup(const wchar_t *pszGroup)
+{
+	if (_groups.find(pszGroup) == _groups.end()) {
+		GROUPRECORD &rec = _groups[pszGroup];
+		rec.pvfs = make_shared<VFS>();
+		rec.pperms = make_shared<PermDB>();
+		return true;
+	} else {
+		return false;
+	}
+}
+
+VFS * UserDB::GetGroupVFS(const wchar_t *pszGroup)
+{
+	group_map_type::iterator it = _groups.find(pszGroup);
+	if (it != _groups.end()) {
+		return it->second.pvfs.get();
+	}
+	return NULL;
+}
+
+PermDB * UserDB::GetGroupPermDB(const wchar_t *pszGroup)
+{
+	group_map_type::iterator it = _groups.find(pszGroup);
+	if (it != _groups.end()) {
+		return it->second.pperms.get();
+	}
+	return NULL;
+}
+
+bool UserDB::SetGroup(const wchar_t *pszUsername, const wchar_t *pszGroup)
+// Makes the user share the group's trees. Fails if either does not exist,
+// or if the user already has a group or trees of their own.
+{
+	bool isSet = false;
+
+	EnterCriticalSection(&_cs);
 	map_type::iterator it = _users.find(pszUsername);
-	return (it != _users.end()) && (it->second.strPassword == pszPassword);
+	group_map_type::iterator itGroup = _groups.find(pszGroup);
+	if ((it != _users.end()) && (itGroup != _groups.end()) && !it->second->isGrouped && !it->second->isCustomized) {
+		it->second->pvfs = itGroup->second.pvfs;
+		it->second->pperms = itGroup->second.pperms;
+		it->second->isGrouped = true;
+		isSet = true;
+	}
+	LeaveCriticalSection(&_cs);
+	return isSet;
+}
+
+void UserDB::GetMemoryUsage(size_t *pstUsers, size_t *pstGroups, size_t *pstOverridden, size_t *pstBytes, size_t *pstUnsharedBytes)
+// Counts the bytes taken by every mount and permission tree, once per tree
+// in *pstBytes and once per user in *pstUnsharedBytes, which is what they
+// would take if no trees were shared. *pstOverridden is the number of
+// users with trees of their own laid over their group's.
+{
+	set<const void *> counted;
+	map_type::const_iterator it;
+	group_map_type::const_iterator itGroup;
+	size_t stVFS, stPerms;
+
+	EnterCriticalSection(&_cs);
+	*pstOverridden = 0;
+	*pstBytes = 0;
+	*pstUnsharedBytes = 0;
+	for (it = _users.begin(); it != _users.end(); ++it) {
+		// A user still loading is having their trees filled in
+		if (it->second->isLoading) continue;
+		stVFS = it->second->pvfs->GetMemoryUsage();
+		stPerms = it->second->pperms->GetMemoryUsage();
+		*pstUnsharedBytes += stVFS + stPerms;
+		if (it->second->pvfs->GetBase()) *pstUnsharedBytes += it->second->pvfs->GetBase()->GetMemoryUsage();
+		if (it->second->pperms->GetBase()) *pstUnsharedBytes += it->second->pperms->GetBase()->GetMemoryUsage();
+		if (it->second->pvfs->GetBase() || it->second->pperms->GetBase()) (*pstOverridden)++;
+		if (counted.insert(it->second->pvfs.get()).second) *pstBytes += stVFS;
+		if (counted.insert(it->second->pperms.get()).second) *pstBytes += stPerms;
+	}
+	for (itGroup = _groups.begin(); itGroup != _groups.end(); ++itGroup) {
+		if (counted.insert(itGroup->second.pvfs.get()).second) *pstBytes += itGroup->second.pvfs->GetMemoryUsage();
+		if (counted.insert(itGroup->second.pperms.get()).second) *pstBytes += itGroup->second.pperms->GetMemoryUsage();
+	}
+	*pstUsers = _users.size();
+	*pstGroups = _groups.size();
+	LeaveCriticalSection(&_cs);
 }
@@ -31,27 +31,84 @@
 #define _INCL_USERDB_H
 
 #include <windows.h>
+#include <list>
 #include <map>
+#include <memory>
 #include "String.h"
+#include "auth.h"
+#include "confimage.h"
 #include "vfs.h"
 #include "permdb.h"
+#include "userstore.h"
+
+class UserDB;
+
+// Applies the body of a User block read from the user store to a user that
+// has just been added to pdb. Returns false if the block has an error.
+typedef bool (*USERLOADPROC)(UserDB *pdb, const wchar_t *pszUser, const wchar_t *pszBlock, DWORD dwLine);
 
 class UserDB {
-private:
+public:
 	struct USERDBRECORD {
 		wstring strPassword;
-		VFS vfs;
-		PermDB perms;
+		shared_ptr<VFS> pvfs;
+		shared_ptr<PermDB> pperms;
+		bool isGrouped;
+		bool isCustomized;
+		bool isStored;
+		bool isLoading;
+		list<wstring>::iterator itLRU;
 	};
-	typedef std::map<wstring, USERDBRECORD> map_type;
+	typedef shared_ptr<USERDBRECORD> user_ptr;
+
+private:
+	// Users in a group point at the group's trees, which are never changed
+	// once the group is defined. A user's first own Mount, Allow or Deny
+	// gives them a small tree of their own, laid over the group's, which
+	// holds only what the user adds.
+	struct GROUPRECORD {
+		shared_ptr<VFS> pvfs;
+		shared_ptr<PermDB> pperms;
+	};
+	// User and group names are matched without regard to case
+	struct NOCASE_LESS {
+		bool operator()(const wstring &str1, const wstring &str2) const { return _wcsicmp(str1.c_str(), str2.c_str()) < 0; }
+	};
+	typedef std::map<wstring, user_ptr, NOCASE_LESS> map_type;
+	typedef std::map<wstring, GROUPRECORD, NOCASE_LESS> group_map_type;
 	map_type _users;
+	group_map_type _groups;
+	UserStore *_pStore;
+	Authenticator *_pAuth;
+	USERLOADPROC _pfnLoad;
+	list<wstring> _lru;
+	size_t _stMaxStored;
+	CRITICAL_SECTION _cs;
+	CONDITION_VARIABLE _cvLoaded;
+
+	static user_ptr NewRecord();
+	void Trim();
 
 public:
+	UserDB();
+	~UserDB();
+	void SetStore(UserStore *pStore, size_t stMaxStored, USERLOADPROC pfnLoad);
+	void Freeze();
+	void SaveImage(ConfImageWriter *pwriter);
+	bool LoadImage(ConfImage *pimage, vector<MountCheck::MOUNT> *pmounts);
+	void SetAuthenticator(Authenticator *pAuth);
 	bool Add(const wchar_t *pszUsername);
 	bool SetPassword(const wchar_t *pszUsername, const wchar_t *pszPassword);
-	VFS *GetVFS(const wchar_t *pszUsername);
-	PermDB *GetPermDB(const wchar_t *pszUsername);
+	user_ptr GetUser(const wchar_t *pszUsername);
+	VFS *GetVFSForUpdate(const wchar_t *pszUsername);
+	PermDB *GetPermDBForUpdate(const wchar_t *pszUsername);
 	bool CheckPassword(const wchar_t *pszUsername, const wchar_t *pszPassword);
+	bool CheckPassword(const wchar_t *pszUsername, const user_ptr &puser, const wchar_t *pszPassword);
+	bool AddGroup(const wchar_t *pszGroup);
+	VFS *GetGroupVFS(const wchar_t *pszGroup);
+	PermDB *GetGroupPermDB(const wchar_t *pszGroup);
+	bool SetGroup(const wchar_t *pszUsername, const wchar_t *pszGroup);
+	void GetMemoryUsage(size_t *pstUsers, size_t *pstGroups, size_t *pstOverridden, size_t *pstBytes, size_t *pstUnsharedBytes);
 };
 
 #endif
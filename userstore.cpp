@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "userstore.h"
+#include <algorithm>
+
+#define WRITE_BUFFER_SIZE 0x10000
+
+static wchar_t FoldChar(wchar_t ch)
+{
+	return ((ch >= L'A') && (ch <= L'Z')) ? (ch - L'A' + L'a') : ch;
+}
+
+UserStore::UserStore()
+{
+	_hFile = INVALID_HANDLE_VALUE;
+	_hMapping = NULL;
+	_pbView = NULL;
+	_dwSize = 0;
+	_phdr = NULL;
+	_pslots = NULL;
+}
+
+UserStore::~UserStore()
+{
+	Close();
+}
+
+void UserStore::Close()
+{
+	if (_pbView) UnmapViewOfFile(_pbView);
+	if (_hMapping) CloseHandle(_hMapping);
+	if (_hFile != INVALID_HANDLE_VALUE) CloseHandle(_hFile);
+	_hFile = INVALID_HANDLE_VALUE;
+	_hMapping = NULL;
+	_pbView = NULL;
+	_phdr = NULL;
+	_pslots = NULL;
+}
+
+DWORD UserStore::Hash(const wchar_t *psz, size_t stLen)
+// FNV-1a over the name with ASCII letters folded, matching _wcsicmp.
+{
+	DWORD dwHash = 2166136261U;
+
+	while (stLen--) dwHash = (dwHash ^ FoldChar(*psz++)) * 16777619;
+	return dwHash;
+}
+
+bool UserStore::Open(const wchar_t *pszFile)
+// Maps the store file and checks that its header and index are sound.
+{
+	LARGE_INTEGER liSize;
+
+	Close();
+	_hFile = ::CreateFile(pszFile, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+	if (_hFile == INVALID_HANDLE_VALUE) return false;
+	if (!GetFileSizeEx(_hFile, &liSize) || (liSize.QuadPart < sizeof(STOREHEADER)) || (liSize.QuadPart > MAXDWORD)) {
+		Close();
+		return false;
+	}
+	_dwSize = (DWORD)liSize.QuadPart;
+	_hMapping = CreateFileMapping(_hFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (_hMapping) _pbView = (const BYTE *)MapViewOfFile(_hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!_pbView) {
+		Close();
+		return false;
+	}
+	_phdr = (const STOREHEADER *)_pbView;
+	if ((_phdr->dwMagic != USERSTORE_MAGIC) || (_phdr->dwVersion != USERSTORE_VERSION) ||
+		!_phdr->dwSlots || (_phdr->dwSlots & (_phdr->dwSlots - 1)) || (_phdr->dwSlots > (MAXDWORD / sizeof(SLOT))) ||
+		(_phdr->dwIndexOffset < sizeof(STOREHEADER)) || (_phdr->dwIndexOffset > _dwSize) ||
+		(_dwSize - _phdr->dwIndexOffset < _phdr->dwSlots * sizeof(SLOT))) {
+		Close();
+		return false;
+	}
+	_pslots = (const SLOT *)(_pbView + _phdr->dwIndexOffset);
+	return true;
+}
+
+DWORD UserStore::GetCount() const
+{
+	return _phdr ? _phdr->dwUsers : 0;
+}
+
+bool UserStore::Find(const wchar_t *pszUser, wstring &strBlock, DWORD *pdwLine) const
+// Looks up a user by name, ignoring case. On success returns the text of the
+// user's block, one line per '\n', and the line of the source file it
+// started on.
+{
+	const STORERECORD *prec;
+	const wchar_t *pszName;
+	size_t stLen;
+	DWORD dwHash, dwSlot, dwMask;
+
+	if (!_phdr) return false;
+	stLen = wcslen(pszUser);
+	dwHash = Hash(pszUser, stLen);
+	dwMask = _phdr->dwSlots - 1;
+	for (dwSlot = dwHash & dwMask; _pslots[dwSlot].dwOffset; dwSlot = (dwSlot + 1) & dwMask) {
+		if (_pslots[dwSlot].dwHash != dwHash) continue;
+		if ((_pslots[dwSlot].dwOffset > _phdr->dwIndexOffset) || (_phdr->dwIndexOffset - _pslots[dwSlot].dwOffset < sizeof(STORERECORD))) return false;
+		prec = (const STORERECORD *)(_pbView + _pslots[dwSlot].dwOffset);
+		if ((prec->dwNameLen != stLen) || (((ULONGLONG)prec->dwNameLen + prec->dwBlockLen) * sizeof(wchar_t) > _phdr->dwIndexOffset - _pslots[dwSlot].dwOffset - sizeof(STORERECORD))) continue;
+		pszName = (const wchar_t *)(prec + 1);
+		if (_wcsnicmp(pszName, pszUser, stLen)) continue;
+		strBlock.assign(pszName + prec->dwNameLen, prec->dwBlockLen);
+		*pdwLine = prec->dwLine;
+		return true;
+	}
+	return false;
+}
+
+UserStoreWriter::UserStoreWriter()
+{
+	_hFile = INVALID_HANDLE_VALUE;
+	_dwOffset = 0;
+}
+
+UserStoreWriter::~UserStoreWriter()
+// A writer destroyed before Finish leaves the old store untouched.
+{
+	if (_hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(_hFile);
+		::DeleteFile(_strTemp.c_str());
+	}
+}
+
+bool UserStoreWriter::Create(const wchar_t *pszFile)
+// Starts writing a new store, which replaces pszFile once it is finished.
+{
+	UserStore::STOREHEADER hdr;
+
+	_strFile = pszFile;
+	_strTemp = _strFile + L".tmp";
+	_hFile = ::CreateFile(_strTemp.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (_hFile == INVALID_HANDLE_VALUE) return false;
+	ZeroMemory(&hdr, sizeof(hdr));
+	_dwOffset = 0;
+	_buffer.reserve(WRITE_BUFFER_SIZE);
+	return Write(&hdr, sizeof(hdr));
+}
+
+bool UserStoreWriter::Write(const void *pv, DWORD dwBytes)
+{
+	if (dwBytes > MAXDWORD - _dwOffset) return false;
+	_buffer.insert(_buffer.end(), (const BYTE *)pv, (const BYTE *)pv + dwBytes);
+	_dwOffset += dwBytes;
+	return (_buffer.size() < WRITE_BUFFER_SIZE) || Flush();
+}
+
+bool UserStoreWriter::Flush()
+{
+	DWORD dw;
+
+	if (_buffer.empty()) return true;
+	if (!WriteFile(_hFile, &_buffer[0], (DWORD)_buffer.size(), &dw, 0) || (dw != _buffer.size())) return false;
+	_buffer.clear();
+	return true;
+}
+
+bool UserStoreWriter::Add(const wchar_t *pszUser, DWORD dwLine, const wchar_t *pszBlock, size_t stBlockLen)
+// Appends a user's block. Returns false if the user was already added
+// under any case, or if the file would grow past 4 GB.
+{
+	UserStore::STORERECORD rec;
+	UserStore::SLOT slot;
+	wstring strFolded;
+	DWORD dwPad = 0;
+
+	strFolded = pszUser;
+	for (size_t st = 0; st < strFolded.length(); st++) strFolded[st] = FoldChar(strFolded[st]);
+	slot.dwHash = UserStore::Hash(pszUser, strFolded.length());
+	slot.dwOffset = _dwOffset;
+	if (_names.find(strFolded) != _names.end()) return false;
+	rec.dwLine = dwLine;
+	rec.dwNameLen = (DWORD)strFolded.length();
+	rec.dwBlockLen = (DWORD)stBlockLen;
+	if (!Write(&rec, sizeof(rec)) || !Write(pszUser, rec.dwNameLen * sizeof(wchar_t)) || !Write(pszBlock, rec.dwBlockLen * sizeof(wchar_t))) return false;
+	if (_dwOffset & 3) Write(&dwPad, 4 - (_dwOffset & 3));
+	_entries.push_back(slot);
+	_names.insert(strFolded);
+	return true;
+}
+
+bool UserStoreWriter::Finish()
+// Writes the index and header, and puts the new store in place.
+{
+	vector<UserStore::SLOT> slots;
+	UserStore::SLOT empty = { 0, 0 };
+	UserStore::STOREHEADER hdr;
+	DWORD dwSlots, dw, dwSlot;
+
+	// Keep the table at most half full so probe runs stay short
+	for (dwSlots = 16; dwSlots < _entries.size() * 2; dwSlots <<= 1);
+	slots.assign(dwSlots, empty);
+	for (size_t st = 0; st < _entries.size(); st++) {
+		for (dwSlot = _entries[st].dwHash & (dwSlots - 1); slots[dwSlot].dwOffset; dwSlot = (dwSlot + 1) & (dwSlots - 1));
+		slots[dwSlot] = _entries[st];
+	}
+	hdr.dwMagic = USERSTORE_MAGIC;
+	hdr.dwVersion = USERSTORE_VERSION;
+	hdr.dwUsers = (DWORD)_entries.size();
+	hdr.dwSlots = dwSlots;
+	hdr.dwIndexOffset = _dwOffset;
+	if (!Write(&slots[0], dwSlots * sizeof(UserStore::SLOT)) || !Flush()) return false;
+	if ((SetFilePointer(_hFile, 0, 0, FILE_BEGIN) != 0) || !WriteFile(_hFile, &hdr, sizeof(hdr), &dw, 0) || (dw != sizeof(hdr))) return false;
+	CloseHandle(_hFile);
+	_hFile = INVALID_HANDLE_VALUE;
+	if (!MoveFileEx(_strTemp.c_str(), _strFile.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		::DeleteFile(_strTemp.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_USERSTORE_H
+#define _INCL_USERSTORE_H
+
+#include <windows.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+// A read-only file of User blocks, indexed by a hash of the case-folded
+// user name so that one account can be found without reading the others.
+// The file is mapped into memory; only the pages that are looked at are
+// ever read in.
+//
+// Layout: a STOREHEADER, then the records, then a power-of-two table of
+// SLOTs placed by linear probing. A record is a STORERECORD followed by the
+// user name and the block text, both as wide characters without
+// terminators, padded to a multiple of four bytes.
+
+#define USERSTORE_MAGIC 0x53554653
+#define USERSTORE_VERSION 1
+
+class UserStore
+{
+public:
+	struct STOREHEADER {
+		DWORD dwMagic;
+		DWORD dwVersion;
+		DWORD dwUsers;
+		DWORD dwSlots;
+		DWORD dwIndexOffset;
+	};
+	struct STORERECORD {
+		DWORD dwLine;
+		DWORD dwNameLen;
+		DWORD dwBlockLen;
+	};
+	struct SLOT {
+		DWORD dwHash;
+		DWORD dwOffset;
+	};
+
+private:
+	HANDLE _hFile;
+	HANDLE _hMapping;
+	const BYTE *_pbView;
+	DWORD _dwSize;
+	const STOREHEADER *_phdr;
+	const SLOT *_pslots;
+
+	void Close();
+
+public:
+	UserStore();
+	~UserStore();
+	bool Open(const wchar_t *pszFile);
+	DWORD GetCount() const;
+	bool Find(const wchar_t *pszUser, wstring &strBlock, DWORD *pdwLine) const;
+	static DWORD Hash(const wchar_t *psz, size_t stLen);
+};
+
+class UserStoreWriter
+{
+private:
+	HANDLE _hFile;
+	wstring _strFile;
+	wstring _strTemp;
+	DWORD _dwOffset;
+	vector<UserStore::SLOT> _entries;
+	unordered_set<wstring> _names;
+	vector<BYTE> _buffer;
+
+	bool Write(const void *pv, DWORD dwBytes);
+	bool Flush();
+
+public:
+	UserStoreWriter();
+	~UserStoreWriter();
+	bool Create(const wchar_t *pszFile);
+	bool Add(const wchar_t *pszUser, DWORD dwLine, const wchar_t *pszBlock, size_t stBlockLen);
+	bool Finish();
+};
+
+#endif
@@ -29,19 +29,178 @@
 
 #include "vfs.h"
 #include <algorithm>
+#include "fswatch.h"
+#include "listcache.h"
+#include "mountcheck.h"
 #include "tree.h"
 #define STRSAFE_NO_DEPRECATE
 #include <strsafe.h>
 
+#define CLONE_CHUNK_SIZE 0x40000000
+#define COPY_BUFFER_SIZE 0x100000
+#define VIRTUAL_PATH_BUFFER 1024
+
+FSWatcher *VFS::_pWatcher = NULL;
+MountCheck *VFS::_pMountCheck = NULL;
+ListingCache *VFS::_pListingCache = NULL;
+StatCache *VFS::_pStatCache = NULL;
+HandleCache *VFS::_pHandleCache = NULL;
+FileCache *VFS::_pFileCache = NULL;
+DWORD VFS::_dwDefaultMapThreshold = 0;
+
 VFS::VFS()
 {
 }
 
-void VFS::Mount(const wchar_t *pszVirtual, const wchar_t *pszLocal)
-// Creates a new mount point in the virtual file system.
+VFS::VFS(const shared_ptr<VFS> &pbase) : _pbase(pbase)
+// Makes an empty tree for a user's own mounts, laid over a group's tree so
+// that the user can be given mounts of their own without copying the group's.
+{
+}
+
+const VFS * VFS::GetBase() const
+{
+	return _pbase.get();
+}
+
+size_t VFS::GetMemoryUsage() const
+// Returns roughly how many bytes the mount tree and its index take, not
+// counting a group tree it is laid over.
+{
+	return sizeof(VFS) + GetTreeMemoryUsage(&_root) - sizeof(_root) + _index.memory() + _frozen.memory();
+}
+
+void VFS::Freeze()
+// Builds the frozen form that lookups use and frees the pointer tree. Must
+// be called once the mounts are all added; does nothing if nothing has
+// changed since the last call.
+{
+	if (!_frozen.empty()) return;
+	_frozen.build(&_root, [](const MOUNTPOINT &mp, FROZENMOUNT &fm, frozen_type::pool &strings) {
+		fm.dwLocal = strings.intern(mp.strLocal);
+		fm.dwLocalLen = (DWORD)mp.strLocal.length();
+		fm.dwMapThreshold = mp.dwMapThreshold;
+	});
+	while (_root._pdown) delete _root._pdown;
+	_root._data = MOUNTPOINT();
+	_index.clear();
+}
+
+size_t VFS::GetImageSize() const
+// Returns the bytes SaveImage writes. The tree must be frozen.
+{
+	return _frozen.image_size();
+}
+
+void VFS::SaveImage(BYTE *pb) const
+// Writes the frozen tree for a compiled config.
+{
+	_frozen.save(pb);
+}
+
+bool VFS::AttachImage(const BYTE *pb, size_t stBytes, vector<MountCheck::MOUNT> *pmounts)
+// Uses a frozen tree saved by SaveImage in place, and adds the folders it
+// mounts to pmounts to be checked, as the Mount directives would have.
+{
+	const frozen_type::NODE *pnode;
+	MountCheck::MOUNT mount;
+
+	if (!_frozen.attach(pb, stBytes)) return false;
+	while (_root._pdown) delete _root._pdown;
+	_root._data = MOUNTPOINT();
+	_index.clear();
+	if (!_frozen.empty()) {
+		// The image does not keep the lines the mounts came from
+		mount.dwLine = 0;
+		for (pnode = _frozen.root(); pnode < _frozen.root() + _frozen.count(); pnode++) {
+			if (!pnode->data.dwLocalLen) continue;
+			mount.strLocal.assign(_frozen.str(pnode->data.dwLocal), pnode->data.dwLocalLen);
+			pmounts->push_back(mount);
+		}
+	}
+	return true;
+}
+
+void VFS::Thaw()
+// Turns a frozen tree back into pointers so that mounts can be added to it.
+{
+	if (_frozen.empty()) return;
+	_frozen.thaw(&_root, _index, [](const FROZENMOUNT &fm, MOUNTPOINT &mp, const frozen_type &ft) {
+		mp.strLocal.assign(ft.str(fm.dwLocal), fm.dwLocalLen);
+		mp.dwMapThreshold = fm.dwMapThreshold;
+	});
+	_frozen.clear();
+}
+
+size_t VFS::GetTreeMemoryUsage(const tree<MOUNTPOINT> *ptree)
+{
+	size_t st;
+
+	st = sizeof(*ptree) + (ptree->_data.strVirtual.capacity() + ptree->_data.strLocal.capacity() + 2) * sizeof(wchar_t);
+	for (ptree = ptree->_pdown; ptree; ptree = ptree->_pright) st += GetTreeMemoryUsage(ptree);
+	return st;
+}
+
+void VFS::SetWatcher(FSWatcher *pWatcher)
+// Sets the watcher that is told about changes made through any VFS.
+{
+	_pWatcher = pWatcher;
+}
+
+void VFS::SetMountCheck(MountCheck *pMountCheck)
+// Sets the checker that says which mounted folders are unavailable, or
+// NULL for none.
+{
+	_pMountCheck = pMountCheck;
+}
+
+void VFS::SetListingCache(ListingCache *pListingCache)
+// Sets the listing cache shared by all VFS instances, or NULL for none.
+{
+	_pListingCache = pListingCache;
+}
+
+void VFS::SetStatCache(StatCache *pStatCache)
+// Sets the metadata cache shared by all VFS instances, or NULL for none.
+{
+	_pStatCache = pStatCache;
+}
+
+void VFS::SetHandleCache(HandleCache *pHandleCache)
+// Sets the cache of shared download handles, or NULL for none.
+{
+	_pHandleCache = pHandleCache;
+}
+
+void VFS::SetFileCache(FileCache *pFileCache)
+// Sets the in-memory cache of hot file contents, or NULL for none.
+{
+	_pFileCache = pFileCache;
+}
+
+void VFS::SetDefaultMapThreshold(DWORD dwKB)
+// Sets the map threshold for mount points that do not give their own.
+{
+	_dwDefaultMapThreshold = dwKB;
+}
+
+void VFS::Changed(const wchar_t *pszVirtual)
+// Tells the caches that the file or folder at pszVirtual was changed by
+// the server, e.g. at the end of an upload.
+{
+	wstring strLocal;
+
+	if (_pWatcher && Map(pszVirtual, strLocal) && (strLocal.length() != 0)) _pWatcher->Changed(strLocal.c_str(), false);
+}
+
+void VFS::Mount(const wchar_t *pszVirtual, const wchar_t *pszLocal, DWORD dwMapThreshold)
+// Creates a new mount point in the virtual file system. Files under it up to
+// dwMapThreshold KB are downloaded from a mapped view; MAP_THRESHOLD_DEFAULT
+// uses the server-wide setting.
 {
 	tree<MOUNTPOINT> *ptree, *pparent;
 
+	Thaw();
 	ptree = &_root;
 	size_t i = 0;
 	wstring dir;
@@ -51,28 +210,31 @@ void VFS::Mount(const wchar_t *pszVirtual, const wchar_t *pszLocal)
 		size_t j = wcscspn(pszVirtual + i, L"/");
 		dir.assign(pszVirtual + i, j);
 		pparent = ptree;
-		ptree = ptree->_pdown;
-		while (ptree && _wcsicmp(ptree->_data.strVirtual.c_str(), dir.c_str())) ptree = ptree->_pright;
+		ptree = _index.find(pparent, dir.c_str(), dir.length());
 		if (!ptree) {
 			ptree = new tree<MOUNTPOINT>(pparent);
 			ptree->_data.strVirtual = dir;
+			_index.insert(ptree);
 		}
 		i += j;
 	}
 	ptree->_data.strLocal = pszLocal;
+	ptree->_data.dwMapThreshold = dwMapThreshold;
 }
 
-DWORD VFS::GetDirectoryListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listing_type &listing)
+DWORD VFS::GetDirectoryListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listing_type &listing, folder_list_type *pFolders)
 // Fills a map class with lines comprising an FTP-style directory listing.
 // If dwIsNLST is non-zero, will return filenames only.
+// If pFolders is given, the names of listed subfolders that may be descended
+// into (not reparse points) are appended to it.
 {
 	wchar_t szLine[512];
-	const wchar_t *pszMonthAbbr[]={L"Jan",L"Feb",L"Mar",L"Apr",L"May",L"Jun",L"Jul",L"Aug",L"Sep",L"Oct",L"Nov",L"Dec"};
 	LPVOID hFind;
 	WIN32_FIND_DATA w32fd;
-	SYSTEMTIME stCutoff, stFile;
+	SYSTEMTIME stCutoff;
 
 	if (IsFolder(pszVirtual)) {
+		if (_pListingCache) return GetFolderListing(pszVirtual, dwIsNLST, listing, pFolders);
 		wstring str;
 		ResolveRelative(pszVirtual, L"*", str);
 		hFind = FindFirstFile(str.c_str(), &w32fd);
@@ -85,28 +247,13 @@ DWORD VFS::GetDirectoryListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listin
 		stCutoff.wYear--;
 		do {
 			if (!wcscmp(w32fd.cFileName, L".") || !wcscmp(w32fd.cFileName, L"..")) continue;
-			FileTimeToSystemTime(&w32fd.ftLastWriteTime, &stFile);
-			if (dwIsNLST) {
-				wcscpy_s(szLine, w32fd.cFileName);
-				if (w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-					wcscat_s(szLine, L"/");
-				}
-			} else {
-				wsprintf(szLine, L"%c--------- 1 ftp ftp %10u %s %2u ", (w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? L'd' : L'-', w32fd.nFileSizeLow, pszMonthAbbr[stFile.wMonth-1], stFile.wDay);
-				if ((stFile.wYear > stCutoff.wYear) || ((stFile.wYear == stCutoff.wYear) && ((stFile.wMonth > stCutoff.wMonth) || ((stFile.wMonth == stCutoff.wMonth) && (stFile.wDay > stCutoff.wDay))))) {
-					wsprintf(szLine + wcslen(szLine), L"%.2u:%.2u ", stFile.wHour, stFile.wMinute);
-				} else {
-					wsprintf(szLine + wcslen(szLine), L"%5u ", stFile.wYear);
-				}
-				wcscat_s(szLine, w32fd.cFileName);
-			}
-			wcscat_s(szLine,L"\r\n");
-			listing_type::iterator it = listing.find(w32fd.cFileName);
-			if (it != listing.end()) {
-				it->second = szLine;
-			}
-			else {
-				listing.insert(std::make_pair(w32fd.cFileName, szLine));
+			FormatListingLine(&w32fd, dwIsNLST, &stCutoff, szLine, ARRAYSIZE(szLine));
+			// Mount points come first and shadow what is on disk under
+			// the same name, as they do in Map
+			if (listing.find(w32fd.cFileName) != listing.end()) continue;
+			listing.insert(std::make_pair(w32fd.cFileName, szLine));
+			if (pFolders && (w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(w32fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+				pFolders->push_back(w32fd.cFileName);
 			}
 		} while (FindNextFile(hFind, &w32fd));
 		FindClose(hFind);
@@ -116,139 +263,360 @@ DWORD VFS::GetDirectoryListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listin
 	}
 }
 
-DWORD VFS::Map(const wchar_t *pszVirtual, wstring &strLocal, tree<MOUNTPOINT> *ptree)
-// Recursive function to map a virtual path to a local path.
+DWORD VFS::GetFolderListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listing_type &listing, folder_list_type *pFolders)
+// Lists a whole folder through the shared listing cache. The local folder's
+// entries come from the cache; this user's mount points are laid over them.
+// Folders that are not being watched, such as on a share that has dropped,
+// are always read from disk, since nothing would tell the cache they changed.
 {
-	const wchar_t *psz;
-	UINT_PTR dwLen;
-
-	psz = wcschr(pszVirtual, L'/');
-	if (psz) dwLen = psz - pszVirtual;
-	else dwLen = wcslen(pszVirtual);
-	while (ptree) {
-		if ((ptree->_data.strVirtual.length() == dwLen) && (!dwLen || !_wcsnicmp(pszVirtual, ptree->_data.strVirtual.c_str(), dwLen))) {
-			if (psz) {
-				if (Map(psz + 1, strLocal, ptree->_pdown)) return 1;
-				else {
-					if (ptree->_data.strLocal.length() != 0) {
-						strLocal = ptree->_data.strLocal;
-						strLocal += psz;
-						replace(strLocal.begin(), strLocal.end(), L'/', L'\\');
-						return 1;
-					} else {
-						return 0;
-					}
-				}
-			} else {
-				strLocal = ptree->_data.strLocal;
-				return 1;
+	SYSTEMTIME stCutoff;
+	wstring strLocal;
+	ListingCache::snapshot_ptr psnap;
+	ULONGLONG qwGeneration;
+	DWORD dwFound = 0;
+
+	if (Map(pszVirtual, strLocal) && (strLocal.length() != 0)) {
+		if (_pWatcher && _pWatcher->IsWatched(strLocal.c_str())) {
+			psnap = _pListingCache->Get(strLocal.c_str(), dwIsNLST, &qwGeneration);
+			if (!psnap) {
+				psnap = ReadLocalListing(strLocal.c_str(), dwIsNLST);
+				if (psnap && _pWatcher->IsWatched(strLocal.c_str())) _pListingCache->Put(strLocal.c_str(), dwIsNLST, psnap, qwGeneration);
 			}
 		} else {
-			ptree = ptree->_pright;
+			psnap = ReadLocalListing(strLocal.c_str(), dwIsNLST);
+		}
+		if (psnap) {
+			listing.insert(psnap->listing.begin(), psnap->listing.end());
+			if (pFolders) pFolders->insert(pFolders->end(), psnap->folders.begin(), psnap->folders.end());
+			dwFound = 1;
+		}
+	}
+
+	// Mount points shadow entries on disk, and a user's own the group's
+	GetSystemTime(&stCutoff);
+	stCutoff.wYear--;
+	if (_pbase && _pbase->AddMountPoints(pszVirtual, dwIsNLST, &stCutoff, listing, pFolders, NULL)) dwFound = 1;
+	if (AddMountPoints(pszVirtual, dwIsNLST, &stCutoff, listing, pFolders, _pbase.get())) dwFound = 1;
+
+	return dwFound;
+}
+
+DWORD VFS::AddMountPoints(const wchar_t *pszVirtual, DWORD dwIsNLST, const SYSTEMTIME *pstCutoff, listing_type &listing, folder_list_type *pFolders, const VFS *pbase)
+// Adds the mount points of this tree alone that lie in the folder to a
+// listing. As in Map, a mount point shadows an entry of the same name on
+// disk, and one the group tree pbase already added unless it is only a
+// virtual folder. Returns 0 if the folder is not a node of this tree.
+{
+	wchar_t szLine[512];
+	WIN32_FIND_DATA w32fd;
+	const frozen_type::NODE *pnode, *pchild, *pbaseNode;
+	listing_type::iterator it;
+	wstring strName;
+
+	pnode = FindMountPoint(pszVirtual);
+	if (!pnode) return 0;
+	pbaseNode = pbase ? pbase->FindMountPoint(pszVirtual) : NULL;
+	for (DWORD dw = 0; dw < pnode->dwChildren; dw++) {
+		pchild = _frozen.child(pnode, dw);
+		if (!pchild->data.dwLocalLen && pbaseNode && pbase->_frozen.find(pbaseNode, _frozen.name(pchild), pchild->dwNameLen)) continue;
+		strName.assign(_frozen.name(pchild), pchild->dwNameLen);
+		GetMountPointFindData(pchild, &w32fd);
+		FormatListingLine(&w32fd, dwIsNLST, pstCutoff, szLine, ARRAYSIZE(szLine));
+		it = listing.find(strName);
+		if (it != listing.end()) {
+			it->second = szLine;
+			if (pFolders) pFolders->erase(remove(pFolders->begin(), pFolders->end(), strName), pFolders->end());
+		}
+		else {
+			listing.insert(std::make_pair(strName, szLine));
+		}
+		if (pFolders && (w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(w32fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+			pFolders->push_back(strName);
 		}
 	}
-	strLocal.clear();
-	return 0;
-} 
+	return 1;
+}
 
-tree<VFS::MOUNTPOINT> * VFS::FindMountPoint(const wchar_t *pszVirtual, tree<MOUNTPOINT> *ptree)
-// Returns a pointer to the tree node described by pszVirtual, or 0.
+ListingCache::snapshot_ptr VFS::ReadLocalListing(const wchar_t *pszLocal, DWORD dwIsNLST)
+// Enumerates a local folder into a new listing snapshot.
 {
-	const wchar_t *psz;
-	UINT_PTR dwLen;
-
-	if (!wcscmp(pszVirtual, L"/")) return ptree;
-	psz = wcschr(pszVirtual, L'/');
-	if (psz) dwLen = psz - pszVirtual;
-	else dwLen = wcslen(pszVirtual);
-	while (ptree) {
-		if ((ptree->_data.strVirtual.length() == dwLen) && (!dwLen || !_wcsnicmp(pszVirtual, ptree->_data.strVirtual.c_str(), dwLen))) {
-			if (psz) {
-				return FindMountPoint(psz + 1, ptree->_pdown);
-			} else {
-				return ptree;
-			}
+	wchar_t szLine[512];
+	WIN32_FIND_DATA w32fd;
+	SYSTEMTIME stCutoff;
+	HANDLE hFind;
+	wstring str;
+	shared_ptr<ListingCache::SNAPSHOT> psnap;
+
+	str = pszLocal;
+	while (str.length() && (*str.rbegin() == L'\\')) str.erase(str.length() - 1);
+	str += L"\\*";
+	hFind = ::FindFirstFile(str.c_str(), &w32fd);
+	if (hFind == INVALID_HANDLE_VALUE) return psnap;
+	psnap = make_shared<ListingCache::SNAPSHOT>();
+	GetSystemTime(&stCutoff);
+	stCutoff.wYear--;
+	do {
+		if (!wcscmp(w32fd.cFileName, L".") || !wcscmp(w32fd.cFileName, L"..")) continue;
+		FormatListingLine(&w32fd, dwIsNLST, &stCutoff, szLine, ARRAYSIZE(szLine));
+		psnap->listing.insert(std::make_pair(w32fd.cFileName, szLine));
+		if ((w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(w32fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+			psnap->folders.push_back(w32fd.cFileName);
+		}
+	} while (::FindNextFile(hFind, &w32fd));
+	::FindClose(hFind);
+	return psnap;
+}
+
+void VFS::FormatListingLine(const WIN32_FIND_DATA *pw32fd, DWORD dwIsNLST, const SYSTEMTIME *pstCutoff, wchar_t *pszLine, size_t stLine)
+// Formats one line of a LIST (or NLST) listing, including the CR/LF.
+// Files newer than pstCutoff show the time of day instead of the year.
+{
+	const wchar_t *pszMonthAbbr[]={L"Jan",L"Feb",L"Mar",L"Apr",L"May",L"Jun",L"Jul",L"Aug",L"Sep",L"Oct",L"Nov",L"Dec"};
+	SYSTEMTIME stFile;
+
+	FileTimeToSystemTime(&pw32fd->ftLastWriteTime, &stFile);
+	if (dwIsNLST) {
+		wcscpy_s(pszLine, stLine, pw32fd->cFileName);
+		if (pw32fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			wcscat_s(pszLine, stLine, L"/");
+		}
+	} else {
+		wsprintf(pszLine, L"%c--------- 1 ftp ftp %10u %s %2u ", (pw32fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? L'd' : L'-', pw32fd->nFileSizeLow, pszMonthAbbr[stFile.wMonth-1], stFile.wDay);
+		if ((stFile.wYear > pstCutoff->wYear) || ((stFile.wYear == pstCutoff->wYear) && ((stFile.wMonth > pstCutoff->wMonth) || ((stFile.wMonth == pstCutoff->wMonth) && (stFile.wDay > pstCutoff->wDay))))) {
+			wsprintf(pszLine + wcslen(pszLine), L"%.2u:%.2u ", stFile.wHour, stFile.wMinute);
 		} else {
-			ptree = ptree->_pright;
+			wsprintf(pszLine + wcslen(pszLine), L"%5u ", stFile.wYear);
 		}
+		wcscat_s(pszLine, stLine, pw32fd->cFileName);
 	}
-	return 0;
+	wcscat_s(pszLine, stLine, L"\r\n");
 }
 
-void VFS::CleanVirtualPath(const wchar_t *pszVirtual, wstring &strNewVirtual)
-// Strips utter rubbish out of a virtual path.
-// Ex: /home/./user//...\ftp/  =>  /home/ftp
+DWORD VFS::Map(const wchar_t *pszVirtual, wstring &strLocal, const FROZENMOUNT **ppmp)
+// Maps a virtual path to a local path. A path naming a node of the mount
+// tree maps to that node's local path, which is empty for purely virtual
+// folders; any other path maps below the deepest mount point on its way.
+// If ppmp is given, it receives the mount point the local path came from.
+// A path under a mounted folder that is unavailable does not map, nor does
+// one with a colon below the mount point, which Windows would take as naming
+// an alternate data stream such as the upload digest's. A user's tree and
+// the group tree under it map as if they were one tree.
+{
+	const frozen_type::NODE *pnode, *pbaseNode;
+	const wchar_t *pszRest, *pszBaseRest;
+	const VFS *pvfs = this;
+	DWORD dw, dwDepth, dwBaseDepth;
+
+	pnode = FindMapping(pszVirtual, &pszRest, &dwDepth);
+	if (_pbase && (pbaseNode = _pbase->FindMapping(pszVirtual, &pszBaseRest, &dwBaseDepth))) {
+		// A node the path names wins over a mount above it, and a deeper
+		// mount over a shallower one. Where both trees have the node, the
+		// user's wins unless it is only a virtual folder.
+		if (!pnode ||
+			(!pszBaseRest && (pszRest || (!pnode->data.dwLocalLen && pbaseNode->data.dwLocalLen))) ||
+			(pszBaseRest && pszRest && (dwBaseDepth > dwDepth))) {
+			pnode = pbaseNode;
+			pszRest = pszBaseRest;
+			pvfs = _pbase.get();
+		}
+	}
+	if (!pnode || (pszRest && wcschr(pszRest, L':')) ||
+		(_pMountCheck && pnode->data.dwLocalLen && !_pMountCheck->IsAvailable(pvfs->_frozen.str(pnode->data.dwLocal)))) {
+		strLocal.clear();
+		return 0;
+	}
+	strLocal.assign(pvfs->_frozen.str(pnode->data.dwLocal), pnode->data.dwLocalLen);
+	if (pszRest) {
+		dw = (DWORD)strLocal.length();
+		strLocal += pszRest;
+		replace(strLocal.begin() + dw, strLocal.end(), L'/', L'\\');
+	}
+	if (ppmp) *ppmp = &pnode->data;
+	return 1;
+}
+
+const VFS::frozen_type::NODE * VFS::FindMapping(const wchar_t *pszVirtual, const wchar_t **ppszRest, DWORD *pdwDepth) const
+// Finds where this tree alone maps pszVirtual from: the node the path
+// names, with *ppszRest set to NULL, or else the deepest mount point on its
+// way, with *ppszRest at the rest of the path. *pdwDepth receives the
+// node's depth. Returns NULL if there is neither.
+{
+	const frozen_type::NODE *pnode, *pmount = NULL;
+	const wchar_t *psz;
+	DWORD dwDepth = 0;
+
+	// The root's name is empty, so the path must begin with a slash
+	pnode = _frozen.root();
+	if (!pnode || (*pszVirtual && (*pszVirtual != L'/'))) return NULL;
+	for (;;) {
+		psz = wcschr(pszVirtual, L'/');
+		if (!psz) {
+			*ppszRest = NULL;
+			*pdwDepth = dwDepth;
+			return pnode;
+		}
+		if (pnode->data.dwLocalLen != 0) {
+			pmount = pnode;
+			*ppszRest = psz;
+			*pdwDepth = dwDepth;
+		}
+		pszVirtual = psz + 1;
+		pnode = _frozen.find(pnode, pszVirtual, wcscspn(pszVirtual, L"/"));
+		if (!pnode) return pmount;
+		dwDepth++;
+	}
+}
+
+bool VFS::IsMountPoint(const wchar_t *pszVirtual) const
+// Returns true iff pszVirtual names a node of this tree or the group's.
+{
+	return FindMountPoint(pszVirtual) || (_pbase && _pbase->FindMountPoint(pszVirtual));
+}
+
+const VFS::frozen_type::NODE * VFS::FindMountPoint(const wchar_t *pszVirtual) const
+// Returns a pointer to the node of this tree alone described by
+// pszVirtual, or 0.
+{
+	const frozen_type::NODE *pnode;
+	const wchar_t *psz;
+
+	pnode = _frozen.root();
+	if (!pnode) return 0;
+	if (!*pszVirtual || !wcscmp(pszVirtual, L"/")) return pnode;
+	if (*pszVirtual != L'/') return 0;
+	for (psz = pszVirtual; pnode && *psz; ) {
+		psz++;
+		pnode = _frozen.find(pnode, psz, wcscspn(psz, L"/"));
+		psz += wcscspn(psz, L"/");
+	}
+	return pnode;
+}
+
+bool VFS::IsCleanVirtualPath(const wchar_t *pszVirtual)
+// Returns true iff pszVirtual is absolute and CleanVirtualPath would give it
+// back unchanged: no backslashes, empty components, "." or "..".
+{
+	const wchar_t *psz;
+
+	if (*pszVirtual != L'/') return false;
+	for (psz = pszVirtual; *psz; ++psz) {
+		if (*psz == L'\\') return false;
+		if (*psz != L'/') continue;
+		if (psz[1] == L'/') return false;
+		if (psz[1] == L'.') {
+			if ((psz[2] == L'\0') || (psz[2] == L'/')) return false;
+			if ((psz[2] == L'.') && ((psz[3] == L'\0') || (psz[3] == L'/'))) return false;
+		}
+	}
+	return true;
+}
+
+size_t VFS::CleanInto(const wchar_t *pszVirtual, wchar_t *pszBuffer)
+// Cleans pszVirtual into pszBuffer, which must hold wcslen(pszVirtual) + 4
+// characters. Returns the length of the result, which starts at pszBuffer + 3.
 {
 	const wchar_t *in = pszVirtual;
-	wchar_t *buf = new wchar_t[wcslen(pszVirtual) + 4];
-	buf[0] = L'\0'; buf[1] = L'\0'; buf[2] = L'\0';
-	wchar_t *out = buf + 3;
+	wchar_t *out = pszBuffer + 3;
+
+	pszBuffer[0] = L'\0'; pszBuffer[1] = L'\0'; pszBuffer[2] = L'\0';
 	do {
 		*out = *in;
 		if (*out == L'\\') *out = L'/'; // convert backslashes to forward slashes
 		if ((*out == L'\0') || (*out == L'/')) {
-			if (out[-1] == L'.') { // output ends with "."
+			if ((out[-1] == L'.') && ((out[-2] == L'\0') || (out[-2] == L'/'))) { // output ends with "." component
 				if (out[-2] == L'\0') --out; // entire output is "."
-				else if (out[-2] == L'/') { // output ends with "/."
-					if (out[-3] == L'\0') --out; // entire output is "/."
-					else out -= 2;
-				}
-				else if (out[-2] == L'.') { // output ends with ".."
-					if (out[-3] == L'\0') out -= 2; // entire output is ".."
-					else if (out[-3] == L'/') { // output ends with "/.."
-						if (out[-4] == L'\0') out -= 2; // entire output is "/.."
-						else {
-							out -= 3;
-							while ((out[-1] != L'\0') && (out[-1] != L'/')) --out;
-						}
-					}
+				else if (out[-3] == L'\0') --out; // entire output is "/."
+				else out -= 2;
+			}
+			else if ((out[-1] == L'.') && (out[-2] == L'.') && ((out[-3] == L'\0') || (out[-3] == L'/'))) { // output ends with ".." component
+				if (out[-3] == L'\0') out -= 2; // entire output is ".."
+				else if (out[-4] == L'\0') out -= 2; // entire output is "/.."
+				else {
+					out -= 3;
+					while ((out[-1] != L'\0') && (out[-1] != L'/')) --out;
 				}
-				else ++in;
 			}
-			else {
+			else { // ordinary component, including names like "..." or "a."
 				++in;
 				if (out[-1] != L'/') ++out;
 			}
 		}
 		else ++in, ++out;
 	} while (in[-1] != L'\0');
-	strNewVirtual = buf + 3;
-	delete[] buf;
+	return wcslen(pszBuffer + 3);
+}
+
+void VFS::CleanVirtualPath(const wchar_t *pszVirtual, wstring &strNewVirtual)
+// Strips utter rubbish out of a virtual path.
+// Ex: /home/./user//..\ftp/  =>  /home/ftp/
+// Paths that are already clean are copied as they are, and short ones are
+// cleaned on the stack, so strNewVirtual's own buffer is the only storage used.
+{
+	wchar_t szBuffer[VIRTUAL_PATH_BUFFER];
+	size_t stLen;
+
+	if (IsCleanVirtualPath(pszVirtual)) {
+		if (pszVirtual != strNewVirtual.c_str()) strNewVirtual.assign(pszVirtual);
+		return;
+	}
+	stLen = wcslen(pszVirtual);
+	if (stLen + 4 <= ARRAYSIZE(szBuffer)) {
+		stLen = CleanInto(pszVirtual, szBuffer);
+		strNewVirtual.assign(szBuffer + 3, stLen);
+	}
+	else {
+		wchar_t *buf = new wchar_t[stLen + 4];
+		stLen = CleanInto(pszVirtual, buf);
+		strNewVirtual.assign(buf + 3, stLen);
+		delete[] buf;
+	}
 }
 
 void VFS::ResolveRelative(const wchar_t *pszCurrentVirtual, const wchar_t *pszRelativeVirtual, wstring &strNewVirtual)
 // Concatenates pszRelativeVirtual to pszCurrentVirtual and resolves.
 {
+	wchar_t szJoined[VIRTUAL_PATH_BUFFER];
+	size_t stCurrent, stRelative;
+
 	if (*pszRelativeVirtual!=L'/') {
-		strNewVirtual = pszCurrentVirtual;
-		strNewVirtual += L"/";
-		strNewVirtual += pszRelativeVirtual;
-		CleanVirtualPath(strNewVirtual.c_str(), strNewVirtual);
+		stCurrent = wcslen(pszCurrentVirtual);
+		stRelative = wcslen(pszRelativeVirtual);
+		if (stCurrent + stRelative + 2 <= ARRAYSIZE(szJoined)) {
+			wmemcpy(szJoined, pszCurrentVirtual, stCurrent);
+			szJoined[stCurrent] = L'/';
+			wmemcpy(szJoined + stCurrent + 1, pszRelativeVirtual, stRelative + 1);
+			CleanVirtualPath(szJoined, strNewVirtual);
+		}
+		else {
+			strNewVirtual = pszCurrentVirtual;
+			strNewVirtual += L"/";
+			strNewVirtual += pszRelativeVirtual;
+			CleanVirtualPath(strNewVirtual.c_str(), strNewVirtual);
+		}
 	}
 	else {
 		CleanVirtualPath(pszRelativeVirtual, strNewVirtual);
 	}
 }
 
-bool VFS::WildcardMatch(const wchar_t *pszFilespec, const wchar_t *pszFilename)
-// Returns true iff pszFilename matches wildcard pattern pszFilespec.
+void VFS::Resolve(const wchar_t *pszCurrentVirtual, const wchar_t *pszRelativeVirtual, RESOLVED &res)
+// Resolves pszRelativeVirtual against pszCurrentVirtual and maps the result
+// in one pass, filling in everything a transfer needs to know about the path.
+// res is meant to live as long as the session, so its strings keep their
+// buffers from one command to the next.
 {
-	if (*pszFilespec == 0) return true;
-	while (*pszFilespec) {
-		if (*pszFilespec == L'*') {
-			pszFilespec++;
-			do {
-				if (WildcardMatch(pszFilespec, pszFilename)) return true;
-			} while (*pszFilename++);
-			return false;
-		} else if (((*pszFilespec | 0x20) != (*pszFilename | 0x20)) && (*pszFilespec != L'?')) {
-			return false;
-		}
-		pszFilespec++;
-		pszFilename++;
+	const FROZENMOUNT *pmp = NULL;
+	DWORD dw;
+
+	ResolveRelative(pszCurrentVirtual, pszRelativeVirtual, res.strVirtual);
+	res.isMapped = (Map(res.strVirtual.c_str(), res.strLocal, &pmp) != 0);
+	if (res.isMapped && pmp) {
+		dw = (pmp->dwMapThreshold == MAP_THRESHOLD_DEFAULT) ? _dwDefaultMapThreshold : pmp->dwMapThreshold;
+		res.qwMapThreshold = (ULONGLONG)dw * 1024;
+	}
+	else {
+		res.qwMapThreshold = 0;
 	}
-	if (!*pszFilespec && !*pszFilename) return true;
-	else return false;
 }
 
 LPVOID VFS::FindFirstFile(const wchar_t *pszVirtual, WIN32_FIND_DATA *pw32fd)
@@ -265,9 +633,11 @@ LPVOID VFS::FindFirstFile(const wchar_t *pszVirtual, WIN32_FIND_DATA *pw32fd)
 	pfd = new FINDDATA;
 	pfd->hFind = 0;
 	pfd->strVirtual = pszVirtual;
-	pfd->strFilespec = psz + 1;
-	pfd->ptree = FindMountPoint(str.c_str(), &_root);
-	if (pfd->ptree) pfd->ptree = pfd->ptree->_pdown;
+	pfd->wildcard.Compile(psz + 1);
+	pfd->pparent = FindMountPoint(str.c_str());
+	pfd->pbaseParent = _pbase ? _pbase->FindMountPoint(str.c_str()) : NULL;
+	pfd->dwNextChild = 0;
+	pfd->dwNextBaseChild = 0;
 
 	if (FindNextFile(pfd, pw32fd)) return pfd;
 	else {
@@ -281,21 +651,34 @@ bool VFS::FindNextFile(LPVOID lpFindHandle, WIN32_FIND_DATA *pw32fd)
 	FINDDATA *pfd = (FINDDATA *)lpFindHandle;
 	wstring str;
 
-	while (pfd->ptree) {
-		str = pfd->ptree->_data.strVirtual;
+	const frozen_type::NODE *pchild;
+
+	while (pfd->pparent && (pfd->dwNextChild < pfd->pparent->dwChildren)) {
+		pchild = _frozen.child(pfd->pparent, pfd->dwNextChild++);
+		str.assign(_frozen.name(pchild), pchild->dwNameLen);
 		if (str.find_first_of(L'.') == wstring::npos) str.push_back(L'.');
-		if (WildcardMatch(pfd->strFilespec.c_str(), str.c_str())) {
-			GetMountPointFindData(pfd->ptree, pw32fd);
-			pfd->ptree = pfd->ptree->_pright;
+		if (pfd->wildcard.Match(str.c_str(), str.length())) {
+			GetMountPointFindData(pchild, pw32fd);
+			return true;
+		}
+	}
+
+	// Then the group's, but for those the user's own tree has listed
+	while (pfd->pbaseParent && (pfd->dwNextBaseChild < pfd->pbaseParent->dwChildren)) {
+		pchild = _pbase->_frozen.child(pfd->pbaseParent, pfd->dwNextBaseChild++);
+		if (pfd->pparent && _frozen.find(pfd->pparent, _pbase->_frozen.name(pchild), pchild->dwNameLen)) continue;
+		str.assign(_pbase->_frozen.name(pchild), pchild->dwNameLen);
+		if (str.find_first_of(L'.') == wstring::npos) str.push_back(L'.');
+		if (pfd->wildcard.Match(str.c_str(), str.length())) {
+			_pbase->GetMountPointFindData(pchild, pw32fd);
 			return true;
 		}
-		pfd->ptree = pfd->ptree->_pright;
 	}
 
 	if (pfd->hFind) {
 		return ::FindNextFile(pfd->hFind, pw32fd) ? true : false;
 	} else {
-		if (!Map(pfd->strVirtual.c_str(), str, &_root)) return false;
+		if (!Map(pfd->strVirtual.c_str(), str)) return false;
 		if (str.length() != 0) {
 			pfd->hFind = ::FindFirstFile(str.c_str(), pw32fd);
 			return (pfd->hFind != INVALID_HANDLE_VALUE);
@@ -319,6 +702,14 @@ bool VFS::FileExists(const wchar_t *pszVirtual)
 {
 	LPVOID hFind;
 	WIN32_FIND_DATA w32fd;
+	wstring strLocal;
+	StatCache::STATINFO si;
+
+	if (!wcspbrk(pszVirtual, L"*?")) {
+		if (IsMountPoint(pszVirtual)) return true;
+		if (!Map(pszVirtual, strLocal) || (strLocal.length() == 0)) return false;
+		return StatLocal(strLocal.c_str(), &si);
+	}
 
 	hFind = FindFirstFile(pszVirtual, &w32fd);
 	if (hFind) {
@@ -334,36 +725,125 @@ bool VFS::IsFolder(const wchar_t *pszVirtual)
 // Does NOT support wildcards.
 {
 	wstring strLocal;
-	DWORD dw;
+	StatCache::STATINFO si;
+
+	if (IsMountPoint(pszVirtual)) return true;
+	if (!Map(pszVirtual, strLocal)) return true;
+	return (StatLocal(strLocal.c_str(), &si) && (si.dwAttributes & FILE_ATTRIBUTE_DIRECTORY));
+}
+
+bool VFS::GetFileInfo(const wchar_t *pszVirtual, StatCache::STATINFO *psi)
+// Returns the attributes, size and write time of an existing file or
+// folder without opening it. Does NOT support wildcards.
+{
+	wstring strLocal;
+
+	if (!Map(pszVirtual, strLocal) || (strLocal.length() == 0)) return false;
+	return StatLocal(strLocal.c_str(), psi);
+}
 
-	if (FindMountPoint(pszVirtual, &_root)) return true;
-	if (!Map(pszVirtual, strLocal, &_root)) return true;
-	dw = GetFileAttributes(strLocal.c_str());
-	return ((dw != INVALID_FILE_ATTRIBUTES) && (dw & FILE_ATTRIBUTE_DIRECTORY));
+bool VFS::StatLocal(const wchar_t *pszLocal, StatCache::STATINFO *psi)
+// Looks up a local path in the metadata cache, or on disk if there is none.
+{
+	WIN32_FILE_ATTRIBUTE_DATA wfad;
+
+	if (_pStatCache) return _pStatCache->Stat(pszLocal, psi);
+	if (!GetFileAttributesEx(pszLocal, GetFileExInfoStandard, &wfad)) return false;
+	psi->dwAttributes = wfad.dwFileAttributes;
+	psi->uliSize.LowPart = wfad.nFileSizeLow;
+	psi->uliSize.HighPart = wfad.nFileSizeHigh;
+	psi->ftLastWrite = wfad.ftLastWriteTime;
+	return true;
 }
 
-void VFS::GetMountPointFindData(tree<MOUNTPOINT> *ptree, WIN32_FIND_DATA *pw32fd)
+void VFS::GetMountPointFindData(const frozen_type::NODE *pnode, WIN32_FIND_DATA *pw32fd)
 // Fills in the WIN32_FIND_DATA structure with data about the mount point.
 {
 	HANDLE hFind;
 	SYSTEMTIME st = {1980, 1, 2, 1, 0, 0, 0, 0};
 
-	if ((ptree->_data.strLocal.length() != 0) && ((hFind = ::FindFirstFile(ptree->_data.strLocal.c_str(), pw32fd)) != INVALID_HANDLE_VALUE)) {
+	if ((pnode->data.dwLocalLen != 0) && ((hFind = ::FindFirstFile(_frozen.str(pnode->data.dwLocal), pw32fd)) != INVALID_HANDLE_VALUE)) {
 		::FindClose(hFind);
 	} else {
 		memset(pw32fd, 0, sizeof(WIN32_FIND_DATA));
 		pw32fd->dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
 		SystemTimeToFileTime(&st, &pw32fd->ftLastWriteTime);
 	}
-	wcscpy_s(pw32fd->cFileName, sizeof(pw32fd->cFileName)/sizeof(wchar_t), ptree->_data.strVirtual.c_str());
+	wcscpy_s(pw32fd->cFileName, sizeof(pw32fd->cFileName)/sizeof(wchar_t), _frozen.name(pnode));
 }
 
 HANDLE VFS::CreateFile(const wchar_t *pszVirtual, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition)
 {
 	wstring strLocal;
+	HANDLE hFile;
 
-	if (Map(pszVirtual, strLocal, &_root)) {
-		return ::CreateFile(strLocal.c_str(), dwDesiredAccess, dwShareMode, 0, dwCreationDisposition, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (Map(pszVirtual, strLocal)) {
+		hFile = ::CreateFile(strLocal.c_str(), dwDesiredAccess, dwShareMode, 0, dwCreationDisposition, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+		if ((hFile != INVALID_HANDLE_VALUE) && (dwDesiredAccess & GENERIC_WRITE) && _pWatcher) _pWatcher->Changed(strLocal.c_str(), false);
+		return hFile;
+	} else {
+		return INVALID_HANDLE_VALUE;
+	}
+}
+
+HANDLE VFS::CreateFile(const RESOLVED &res, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition)
+// Opens a path already mapped by Resolve.
+{
+	HANDLE hFile;
+
+	if (!res.isMapped) return INVALID_HANDLE_VALUE;
+	hFile = ::CreateFile(res.strLocal.c_str(), dwDesiredAccess, dwShareMode, 0, dwCreationDisposition, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if ((hFile != INVALID_HANDLE_VALUE) && (dwDesiredAccess & GENERIC_WRITE) && _pWatcher) _pWatcher->Changed(res.strLocal.c_str(), false);
+	return hFile;
+}
+
+FileCache::content_ptr VFS::GetCachedContent(const RESOLVED &res)
+// Returns the contents of the resolved file if it is small and popular
+// enough to be served from memory, or an empty pointer otherwise.
+{
+	StatCache::STATINFO si;
+
+	if (!_pFileCache) return FileCache::content_ptr();
+	if (!res.isMapped || (res.strLocal.length() == 0)) return FileCache::content_ptr();
+	if (!StatLocal(res.strLocal.c_str(), &si) || (si.dwAttributes & FILE_ATTRIBUTE_DIRECTORY)) return FileCache::content_ptr();
+	return _pFileCache->Fetch(res.strLocal.c_str(), &si.ftLastWrite, &si.uliSize);
+}
+
+HandleCache::FILEREF * VFS::OpenShared(const RESOLVED &res)
+// Returns a reference to a shared read-only handle for downloading the
+// resolved file, or NULL if there is no handle cache or the file cannot be
+// opened. The reference must be given back with CloseShared.
+{
+	StatCache::STATINFO si;
+
+	if (!_pHandleCache) return NULL;
+	if (!res.isMapped || (res.strLocal.length() == 0)) return NULL;
+	if (!StatLocal(res.strLocal.c_str(), &si) || (si.dwAttributes & FILE_ATTRIBUTE_DIRECTORY)) return NULL;
+	return _pHandleCache->Acquire(res.strLocal.c_str(), &si.ftLastWrite, &si.uliSize);
+}
+
+void VFS::CloseShared(HandleCache::FILEREF *pref)
+{
+	_pHandleCache->Release(pref);
+}
+
+void VFS::DropCachedHandles(const wchar_t *pszLocal, bool isTree)
+// Closes idle shared handles to a path the server is about to change, so
+// they cannot get in the way of deleting, renaming or recreating it.
+{
+	if (_pHandleCache) _pHandleCache->Invalidate(pszLocal, isTree);
+}
+
+HANDLE VFS::CreateStream(const wchar_t *pszVirtual, const wchar_t *pszStream, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition)
+// Opens a named alternate data stream attached to a file. Used for sidecar
+// metadata that must travel with the file without showing up in listings.
+{
+	wstring strLocal;
+
+	if (Map(pszVirtual, strLocal) && (strLocal.length() != 0)) {
+		strLocal += L":";
+		strLocal += pszStream;
+		return ::CreateFile(strLocal.c_str(), dwDesiredAccess, dwShareMode, 0, dwCreationDisposition, 0, 0);
 	} else {
 		return INVALID_HANDLE_VALUE;
 	}
@@ -373,26 +853,150 @@ BOOL VFS::DeleteFile(const wchar_t *pszVirtual)
 {
 	wstring strLocal;
 
-	return (Map(pszVirtual, strLocal, &_root) && ::DeleteFile(strLocal.c_str()));
+	if (!Map(pszVirtual, strLocal)) return FALSE;
+	DropCachedHandles(strLocal.c_str(), false);
+	if (::DeleteFile(strLocal.c_str())) {
+		if (_pWatcher) _pWatcher->Changed(strLocal.c_str(), true);
+		return TRUE;
+	}
+	return FALSE;
 }
 
 BOOL VFS::MoveFile(const wchar_t *pszOldVirtual, const wchar_t *pszNewVirtual)
 {
 	wstring strOldLocal, strNewLocal;
 
-	return (Map(pszOldVirtual, strOldLocal, &_root) && Map(pszNewVirtual, strNewLocal, &_root) && ::MoveFile(strOldLocal.c_str(), strNewLocal.c_str()));
+	if (!Map(pszOldVirtual, strOldLocal) || !Map(pszNewVirtual, strNewLocal)) return FALSE;
+	DropCachedHandles(strOldLocal.c_str(), true);
+	if (::MoveFile(strOldLocal.c_str(), strNewLocal.c_str())) {
+		if (_pWatcher) {
+			_pWatcher->Changed(strOldLocal.c_str(), true);
+			_pWatcher->Changed(strNewLocal.c_str(), true);
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+BOOL VFS::CopyFile(const wchar_t *pszOldVirtual, const wchar_t *pszNewVirtual)
+// Duplicates a file on the server. Clones the source's extents where the
+// volume supports block cloning; otherwise streams it through a large buffer.
+// The copy is made under a temporary name in the target's folder and only
+// then moved over the target, so a failed copy leaves any old file intact.
+{
+	wstring strOldLocal, strNewLocal, strFolder;
+	wchar_t szTemp[MAX_PATH];
+	HANDLE hSrc, hDst;
+	LARGE_INTEGER liSize;
+	FILETIME ft;
+	size_t stSlash;
+	bool bSuccess;
+
+	if (!Map(pszOldVirtual, strOldLocal) || !Map(pszNewVirtual, strNewLocal)) return FALSE;
+	if (!_wcsicmp(strOldLocal.c_str(), strNewLocal.c_str())) return FALSE;
+	stSlash = strNewLocal.rfind(L'\\');
+	if (stSlash == wstring::npos) return FALSE;
+	strFolder.assign(strNewLocal, 0, stSlash);
+	hSrc = ::CreateFile(strOldLocal.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hSrc == INVALID_HANDLE_VALUE) return FALSE;
+	if (!GetTempFileName(strFolder.c_str(), L"cpy", 0, szTemp)) {
+		CloseHandle(hSrc);
+		return FALSE;
+	}
+	hDst = ::CreateFile(szTemp, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hDst == INVALID_HANDLE_VALUE) {
+		CloseHandle(hSrc);
+		::DeleteFile(szTemp);
+		return FALSE;
+	}
+	bSuccess = GetFileSizeEx(hSrc, &liSize) && (CloneFileData(hSrc, hDst, liSize.QuadPart) || StreamFileData(hSrc, hDst));
+	if (bSuccess && GetFileTime(hSrc, 0, 0, &ft)) SetFileTime(hDst, 0, 0, &ft);
+	CloseHandle(hSrc);
+	CloseHandle(hDst);
+	if (bSuccess) {
+		DropCachedHandles(strNewLocal.c_str(), false);
+		bSuccess = (MoveFileEx(szTemp, strNewLocal.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+	}
+	if (!bSuccess) ::DeleteFile(szTemp);
+	if (_pWatcher) _pWatcher->Changed(strNewLocal.c_str(), false);
+	return bSuccess;
+}
+
+bool VFS::CloneFileData(HANDLE hSrc, HANDLE hDst, LONGLONG llSize)
+// Shares the source's clusters with the destination instead of copying them.
+// Returns false, leaving hDst empty, if the volume cannot do this.
+{
+	FSCTL_GET_INTEGRITY_INFORMATION_BUFFER fgiib;
+	DUPLICATE_EXTENTS_DATA ded;
+	FILE_END_OF_FILE_INFO feofi;
+	BY_HANDLE_FILE_INFORMATION bhfi;
+	LONGLONG llCluster, llOffset, llChunk;
+	DWORD dw;
+
+	// Only block-cloning volumes (ReFS) answer this, and clones must be aligned to the cluster size it reports
+	if (!DeviceIoControl(hSrc, FSCTL_GET_INTEGRITY_INFORMATION, 0, 0, &fgiib, sizeof(fgiib), &dw, 0)) return false;
+	llCluster = fgiib.ClusterSizeInBytes;
+	if (!llCluster) return false;
+	if (GetFileInformationByHandle(hSrc, &bhfi) && (bhfi.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+		if (!DeviceIoControl(hDst, FSCTL_SET_SPARSE, 0, 0, 0, 0, &dw, 0)) return false;
+	}
+	feofi.EndOfFile.QuadPart = llSize;
+	if (!SetFileInformationByHandle(hDst, FileEndOfFileInfo, &feofi, sizeof(feofi))) return false;
+	ded.FileHandle = hSrc;
+	for (llOffset = 0; llOffset < llSize; llOffset += llChunk) {
+		llChunk = min(llSize - llOffset, (LONGLONG)CLONE_CHUNK_SIZE);
+		ded.SourceFileOffset.QuadPart = llOffset;
+		ded.TargetFileOffset.QuadPart = llOffset;
+		ded.ByteCount.QuadPart = (llChunk + llCluster - 1) / llCluster * llCluster;
+		if (!DeviceIoControl(hDst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &ded, sizeof(ded), 0, 0, &dw, 0)) {
+			feofi.EndOfFile.QuadPart = 0;
+			SetFileInformationByHandle(hDst, FileEndOfFileInfo, &feofi, sizeof(feofi));
+			return false;
+		}
+	}
+	return true;
+}
+
+bool VFS::StreamFileData(HANDLE hSrc, HANDLE hDst)
+// Copies the rest of hSrc to hDst through a large buffer.
+{
+	BYTE *pb;
+	DWORD dwRead, dwWritten;
+	bool bSuccess = false;
+
+	pb = new BYTE[COPY_BUFFER_SIZE];
+	for (;;) {
+		if (!ReadFile(hSrc, pb, COPY_BUFFER_SIZE, &dwRead, 0)) break;
+		if (!dwRead) {
+			bSuccess = true;
+			break;
+		}
+		if (!WriteFile(hDst, pb, dwRead, &dwWritten, 0) || (dwWritten != dwRead)) break;
+	}
+	delete[] pb;
+	return bSuccess;
 }
 
 BOOL VFS::CreateDirectory(const wchar_t *pszVirtual)
 {
 	wstring strLocal;
 
-	return (Map(pszVirtual, strLocal, &_root) && ::CreateDirectory(strLocal.c_str(), NULL));
+	if (Map(pszVirtual, strLocal) && ::CreateDirectory(strLocal.c_str(), NULL)) {
+		if (_pWatcher) _pWatcher->Changed(strLocal.c_str(), false);
+		return TRUE;
+	}
+	return FALSE;
 }
 
 BOOL VFS::RemoveDirectory(const wchar_t *pszVirtual)
 {
 	wstring strLocal;
 
-	return (Map(pszVirtual, strLocal, &_root) && ::RemoveDirectory(strLocal.c_str()));
+	if (!Map(pszVirtual, strLocal)) return FALSE;
+	DropCachedHandles(strLocal.c_str(), true);
+	if (::RemoveDirectory(strLocal.c_str())) {
+		if (_pWatcher) _pWatcher->Changed(strLocal.c_str(), true);
+		return TRUE;
+	}
+	return FALSE;
 }
@@ -31,50 +31,138 @@
 #define _INCL_VFS_H
 
 #include <windows.h>
+#include <winioctl.h>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
+#include "filecache.h"
+#include "frozentree.h"
+#include "handlecache.h"
+#include "listcache.h"
+#include "mountcheck.h"
+#include "statcache.h"
 #include "tree.h"
+#include "treeindex.h"
+#include "wildcard.h"
 
 using namespace std;
 
+#define MAP_THRESHOLD_DEFAULT ((DWORD)-1)
+
+class FSWatcher;
+
 class VFS
 {
+public:
+	typedef map<wstring, wstring> listing_type;
+	typedef vector<wstring> folder_list_type;
+	struct RESOLVED {
+		wstring strVirtual;
+		wstring strLocal;
+		bool isMapped;
+		ULONGLONG qwMapThreshold;
+		RESOLVED() : isMapped(false), qwMapThreshold(0) {}
+	};
+
 private:
 	struct MOUNTPOINT {
 		wstring strVirtual;
 		wstring strLocal;
+		DWORD dwMapThreshold;
+		MOUNTPOINT() : dwMapThreshold(MAP_THRESHOLD_DEFAULT) {}
 	};
+	struct FROZENMOUNT {
+		DWORD dwLocal;
+		DWORD dwLocalLen;
+		DWORD dwMapThreshold;
+	};
+	typedef frozentree<FROZENMOUNT> frozen_type;
 	struct FINDDATA {
 		wstring strVirtual;
-		wstring strFilespec;
+		Wildcard wildcard;
 		HANDLE hFind;
-		tree<MOUNTPOINT> *ptree;
+		const frozen_type::NODE *pparent;
+		const frozen_type::NODE *pbaseParent;
+		DWORD dwNextChild;
+		DWORD dwNextBaseChild;
 	};
 
+	// Mounts are added to the pointer tree while the config is read, and
+	// looked up only in the frozen form built from it afterwards
 	tree<MOUNTPOINT> _root;
+	treeindex<MOUNTPOINT> _index;
+	frozen_type _frozen;
+	// A user's own mounts are laid over the group's tree, which is shared
+	// and never changed; a mount here wins over the group's at the same depth
+	shared_ptr<VFS> _pbase;
+	static FSWatcher *_pWatcher;
+	static MountCheck *_pMountCheck;
+	static ListingCache *_pListingCache;
+	static StatCache *_pStatCache;
+	static HandleCache *_pHandleCache;
+	static FileCache *_pFileCache;
+	static DWORD _dwDefaultMapThreshold;
 
-	static DWORD Map(const wchar_t *pszVirtual, wstring &strLocal, tree<MOUNTPOINT> *ptree);
-	static tree<MOUNTPOINT> * FindMountPoint(const wchar_t *pszVirtual, tree<MOUNTPOINT> *ptree);
-	static bool WildcardMatch(const wchar_t *pszFilespec, const wchar_t *pszFilename);
-	static void GetMountPointFindData(tree<MOUNTPOINT> *ptree, WIN32_FIND_DATA *pw32fd);
+	DWORD Map(const wchar_t *pszVirtual, wstring &strLocal, const FROZENMOUNT **ppmp = NULL);
+	const frozen_type::NODE * FindMapping(const wchar_t *pszVirtual, const wchar_t **ppszRest, DWORD *pdwDepth) const;
+	const frozen_type::NODE * FindMountPoint(const wchar_t *pszVirtual) const;
+	bool IsMountPoint(const wchar_t *pszVirtual) const;
+	static bool IsCleanVirtualPath(const wchar_t *pszVirtual);
+	static size_t CleanInto(const wchar_t *pszVirtual, wchar_t *pszBuffer);
+	void GetMountPointFindData(const frozen_type::NODE *pnode, WIN32_FIND_DATA *pw32fd);
+	DWORD AddMountPoints(const wchar_t *pszVirtual, DWORD dwIsNLST, const SYSTEMTIME *pstCutoff, listing_type &listing, folder_list_type *pFolders, const VFS *pbase);
+	static void FormatListingLine(const WIN32_FIND_DATA *pw32fd, DWORD dwIsNLST, const SYSTEMTIME *pstCutoff, wchar_t *pszLine, size_t stLine);
+	static ListingCache::snapshot_ptr ReadLocalListing(const wchar_t *pszLocal, DWORD dwIsNLST);
+	static bool StatLocal(const wchar_t *pszLocal, StatCache::STATINFO *psi);
+	static void DropCachedHandles(const wchar_t *pszLocal, bool isTree);
+	void Thaw();
+	static size_t GetTreeMemoryUsage(const tree<MOUNTPOINT> *ptree);
+	VFS(const VFS &);
+	VFS & operator=(const VFS &);
+	DWORD GetFolderListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listing_type &listing, folder_list_type *pFolders);
+	static bool CloneFileData(HANDLE hSrc, HANDLE hDst, LONGLONG llSize);
+	static bool StreamFileData(HANDLE hSrc, HANDLE hDst);
 
 public:
-	typedef map<wstring, wstring> listing_type;
 	VFS();
-	void Mount(const wchar_t *pszVirtual, const wchar_t *pszLocal);
-	DWORD GetDirectoryListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listing_type &listing);
+	explicit VFS(const shared_ptr<VFS> &pbase);
+	const VFS * GetBase() const;
+	size_t GetMemoryUsage() const;
+	void Freeze();
+	size_t GetImageSize() const;
+	void SaveImage(BYTE *pb) const;
+	bool AttachImage(const BYTE *pb, size_t stBytes, vector<MountCheck::MOUNT> *pmounts);
+	static void SetWatcher(FSWatcher *pWatcher);
+	static void SetMountCheck(MountCheck *pMountCheck);
+	static void SetListingCache(ListingCache *pListingCache);
+	static void SetStatCache(StatCache *pStatCache);
+	static void SetHandleCache(HandleCache *pHandleCache);
+	static void SetFileCache(FileCache *pFileCache);
+	static void SetDefaultMapThreshold(DWORD dwKB);
+	void Changed(const wchar_t *pszVirtual);
+	void Mount(const wchar_t *pszVirtual, const wchar_t *pszLocal, DWORD dwMapThreshold);
+	DWORD GetDirectoryListing(const wchar_t *pszVirtual, DWORD dwIsNLST, listing_type &listing, folder_list_type *pFolders);
 	bool FileExists(const wchar_t *pszVirtual);
 	bool IsFolder(const wchar_t *pszVirtual);
+	bool GetFileInfo(const wchar_t *pszVirtual, StatCache::STATINFO *psi);
 	LPVOID FindFirstFile(const wchar_t *pszVirtual, WIN32_FIND_DATA *pw32fd);
 	bool FindNextFile(LPVOID lpFindHandle, WIN32_FIND_DATA *pw32fd);
 	void FindClose(LPVOID lpFindHandle);
 	HANDLE CreateFile(const wchar_t *pszVirtual, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition);
+	HANDLE CreateFile(const RESOLVED &res, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition);
+	FileCache::content_ptr GetCachedContent(const RESOLVED &res);
+	HandleCache::FILEREF * OpenShared(const RESOLVED &res);
+	static void CloseShared(HandleCache::FILEREF *pref);
+	HANDLE CreateStream(const wchar_t *pszVirtual, const wchar_t *pszStream, DWORD dwDesiredAccess, DWORD dwShareMode, DWORD dwCreationDisposition);
 	BOOL DeleteFile(const wchar_t *pszVirtual);
 	BOOL MoveFile(const wchar_t *pszOldVirtual, const wchar_t *pszNewVirtual);
+	BOOL CopyFile(const wchar_t *pszOldVirtual, const wchar_t *pszNewVirtual);
 	BOOL CreateDirectory(const wchar_t *pszVirtual);
 	BOOL RemoveDirectory(const wchar_t *pszVirtual);
 	static void CleanVirtualPath(const wchar_t *pszVirtual, wstring &strNewVirtual);
 	static void ResolveRelative(const wchar_t *pszCurrentVirtual, const wchar_t *pszRelativeVirtual, wstring &strNewVirtual);
+	void Resolve(const wchar_t *pszCurrentVirtual, const wchar_t *pszRelativeVirtual, RESOLVED &res);
 };
 
 #endif
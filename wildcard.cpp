@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "wildcard.h"
+#include <intrin.h>
+#include <emmintrin.h>
+
+// Matching is case-insensitive the way FTP clients expect on Windows: bit 5
+// is ignored in every character, which folds ASCII letters together.
+#define FOLD(ch) ((wchar_t)((ch) | 0x20))
+
+Wildcard::Wildcard()
+{
+	_isLeadingStar = false;
+	_isTrailingStar = false;
+}
+
+void Wildcard::Compile(const wchar_t *pszPattern)
+// Splits pszPattern at its stars into literal segments, which may contain
+// '?'. Runs of stars count as one. An empty pattern matches every name.
+{
+	SEGMENT seg;
+	const wchar_t *psz;
+
+	_strFolded.clear();
+	_segments.clear();
+	_isLeadingStar = (*pszPattern == L'*') || (*pszPattern == L'\0');
+	_isTrailingStar = _isLeadingStar;
+	seg.stStart = 0;
+	seg.stLen = 0;
+	seg.stLiteral = (size_t)-1;
+	for (psz = pszPattern; ; ++psz) {
+		if ((*psz == L'*') || (*psz == L'\0')) {
+			if (seg.stLen) {
+				if (seg.stLiteral == (size_t)-1) seg.stLiteral = seg.stLen;
+				_segments.push_back(seg);
+			}
+			if (*psz == L'\0') break;
+			_isTrailingStar = true;
+			seg.stStart = _strFolded.length();
+			seg.stLen = 0;
+			seg.stLiteral = (size_t)-1;
+		}
+		else {
+			_isTrailingStar = false;
+			if ((*psz != L'?') && (seg.stLiteral == (size_t)-1)) seg.stLiteral = seg.stLen;
+			_strFolded.push_back((*psz == L'?') ? L'?' : FOLD(*psz));
+			seg.stLen++;
+		}
+	}
+}
+
+bool Wildcard::MatchAt(const SEGMENT &seg, const wchar_t *pszName) const
+// Returns true iff the segment matches the characters starting at pszName,
+// of which the caller guarantees there are at least seg.stLen.
+{
+	const wchar_t *pszSeg = _strFolded.c_str() + seg.stStart;
+	size_t i;
+
+	for (i = 0; i < seg.stLen; i++) {
+		if ((pszSeg[i] != L'?') && (pszSeg[i] != FOLD(pszName[i]))) return false;
+	}
+	return true;
+}
+
+const wchar_t * Wildcard::ScanFor(const wchar_t *psz, const wchar_t *pszEnd, wchar_t chFolded)
+// Returns the first character in [psz, pszEnd) that folds to chFolded, or
+// pszEnd. Eight characters are compared at a time.
+{
+	__m128i vFold = _mm_set1_epi16(0x20);
+	__m128i vChar = _mm_set1_epi16((short)chFolded);
+	unsigned long ulBit;
+	int iMask;
+
+	while (pszEnd - psz >= 8) {
+		iMask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_or_si128(_mm_loadu_si128((const __m128i *)psz), vFold), vChar));
+		if (iMask) {
+			_BitScanForward(&ulBit, (unsigned long)iMask);
+			return psz + ulBit / 2;
+		}
+		psz += 8;
+	}
+	while ((psz < pszEnd) && (FOLD(*psz) != chFolded)) ++psz;
+	return psz;
+}
+
+const wchar_t * Wildcard::Find(const SEGMENT &seg, const wchar_t *psz, const wchar_t *pszEnd) const
+// Returns the leftmost place in [psz, pszEnd) where the segment matches in
+// full, or NULL. Candidates are found by scanning for its first literal.
+{
+	const wchar_t *pszHit, *pszLast;
+	wchar_t chLiteral;
+
+	if (pszEnd - psz < (ptrdiff_t)seg.stLen) return NULL;
+	pszLast = pszEnd - seg.stLen;
+	if (seg.stLiteral == seg.stLen) return psz; // nothing but '?'
+	chLiteral = _strFolded[seg.stStart + seg.stLiteral];
+	while (psz <= pszLast) {
+		pszHit = ScanFor(psz + seg.stLiteral, pszLast + seg.stLiteral + 1, chLiteral);
+		if (pszHit > pszLast + seg.stLiteral) break;
+		psz = pszHit - seg.stLiteral;
+		if (MatchAt(seg, psz)) return psz;
+		++psz;
+	}
+	return NULL;
+}
+
+bool Wildcard::Match(const wchar_t *pszName, size_t stLen) const
+// Returns true iff the stLen characters at pszName match the pattern. The
+// segments between stars are placed leftmost-first without backtracking,
+// which is exact for '*' and '?' and keeps the cost linear in the name for
+// each segment instead of exponential in the number of stars.
+{
+	const wchar_t *psz = pszName, *pszEnd = pszName + stLen;
+	size_t i = 0, n = _segments.size();
+
+	if (n == 0) return _isLeadingStar || (stLen == 0);
+	if (!_isLeadingStar) {
+		if ((stLen < _segments[0].stLen) || !MatchAt(_segments[0], psz)) return false;
+		if ((n == 1) && !_isTrailingStar) return (stLen == _segments[0].stLen);
+		psz += _segments[0].stLen;
+		i = 1;
+	}
+	if (!_isTrailingStar) {
+		// The last segment is pinned to the end of the name
+		--n;
+		if ((size_t)(pszEnd - psz) < _segments[n].stLen) return false;
+		pszEnd -= _segments[n].stLen;
+		if (!MatchAt(_segments[n], pszEnd)) return false;
+	}
+	for (; i < n; i++) {
+		psz = Find(_segments[i], psz, pszEnd);
+		if (!psz) return false;
+		psz += _segments[i].stLen;
+	}
+	return true;
+}
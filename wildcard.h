@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2006, Matt Whitlock and WhitSoft Development
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Matt Whitlock and WhitSoft Development nor the
+ *     names of their contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _INCL_WILDCARD_H
+#define _INCL_WILDCARD_H
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class Wildcard
+{
+private:
+	struct SEGMENT {
+		size_t stStart;
+		size_t stLen;
+		size_t stLiteral;
+	};
+
+	wstring _strFolded;
+	vector<SEGMENT> _segments;
+	bool _isLeadingStar;
+	bool _isTrailingStar;
+
+	bool MatchAt(const SEGMENT &seg, const wchar_t *pszName) const;
+	const wchar_t * Find(const SEGMENT &seg, const wchar_t *psz, const wchar_t *pszEnd) const;
+	static const wchar_t * ScanFor(const wchar_t *psz, const wchar_t *pszEnd, wchar_t chFolded);
+
+public:
+	Wildcard();
+	void Compile(const wchar_t *pszPattern);
+	bool Match(const wchar_t *pszName, size_t stLen) const;
+};
+
+#endif